@@ -70,7 +70,7 @@ if platform.system().lower() == 'linux':
 # dependencies
 setup(name='cdmcfparser',
       description=description,
-      python_requires='>=3.5, <3.10',
+      python_requires='>=3.5',
       long_description=long_description,
       version=version,
       author='Sergey Satskiy',
@@ -93,18 +93,31 @@ setup(name='cdmcfparser',
                                        'src/cflowutils.cpp',
                                        'src/cflowparser.cpp',
                                        'src/cflowcomments.cpp',
+                                       'src/cflowtokenizer.cpp',
+                                       'src/cflowsyntax.cpp',
+                                       'src/cflowpgen.cpp',
+                                       'src/cflowasync.cpp',
+                                       'src/cflowdiff.cpp',
+                                       'src/cflowindex.cpp',
                                        'thirdparty/pycxx/Src/cxxsupport.cxx',
                                        'thirdparty/pycxx/Src/cxx_extensions.cxx',
                                        'thirdparty/pycxx/Src/IndirectPythonInterface.cxx',
                                        'thirdparty/pycxx/Src/cxxextensions.c',
                                        'thirdparty/pycxx/Src/cxx_exceptions.cxx'],
-                              depends=['src/cflowcomments.hpp',
+                              depends=['src/cflowasync.hpp',
+                                       'src/cflowcomments.hpp',
+                                       'src/cflowdiff.hpp',
                                        'src/cflowdocs.hpp',
                                        'src/cflowfragments.hpp',
                                        'src/cflowfragmenttypes.hpp',
+                                       'src/cflowindex.hpp',
                                        'src/cflowmodule.hpp',
                                        'src/cflowparser.hpp',
+                                       'src/cflowpgen.hpp',
+                                       'src/cflowsyntax.hpp',
+                                       'src/cflowtokenizer.hpp',
                                        'src/cflowutils.hpp',
+                                       'src/cflowvisitor.hpp',
                                        'src/cflowversion.hpp',
                                        'thirdparty/pycxx/Src/Python3/cxx_exceptions.cxx',
                                        'thirdparty/pycxx/Src/Python3/cxx_extensions.cxx',
@@ -0,0 +1,660 @@
+/*
+ * codimension - graphics python two-way code editor and analyzer
+ * Copyright (C) 2014 - 2016  Sergey Satskiy <sergey.satskiy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Asynchronous parsing: worker pool and event loop integration
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "cflowasync.hpp"
+#include "cflowparser.hpp"
+#include "cflowfragments.hpp"
+#include "cflowfragmenttypes.hpp"
+#include "cflowutils.hpp"
+#include "cflowdocs.hpp"
+
+
+
+ParseJob::ParseJob( char *  buffer_ ) :
+    buffer( buffer_ ), parsed( false ), priority( PRIORITY_BACKGROUND ),
+    done( false ),
+    readFD( -1 ), writeFD( -1 )
+{
+    openSignal();
+}
+
+
+ParseJob::ParseJob( const std::string &  fileName_ ) :
+    buffer( NULL ), fileName( fileName_ ), parsed( false ),
+    priority( PRIORITY_BACKGROUND ), done( false ),
+    readFD( -1 ), writeFD( -1 )
+{
+    openSignal();
+}
+
+
+ParseJob::~ParseJob()
+{
+    if ( buffer != NULL )
+        delete [] buffer;
+    if ( writeFD != -1 && writeFD != readFD )
+        close( writeFD );
+    if ( readFD != -1 )
+        close( readFD );
+}
+
+
+void ParseJob::openSignal( void )
+{
+    #ifdef __linux__
+    readFD = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+    writeFD = readFD;
+    #else
+    int     fds[ 2 ];
+    if ( pipe( fds ) != 0 )
+        return;
+    for ( int  k = 0; k < 2; ++k )
+    {
+        fcntl( fds[ k ], F_SETFD, FD_CLOEXEC );
+        fcntl( fds[ k ], F_SETFL, O_NONBLOCK );
+    }
+    readFD = fds[ 0 ];
+    writeFD = fds[ 1 ];
+    #endif
+}
+
+
+void ParseJob::signal( void )
+{
+    if ( writeFD == -1 )
+        return;
+
+    #ifdef __linux__
+    uint64_t    value = 1;
+    #else
+    char        value = 1;
+    #endif
+    while ( write( writeFD, &value, sizeof( value ) ) < 0 && errno == EINTR )
+    {}
+}
+
+
+void ParseJob::clearSignal( void )
+{
+    if ( readFD == -1 )
+        return;
+
+    char    drain[ 8 ];
+    while ( read( readFD, drain, sizeof( drain ) ) > 0 )
+    {}
+}
+
+
+void ParseJob::run( void )
+{
+    if ( ! fileName.empty() )
+    {
+        size_t      size;
+        buffer = readFileContent( fileName, size, error );
+        if ( buffer != NULL && size == 0 )
+        {
+            delete [] buffer;
+            buffer = NULL;
+        }
+    }
+
+    if ( buffer != NULL )
+    {
+        tree.headerCommentsOnly = ! options.needComments();
+        parsed = buildParseTree( buffer, tree, & control );
+    }
+
+    done = true;
+    signal();
+}
+
+
+void ParseJob::supersede( void )
+{
+    control.supersede();
+    done = true;
+    signal();
+}
+
+
+void ParseJob::abandon( void )
+{
+    control.cancel();
+    control.shouldStop();       // Sets the cancelled status
+    done = true;
+    signal();
+}
+
+
+Py::Object  ParseJob::getControlFlow( void )
+{
+    if ( ! error.empty() )
+        throw Py::RuntimeError( error );
+
+    if ( buffer == NULL )
+    {
+        // A superseded file job has not read its file
+        if ( control.isStopped() )
+            return buildControlFlow( "", false, false, tree, & control );
+        return Py::asObject( new ControlFlow() );
+    }
+
+    if ( ! options.serialize )
+        return buildControlFlow( buffer, false, parsed, tree, & control,
+                                 & options );
+
+    // The control flow takes the ownership of the buffer
+    char *      content = buffer;
+    buffer = NULL;
+    return buildControlFlow( content, true, parsed, tree, & control,
+                             & options );
+}
+
+
+
+WorkerPool::WorkerPool() :
+    sequence( 0 ), stopping( false ), paused( false )
+{}
+
+
+WorkerPool::~WorkerPool()
+{
+    JobQueue        queued;
+    {
+        std::lock_guard< std::mutex >   guard( lock );
+        stopping = true;
+        queued.swap( queue );
+        documents.clear();
+
+        // The running parses stop at their next check
+        for ( size_t  k = 0; k < running.size(); ++k )
+            running[ k ]->getControl().cancel();
+    }
+    available.notify_all();
+
+    // The futures of the jobs which never run get the cancel error
+    for ( JobQueue::iterator  k = queued.begin(); k != queued.end(); ++k )
+        k->second->abandon();
+
+    for ( size_t  k = 0; k < workers.size(); ++k )
+        workers[ k ].join();
+}
+
+
+void WorkerPool::pause( bool  value )
+{
+    {
+        std::lock_guard< std::mutex >   guard( lock );
+        paused = value;
+    }
+    available.notify_all();
+}
+
+
+void WorkerPool::submit( const std::shared_ptr< ParseJob > &  job )
+{
+    std::shared_ptr< ParseJob >     superseded;
+    {
+        std::lock_guard< std::mutex >   guard( lock );
+        if ( workers.empty() )
+        {
+            unsigned int    count = std::thread::hardware_concurrency();
+            if ( count == 0 )
+                count = 1;
+            for ( unsigned int  k = 0; k < count; ++k )
+                workers.push_back( std::thread( &WorkerPool::work, this ) );
+        }
+
+        QueueKey        key( -job->getPriority(), sequence++ );
+        queue[ key ] = job;
+
+        const std::string &     document = job->getDocument();
+        if ( ! document.empty() )
+        {
+            std::map< std::string, QueueKey >::iterator
+                                    found = documents.find( document );
+            if ( found != documents.end() )
+            {
+                JobQueue::iterator  older = queue.find( found->second );
+                superseded = older->second;
+                queue.erase( older );
+                found->second = key;
+            }
+            else
+                documents[ document ] = key;
+        }
+    }
+    available.notify_one();
+
+    if ( superseded )
+        superseded->supersede();
+}
+
+
+void WorkerPool::work( void )
+{
+    for ( ; ; )
+    {
+        std::shared_ptr< ParseJob >     job;
+        {
+            std::unique_lock< std::mutex >  guard( lock );
+            while ( ! stopping && ( paused || queue.empty() ) )
+                available.wait( guard );
+            if ( stopping )
+                return;
+
+            JobQueue::iterator      first = queue.begin();
+            job = first->second;
+            queue.erase( first );
+            if ( ! job->getDocument().empty() )
+                documents.erase( job->getDocument() );
+            running.push_back( job );
+        }
+        job->run();
+
+        std::lock_guard< std::mutex >   guard( lock );
+        running.erase( std::find( running.begin(), running.end(), job ) );
+    }
+}
+
+
+
+ParseRequest::ParseRequest( const std::shared_ptr< ParseJob > &  job_,
+                            const Py::Object &  loop_,
+                            const Py::Object &  future_ ) :
+    job( job_ ), loop( loop_ ), future( future_ )
+{}
+
+
+ParseRequest::~ParseRequest()
+{}
+
+
+void ParseRequest::initType( void )
+{
+    behaviors().name( "ParseRequest" );
+    behaviors().doc( PARSE_REQUEST_DOC );
+    behaviors().supportGetattr();
+
+    add_noargs_method( "complete", &ParseRequest::complete,
+                       PARSE_REQUEST_COMPLETE_DOC );
+    add_varargs_method( "futureDone", &ParseRequest::futureDone,
+                        PARSE_REQUEST_FUTURE_DONE_DOC );
+
+    behaviors().readyType();
+}
+
+
+Py::Object  ParseRequest::getattr( const char *  attrName )
+{
+    return getattr_methods( attrName );
+}
+
+
+// Called by the future when it is done; a cancelled future stops the job
+Py::Object  ParseRequest::futureDone( const Py::Tuple &  args )
+{
+    if ( future.callMemberFunction( "cancelled" ).isTrue() )
+        job->getControl().cancel();
+    return Py::None();
+}
+
+
+Py::Object  ParseRequest::complete( void )
+{
+    if ( ! job->isDone() )
+        return Py::None();      // Nothing to deliver yet
+
+    loop.callMemberFunction( "remove_reader",
+                             Py::TupleN( Py::Long( job->getDescriptor() ) ) );
+    job->clearSignal();
+
+    // The future could be cancelled by the caller
+    if ( future.callMemberFunction( "done" ).isTrue() )
+        return Py::None();
+
+    try
+    {
+        Py::Object      controlFlow( job->getControlFlow() );
+        future.callMemberFunction( "set_result", Py::TupleN( controlFlow ) );
+    }
+    catch ( Py::BaseException & )
+    {
+        PyObject *      type;
+        PyObject *      value;
+        PyObject *      traceback;
+
+        PyErr_Fetch( &type, &value, &traceback );
+        PyErr_NormalizeException( &type, &value, &traceback );
+        Py_XDECREF( type );
+        Py_XDECREF( traceback );
+
+        Py::Object      exception( value, true );
+        future.callMemberFunction( "set_exception", Py::TupleN( exception ) );
+    }
+    return Py::None();
+}
+
+
+
+CancelToken::CancelToken() :
+    flag( std::make_shared< std::atomic< bool > >( false ) ),
+    started( std::make_shared< std::atomic< bool > >( false ) )
+{}
+
+
+CancelToken::~CancelToken()
+{}
+
+
+void CancelToken::initType( void )
+{
+    behaviors().name( "CancelToken" );
+    behaviors().doc( CANCEL_TOKEN_DOC );
+    behaviors().supportGetattr();
+
+    add_noargs_method( "cancel", &CancelToken::cancel,
+                       CANCEL_TOKEN_CANCEL_DOC );
+    add_noargs_method( "isCancelled", &CancelToken::isCancelled,
+                       CANCEL_TOKEN_IS_CANCELLED_DOC );
+    add_noargs_method( "isStarted", &CancelToken::isStarted,
+                       CANCEL_TOKEN_IS_STARTED_DOC );
+
+    behaviors().readyType();
+}
+
+
+Py::Object  CancelToken::getattr( const char *  attrName )
+{
+    return getattr_methods( attrName );
+}
+
+
+Py::Object  CancelToken::cancel( void )
+{
+    *flag = true;
+    return Py::None();
+}
+
+
+Py::Object  CancelToken::isCancelled( void )
+{
+    return Py::Boolean( *flag );
+}
+
+
+Py::Object  CancelToken::isStarted( void )
+{
+    return Py::Boolean( *started );
+}
+
+
+
+// Returns false if the argument is not a control one. None keeps the default.
+static bool
+setControlArgument( const std::string &  name, const Py::Object &  value,
+                    const char *  funcName, ParseControl &  control )
+{
+    if ( name != "token" && name != "timeout" )
+        return false;
+    if ( value.isNone() )
+        return true;
+
+    if ( name == "token" )
+    {
+        if ( ! isInstance< CancelToken >( value.ptr() ) )
+            throw Py::TypeError( std::string( funcName ) + "() token "
+                                 "must be a CancelToken" );
+        CancelToken *   token( static_cast< CancelToken * >( value.ptr() ) );
+        control.setCancelFlag( token->getFlag() );
+        control.setStartedFlag( token->getStartedFlag() );
+        return true;
+    }
+
+    if ( ! value.isNumeric() )
+        throw Py::TypeError( std::string( funcName ) + "() timeout "
+                             "must be a number of seconds" );
+    control.setTimeout( Py::Float( value ) );
+    return true;
+}
+
+
+// The fragment kinds which could be given in the 'kinds' argument
+static bool
+isSuiteKind( long  kind )
+{
+    switch ( kind )
+    {
+        case COMMENT_FRAGMENT:      case CML_COMMENT_FRAGMENT:
+        case CODEBLOCK_FRAGMENT:    case FUNCTION_FRAGMENT:
+        case CLASS_FRAGMENT:        case BREAK_FRAGMENT:
+        case CONTINUE_FRAGMENT:     case RETURN_FRAGMENT:
+        case RAISE_FRAGMENT:        case ASSERT_FRAGMENT:
+        case SYSEXIT_FRAGMENT:      case WHILE_FRAGMENT:
+        case FOR_FRAGMENT:          case IMPORT_FRAGMENT:
+        case IF_FRAGMENT:           case WITH_FRAGMENT:
+        case TRY_FRAGMENT:
+            return true;
+        default: ;
+    }
+    return false;
+}
+
+
+static unsigned long long
+getKindsArgument( const Py::Object &  value, const char *  funcName )
+{
+    PyObject *      iterator = PyObject_GetIter( value.ptr() );
+    if ( iterator == NULL )
+    {
+        PyErr_Clear();
+        throw Py::TypeError( std::string( funcName ) + "() kinds must be "
+                             "an iterable of the fragment kinds" );
+    }
+
+    Py::Object          guard( iterator, true );
+    unsigned long long  kinds = 0;
+    PyObject *          item;
+    while ( ( item = PyIter_Next( iterator ) ) != NULL )
+    {
+        Py::Object      kind( item, true );
+        if ( ! PyLong_Check( item ) )
+            throw Py::TypeError( std::string( funcName ) + "() kinds must "
+                                 "be integers" );
+        long            value = long( Py::Long( kind ) );
+        if ( ! isSuiteKind( value ) )
+            throw Py::ValueError( std::string( funcName ) + "() kinds: " +
+                                  kind.str().as_std_string() +
+                                  " is not a suite fragment kind" );
+        kinds |= 1ULL << value;
+    }
+    if ( PyErr_Occurred() )
+        throw Py::Exception();
+    return kinds;
+}
+
+
+// Returns false if the argument is not an option one. None keeps the default.
+static bool
+setOptionArgument( const std::string &  name, const Py::Object &  value,
+                   const char *  funcName, ParseOptions &  options )
+{
+    if ( name == "kinds" )
+    {
+        if ( ! value.isNone() )
+            options.kinds = getKindsArgument( value, funcName );
+        return true;
+    }
+    if ( name == "maxDepth" )
+    {
+        if ( value.isNone() )
+            return true;
+        if ( ! PyLong_Check( value.ptr() ) || value.isBoolean() )
+            throw Py::TypeError( std::string( funcName ) + "() maxDepth "
+                                 "must be an integer" );
+        long    depth = long( Py::Long( value ) );
+        if ( depth < 0 || depth > INT_MAX )
+            throw Py::ValueError( std::string( funcName ) + "() maxDepth "
+                                  "must be 0 (no limit) or positive" );
+        options.maxDepth = int( depth );
+        return true;
+    }
+
+    bool *      option = NULL;
+    if ( name == "outline" )
+        option = & options.outline;
+    else if ( name == "comments" )
+        option = & options.comments;
+    else if ( name == "cmlProperties" )
+        option = & options.cmlProperties;
+    else if ( name == "docstrings" )
+        option = & options.docstrings;
+    else if ( name == "sysExit" )
+        option = & options.sysExit;
+    else if ( name == "arguments" )
+        option = & options.arguments;
+    else if ( name == "serialize" )
+        option = & options.serialize;
+    else if ( name == "hashes" )
+        option = & options.hashes;
+    else if ( name == "lazySuites" )
+        option = & options.lazySuites;
+    else
+        return false;
+
+    if ( value.isNone() )
+        return true;
+    if ( ! value.isBoolean() )
+        throw Py::TypeError( std::string( funcName ) + "() " + name +
+                             " must be a boolean" );
+    *option = value.isTrue();
+    return true;
+}
+
+
+static void
+throwUnexpectedArgument( const std::string &  name, const char *  funcName )
+{
+    throw Py::TypeError( std::string( funcName ) + "() got an "
+                         "unexpected keyword argument '" + name + "'" );
+}
+
+
+bool  getParseControl( const Py::Dict &  keywords, const char *  funcName,
+                       ParseControl &  control, ParseOptions &  options )
+{
+    bool            configured = false;
+    Py::List        names( keywords.keys() );
+
+    for ( Py::List::size_type  k = 0; k < names.size(); ++k )
+    {
+        std::string     name( Py::String( names[ k ] ).as_std_string() );
+        Py::Object      value( keywords[ name ] );
+
+        if ( setOptionArgument( name, value, funcName, options ) )
+            continue;
+        if ( ! setControlArgument( name, value, funcName, control ) )
+            throwUnexpectedArgument( name, funcName );
+        if ( ! value.isNone() )
+            configured = true;
+    }
+    return configured;
+}
+
+
+void  setupParseJob( const Py::Dict &  keywords, const char *  funcName,
+                     ParseJob &  job )
+{
+    Py::List        names( keywords.keys() );
+
+    for ( Py::List::size_type  k = 0; k < names.size(); ++k )
+    {
+        std::string     name( Py::String( names[ k ] ).as_std_string() );
+        Py::Object      value( keywords[ name ] );
+
+        if ( name == "document" )
+        {
+            if ( value.isNone() )
+                continue;
+            if ( ! value.isString() )
+                throw Py::TypeError( std::string( funcName ) + "() document "
+                                     "must be a string" );
+            job.setDocument( Py::String( value ).as_std_string( "utf-8" ) );
+        }
+        else if ( name == "priority" )
+        {
+            if ( value.isNone() )
+                continue;
+            if ( ! PyLong_Check( value.ptr() ) )
+                throw Py::TypeError( std::string( funcName ) + "() priority "
+                                     "must be an integer" );
+            job.setPriority( long( Py::Long( value ) ) );
+        }
+        else if ( ! setOptionArgument( name, value, funcName,
+                                       job.getOptions() ) &&
+                  ! setControlArgument( name, value, funcName,
+                                        job.getControl() ) )
+            throwUnexpectedArgument( name, funcName );
+    }
+}
+
+
+
+Py::Object  startParseJob( WorkerPool &  pool,
+                           const std::shared_ptr< ParseJob > &  job,
+                           const Py::Object &  loop )
+{
+    if ( job->getDescriptor() == -1 )
+        throw Py::RuntimeError( "Cannot create the parse completion "
+                                "descriptor" );
+
+    Py::Object      eventLoop( loop );
+    if ( eventLoop.isNone() )
+    {
+        PyObject *      module = PyImport_ImportModule( "asyncio" );
+        if ( module == NULL )
+            throw Py::Exception();
+
+        Py::Object      asyncio( module, true );
+        eventLoop = asyncio.callMemberFunction( "get_running_loop" );
+    }
+
+    Py::Object      future( eventLoop.callMemberFunction( "create_future" ) );
+    Py::Object      request( Py::asObject( new ParseRequest( job, eventLoop,
+                                                             future ) ) );
+
+    future.callMemberFunction( "add_done_callback",
+                               Py::TupleN( request.getAttr( "futureDone" ) ) );
+    eventLoop.callMemberFunction( "add_reader",
+                                  Py::TupleN( Py::Long( job->getDescriptor() ),
+                                              request.getAttr( "complete" ) ) );
+    pool.submit( job );
+    return future;
+}
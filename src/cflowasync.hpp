@@ -0,0 +1,244 @@
+/*
+ * codimension - graphics python two-way code editor and analyzer
+ * Copyright (C) 2014 - 2016  Sergey Satskiy <sergey.satskiy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Asynchronous parsing: worker pool and event loop integration
+ */
+
+#ifndef CFLOWASYNC_HPP
+#define CFLOWASYNC_HPP
+
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "CXX/Objects.hxx"
+#include "CXX/Extensions.hxx"
+
+#include "cflowsyntax.hpp"
+#include "cflowfragments.hpp"
+
+
+// The parse priorities suggested for an editor; any integer could be used
+// and the higher priority parses are started first
+#define PRIORITY_BACKGROUND     0       // e.g. indexing a project
+#define PRIORITY_OPEN           1       // e.g. a file in a not visible tab
+#define PRIORITY_VISIBLE        2       // e.g. the file the user edits
+
+
+// A parse which syntax tree is built on a worker thread without python.
+// The control flow objects are built later by a thread which holds the GIL.
+// The completion is signalled through a file descriptor which becomes
+// readable so that any event loop could wait for it without polling.
+class ParseJob
+{
+    public:
+        // Takes the ownership of the buffer; NULL stands for an empty code
+        ParseJob( char *  buffer );
+        // The file is read on the worker thread
+        ParseJob( const std::string &  fileName );
+        ~ParseJob();
+
+        // Called by a worker thread
+        void  run( void );
+
+        // -1 if the descriptor could not be created
+        int  getDescriptor( void ) const
+        { return readFD; }
+        bool  isDone( void ) const
+        { return done; }
+
+        // Consumes the completion signal
+        void  clearSignal( void );
+
+        // Could be used from any thread to stop the parse
+        ParseControl &  getControl( void )
+        { return control; }
+
+        // What the control flow is built of; must be set before the job is
+        // submitted
+        ParseOptions &  getOptions( void )
+        { return options; }
+
+        // The scheduling parameters; must be set before the job is submitted.
+        // An empty document id means the job is never superseded.
+        void  setDocument( const std::string &  id )
+        { document = id; }
+        const std::string &  getDocument( void ) const
+        { return document; }
+        void  setPriority( int  value )
+        { priority = value; }
+        int  getPriority( void ) const
+        { return priority; }
+
+        // Called by the pool instead of run() when a newer job of the same
+        // document replaces this one in the queue
+        void  supersede( void );
+        // Called by the pool instead of run() when the pool is destroyed
+        // with the job still queued; the job reports the cancel
+        void  abandon( void );
+
+        // Must be called by a thread holding the GIL when the job is done.
+        // Throws a python exception if the file could not be read.
+        Py::Object  getControlFlow( void );
+
+    private:
+        char *              buffer;
+        std::string         fileName;
+        std::string         error;      // The file reading error
+        ParseTree           tree;
+        bool                parsed;
+        ParseControl        control;
+        ParseOptions        options;
+        std::string         document;
+        int                 priority;
+        std::atomic< bool > done;
+
+        int                 readFD;
+        int                 writeFD;    // The same as readFD for eventfd
+
+    private:
+        void  openSignal( void );
+        void  signal( void );
+
+        ParseJob( const ParseJob & );
+        ParseJob &  operator=( const ParseJob & );
+};
+
+
+// A fixed number of threads which run the parse jobs. A free thread takes
+// the highest priority job; the jobs of the same priority are taken in the
+// order they were submitted. A job of a document replaces the queued job of
+// the same document. The threads are started when the first job comes.
+class WorkerPool
+{
+    public:
+        WorkerPool();
+        // Cancels the queued and the running jobs so all their futures are
+        // completed and waits for the threads
+        ~WorkerPool();
+
+        void  submit( const std::shared_ptr< ParseJob > &  job );
+
+        // The paused pool does not start the queued jobs; the running ones
+        // are not affected. Lets the tests build a queue deterministically.
+        void  pause( bool  value );
+
+    private:
+        // The negated priority and the submit sequence number, so the
+        // first queue item is the one to run next
+        typedef std::pair< int, unsigned long >     QueueKey;
+        typedef std::map< QueueKey,
+                          std::shared_ptr< ParseJob > > JobQueue;
+
+        std::vector< std::thread >                  workers;
+        std::mutex                                  lock;
+        std::condition_variable                     available;
+        JobQueue                                    queue;
+        std::map< std::string, QueueKey >           documents;  // Queued only
+        std::vector< std::shared_ptr< ParseJob > >  running;
+        unsigned long                               sequence;
+        bool                                        stopping;
+        bool                                        paused;
+
+    private:
+        void  work( void );
+
+        WorkerPool( const WorkerPool & );
+        WorkerPool &  operator=( const WorkerPool & );
+};
+
+
+// Delivers the job result to an asyncio style future when the event loop
+// reports the job descriptor as readable
+class ParseRequest : public Py::PythonExtension< ParseRequest >
+{
+    public:
+        ParseRequest( const std::shared_ptr< ParseJob > &  job,
+                      const Py::Object &  loop,
+                      const Py::Object &  future );
+        virtual ~ParseRequest();
+
+        static void initType( void );
+        Py::Object getattr( const char *  attrName );
+
+        Py::Object  complete( void );
+        Py::Object  futureDone( const Py::Tuple &  args );
+
+    private:
+        std::shared_ptr< ParseJob >     job;
+        Py::Object                      loop;
+        Py::Object                      future;
+};
+
+
+// The python side of a cancellation flag. A token could be given to many
+// parses and all of them stop when it is cancelled.
+class CancelToken : public Py::PythonExtension< CancelToken >
+{
+    public:
+        CancelToken();
+        virtual ~CancelToken();
+
+        static void initType( void );
+        Py::Object getattr( const char *  attrName );
+
+        Py::Object  cancel( void );
+        Py::Object  isCancelled( void );
+        Py::Object  isStarted( void );
+
+        const std::shared_ptr< std::atomic< bool > > &  getFlag( void ) const
+        { return flag; }
+        const std::shared_ptr< std::atomic< bool > > &  getStartedFlag( void ) const
+        { return started; }
+
+    private:
+        std::shared_ptr< std::atomic< bool > >      flag;
+        std::shared_ptr< std::atomic< bool > >      started;
+};
+
+
+// Sets up the control from the 'token' (a CancelToken) and the 'timeout'
+// (seconds) keyword arguments and the options from the 'outline',
+// 'comments', 'cmlProperties', 'docstrings', 'sysExit', 'arguments',
+// 'serialize', 'hashes', 'lazySuites' (booleans), 'kinds' (fragment kinds) and
+// 'maxDepth' (an integer) ones. Returns false if neither token nor timeout
+// is given.
+bool  getParseControl( const Py::Dict &  keywords, const char *  funcName,
+                       ParseControl &  control, ParseOptions &  options );
+
+// The same as getParseControl() plus the 'document' (a string id) and the
+// 'priority' (an integer) keyword arguments of the asynchronous parses
+void  setupParseJob( const Py::Dict &  keywords, const char *  funcName,
+                     ParseJob &  job );
+
+
+// Submits the job and provides the future the result will be delivered to.
+// The loop must provide create_future(), add_reader() and remove_reader().
+// If the loop is None then the running asyncio event loop is used.
+Py::Object  startParseJob( WorkerPool &  pool,
+                           const std::shared_ptr< ParseJob > &  job,
+                           const Py::Object &  loop );
+
+
+#endif
+
@@ -22,7 +22,9 @@
 #include <ctype.h>
 
 #include <string.h>
+#include <limits.h>
 #include <stdexcept>
+#include <algorithm>
 
 #include "cflowcomments.hpp"
 
@@ -47,6 +49,215 @@ std::string  commentTypeToString( CommentType  t )
 }
 
 
+void EditedText::assign( const char *  buffer )
+{
+    blocks.clear();
+    setBlocks( 0, 0, buffer );
+}
+
+
+// The block which has the position. The position must be in the text.
+size_t EditedText::findBlock( int  absPos, int &  blockBegin ) const
+{
+    for ( size_t  k = lastBlock; k < blocks.size() && k <= lastBlock + 1;
+            ++k )
+    {
+        int     begin = k == lastBlock ? lastBegin
+                                       : lastBegin + blocks[ lastBlock ]->size();
+        if ( absPos >= begin && absPos < begin + int( blocks[ k ]->size() ) )
+        {
+            blockBegin = begin;
+            return k;
+        }
+    }
+
+    size_t      count = 0;
+    size_t      step = 1;
+    int         rest = absPos;
+
+    while ( step * 2 < sizes.size() )
+        step *= 2;
+    for ( ; step > 0; step /= 2 )
+    {
+        if ( count + step < sizes.size() && sizes[ count + step ] <= rest )
+        {
+            count += step;
+            rest -= sizes[ count ];
+        }
+    }
+    blockBegin = absPos - rest;
+    return count;
+}
+
+
+void EditedText::addSize( size_t  block, int  delta )
+{
+    for ( size_t  k = block + 1; k < sizes.size(); k += k & ( ~k + 1 ) )
+        sizes[ k ] += delta;
+}
+
+
+// Replaces the blocks from the first one till the one before the last one
+// with the text cut in blocks and builds the sizes tree again
+void EditedText::setBlocks( size_t  first, size_t  last,
+                            const std::string &  text )
+{
+    std::vector< std::shared_ptr< std::string > >   added;
+    size_t      blockCount = ( text.size() + EDITED_TEXT_BLOCK_SIZE - 1 ) /
+                             EDITED_TEXT_BLOCK_SIZE;
+
+    for ( size_t  k = 0; k < blockCount; ++k )
+    {
+        size_t      begin = text.size() * k / blockCount;
+        size_t      end = text.size() * ( k + 1 ) / blockCount;
+        added.push_back( std::make_shared< std::string >(
+                                    text.substr( begin, end - begin ) ) );
+    }
+    blocks.erase( blocks.begin() + first, blocks.begin() + last );
+    blocks.insert( blocks.begin() + first, added.begin(), added.end() );
+
+    size = 0;
+    sizes.assign( blocks.size() + 1, 0 );
+    for ( size_t  k = 1; k < sizes.size(); ++k )
+    {
+        size += blocks[ k - 1 ]->size();
+        sizes[ k ] += blocks[ k - 1 ]->size();
+
+        size_t      upper = k + ( k & ( ~k + 1 ) );
+        if ( upper < sizes.size() )
+            sizes[ upper ] += sizes[ k ];
+    }
+    lastBlock = 0;
+    lastBegin = 0;
+    lastSize = 0;
+}
+
+
+// An edit inside a block changes that block only, copying it if it is
+// shared. The blocks which grow too large or too small and the edits over
+// several blocks cut the text in blocks again.
+void EditedText::replace( int  offset, int  removed,
+                          const std::string &  inserted )
+{
+    if ( blocks.empty() )
+    {
+        setBlocks( 0, 0, inserted );
+        return;
+    }
+
+    int         firstBegin;
+    size_t      first = offset < size ? findBlock( offset, firstBegin )
+                                      : blocks.size() - 1;
+    if ( offset >= size )
+        firstBegin = size - blocks[ first ]->size();
+
+    size_t      last = first;
+    int         lastBlockBegin = firstBegin;
+    while ( last + 1 < blocks.size() &&
+            lastBlockBegin + int( blocks[ last ]->size() ) < offset + removed )
+    {
+        lastBlockBegin += blocks[ last ]->size();
+        ++last;
+    }
+
+    if ( first != last )
+    {
+        const std::string &     tail( *blocks[ last ] );
+        setBlocks( first, last + 1,
+                   blocks[ first ]->substr( 0, offset - firstBegin ) +
+                   inserted +
+                   tail.substr( offset + removed - lastBlockBegin ) );
+        return;
+    }
+
+    std::shared_ptr< std::string > &    block( blocks[ first ] );
+    int     blockSize = block->size() + inserted.size() - removed;
+    if ( blockSize > 2 * EDITED_TEXT_BLOCK_SIZE ||
+         ( blockSize < EDITED_TEXT_BLOCK_SIZE / 8 && blocks.size() > 1 ) )
+    {
+        // Cut again together with a neighbour if it is too small
+        size_t      begin = first;
+        size_t      end = first + 1;
+        if ( blockSize < EDITED_TEXT_BLOCK_SIZE / 8 )
+        {
+            if ( end < blocks.size() )
+                ++end;
+            else
+            {
+                --begin;
+                firstBegin -= blocks[ begin ]->size();
+            }
+        }
+
+        std::string     text;
+        for ( size_t  k = begin; k < end; ++k )
+            text += *blocks[ k ];
+        text.replace( offset - firstBegin, removed, inserted );
+        setBlocks( begin, end, text );
+        return;
+    }
+
+    if ( block.use_count() > 1 )
+        block = std::make_shared< std::string >( *block );
+    block->replace( offset - firstBegin, removed, inserted );
+    addSize( first, inserted.size() - removed );
+    size += inserted.size() - removed;
+    lastBlock = 0;
+    lastBegin = 0;
+    lastSize = 0;
+}
+
+
+char EditedText::getChar( int  absPos ) const
+{
+    if ( absPos < 0 || absPos >= size )
+        return '\0';
+
+    int         blockBegin;
+    size_t      block = findBlock( absPos, blockBegin );
+
+    lastBlock = block;
+    lastBegin = blockBegin;
+    lastData = blocks[ block ]->data();
+    lastSize = blocks[ block ]->size();
+    return lastData[ absPos - blockBegin ];
+}
+
+
+std::string EditedText::getText( int  begin, int  length ) const
+{
+    std::string     text;
+
+    if ( begin < 0 )
+    {
+        length += begin;
+        begin = 0;
+    }
+    if ( length > size - begin )
+        length = size - begin;
+    if ( length <= 0 )
+        return text;
+
+    int         blockBegin;
+    size_t      block = findBlock( begin, blockBegin );
+
+    text.reserve( length );
+    while ( int( text.size() ) < length )
+    {
+        const std::string &     blockText( *blocks[ block ] );
+        int     from = begin + text.size() - blockBegin;
+        int     count = std::min( int( blockText.size() ) - from,
+                                  length - int( text.size() ) );
+
+        text.append( blockText, from, count );
+        blockBegin += blockText.size();
+        ++block;
+    }
+    return text;
+}
+
+
+
 // Comment search state
 enum ExpectState
 {
@@ -60,17 +271,9 @@ enum ExpectState
 
 
 
+template < typename Text >
 static bool
-isEscaped( const char *  buffer, int  absPos )
-{
-    if ( absPos == 0 )
-        return false;
-    return buffer[ absPos - 1 ] == '\\';
-}
-
-
-static bool
-isTriple( const char *  buffer, int  absPos )
+isTriple( const Text &  buffer, int  absPos )
 {
     char    symbol = buffer[ absPos ];
     if ( buffer[ absPos + 1 ] != symbol )
@@ -81,10 +284,20 @@ isTriple( const char *  buffer, int  absPos )
 }
 
 
-void CommentLine::detectType( const char *  buffer )
+static bool
+isInString( ExpectState  expectState )
+{
+    return expectState != expectCommentStart &&
+           expectState != expectCommentEnd;
+}
+
+
+template < typename Text >
+static CommentType
+getCommentType( const Text &  buffer, const CommentLine &  comment )
 {
-    int     shift = begin + 1;
-    while ( shift <= end )
+    int     shift = comment.begin + 1;
+    while ( shift <= comment.end )
     {
         // skip spaces if so
         if ( buffer[ shift ] == ' ' || buffer[ shift ] == '\t' )
@@ -93,39 +306,49 @@ void CommentLine::detectType( const char *  buffer )
             continue;
         }
 
-        if ( strncmp( buffer + shift, "cml", 3 ) == 0 )
+        if ( buffer[ shift ] == 'c' && buffer[ shift + 1 ] == 'm' &&
+             buffer[ shift + 2 ] == 'l' )
         {
             shift += 3;
             if ( buffer[ shift ] == '+' )
-                type = CML_COMMENT_CONTINUE;
-            else
-                type = CML_COMMENT;
-            return;
+                return CML_COMMENT_CONTINUE;
+            return CML_COMMENT;
         }
-        type = REGULAR_COMMENT;
-        return;
+        return REGULAR_COMMENT;
     }
+    return REGULAR_COMMENT;
+}
 
-    type = REGULAR_COMMENT;
-    return;
+
+void CommentLine::detectType( const char *  buffer )
+{
+    type = getCommentType( buffer, *this );
 }
 
 
-// The function walks the given buffer and provides two things:
-// - an array of absolute positions of the beginning of each line
-// - a deque of found comments
-void getLineShiftsAndComments( const char *  buffer, int *  lineShifts,
-                               std::deque< CommentLine > &  comments )
+void CommentLine::detectType( const EditedText &  buffer )
+{
+    type = getCommentType( buffer, *this );
+}
+
+
+// Walks the buffer from a line start in the given lexer state. The strings
+// follow the tokenizer rules: a backslash in a string escapes the next
+// character, a line break included, and a single quoted string which is not
+// closed on its line ends there. The handler gets the beginning of each next
+// line and stops the walk by returning false. The comments are collected if
+// the deque is given.
+template < typename Text, typename LineHandler >
+static void
+scanBuffer( const Text &  buffer, int  absPos, int  line,
+            ExpectState  expectState, LineHandler &  onLineStart,
+            std::deque< CommentLine > *  comments )
 {
-    int             absPos = 0;
     char            symbol;
-    int             line = 1;
     int             column = 1;
-    ExpectState     expectState = expectCommentStart;
+    bool            escapedLineBreak = false;
     CommentLine     comment;
 
-    /* index 0 is not used; The first line starts with shift 0 */
-    lineShifts[ 1 ] = 0;
     while ( buffer[ absPos ] != '\0' )
     {
         symbol = buffer[ absPos ];
@@ -144,17 +367,23 @@ void getLineShiftsAndComments( const char *  buffer, int *  lineShifts,
                 continue;
             }
         }
+        else if ( symbol == '\\' && isInString( expectState ) )
+        {
+            ++absPos;
+            ++column;
+            if ( buffer[ absPos ] == '\r' || buffer[ absPos ] == '\n' )
+                escapedLineBreak = true;
+            else if ( buffer[ absPos ] != '\0' )
+            {
+                ++absPos;
+                ++column;
+            }
+            continue;
+        }
         else if ( expectState != expectCommentEnd )
         {
             if ( symbol == '\"' || symbol == '\'' )
             {
-                if ( isEscaped( buffer, absPos ) )
-                {
-                    ++absPos;
-                    ++column;
-                    continue;
-                }
-
                 // It is not escaped some kind of quote
                 if ( symbol == '\"' &&
                         ( expectState == expectClosingSingleQuote ||
@@ -229,56 +458,578 @@ void getLineShiftsAndComments( const char *  buffer, int *  lineShifts,
 
 
 
-        if ( symbol == '\r' )
+        if ( symbol == '\r' || symbol == '\n' )
         {
             comment.end = absPos - 1;   // will not harm but will unify the code
             ++absPos;
-            if ( buffer[ absPos ] == '\n' )
+            if ( symbol == '\r' && buffer[ absPos ] == '\n' )
             {
                 ++absPos;
             }
             ++line;
-            lineShifts[ line ] = absPos;
             column = 1;
             if ( expectState == expectCommentEnd )
             {
                 comment.detectType( buffer );
-                comments.push_back( comment );
+                if ( comments != NULL )
+                    comments->push_back( comment );
                 comment.begin = -1;
                 expectState = expectCommentStart;
             }
+            else if ( ( expectState == expectClosingSingleQuote ||
+                        expectState == expectClosingDoubleQuote ) &&
+                      ! escapedLineBreak )
+                expectState = expectCommentStart;
+            escapedLineBreak = false;
+            if ( ! onLineStart( absPos, expectState ) )
+                return;
             continue;
         }
+        ++absPos;
+        ++column;
+    }
+
+    if ( comment.begin != -1 && comments != NULL )
+    {
+        // Need to flush the collected comment
+        comment.detectType( buffer );
+        comment.end = absPos - 1;
+        comments->push_back( comment );
+    }
+
+    return;
+}
+
+
+
+
+struct ArrayLineShifts
+{
+    int *   lineShifts;
+    int     line;
+
+    bool operator()( int  absPos, ExpectState )
+    {
+        lineShifts[ ++line ] = absPos;
+        return true;
+    }
+};
+
+
+// The function walks the given buffer and provides two things:
+// - an array of absolute positions of the beginning of each line
+// - a deque of found comments
+void getLineShiftsAndComments( const char *  buffer, int *  lineShifts,
+                               std::deque< CommentLine > &  comments )
+{
+    ArrayLineShifts     handler = { lineShifts, 1 };
+
+    /* index 0 is not used; The first line starts with shift 0 */
+    lineShifts[ 1 ] = 0;
+    scanBuffer( buffer, 0, 1, expectCommentStart, handler, & comments );
+}
+
+
+
+struct ScannedLineShifts
+{
+    std::vector< ScannedLines::LineStart > &    lines;
+
+    bool operator()( int  absPos, ExpectState  expectState )
+    {
+        ScannedLines::LineStart     lineStart = { absPos, expectState };
+        lines.push_back( lineStart );
+        return true;
+    }
+};
+
+
+void ScannedLines::scan( const char *  buffer )
+{
+    ScannedLineShifts           handler = { before };
+    ScannedLines::LineStart     first = { 0, expectCommentStart };
+
+    before.assign( 2, first );
+    after.clear();
+    commentsBefore.clear();
+    commentsAfter.clear();
+    size = strlen( buffer );
+    scanBuffer( buffer, 0, 1, expectCommentStart, handler, & commentsBefore );
+}
+
+
+void ScannedLines::scan( const EditedText &  buffer )
+{
+    ScannedLineShifts           handler = { before };
+    ScannedLines::LineStart     first = { 0, expectCommentStart };
+
+    before.assign( 2, first );
+    after.clear();
+    commentsBefore.clear();
+    commentsAfter.clear();
+    size = buffer.getSize();
+    scanBuffer( buffer, 0, 1, expectCommentStart, handler, & commentsBefore );
+}
+
+
+CommentLine  ScannedLines::flipComment( const CommentLine &  comment ) const
+{
+    CommentLine     flipped( comment );
 
-        if ( symbol == '\n' )
+    flipped.begin = size - comment.begin;
+    flipped.end = size - comment.end;
+    flipped.line = getLineCount() - comment.line;
+    return flipped;
+}
+
+
+void ScannedLines::splitComments( int  absPos )
+{
+    while ( ! commentsBefore.empty() && commentsBefore.back().begin >= absPos )
+    {
+        commentsAfter.push_back( flipComment( commentsBefore.back() ) );
+        commentsBefore.pop_back();
+    }
+    while ( ! commentsAfter.empty() &&
+            size - commentsAfter.back().begin < absPos )
+    {
+        commentsBefore.push_back( flipComment( commentsAfter.back() ) );
+        commentsAfter.pop_back();
+    }
+}
+
+
+// Adds the lines of the edited text till a line starts where an old line
+// starts after the edit and in the same lexer state: the rest is the same
+struct RescannedLineShifts
+{
+    std::vector< ScannedLines::LineStart > &    before;
+    std::vector< ScannedLines::LineStart > &    after;
+    int                                         size;   // The edited one
+
+    bool operator()( int  absPos, ExpectState  expectState )
+    {
+        while ( ! after.empty() && size - after.back().shift < absPos )
+            after.pop_back();
+        if ( ! after.empty() && size - after.back().shift == absPos )
+        {
+            if ( after.back().state == expectState )
+                return false;
+            after.pop_back();   // The same line in another state
+        }
+
+        ScannedLines::LineStart     lineStart = { absPos, expectState };
+        before.push_back( lineStart );
+        return true;
+    }
+};
+
+
+// The table is split before the edit first. The lines which start before the
+// edit stay as they are, and so do the lines after it as the distances from
+// the end do not change.
+void ScannedLines::rescan( const EditedText &  buffer,
+                           int  offset, int  removed, int  inserted )
+{
+    while ( before.size() > 2 && before.back().shift >= offset )
+    {
+        LineStart   lineStart = { size - before.back().shift,
+                                  before.back().state };
+        after.push_back( lineStart );
+        before.pop_back();
+    }
+    while ( ! after.empty() && size - after.back().shift < offset )
+    {
+        LineStart   lineStart = { size - after.back().shift,
+                                  after.back().state };
+        before.push_back( lineStart );
+        after.pop_back();
+    }
+
+    // The comments of the rescanned lines are found again
+    splitComments( before.back().shift );
+
+    // The line starts in the removed text and right after it could be gone
+    while ( ! after.empty() && size - after.back().shift <= offset + removed )
+        after.pop_back();
+
+    size += inserted - removed;
+
+    RescannedLineShifts         handler = { before, after, size };
+    std::deque< CommentLine >   comments;
+    scanBuffer( buffer, before.back().shift, before.size() - 1,
+                ExpectState( before.back().state ), handler, & comments );
+
+    // The scan stops at the first kept line; the comments before it are the
+    // new ones. The kept ones are on the same lines counted from the end.
+    int     stop = after.empty() ? size + 1 : size - after.back().shift;
+    while ( ! commentsAfter.empty() &&
+            size - commentsAfter.back().begin < stop )
+        commentsAfter.pop_back();
+    commentsBefore.insert( commentsBefore.end(),
+                           comments.begin(), comments.end() );
+}
+
+
+void ScannedLines::getComments( std::vector< CommentLine > &  comments ) const
+{
+    comments.assign( commentsBefore.begin(), commentsBefore.end() );
+    for ( size_t  k = commentsAfter.size(); k > 0; --k )
+        comments.push_back( flipComment( commentsAfter[ k - 1 ] ) );
+}
+
+
+static bool
+isBefore( int  absPos, const ScannedLines::LineStart &  lineStart )
+{
+    return absPos < lineStart.shift;
+}
+
+
+static bool
+isCloser( const ScannedLines::LineStart &  lineStart, int  distance )
+{
+    return lineStart.shift < distance;
+}
+
+
+void ScannedLines::getLineAndPos( int  absPos, int &  line, int &  pos ) const
+{
+    int     lineShift;
+
+    line = std::upper_bound( before.begin() + 1, before.end(), absPos,
+                             isBefore ) - before.begin() - 1;
+    lineShift = before[ line ].shift;
+    if ( size_t( line ) == before.size() - 1 )
+    {
+        // The lines after the split which start at the position or earlier
+        // are the ones with the distance from the end at least that large
+        int     count = after.end() -
+                        std::lower_bound( after.begin(), after.end(),
+                                          size - absPos, isCloser );
+        line += count;
+        if ( count > 0 )
+            lineShift = size - after[ after.size() - count ].shift;
+    }
+    pos = absPos - lineShift + 1;
+}
+
+
+int ScannedLines::getLineStart( int  line ) const
+{
+    if ( size_t( line ) < before.size() )
+        return before[ line ].shift;
+
+    // The first line after the split is the closest one
+    size_t      k = line - before.size();
+    if ( k < after.size() )
+        return size - after[ after.size() - 1 - k ].shift;
+    return INT_MAX;
+}
+
+
+// Provides the keyword length if the buffer has the keyword followed by a
+// space or a tab at the given position and 0 otherwise
+static int
+matchKeyword( const char *  buffer, int  absPos, const char *  keyword )
+{
+    int     length = strlen( keyword );
+    if ( strncmp( buffer + absPos, keyword, length ) != 0 )
+        return 0;
+    if ( buffer[ absPos + length ] != ' ' && buffer[ absPos + length ] != '\t' )
+        return 0;
+    return length;
+}
+
+
+static int
+skipBlanks( const char *  buffer, int  absPos )
+{
+    while ( buffer[ absPos ] == ' ' || buffer[ absPos ] == '\t' )
+        ++absPos;
+    return absPos;
+}
+
+
+static bool
+isNameCharacter( char  symbol )
+{
+    // The utf-8 encoded non ascii characters are accepted as is
+    return isalnum( (unsigned char)symbol ) != 0 || symbol == '_' ||
+           (unsigned char)symbol >= 0x80;
+}
+
+
+// Checks a statement which starts at the first column. Provides true and
+// fills the definition if it is a 'def', 'async def' or 'class' one.
+static bool
+scanDefinitionHeader( const char *  buffer, int  absPos, int  line,
+                      ScannedDefinition &  definition )
+{
+    int     length;
+
+    definition.asyncBegin = -1;
+    definition.isClass = false;
+    definition.keywordBegin = absPos;
+
+    length = matchKeyword( buffer, absPos, "async" );
+    if ( length != 0 )
+    {
+        definition.asyncBegin = absPos;
+        definition.keywordBegin = skipBlanks( buffer, absPos + length );
+        length = matchKeyword( buffer, definition.keywordBegin, "def" );
+    }
+    else
+    {
+        length = matchKeyword( buffer, absPos, "def" );
+        if ( length == 0 )
+        {
+            length = matchKeyword( buffer, absPos, "class" );
+            definition.isClass = true;
+        }
+    }
+    if ( length == 0 )
+        return false;
+
+    definition.line = line;
+    definition.pos = definition.keywordBegin - absPos + 1;
+
+    int     nameEnd = skipBlanks( buffer, definition.keywordBegin + length );
+    definition.nameBegin = nameEnd;
+    while ( isNameCharacter( buffer[ nameEnd ] ) )
+        ++nameEnd;
+    if ( nameEnd == definition.nameBegin )
+        definition.nameBegin = -1;      // The name is not typed yet
+    definition.nameEnd = nameEnd - 1;
+    return true;
+}
+
+
+// The pre-scan is more forgiving than the tokenizer: a not closed quote ends
+// at the end of the line and a top level 'def' or 'class' resets the not
+// closed brackets. So the code which is being typed does not hide the rest
+// of the definitions.
+void scanDefinitions( const char *  buffer,
+                      std::vector< ScannedDefinition > &  definitions )
+{
+    int                 absPos = 0;
+    char                symbol;
+    int                 line = 1;
+    int                 column = 1;
+    ExpectState         expectState = expectCommentStart;
+    int                 brackets = 0;
+    bool                continued = false;  // A backslash before a line end
+    bool                lineStart = true;
+    bool                lineHasCode = false;
+    bool                open = false;       // The last definition has no end
+    int                 decoratorBegin = -1;   // Leading comments included
+    int                 decoratorLine = -1;
+    int                 leadingBegin = -1;     // The leading comments
+    int                 leadingLine = -1;
+    ScannedDefinition   definition;
+
+    // The last character of the code and of the side comments
+    int                 lastEnd = -1;
+    int                 lastLine = 1;
+    int                 lastPos = 0;
+
+    while ( buffer[ absPos ] != '\0' )
+    {
+        symbol = buffer[ absPos ];
+
+        if ( lineStart )
+        {
+            lineStart = false;
+            if ( brackets > 0 && expectState == expectCommentStart &&
+                 scanDefinitionHeader( buffer, absPos, line, definition ) )
+                brackets = 0;
+
+            int     first = skipBlanks( buffer, absPos );
+            char    firstSymbol = buffer[ first ];
+
+            if ( brackets > 0 )
+                ;   // A continuation line
+            else if ( firstSymbol == '\r' || firstSymbol == '\n' ||
+                      firstSymbol == '\0' || firstSymbol == '\f' )
+                leadingBegin = -1;
+            else if ( firstSymbol == '#' )
+            {
+                if ( first != absPos )
+                {
+                    // An indented comment is a trailing one of the
+                    // definition suite
+                    leadingBegin = -1;
+                    lineHasCode = open;
+                }
+                else if ( leadingBegin == -1 )
+                {
+                    leadingBegin = absPos;
+                    leadingLine = line;
+                }
+            }
+            else if ( first != absPos )
+                leadingBegin = -1;
+            else
+            {
+                // A top level statement ends the previous definition
+                if ( open )
+                {
+                    definitions.back().end = lastEnd;
+                    definitions.back().endLine = lastLine;
+                    definitions.back().endPos = lastPos;
+                    open = false;
+                }
+
+                if ( leadingBegin == -1 )
+                {
+                    leadingBegin = absPos;
+                    leadingLine = line;
+                }
+
+                if ( symbol == '@' )
+                {
+                    if ( decoratorBegin == -1 )
+                    {
+                        decoratorBegin = leadingBegin;
+                        decoratorLine = leadingLine;
+                    }
+                }
+                else
+                {
+                    if ( scanDefinitionHeader( buffer, absPos, line,
+                                               definition ) )
+                    {
+                        definition.begin = leadingBegin;
+                        definition.beginLine = leadingLine;
+                        if ( decoratorBegin != -1 )
+                        {
+                            definition.begin = decoratorBegin;
+                            definition.beginLine = decoratorLine;
+                        }
+                        definitions.push_back( definition );
+                        open = true;
+                    }
+                    decoratorBegin = -1;
+                }
+                leadingBegin = -1;
+            }
+        }
+
+        if ( symbol == '\r' || symbol == '\n' )
         {
-            comment.end = absPos - 1;   // will not harm but will unify the code
             ++absPos;
+            if ( symbol == '\r' && buffer[ absPos ] == '\n' )
+                ++absPos;
             ++line;
-            lineShifts[ line ] = absPos;
             column = 1;
+
             if ( expectState == expectCommentEnd )
-            {
-                comment.detectType( buffer );
-                comments.push_back( comment );
-                comment.begin = -1;
                 expectState = expectCommentStart;
+            else if ( ! continued &&
+                      ( expectState == expectClosingSingleQuote ||
+                        expectState == expectClosingDoubleQuote ) )
+                expectState = expectCommentStart;
+
+            lineStart = expectState == expectCommentStart && ! continued;
+            lineHasCode = lineHasCode && ! lineStart;
+            continued = false;
+            continue;
+        }
+
+        if ( symbol == ' ' || symbol == '\t' || symbol == '\f' )
+        {
+            ++absPos;
+            ++column;
+            continue;
+        }
+
+        if ( expectState == expectCommentEnd )
+        {
+            if ( lineHasCode )
+            {
+                lastEnd = absPos;
+                lastLine = line;
+                lastPos = column;
             }
+            ++absPos;
+            ++column;
             continue;
         }
-        ++absPos;
-        ++column;
+
+        int     length = 1;
+        if ( symbol == '\\' )
+        {
+            if ( buffer[ absPos + 1 ] == '\r' || buffer[ absPos + 1 ] == '\n' )
+                continued = true;
+            else if ( expectState != expectCommentStart &&
+                      buffer[ absPos + 1 ] != '\0' )
+                length = 2;     // An escaped character of a string literal
+        }
+        else if ( expectState == expectCommentStart )
+        {
+            if ( symbol == '#' )
+                expectState = expectCommentEnd;
+            else if ( symbol == '(' || symbol == '[' || symbol == '{' )
+                ++brackets;
+            else if ( symbol == ')' || symbol == ']' || symbol == '}' )
+            {
+                if ( brackets > 0 )
+                    --brackets;
+            }
+            else if ( symbol == '\"' || symbol == '\'' )
+            {
+                if ( isTriple( buffer, absPos ) )
+                {
+                    length = 3;
+                    expectState = symbol == '\"' ?
+                                        expectClosingTripleDoubleQuote :
+                                        expectClosingTripleSingleQuote;
+                }
+                else
+                    expectState = symbol == '\"' ? expectClosingDoubleQuote :
+                                                   expectClosingSingleQuote;
+            }
+        }
+        else if ( ( symbol == '\"' &&
+                    expectState == expectClosingDoubleQuote ) ||
+                  ( symbol == '\'' &&
+                    expectState == expectClosingSingleQuote ) )
+            expectState = expectCommentStart;
+        else if ( ( symbol == '\"' &&
+                    expectState == expectClosingTripleDoubleQuote ) ||
+                  ( symbol == '\'' &&
+                    expectState == expectClosingTripleSingleQuote ) )
+        {
+            if ( isTriple( buffer, absPos ) )
+            {
+                length = 3;
+                expectState = expectCommentStart;
+            }
+        }
+
+        if ( expectState != expectCommentEnd )
+        {
+            lineHasCode = true;
+            lastEnd = absPos + length - 1;
+            lastLine = line;
+            lastPos = column + length - 1;
+        }
+        else if ( lineHasCode )
+        {
+            lastEnd = absPos;
+            lastLine = line;
+            lastPos = column;
+        }
+        absPos += length;
+        column += length;
     }
 
-    if ( comment.begin != -1 )
+    if ( open )
     {
-        // Need to flush the collected comment
-        comment.detectType( buffer );
-        comment.end = absPos - 1;
-        comments.push_back( comment );
+        definitions.back().end = lastEnd;
+        definitions.back().endLine = lastLine;
+        definitions.back().endPos = lastPos;
     }
-
-    return;
 }
 
 
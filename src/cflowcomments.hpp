@@ -23,7 +23,9 @@
 
 
 #include <deque>
+#include <memory>
 #include <string>
+#include <vector>
 
 
 enum CommentType
@@ -38,6 +40,56 @@ enum CommentType
 
 std::string  commentTypeToString( CommentType  t );
 
+
+// The buffer of an edited control flow. It is kept in blocks of a few
+// kilobytes so an edit copies the blocks it changes rather than the whole
+// buffer. The blocks could be shared by several texts; the shared ones are
+// copied before they are changed. The block positions are found by the block
+// sizes kept in a Fenwick tree.
+#define EDITED_TEXT_BLOCK_SIZE      4096
+
+class EditedText
+{
+    public:
+        EditedText() : size( 0 ), lastBlock( 0 ), lastBegin( 0 ),
+                       lastData( NULL ), lastSize( 0 )
+        {}
+
+        void  assign( const char *  buffer );
+        void  replace( int  offset, int  removed,
+                       const std::string &  inserted );
+
+        int   getSize( void ) const
+        { return size; }
+
+        // '\0' out of the text as at the end of a C string
+        char  operator[]( int  absPos ) const
+        {
+            if ( absPos >= lastBegin && absPos - lastBegin < lastSize )
+                return lastData[ absPos - lastBegin ];
+            return getChar( absPos );
+        }
+
+        std::string  getText( int  begin, int  length ) const;
+
+    private:
+        std::vector< std::shared_ptr< std::string > >   blocks;
+        std::vector< int >                              sizes;  // 1-based
+        int                                             size;
+
+        // The block of the last read; the reads are mostly sequential
+        mutable size_t                                  lastBlock;
+        mutable int                                     lastBegin;
+        mutable const char *                            lastData;
+        mutable int                                     lastSize;
+
+        char    getChar( int  absPos ) const;
+        size_t  findBlock( int  absPos, int &  blockBegin ) const;
+        void    addSize( size_t  block, int  delta );
+        void    setBlocks( size_t  first, size_t  last,
+                           const std::string &  text );
+};
+
 struct CommentLine
 {
     int             begin;      // Absolute position of the '#' character,
@@ -57,6 +109,7 @@ struct CommentLine
 
     // Updates the 'type' field
     void  detectType( const char *  buffer );
+    void  detectType( const EditedText &  buffer );
 };
 
 
@@ -65,6 +118,90 @@ void getLineShiftsAndComments( const char *  buffer, int *  lineShifts,
                                std::deque< CommentLine > &  comments );
 
 
+// The beginnings of the lines of a buffer which is edited, with the lexer
+// state at each of them, and the comments. The state tells if a line starts
+// inside a string so an edited buffer could be scanned again from the edited
+// line only. The lines and the comments after the last edit are kept as the
+// distances from the buffer end (and from the last line), so an edit
+// changes only the ones between it and the previous one.
+class ScannedLines
+{
+    public:
+        struct LineStart
+        {
+            int     shift;      // The distance from the end after the split
+            int     state;
+        };
+
+        ScannedLines() : size( 0 )
+        {}
+
+        void  scan( const char *  buffer );
+        void  scan( const EditedText &  buffer );
+
+        // The buffer is the edited one while the offset and the removed
+        // length are in the buffer before the edit. The walk stops at the
+        // first line after the edit which starts in the same state as before.
+        void  rescan( const EditedText &  buffer,
+                      int  offset, int  removed, int  inserted );
+
+        // The 1-based line and column of the absolute position
+        void  getLineAndPos( int  absPos, int &  line, int &  pos ) const;
+
+        // The absolute position of the 1-based line; INT_MAX if there is
+        // no such line
+        int   getLineStart( int  line ) const;
+
+        // The comments of the edited buffer in the order of their positions
+        void  getComments( std::vector< CommentLine > &  comments ) const;
+
+    private:
+        std::vector< LineStart >    before;     // Index 0 is not used
+        std::vector< LineStart >    after;      // The last one is the closest
+        std::deque< CommentLine >   commentsBefore;
+        std::vector< CommentLine >  commentsAfter;  // The same as after
+        int                         size;
+
+    private:
+        int  getLineCount( void ) const
+        { return before.size() - 1 + after.size(); }
+        // Moves the comments between the two parts so the ones which start
+        // at the position or later are after the split
+        void  splitComments( int  absPos );
+        // Turns the positions and the line of a comment counted from the
+        // beginning to the ones counted from the end and back
+        CommentLine  flipComment( const CommentLine &  comment ) const;
+};
+
+
+// A top level 'def' or 'class' found by the pre-scan. The range is
+// approximate: it starts at the leading comments or at the first decorator
+// and ends at the last code or indented comment line before the next top
+// level statement.
+struct ScannedDefinition
+{
+    bool            isClass;
+    int             begin;          // Absolute positions, 0-based
+    int             end;
+    int             beginLine;      // 1-based
+    int             endLine;
+    int             endPos;         // 1-based column of the last character
+    int             asyncBegin;     // -1 if there is no 'async' keyword
+    int             keywordBegin;   // 'def' or 'class'
+    int             nameBegin;      // -1 if there is no name yet
+    int             nameEnd;
+    int             line;           // The line of the keyword
+    int             pos;            // 1-based column of the keyword
+};
+
+// Finds the top level definitions by the indentation and the keywords
+// without tokenizing the buffer. The strings, the comments, the brackets and
+// the line continuations are skipped the same way as by
+// getLineShiftsAndComments() so it takes a single pass over the buffer.
+void scanDefinitions( const char *  buffer,
+                      std::vector< ScannedDefinition > &  definitions );
+
+
 // CML comments parsing support
 std::string  getCMLCommentToken( const std::string &  comment,
                                  ssize_t &  pos );
@@ -0,0 +1,565 @@
+/*
+ * codimension - graphics python two-way code editor and analyzer
+ * Copyright (C) 2014 - 2016  Sergey Satskiy <sergey.satskiy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Structural difference between two control flows
+ */
+
+#include <vector>
+#include <map>
+#include <set>
+
+#include "cflowdiff.hpp"
+#include "cflowfragmenttypes.hpp"
+
+
+
+struct DiffNode
+{
+    PyObject *          object;
+    FragmentBase *      fragment;
+    unsigned long long  hash;
+    int                 match;      // The other side node index or -1
+    bool                stable;     // Matched and kept the order
+    bool                changed;    // Matched by kind, not by hash
+};
+
+
+// The nested fragments which are compared as separate subtrees
+static void
+getDiffNodes( FragmentBase *  fragment, std::vector< DiffNode > &  nodes )
+{
+    std::vector< PyObject * >   objects;
+
+    getNestedObjects( fragment, objects, true );
+    for ( size_t  k = 0; k < objects.size(); ++k )
+    {
+        FragmentBase *  nested( getFragment( objects[ k ] ) );
+        if ( nested->kind == FRAGMENT )
+            continue;
+
+        DiffNode        node;
+        node.object = objects[ k ];
+        node.fragment = nested;
+        node.hash = nested->getHash();
+        node.match = -1;
+        node.stable = false;
+        node.changed = false;
+        nodes.push_back( node );
+    }
+}
+
+
+// 0 for the other fragments
+static unsigned long long
+getNameHash( FragmentBase *  fragment )
+{
+    PyObject *      name( NULL );
+    if ( fragment->kind == FUNCTION_FRAGMENT )
+        name = static_cast< Function * >( fragment )->name.ptr();
+    else if ( fragment->kind == CLASS_FRAGMENT )
+        name = static_cast< Class * >( fragment )->name.ptr();
+
+    FragmentBase *  nameFragment( name == NULL ? NULL : getFragment( name ) );
+    return nameFragment == NULL ? 0 : nameFragment->getHash();
+}
+
+
+// Gets the outcome of matching two subtrees
+class MatchHandler
+{
+    public:
+        virtual ~MatchHandler()
+        {}
+
+        // One of the DIFF_... operations; the missing node is NULL. The
+        // nested nodes of a changed pair are matched after the call.
+        virtual void  onEdit( int  operation, const DiffNode *  oldNode,
+                              const DiffNode *  newNode ) = 0;
+
+        // The same subtree which kept its order
+        virtual void  onSame( const DiffNode &  oldNode,
+                              const DiffNode &  newNode ) = 0;
+};
+
+
+class EditScript : public MatchHandler
+{
+    public:
+        EditScript( Py::List &  s ) : script( s )
+        {}
+
+        virtual void  onEdit( int  operation, const DiffNode *  oldNode,
+                              const DiffNode *  newNode )
+        {
+            script.append( Py::TupleN(
+                    Py::Int( operation ),
+                    Py::Object( oldNode == NULL ? Py_None : oldNode->object ),
+                    Py::Object( newNode == NULL ? Py_None
+                                                : newNode->object ) ) );
+        }
+
+        virtual void  onSame( const DiffNode &, const DiffNode & )
+        {}
+
+    private:
+        Py::List &      script;
+};
+
+
+// Marks the longest sequence of the matched nodes which keeps the order on
+// both sides; the other matched nodes are moved
+static void
+markStable( std::vector< DiffNode > &  oldNodes,
+            std::vector< DiffNode > &  newNodes )
+{
+    std::vector< int >      tails;  // The last node of a sequence by length
+    std::vector< int >      previous( newNodes.size(), -1 );
+
+    for ( size_t  k = 0; k < newNodes.size(); ++k )
+    {
+        int         match( newNodes[ k ].match );
+        if ( match < 0 )
+            continue;
+
+        size_t      low( 0 );
+        size_t      high( tails.size() );
+        while ( low < high )
+        {
+            size_t  middle( ( low + high ) / 2 );
+            if ( newNodes[ tails[ middle ] ].match < match )
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        if ( low > 0 )
+            previous[ k ] = tails[ low - 1 ];
+        if ( low == tails.size() )
+            tails.push_back( k );
+        else
+            tails[ low ] = k;
+    }
+
+    for ( int  k = tails.empty() ? -1 : tails.back(); k >= 0;
+          k = previous[ k ] )
+    {
+        newNodes[ k ].stable = true;
+        oldNodes[ newNodes[ k ].match ].stable = true;
+    }
+}
+
+
+static void
+matchFragments( FragmentBase *  oldFragment, FragmentBase *  newFragment,
+                MatchHandler &  handler );
+
+
+static void
+pairChanged( DiffNode &  oldNode, int  oldIndex,
+             DiffNode &  newNode, int  newIndex )
+{
+    oldNode.match = newIndex;
+    oldNode.changed = true;
+    newNode.match = oldIndex;
+    newNode.changed = true;
+}
+
+
+// The functions and the classes are the same ones if they have the same
+// names wherever they are in the suite
+static void
+pairDefinitions( std::vector< DiffNode > &  oldNodes,
+                 std::vector< DiffNode > &  newNodes )
+{
+    std::map< std::pair< int, unsigned long long >, std::vector< int > >
+                                                            definitions;
+    for ( int  o = oldNodes.size() - 1; o >= 0; --o )
+    {
+        unsigned long long  name( getNameHash( oldNodes[ o ].fragment ) );
+        if ( oldNodes[ o ].match < 0 && name != 0 )
+            definitions[ std::make_pair( oldNodes[ o ].fragment->kind,
+                                         name ) ].push_back( o );
+    }
+
+    for ( size_t  n = 0; n < newNodes.size(); ++n )
+    {
+        unsigned long long  name( getNameHash( newNodes[ n ].fragment ) );
+        if ( newNodes[ n ].match >= 0 || name == 0 )
+            continue;
+
+        std::vector< int > &    found( definitions[ std::make_pair(
+                                    newNodes[ n ].fragment->kind, name ) ] );
+        if ( found.empty() )
+            continue;
+        pairChanged( oldNodes[ found.back() ], found.back(),
+                     newNodes[ n ], n );
+        found.pop_back();
+    }
+}
+
+
+// Compares the nodes between two stable ones. The nodes which are not
+// matched yet are paired by kind as changed; the rest are deleted or
+// inserted.
+static void
+diffGap( std::vector< DiffNode > &  oldNodes, size_t  oldBegin, size_t  oldEnd,
+         std::vector< DiffNode > &  newNodes, size_t  newBegin, size_t  newEnd,
+         MatchHandler &  handler )
+{
+    // The old node indices are kept reversed so the first one is at the back
+    std::map< int, std::vector< int > >     kinds;
+    for ( size_t  o = oldEnd; o > oldBegin; --o )
+        if ( oldNodes[ o - 1 ].match < 0 )
+            kinds[ oldNodes[ o - 1 ].fragment->kind ].push_back( o - 1 );
+
+    for ( size_t  n = newBegin; n < newEnd; ++n )
+    {
+        if ( newNodes[ n ].match >= 0 )
+            continue;
+
+        std::map< int, std::vector< int > >::iterator
+                found( kinds.find( newNodes[ n ].fragment->kind ) );
+        if ( found == kinds.end() || found->second.empty() )
+            continue;
+
+        int     o( found->second.back() );
+        found->second.pop_back();
+        pairChanged( oldNodes[ o ], o, newNodes[ n ], n );
+    }
+
+    for ( size_t  o = oldBegin; o < oldEnd; ++o )
+        if ( oldNodes[ o ].match < 0 )
+            handler.onEdit( DIFF_DELETED, & oldNodes[ o ], NULL );
+
+    for ( size_t  n = newBegin; n < newEnd; ++n )
+    {
+        DiffNode &      newNode( newNodes[ n ] );
+        if ( newNode.match < 0 )
+        {
+            handler.onEdit( DIFF_INSERTED, NULL, & newNode );
+            continue;
+        }
+
+        DiffNode &      oldNode( oldNodes[ newNode.match ] );
+        if ( newNode.changed )
+        {
+            handler.onEdit( DIFF_CHANGED, & oldNode, & newNode );
+            matchFragments( oldNode.fragment, newNode.fragment, handler );
+        }
+        else
+            handler.onEdit( DIFF_MOVED, & oldNode, & newNode );
+    }
+}
+
+
+static void
+matchFragments( FragmentBase *  oldFragment, FragmentBase *  newFragment,
+                MatchHandler &  handler )
+{
+    std::vector< DiffNode >     oldNodes;
+    std::vector< DiffNode >     newNodes;
+
+    getDiffNodes( oldFragment, oldNodes );
+    getDiffNodes( newFragment, newNodes );
+
+    // The same subtrees are matched in order; the old node indices are kept
+    // reversed so the first one is at the back
+    std::map< unsigned long long, std::vector< int > >      unmatched;
+    for ( int  o = oldNodes.size() - 1; o >= 0; --o )
+        unmatched[ oldNodes[ o ].hash ].push_back( o );
+    for ( size_t  n = 0; n < newNodes.size(); ++n )
+    {
+        std::map< unsigned long long, std::vector< int > >::iterator
+                found( unmatched.find( newNodes[ n ].hash ) );
+        if ( found == unmatched.end() || found->second.empty() )
+            continue;
+
+        int     o( found->second.back() );
+        found->second.pop_back();
+        oldNodes[ o ].match = n;
+        newNodes[ n ].match = o;
+    }
+    markStable( oldNodes, newNodes );
+    pairDefinitions( oldNodes, newNodes );
+
+    // The stable nodes come in the same order on both sides
+    size_t      oldBegin( 0 );
+    size_t      newBegin( 0 );
+    for ( ; ; )
+    {
+        size_t      oldEnd( oldBegin );
+        size_t      newEnd( newBegin );
+        while ( oldEnd < oldNodes.size() && ! oldNodes[ oldEnd ].stable )
+            ++oldEnd;
+        while ( newEnd < newNodes.size() && ! newNodes[ newEnd ].stable )
+            ++newEnd;
+
+        diffGap( oldNodes, oldBegin, oldEnd, newNodes, newBegin, newEnd,
+                 handler );
+        if ( oldEnd >= oldNodes.size() || newEnd >= newNodes.size() )
+            break;
+        handler.onSame( oldNodes[ oldEnd ], newNodes[ newEnd ] );
+        oldBegin = oldEnd + 1;
+        newBegin = newEnd + 1;
+    }
+}
+
+
+// Keeps the edits until the whole control flows are matched. Then the
+// deleted and the inserted subtrees (the nested ones included) which are the
+// same are reported as moved, e.g. the functions which were moved into a
+// class. A move is reported where the new subtree is inserted; a move into
+// an inserted subtree follows the insertion.
+class CrossLevelMoves : public MatchHandler
+{
+    public:
+        CrossLevelMoves( MatchHandler &  h ) : handler( h )
+        {}
+
+        virtual void  onEdit( int  operation, const DiffNode *  oldNode,
+                              const DiffNode *  newNode )
+        {
+            DiffEdit        edit;
+            edit.operation = operation;
+            edit.dropped = false;
+            edit.following = false;
+            if ( oldNode != NULL )
+                edit.oldNode = *oldNode;
+            if ( newNode != NULL )
+                edit.newNode = *newNode;
+            edits.push_back( edit );
+
+            if ( operation == DIFF_DELETED )
+                addCandidates( *oldNode, edits.size() - 1, true,
+                               oldCandidates );
+            else if ( operation == DIFF_INSERTED )
+                addCandidates( *newNode, edits.size() - 1, true,
+                               newCandidates );
+        }
+
+        virtual void  onSame( const DiffNode &  oldNode,
+                              const DiffNode &  newNode )
+        {
+            handler.onSame( oldNode, newNode );
+        }
+
+        // Matches the deleted and inserted subtrees and passes the edits on
+        void  flush( void )
+        {
+            for ( size_t  k = 0; k < edits.size(); ++k )
+            {
+                DiffEdit &      edit( edits[ k ] );
+                if ( edit.dropped )
+                    continue;
+                if ( edit.operation == DIFF_DELETED )
+                    matchCandidate( k, edit.oldNode, newCandidates );
+                else if ( edit.operation == DIFF_INSERTED )
+                    matchCandidate( k, edit.newNode, oldCandidates );
+            }
+
+            for ( size_t  k = 0; k < edits.size(); ++k )
+            {
+                if ( edits[ k ].dropped || edits[ k ].following )
+                    continue;
+                report( edits[ k ] );
+                for ( size_t  m = 0; m < edits[ k ].moves.size(); ++m )
+                    report( edits[ edits[ k ].moves[ m ] ] );
+            }
+            edits.clear();
+        }
+
+    private:
+        struct DiffEdit
+        {
+            int         operation;
+            DiffNode    oldNode;
+            DiffNode    newNode;
+            bool        dropped;    // The other side of a move
+            bool        following;  // Reported after another edit
+            std::vector< size_t >   moves;  // The edits reported after it
+        };
+
+        struct Candidate
+        {
+            DiffNode    node;
+            size_t      edit;
+            bool        root;       // The subtree of the edit itself
+        };
+
+        typedef std::map< unsigned long long,
+                          std::vector< Candidate > >    Candidates;
+
+        MatchHandler &                  handler;
+        std::vector< DiffEdit >         edits;
+        Candidates                      oldCandidates;
+        Candidates                      newCandidates;
+        std::set< FragmentBase * >      consumed;
+
+    private:
+        void  addCandidates( const DiffNode &  node, size_t  edit, bool  root,
+                             Candidates &  candidates )
+        {
+            Candidate       candidate;
+            candidate.node = node;
+            candidate.edit = edit;
+            candidate.root = root;
+            candidates[ node.hash ].push_back( candidate );
+
+            std::vector< DiffNode >     nested;
+            getDiffNodes( node.fragment, nested );
+            for ( size_t  k = 0; k < nested.size(); ++k )
+                addCandidates( nested[ k ], edit, false, candidates );
+        }
+
+        // A moved subtree is not matched again in parts
+        void  consume( FragmentBase *  fragment )
+        {
+            consumed.insert( fragment );
+
+            std::vector< FragmentBase * >   nested;
+            getNestedFragments( fragment, nested, true );
+            for ( size_t  k = 0; k < nested.size(); ++k )
+                consume( nested[ k ] );
+        }
+
+        void  report( const DiffEdit &  edit )
+        {
+            handler.onEdit( edit.operation,
+                            edit.operation == DIFF_INSERTED
+                                ? NULL : & edit.oldNode,
+                            edit.operation == DIFF_DELETED
+                                ? NULL : & edit.newNode );
+        }
+
+        // Looks for the subtree of the k-th edit on the other side
+        void  matchCandidate( size_t  k, const DiffNode &  node,
+                              Candidates &  candidates )
+        {
+            if ( consumed.count( node.fragment ) != 0 )
+                return;
+
+            Candidates::iterator    found( candidates.find( node.hash ) );
+            if ( found == candidates.end() )
+                return;
+
+            std::vector< Candidate > &  same( found->second );
+            for ( size_t  c = 0; c < same.size(); ++c )
+            {
+                if ( consumed.count( same[ c ].node.fragment ) != 0 )
+                    continue;
+
+                DiffEdit &      edit( edits[ k ] );
+                DiffEdit &      other( edits[ same[ c ].edit ] );
+                if ( edit.operation == DIFF_INSERTED )
+                {
+                    edit.oldNode = same[ c ].node;
+                    other.dropped = other.dropped || same[ c ].root;
+                }
+                else if ( same[ c ].root )
+                {
+                    // Reported where the inserted subtree was
+                    other.oldNode = edit.oldNode;
+                    other.operation = DIFF_MOVED;
+                    edit.dropped = true;
+                }
+                else
+                {
+                    edit.newNode = same[ c ].node;
+                    edit.following = true;
+                    other.moves.push_back( k );
+                }
+                edit.operation = DIFF_MOVED;
+                consume( same[ c ].node.fragment );
+                consume( node.fragment );
+                return;
+            }
+        }
+};
+
+
+Py::List  getControlFlowDiff( ControlFlow *  oldFlow, ControlFlow *  newFlow )
+{
+    Py::List        script;
+    EditScript      handler( script );
+    CrossLevelMoves moves( handler );
+
+    if ( oldFlow->getHash() != newFlow->getHash() )
+    {
+        matchFragments( oldFlow, newFlow, moves );
+        moves.flush();
+    }
+    return script;
+}
+
+
+// The fragments which have got their ids already are left as they are
+static void
+carrySubtreeIds( FragmentBase *  oldFragment, FragmentBase *  newFragment )
+{
+    if ( newFragment->id >= 0 )
+        return;
+    newFragment->id = oldFragment->getId();
+
+    std::vector< FragmentBase * >   oldNested;
+    std::vector< FragmentBase * >   newNested;
+
+    getNestedFragments( oldFragment, oldNested, true );
+    getNestedFragments( newFragment, newNested, true );
+    if ( oldNested.size() != newNested.size() )
+        return;     // The hashes collided
+    for ( size_t  k = 0; k < newNested.size(); ++k )
+        carrySubtreeIds( oldNested[ k ], newNested[ k ] );
+}
+
+
+// The same subtrees get the ids of all their fragments while the changed
+// statements get their own ids only
+class IdCarrier : public MatchHandler
+{
+    public:
+        virtual void  onEdit( int  operation, const DiffNode *  oldNode,
+                              const DiffNode *  newNode )
+        {
+            if ( operation == DIFF_MOVED )
+                carrySubtreeIds( oldNode->fragment, newNode->fragment );
+            else if ( operation == DIFF_CHANGED &&
+                      newNode->fragment->id < 0 )
+                newNode->fragment->id = oldNode->fragment->getId();
+        }
+
+        virtual void  onSame( const DiffNode &  oldNode,
+                              const DiffNode &  newNode )
+        {
+            carrySubtreeIds( oldNode.fragment, newNode.fragment );
+        }
+};
+
+
+void  carryControlFlowIds( ControlFlow *  oldFlow, ControlFlow *  newFlow )
+{
+    IdCarrier       handler;
+    CrossLevelMoves moves( handler );
+
+    if ( oldFlow->getHash() == newFlow->getHash() )
+        carrySubtreeIds( oldFlow, newFlow );
+    else
+    {
+        newFlow->id = oldFlow->getId();
+        matchFragments( oldFlow, newFlow, moves );
+        moves.flush();
+    }
+}
+
@@ -0,0 +1,54 @@
+/*
+ * codimension - graphics python two-way code editor and analyzer
+ * Copyright (C) 2014 - 2016  Sergey Satskiy <sergey.satskiy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Structural difference between two control flows
+ */
+
+#ifndef CFLOWDIFF_HPP
+#define CFLOWDIFF_HPP
+
+
+#include "CXX/Objects.hxx"
+
+#include "cflowfragments.hpp"
+
+
+// The edit script operations. Each edit is a tuple of the operation, the old
+// fragment and the new fragment; the missing one is None.
+#define DIFF_INSERTED       0
+#define DIFF_DELETED        1
+#define DIFF_MOVED          2   // The same subtree at another place
+#define DIFF_CHANGED        3   // The same statement with another subtree;
+                                // the nested edits follow it
+
+
+// Matches the subtrees of the control flows top-down by their hashes. The
+// subtrees which are the same and keep their order produce no edits. The
+// plain fragments (names, keywords, bodies) are compared as a part of their
+// owners. The deleted and the inserted subtrees which are the same at
+// another level are reported as moved.
+Py::List  getControlFlowDiff( ControlFlow *  oldFlow, ControlFlow *  newFlow );
+
+// Gives the new control flow fragments the ids of the old ones they are
+// matched with the same way. The fragments of the same subtrees get the old
+// ids, the changed statements keep their own ids only and the rest are left
+// without ids.
+void  carryControlFlowIds( ControlFlow *  oldFlow, ControlFlow *  newFlow );
+
+
+#endif
+
@@ -25,13 +25,147 @@
 #define MODULE_DOC \
 "Codimension Control Flow module types and procedures"
 
-// getControlFlowFromMemory( content ) docstring
+// getControlFlowFromMemory( content [, serialize, token=, timeout=,
+//                           outline=, comments=, cmlProperties=, docstrings=,
+//                           sysExit=, arguments=, serialize=, hashes=,
+//                           kinds=, maxDepth=, lazySuites=] )
 #define GET_CF_MEMORY_DOC \
-"Provides the control flow object for the given content"
-
-// getControlFlowFromFile( fileName ) docstring
+"Provides the control flow object for the given content. The optional\n" \
+"token (a CancelToken) and timeout (seconds) keyword arguments stop the\n" \
+"parse; then the only error is CANCELLED_ERROR or DEADLINE_ERROR at line -1.\n" \
+"outline=True gives the functions and the classes only (names, decorators,\n" \
+"arguments and docstrings) without the comments and the other statements;\n" \
+"the definitions nested in the other statements go to the enclosing suite.\n" \
+"comments, cmlProperties, docstrings, sysExit, arguments and serialize set\n" \
+"to False switch off the corresponding analysis; hashes=True keeps the\n" \
+"subtree hashes of a not serialized control flow. kinds (the *_FRAGMENT\n" \
+"values) limits the suite fragments which are built; the items of the\n" \
+"skipped statements go to the enclosing suite. maxDepth limits the nesting\n" \
+"level of the walked suites (the module suite is 1); the deeper suites are\n" \
+"empty or, with lazySuites=True, walked on the first access."
+
+// visitControlFlow( content, callback ) docstring
+#define VISIT_CF_DOC \
+"Walks the given content without creating the fragments. The callback is\n" \
+"called as callback(event, kind, name, begin, end, beginLine, beginPos,\n" \
+"endLine, endPos) when a control flow statement is entered (VISIT_ENTER)\n" \
+"and left (VISIT_LEAVE); name is set for functions and classes only. False\n" \
+"returned by the callback stops the walk. The callback could also be a\n" \
+"native one in a VISIT_CALLBACK_CAPSULE capsule. Provides the list of errors."
+
+// iterControlFlow( content ) docstring
+#define ITER_CF_DOC \
+"Provides an iterator over the top level fragments of the given content.\n" \
+"The bang line, the encoding line and the docstring come first, then the\n" \
+"module suite fragments one by one as soon as they are walked. The control\n" \
+"flow object (errors included) is the iterator controlFlow attribute; its\n" \
+"suite stays empty and its end is known when the iteration is over. A big\n" \
+"content is parsed part by part as the iteration goes so the fragments\n" \
+"before a syntax error could be provided before the error is found."
+
+// scanControlFlow( content ) docstring
+#define SCAN_CF_DOC \
+"Provides an approximate control flow for the first paint of a large file.\n" \
+"The content is not parsed: the top level functions and classes are found\n" \
+"by the indentation and the keywords. Their ranges start at the first\n" \
+"decorator and end at the last code line; the names and the keywords are\n" \
+"set while the other parts and the suites are empty. The control flow\n" \
+"phase is PHASE_APPROXIMATE; the parsing functions give PHASE_EXACT ones."
+
+// diffControlFlows( oldControlFlow, newControlFlow ) docstring
+#define DIFF_CF_DOC \
+"Provides the edit script between two control flows as a list of tuples\n" \
+"(operation, old fragment, new fragment). The operation is one of\n" \
+"DIFF_INSERTED, DIFF_DELETED, DIFF_MOVED and DIFF_CHANGED; the missing side\n" \
+"is None. The subtrees are matched top-down by their hashes; a changed\n" \
+"statement is followed by the edits of its nested fragments. The deleted\n" \
+"and the inserted subtrees which are the same at another level are moved.\n" \
+"The content of both control flows must be serialized."
+
+// getControlFlowFromMemoryPgen( content ) docstring
+#define GET_CF_MEMORY_PGEN_DOC \
+"Provides the control flow object for the given content using the python\n" \
+"pgen parser instead of the native one. Available for python 3.9 only."
+
+// getControlFlowFromFile( fileName [, token=, timeout=, outline=, ...] )
+// docstring
 #define GET_CF_FILE_DOC \
-"Provides the control flow object for the given file"
+"Provides the control flow object for the given file. The keyword arguments\n" \
+"are the same as for getControlFlowFromMemory()."
+
+// parseMemoryAsync( content [, loop, token=, timeout=, outline=, ...,
+//                   document=, priority=] ) docstring
+#define PARSE_MEMORY_ASYNC_DOC \
+"Parses the given content on a worker thread and provides an asyncio future\n" \
+"which gets the control flow object. The loop must support create_future(),\n" \
+"add_reader() and remove_reader(); the running asyncio loop by default.\n" \
+"Cancelling the future stops the parse. The token, timeout and the parse\n" \
+"options keyword arguments are the same as for getControlFlowFromMemory().\n" \
+"The queued parses are started in the priority order (PRIORITY_VISIBLE,\n" \
+"PRIORITY_OPEN, PRIORITY_BACKGROUND or any integer; higher first). A parse\n" \
+"of a document (any string id) replaces its queued older parse which then\n" \
+"reports the SUPERSEDED_ERROR message at line -1."
+
+// parseFileAsync( fileName [, loop, token=, timeout=, outline=, ...,
+//                 document=, priority=] ) docstring
+#define PARSE_FILE_ASYNC_DOC \
+"Reads and parses the given file on a worker thread and provides an asyncio\n" \
+"future which gets the control flow object. The loop and the keyword\n" \
+"arguments are the same as for parseMemoryAsync()."
+
+// ControlFlowIterator class docstring
+#define CONTROL_FLOW_ITERATOR_DOC \
+"Walks a module lazily and provides its top level fragments"
+
+// FragmentIterator class docstring
+#define FRAGMENT_ITERATOR_DOC \
+"Walks a control flow and provides the fragments of the given kinds"
+
+// ParseRequest class docstring
+#define PARSE_REQUEST_DOC \
+"Delivers an asynchronous parse result to a future"
+
+// ParseRequest::futureDone( future )
+#define PARSE_REQUEST_FUTURE_DONE_DOC \
+"Called by the future when it is done; stops the parse if it is cancelled"
+
+// createCancelToken() docstring
+#define CREATE_CANCEL_TOKEN_DOC \
+"Provides a new CancelToken for the token keyword argument of the parse\n" \
+"functions"
+
+// _setParseTuning()
+#define SET_PARSE_TUNING_DOC \
+"For testing only: overrides the buffer sizes from which the tokenizer\n" \
+"thread and the parallel parts are used and the number of CPUs; None\n" \
+"restores the default"
+
+// _pauseParsing()
+#define PAUSE_PARSING_DOC \
+"For testing only: stops (True) or resumes (False) starting the queued\n" \
+"asynchronous parses; the running ones are not affected"
+
+// CancelToken class docstring
+#define CANCEL_TOKEN_DOC \
+"Stops the parses it was given to when cancelled"
+
+// CancelToken::cancel()
+#define CANCEL_TOKEN_CANCEL_DOC \
+"Stops the parses; they report the CANCELLED_ERROR message at line -1"
+
+// CancelToken::isCancelled()
+#define CANCEL_TOKEN_IS_CANCELLED_DOC \
+"True if the token has been cancelled"
+
+// CancelToken::isStarted()
+#define CANCEL_TOKEN_IS_STARTED_DOC \
+"True once a parse given the token has parsed the content and builds the\n" \
+"control flow. The other threads still run while it is built, so the\n" \
+"token could be cancelled then."
+
+// ParseRequest::complete()
+#define PARSE_REQUEST_COMPLETE_DOC \
+"Called by the event loop when the parse completion descriptor is readable"
 
 // Decorator::getDisplayValue()
 #define DECORATOR_GETDISPLAYVALUE_DOC \
@@ -275,6 +409,84 @@
 #define CONTROLFLOW_GETDISPLAYVALUE_DOC \
 "Provides the ecoding and hash bang line"
 
+// ControlFlow::applyEdit()
+#define CONTROLFLOW_APPLYEDIT_DOC \
+"Applies a text edit to the content: applyEdit(offset, removedLength,\n" \
+"insertedText). The offset and the length are in the same units as the\n" \
+"fragment positions. The fragments after the edit are shifted when they\n" \
+"are read; the ones which the edit changed get dirty set to True. The\n" \
+"control flow of iterControlFlow() cannot be edited."
+
+#define CONTROLFLOW_GETCOMMENTS_DOC \
+"Provides the (begin, end, line, pos) tuples of all the comments of the\n" \
+"edited content: getComments(). The content is scanned on the first call\n" \
+"and an edit rescans the changed lines only."
+
+#define CONTROLFLOW_SHAREUNCHANGED_DOC \
+"Replaces the suite fragments which have the same text at the same\n" \
+"positions as in the given previous version of the control flow with the\n" \
+"previous version fragments: shareUnchanged(previous). The function and\n" \
+"class suites are compared as well. Both control flows must be parsed with\n" \
+"the same options. The previous version is kept while the fragments are\n" \
+"shared and neither of the versions could be edited after that. Provides\n" \
+"the number of the shared subtrees."
+
+#define CONTROLFLOW_CARRYIDS_DOC \
+"Gives the fragments the ids of the matching fragments of the given\n" \
+"previous version of the control flow: carryIds(previous). The subtrees\n" \
+"are matched the same way as by diffControlFlows(): the fragments of the\n" \
+"same subtrees keep their ids and so do the changed statements. The other\n" \
+"fragments get the ids which the previous version does not use. It must\n" \
+"be called before the ids are requested."
+
+#define CONTROLFLOW_FRAGMENTSAT_DOC \
+"Provides the innermost fragment which covers the given position followed\n" \
+"by the fragments it is nested in, up to the control flow:\n" \
+"fragmentsAt(line, column). The line and the column are 1-based. The list\n" \
+"is empty if no fragment covers the position. The lookups binary search\n" \
+"the suites ordered by position, so no index is built for them."
+
+#define CONTROLFLOW_FRAGMENTATOFFSET_DOC \
+"The same as fragmentsAt() for the 0-based absolute position:\n" \
+"fragmentAtOffset(offset)"
+
+#define CONTROLFLOW_FRAGMENTSATOFFSETS_DOC \
+"Provides the fragmentAtOffset() results for each of the given absolute\n" \
+"positions: fragmentsAtOffsets(offsets). The offsets could be any\n" \
+"iterable of integers, e.g. an array."
+
+#define CONTROLFLOW_FRAGMENTSINLINERANGE_DOC \
+"Provides the fragments which overlap the given lines as a flat list of\n" \
+"(fragment, depth) tuples in the tree order:\n" \
+"fragmentsInLineRange(first, last, kinds=None). The lines are 1-based and\n" \
+"the last one is included; ValueError is raised if the first one is after\n" \
+"the last one. The depth is 0 for the control flow itself.\n" \
+"The kinds (an iterable of the *_FRAGMENT constants) limit the fragments\n" \
+"but not the depths. It searches the suites the same way as fragmentsAt()."
+
+#define CONTROLFLOW_FINDBYQUALIFIEDNAME_DOC \
+"Provides the function or the class fragment by its dotted qualified name,\n" \
+"e.g. 'Outer.Inner.method': findByQualifiedName(name). The names are the\n" \
+"same as __qualname__, so a function nested in a function f is\n" \
+"'f.<locals>.name'. Only the functions and the classes make the names; a\n" \
+"definition nested in another statement belongs to the enclosing\n" \
+"definition. Provides the last one if the name is defined more than once\n" \
+"and None if it is not defined. The names are indexed on the first request\n" \
+"and the index is dropped by the edits which change a definition name."
+
+#define CONTROLFLOW_ITERDEFINITIONS_DOC \
+"Provides an iterator over the (qualified name, fragment) tuples of all\n" \
+"the functions and classes in the source order: iterDefinitions()"
+
+#define CONTROLFLOW_ITERFRAGMENTS_DOC \
+"Provides an iterator over all the fragments of the control flow:\n" \
+"iterFragments(kinds=None, order='pre'). The nested suites, the parts, the\n" \
+"decorators, the comments and the docstrings are walked as well as the\n" \
+"control flow itself. The kinds (an iterable of the *_FRAGMENT constants)\n" \
+"limit the provided fragments but not the walk. The order is 'pre' (a\n" \
+"fragment comes before its nested ones) or 'post' (after them). The lazy\n" \
+"suites are walked as the iteration reaches them."
+
 
 #endif
 
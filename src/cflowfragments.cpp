@@ -22,11 +22,14 @@
 
 #include <string>
 #include <limits>
+#include <algorithm>
 
 #include "cflowfragments.hpp"
 #include "cflowfragmenttypes.hpp"
 #include "cflowversion.hpp"
 #include "cflowdocs.hpp"
+#include "cflowdiff.hpp"
+#include "cflowindex.hpp"
 #include "cflowutils.hpp"
 
 
@@ -96,10 +99,12 @@ representPart( const Py::Object &  value,
 
 
 FragmentBase::FragmentBase() :
-    parent( NULL ), content( NULL ),
+    parent( NULL ), content( NULL ), lazySuite( NULL ),
     kind( UNDEFINED_FRAGMENT ),
     begin( -1 ), end( -1 ), beginLine( -1 ), beginPos( -1 ),
-    endLine( -1 ), endPos( -1 )
+    endLine( -1 ), endPos( -1 ), editCount( 0 ), shift( 0 ),
+    lineShift( 0 ), shifts( NULL ), slot( -1 ), dirty( false ),
+    subtreeHash( 0 ), id( -1 )
 {}
 
 
@@ -110,6 +115,29 @@ FragmentBase::~FragmentBase()
         delete [] content;
         content = NULL;
     }
+    delete lazySuite;
+    delete shifts;
+}
+
+
+// The nested fragments kept by the python code lose their parent the same
+// way as when a control flow is released. It is done while the derived
+// fragment still has the nested ones.
+void  FragmentBase::releaseSubtree( void )
+{
+    if ( owner.isNone() )
+        return;
+
+    std::vector< FragmentBase * >   nested;
+    getNestedFragments( this, nested );
+    while ( ! nested.empty() )
+    {
+        FragmentBase *  fragment( nested.back() );
+
+        nested.pop_back();
+        fragment->parent = NULL;
+        getNestedFragments( fragment, nested );
+    }
 }
 
 
@@ -122,6 +150,9 @@ void  FragmentBase::appendMembers( Py::List &  container ) const
     container.append( Py::String( "beginPos" ) );
     container.append( Py::String( "endLine" ) );
     container.append( Py::String( "endPos" ) );
+    container.append( Py::String( "dirty" ) );
+    container.append( Py::String( "hash" ) );
+    container.append( Py::String( "id" ) );
     return;
 }
 
@@ -129,12 +160,25 @@ void  FragmentBase::appendMembers( Py::List &  container ) const
 bool  FragmentBase::getAttribute( const char *  attrName, Py::Object &  retval )
 {
     GETINTATTR( kind );
+
+    sync();
     GETINTATTR( begin );
     GETINTATTR( end );
     GETINTATTR( beginLine );
     GETINTATTR( beginPos );
     GETINTATTR( endLine );
     GETINTATTR( endPos );
+    GETBOOLATTR( dirty );
+    if ( strcmp( attrName, "hash" ) == 0 )
+    {
+        retval = Py::Long( getHash() );
+        return true;
+    }
+    if ( strcmp( attrName, "id" ) == 0 )
+    {
+        retval = PYTHON_INT_TYPE( getId() );
+        return true;
+    }
 
     return false;
 }
@@ -190,6 +234,8 @@ std::string  FragmentBase::alignBlock( const std::string &  content,
 
 std::string  FragmentBase::getContent( const char *  buf )
 {
+    FlowLock        lock( this );
+    sync();
     if ( buf != NULL )
         return std::string( buf + begin, end - begin + 1 );
 
@@ -197,8 +243,10 @@ std::string  FragmentBase::getContent( const char *  buf )
     FragmentBase *      current = this;
     while ( current->parent != NULL )
         current = current->parent;
-    if ( current->content != NULL )
-        return std::string( current->content + begin, end - begin + 1 );
+    if ( current->kind == CONTROL_FLOW_FRAGMENT &&
+         static_cast< ControlFlow * >( current )->hasContent() )
+        return static_cast< ControlFlow * >( current )->getText(
+                                                begin, end - begin + 1 );
 
     throw Py::RuntimeError( "Cannot get content of not serialized "
                             "fragment without its buffer" );
@@ -228,14 +276,16 @@ Py::Object  FragmentBase::getLineContent( const Py::Tuple &  args )
     size_t      argCount( args.length() );
 
     if ( argCount == 0 )
-        return Py::String( std::string( beginPos - 1, ' ' ) +
-                           getContent( NULL ) );
+    {
+        std::string     content( getContent( NULL ) );
+        return Py::String( std::string( beginPos - 1, ' ' ) + content );
+    }
 
     if ( argCount == 1 )
     {
         std::string  content( Py::String( args[ 0 ] ).as_std_string() );
-        return Py::String( std::string( beginPos - 1, ' ' ) +
-                           getContent( content.c_str() ) );
+        std::string  lineContent( getContent( content.c_str() ) );
+        return Py::String( std::string( beginPos - 1, ' ' ) + lineContent );
     }
 
     throw Py::RuntimeError( "Unexpected number of arguments. getLineContent() "
@@ -258,8 +308,12 @@ Py::Object  FragmentBase::getParentIfID( void )
 }
 
 
+// The positions of a lazily walked suite are the parsed ones so they do not
+// update the owners which got the later edits
 void FragmentBase::updateBegin( const FragmentBase *  other )
 {
+    if ( other->editCount != editCount )
+        return;
     if ( begin == -1 || other->begin < begin )
     {
         begin = other->begin;
@@ -274,6 +328,8 @@ void FragmentBase::updateBegin( const FragmentBase *  other )
 
 void FragmentBase::updateEnd( const FragmentBase *  other )
 {
+    if ( other->editCount != editCount )
+        return;
     if ( end == -1 || other->end > end )
     {
         end = other->end;
@@ -292,9 +348,312 @@ void FragmentBase::updateBeginEnd( const FragmentBase *  other )
     updateEnd( other );
 }
 
+FlowLock::FlowLock( FragmentBase *  fragment ) :
+    mutex( NULL )
+{
+    while ( fragment->parent != NULL )
+        fragment = fragment->parent;
+    if ( fragment->kind != CONTROL_FLOW_FRAGMENT )
+        return;
+
+    mutex = & static_cast< ControlFlow * >( fragment )->lazyMutex;
+    if ( ! mutex->try_lock() )
+    {
+        // The holder may need the GIL to finish
+        PyThreadState *     state( PyEval_SaveThread() );
+        mutex->lock();
+        PyEval_RestoreThread( state );
+    }
+}
+
+
+FlowLock::~FlowLock()
+{
+    if ( mutex != NULL )
+        mutex->unlock();
+}
+
+
+void FragmentBase::expandSuite( Py::List &  suite )
+{
+    FlowLock        lock( this );
+    if ( lazySuite == NULL )
+        return;
+    if ( lazySuite->previous.isNone() )
+        walkLazySuite( this, suite );
+    else
+        copySharedSuite( this, suite );
+}
+
+
+// A position in the removed text moves to the edit start
+static void
+shiftPosition( const TextEdit &  edit, INT_TYPE &  absPos,
+               INT_TYPE &  line, INT_TYPE &  pos )
+{
+    if ( absPos < edit.offset )
+        return;
+    if ( absPos < edit.offset + edit.removed )
+    {
+        absPos = edit.offset;
+        line = edit.line;
+        pos = edit.pos;
+        return;
+    }
+    if ( line == edit.endLine )
+        pos += edit.newEndPos - edit.endPos;
+    line += edit.newEndLine - edit.endLine;
+    absPos += edit.inserted - edit.removed;
+}
+
+
+// The items from the rank on are shifted: the shifts are kept as differences
+// between the neighbour ranks
+void  ShiftTree::shiftItems( int  rank, INT_TYPE  offset, INT_TYPE  line )
+{
+    if ( offsets.empty() )
+    {
+        offsets.assign( order.size() + 1, 0 );
+        lines.assign( order.size() + 1, 0 );
+    }
+    for ( size_t  k = rank + 1; k < offsets.size(); k += k & ( ~k + 1 ) )
+    {
+        offsets[ k ] += offset;
+        lines[ k ] += line;
+    }
+}
+
+
+void  ShiftTree::getItemShift( int  rank, INT_TYPE &  offset,
+                               INT_TYPE &  line ) const
+{
+    offset = 0;
+    line = 0;
+    if ( offsets.empty() )
+        return;
+    for ( size_t  k = rank + 1; k > 0; k -= k & ( ~k + 1 ) )
+    {
+        offset += offsets[ k ];
+        line += lines[ k ];
+    }
+}
+
+
+// The parents are brought up to date first. The root control flow is not
+// shifted: the edits change it directly.
+static void
+addShifts( FragmentBase *  fragment, size_t  appliedEdits )
+{
+    FragmentBase *      parent( fragment->parent );
+    if ( fragment->editCount == appliedEdits || parent == NULL )
+        return;
+
+    addShifts( parent, appliedEdits );
+
+    INT_TYPE            offset( parent->shift );
+    INT_TYPE            line( parent->lineShift );
+    const ShiftTree *   tree( parent->shifts );
+    if ( tree != NULL && fragment->slot >= 0 )
+    {
+        INT_TYPE    itemOffset;
+        INT_TYPE    itemLine;
+
+        tree->getItemShift( fragment->slot, itemOffset, itemLine );
+        offset += itemOffset;
+        line += itemLine;
+    }
+    else if ( tree != NULL && fragment->slot <= -2 )
+    {
+        offset += tree->partOffsets[ -2 - fragment->slot ];
+        line += tree->partLines[ -2 - fragment->slot ];
+    }
+
+    fragment->begin += offset - fragment->shift;
+    fragment->end += offset - fragment->shift;
+    fragment->beginLine += line - fragment->lineShift;
+    fragment->endLine += line - fragment->lineShift;
+    fragment->shift = offset;
+    fragment->lineShift = line;
+    fragment->editCount = appliedEdits;
+}
+
+
+void FragmentBase::sync( void )
+{
+    FlowLock            lock( this );
+    FragmentBase *      current = this;
+    while ( current->parent != NULL )
+        current = current->parent;
+    if ( current->kind != CONTROL_FLOW_FRAGMENT )
+        return;
+
+    addShifts( this, static_cast< ControlFlow * >( current )->appliedEdits );
+}
+
+
+// 64-bit FNV-1a
+static const unsigned long long     HASH_OFFSET = 14695981039346656037ULL;
+static const unsigned long long     HASH_PRIME = 1099511628211ULL;
+
+static unsigned long long
+hashValue( unsigned long long  hash, unsigned long long  value )
+{
+    for ( int  k = 0; k < 8; ++k )
+    {
+        hash = ( hash ^ ( value & 0xFF ) ) * HASH_PRIME;
+        value >>= 8;
+    }
+    return hash;
+}
+
+
+static bool
+isHashBlank( char  symbol )
+{
+    return symbol == ' ' || symbol == '\t' || symbol == '\r' ||
+           symbol == '\n' || symbol == '\f' || symbol == '\\';
+}
+
+
+// Provides the position after the string literal or the comment which
+// starts at the given position. The prefixes of the string literals are
+// ordinary characters.
+static INT_TYPE
+getVerbatimEnd( const char *  text, INT_TYPE  pos, INT_TYPE  size )
+{
+    char        quote( text[ pos ] );
+
+    if ( quote == '#' )
+    {
+        while ( pos < size && text[ pos ] != '\n' && text[ pos ] != '\r' )
+            ++pos;
+        return pos;
+    }
+
+    bool        triple( pos + 2 < size && text[ pos + 1 ] == quote &&
+                        text[ pos + 2 ] == quote );
+    INT_TYPE    quoteSize( triple ? 3 : 1 );
+
+    for ( pos += quoteSize; pos < size; ++pos )
+    {
+        if ( text[ pos ] == '\\' )
+        {
+            ++pos;      // The escaped character is a part of the literal
+            continue;
+        }
+        if ( ! triple && ( text[ pos ] == '\n' || text[ pos ] == '\r' ) )
+            return pos; // Not terminated
+        if ( text[ pos ] == quote &&
+             ( ! triple || ( pos + 2 < size && text[ pos + 1 ] == quote &&
+                             text[ pos + 2 ] == quote ) ) )
+            return pos + quoteSize;
+    }
+    return size;
+}
+
+
+// The string literals and the comments are hashed as they are. Between them
+// the blanks, the line breaks and the line continuations are hashed as a
+// single space so the indentation of a moved block does not matter.
+static unsigned long long
+hashText( unsigned long long  hash, const char *  text, INT_TYPE  size )
+{
+    bool        blank( false );
+    INT_TYPE    k( 0 );
+
+    while ( k < size )
+    {
+        char        symbol( text[ k ] );
+
+        if ( isHashBlank( symbol ) )
+        {
+            blank = true;
+            ++k;
+            continue;
+        }
+        if ( blank )
+            hash = ( hash ^ ' ' ) * HASH_PRIME;
+        blank = false;
+
+        if ( symbol != '#' && symbol != '"' && symbol != '\'' )
+        {
+            hash = ( hash ^ (unsigned char)symbol ) * HASH_PRIME;
+            ++k;
+            continue;
+        }
+        for ( INT_TYPE  end( getVerbatimEnd( text, k, size ) ); k < end; ++k )
+            hash = ( hash ^ (unsigned char)text[ k ] ) * HASH_PRIME;
+    }
+    return hash;
+}
+
+
+// The hash is computed on the first request and kept. The leaf fragments
+// hash their text while the others hash the nested fragment hashes.
+// An edit changes the text of the fragments it dirties and of all the
+// fragments they are nested in, so the dirty ones are hashed every time from
+// the edited content.
+unsigned long long  FragmentBase::getHash( const char *  buf )
+{
+    FlowLock        lock( this );
+    sync();
+    if ( subtreeHash != 0 && ! dirty )
+        return subtreeHash;
+
+    std::vector< FragmentBase * >   nested;
+    unsigned long long              hash( hashValue( HASH_OFFSET, kind ) );
+
+    getNestedFragments( this, nested, true );
+    if ( nested.empty() && buf != NULL )
+    {
+        if ( end >= begin )
+            hash = hashText( hash, buf + begin, end - begin + 1 );
+    }
+    else if ( nested.empty() )
+    {
+        FragmentBase *      root( this );
+        while ( root->parent != NULL )
+            root = root->parent;
+        if ( root->kind != CONTROL_FLOW_FRAGMENT ||
+             ! static_cast< ControlFlow * >( root )->hasContent() )
+            throw Py::RuntimeError( "Cannot get hash of not serialized "
+                                    "fragment" );
+        if ( end >= begin )
+        {
+            std::string     text( static_cast< ControlFlow * >( root )->
+                                            getText( begin, end - begin + 1 ) );
+            hash = hashText( hash, text.c_str(), text.size() );
+        }
+    }
+    for ( size_t  k = 0; k < nested.size(); ++k )
+        hash = hashValue( hash, nested[ k ]->getHash( buf ) );
+
+    if ( ! dirty )
+        subtreeHash = hash;
+    return hash;
+}
+
+
+// The whole control flow is numbered on the first request so the ids do not
+// depend on which fragment is asked first
+INT_TYPE  FragmentBase::getId( void )
+{
+    FlowLock            lock( this );
+    if ( id >= 0 )
+        return id;
+
+    FragmentBase *      root( this );
+    while ( root->parent != NULL )
+        root = root->parent;
+    if ( root->kind == CONTROL_FLOW_FRAGMENT )
+        static_cast< ControlFlow * >( root )->numberFragments();
+    return id;
+}
+
 
 Py::Object  FragmentBase::getLineRange( void )
 {
+    sync();
     return Py::TupleN( PYTHON_INT_TYPE( beginLine ),
                        PYTHON_INT_TYPE( endLine ) );
 }
@@ -302,14 +661,17 @@ Py::Object  FragmentBase::getLineRange( void )
 
 Py::Object  FragmentBase::getAbsPosRange( void )
 {
+    sync();
     return Py::TupleN( PYTHON_INT_TYPE( begin ),
                        PYTHON_INT_TYPE( end ) );
 }
 
 
-std::string  FragmentBase::as_string( void ) const
+std::string  FragmentBase::as_string( void )
 {
     char    buffer[ 64 ];
+
+    sync();
     sprintf( buffer, "[%ld:%ld] (%ld,%ld) (%ld,%ld)",
                      begin, end,
                      beginLine, beginPos,
@@ -1754,12 +2116,16 @@ Py::Object Function::getattr( const char *  attrName )
     if ( strcmp( attrName, "docstring" ) == 0 )
         return docstring;
     if ( strcmp( attrName, "suite" ) == 0 )
+    {
+        expandSuite( nsuite );
         return nsuite;
+    }
     return getattr_methods( attrName );
 }
 
 Py::Object  Function::repr( void )
 {
+    expandSuite( nsuite );
     return Py::String( "<Function " + FragmentBase::as_string() +
                        "\n" + FragmentWithComments::as_string() +
                        "\n" + representFragmentPart( asyncKeyword, "Async" ) +
@@ -1886,12 +2252,16 @@ Py::Object Class::getattr( const char *  attrName )
     if ( strcmp( attrName, "docstring" ) == 0 )
         return docstring;
     if ( strcmp( attrName, "suite" ) == 0 )
+    {
+        expandSuite( nsuite );
         return nsuite;
+    }
     return getattr_methods( attrName );
 }
 
 Py::Object  Class::repr( void )
 {
+    expandSuite( nsuite );
     return Py::String( "<Class " + FragmentBase::as_string() +
                        "\n" + FragmentWithComments::as_string() +
                        "\n" + representFragmentPart( name, "Name" ) +
@@ -2509,7 +2879,10 @@ Py::Object While::getattr( const char *  attrName )
     if ( strcmp( attrName, "condition" ) == 0 )
         return condition;
     if ( strcmp( attrName, "suite" ) == 0 )
+    {
+        expandSuite( nsuite );
         return nsuite;
+    }
     if ( strcmp( attrName, "elsePart" ) == 0 )
         return elsePart;
     return getattr_methods( attrName );
@@ -2517,6 +2890,7 @@ Py::Object While::getattr( const char *  attrName )
 
 Py::Object  While::repr( void )
 {
+    expandSuite( nsuite );
     return Py::String( "<While " + FragmentBase::as_string() +
                        "\n" + FragmentWithComments::as_string() +
                        "\n" + representFragmentPart( condition, "Condition" ) +
@@ -2617,7 +2991,10 @@ Py::Object For::getattr( const char *  attrName )
     if ( strcmp( attrName, "iteration" ) == 0 )
         return iteration;
     if ( strcmp( attrName, "suite" ) == 0 )
+    {
+        expandSuite( nsuite );
         return nsuite;
+    }
     if ( strcmp( attrName, "elsePart" ) == 0 )
         return elsePart;
     return getattr_methods( attrName );
@@ -2625,6 +3002,7 @@ Py::Object For::getattr( const char *  attrName )
 
 Py::Object  For::repr( void )
 {
+    expandSuite( nsuite );
     return Py::String( "<For " + FragmentBase::as_string() +
                        "\n" + FragmentWithComments::as_string() +
                        "\n" + representFragmentPart( asyncKeyword, "Async" ) +
@@ -2833,12 +3211,16 @@ Py::Object ElifPart::getattr( const char *  attrName )
     if ( strcmp( attrName, "condition" ) == 0 )
         return condition;
     if ( strcmp( attrName, "suite" ) == 0 )
+    {
+        expandSuite( nsuite );
         return nsuite;
+    }
     return getattr_methods( attrName );
 }
 
 Py::Object  ElifPart::repr( void )
 {
+    expandSuite( nsuite );
     return Py::String( "<ElifPart " + FragmentBase::as_string() +
                        "\n" + FragmentWithComments::as_string() +
                        "\n" + representFragmentPart( condition, "Condition" ) +
@@ -3002,12 +3384,16 @@ Py::Object With::getattr( const char *  attrName )
     if ( strcmp( attrName, "items" ) == 0 )
         return items;
     if ( strcmp( attrName, "suite" ) == 0 )
+    {
+        expandSuite( nsuite );
         return nsuite;
+    }
     return getattr_methods( attrName );
 }
 
 Py::Object  With::repr( void )
 {
+    expandSuite( nsuite );
     return Py::String( "<With " + FragmentBase::as_string() +
                        "\n" + FragmentWithComments::as_string() +
                        "\n" + representFragmentPart( asyncKeyword, "Async" ) +
@@ -3105,12 +3491,16 @@ Py::Object ExceptPart::getattr( const char *  attrName )
     if ( strcmp( attrName, "clause" ) == 0 )
         return clause;
     if ( strcmp( attrName, "suite" ) == 0 )
+    {
+        expandSuite( nsuite );
         return nsuite;
+    }
     return getattr_methods( attrName );
 }
 
 Py::Object  ExceptPart::repr( void )
 {
+    expandSuite( nsuite );
     return Py::String( "<ExceptPart " + FragmentBase::as_string() +
                        "\n" + FragmentWithComments::as_string() +
                        "\n" + representFragmentPart( clause, "Clause" ) +
@@ -3206,12 +3596,16 @@ Py::Object Try::getattr( const char *  attrName )
     if ( strcmp( attrName, "finallyPart" ) == 0 )
         return finallyPart;
     if ( strcmp( attrName, "suite" ) == 0 )
+    {
+        expandSuite( nsuite );
         return nsuite;
+    }
     return getattr_methods( attrName );
 }
 
 Py::Object  Try::repr( void )
 {
+    expandSuite( nsuite );
     return Py::String( "<Try " + FragmentBase::as_string() +
                        "\n" + FragmentWithComments::as_string() +
                        "\n" + representList( nsuite, "Suite" ) +
@@ -3232,6 +3626,13 @@ Py::Object  Try::getDisplayValue( const Py::Tuple &  args )
 ControlFlow::ControlFlow()
 {
     kind = CONTROL_FLOW_FRAGMENT;
+    phase = PHASE_EXACT;
+    appliedEdits = 0;
+    edited = false;
+    scanned = false;
+    iterated = false;
+    nextId = 0;
+    definitionIndex = NULL;
 
     bangLine = Py::None();
     encodingLine = Py::None();
@@ -3246,6 +3647,20 @@ ControlFlow::~ControlFlow()
         delete [] content;
         content = NULL;
     }
+    delete definitionIndex;
+
+    // The fragments kept by the python code lose their parent so they do not
+    // refer to the released objects
+    std::vector< FragmentBase * >   nested;
+    getNestedFragments( this, nested );
+    while ( ! nested.empty() )
+    {
+        FragmentBase *  fragment( nested.back() );
+
+        nested.pop_back();
+        fragment->parent = NULL;
+        getNestedFragments( fragment, nested );
+    }
 }
 
 void ControlFlow::initType( void )
@@ -3267,6 +3682,30 @@ void ControlFlow::initType( void )
                         GETLINECONTENT_DOC );
     add_varargs_method( "getDisplayValue", &ControlFlow::getDisplayValue,
                         CONTROLFLOW_GETDISPLAYVALUE_DOC );
+    add_varargs_method( "applyEdit", &ControlFlow::applyEdit,
+                        CONTROLFLOW_APPLYEDIT_DOC );
+    add_noargs_method( "getComments", &ControlFlow::getComments,
+                       CONTROLFLOW_GETCOMMENTS_DOC );
+    add_varargs_method( "shareUnchanged", &ControlFlow::shareUnchanged,
+                        CONTROLFLOW_SHAREUNCHANGED_DOC );
+    add_varargs_method( "carryIds", &ControlFlow::carryIds,
+                        CONTROLFLOW_CARRYIDS_DOC );
+    add_varargs_method( "fragmentsAt", &ControlFlow::fragmentsAt,
+                        CONTROLFLOW_FRAGMENTSAT_DOC );
+    add_varargs_method( "fragmentAtOffset", &ControlFlow::fragmentAtOffset,
+                        CONTROLFLOW_FRAGMENTATOFFSET_DOC );
+    add_varargs_method( "fragmentsAtOffsets", &ControlFlow::fragmentsAtOffsets,
+                        CONTROLFLOW_FRAGMENTSATOFFSETS_DOC );
+    add_keyword_method( "fragmentsInLineRange",
+                        &ControlFlow::fragmentsInLineRange,
+                        CONTROLFLOW_FRAGMENTSINLINERANGE_DOC );
+    add_varargs_method( "findByQualifiedName",
+                        &ControlFlow::findByQualifiedName,
+                        CONTROLFLOW_FINDBYQUALIFIEDNAME_DOC );
+    add_noargs_method( "iterDefinitions", &ControlFlow::iterDefinitions,
+                       CONTROLFLOW_ITERDEFINITIONS_DOC );
+    add_keyword_method( "iterFragments", &ControlFlow::iterFragments,
+                        CONTROLFLOW_ITERFRAGMENTS_DOC );
 
     behaviors().readyType();
 }
@@ -3286,6 +3725,7 @@ Py::Object ControlFlow::getattr( const char *  attrName )
         members.append( Py::String( "isOK" ) );
         members.append( Py::String( "errors" ) );
         members.append( Py::String( "warnings" ) );
+        members.append( Py::String( "phase" ) );
         return members;
     }
 
@@ -3301,18 +3741,24 @@ Py::Object ControlFlow::getattr( const char *  attrName )
     if ( strcmp( attrName, "docstring" ) == 0 )
         return docstring;
     if ( strcmp( attrName, "suite" ) == 0 )
+    {
+        expandSuite( nsuite );
         return nsuite;
+    }
     if ( strcmp( attrName, "isOK" ) == 0 )
         return Py::Boolean( errors.size() == 0 );
     if ( strcmp( attrName, "errors" ) == 0 )
         return errors;
     if ( strcmp( attrName, "warnings" ) == 0 )
         return warnings;
+    if ( strcmp( attrName, "phase" ) == 0 )
+        return Py::Int( phase );
     return getattr_methods( attrName );
 }
 
 Py::Object  ControlFlow::repr( void )
 {
+    expandSuite( nsuite );
     std::string     ok( "true" );
     if ( errors.size() != 0 )
         ok = "false";
@@ -3373,3 +3819,1734 @@ Py::Object  ControlFlow::getDisplayValue( const Py::Tuple &  args )
 }
 
 
+// Provides the 1-based line and column of the absolute position
+static void
+getLineAndPos( const ScannedLines &  lines, INT_TYPE  absPos,
+               INT_TYPE &  line, INT_TYPE &  pos )
+{
+    int     lineNumber;
+    int     column;
+
+    lines.getLineAndPos( absPos, lineNumber, column );
+    line = lineNumber;
+    pos = column;
+}
+
+
+static bool
+isDefinitionName( FragmentBase *  fragment )
+{
+    FragmentBase *      parent( fragment->parent );
+    if ( parent == NULL )
+        return false;
+    if ( parent->kind == FUNCTION_FRAGMENT )
+        return getFragment(
+                    static_cast< Function * >( parent )->name.ptr() ) ==
+               fragment;
+    if ( parent->kind == CLASS_FRAGMENT )
+        return getFragment(
+                    static_cast< Class * >( parent )->name.ptr() ) ==
+               fragment;
+    return false;
+}
+
+
+static FragmentBase *
+getSuiteItem( const Py::List &  suite, const ShiftTree &  tree, int  rank,
+              size_t  appliedEdits )
+{
+    FragmentBase *      item( getFragment(
+                            PyList_GET_ITEM( suite.ptr(),
+                                             tree.order[ rank ] ) ) );
+    addShifts( item, appliedEdits );
+    return item;
+}
+
+
+// Applies the edit to a fragment which it changes or which is on the edit end
+// line. The nested fragments after that line are moved as a whole by the
+// shift tree; the ones before the edit do not change. So only the fragments
+// around the edit are visited.
+static void
+applyEditTo( ControlFlow *  flow, FragmentBase *  fragment,
+             const TextEdit &  edit )
+{
+    size_t          applied( flow->appliedEdits );
+    addShifts( fragment, applied );
+
+    // The lazy suite is walked before the fragment is changed: the walked
+    // fragments could update the positions which are not edited yet
+    ShiftTree *     tree( getShiftTree( fragment ) );
+
+    // The text typed just after a fragment changes it as well
+    bool            changed;
+    if ( edit.removed > 0 )
+        changed = fragment->begin < edit.offset + edit.removed &&
+                  fragment->end >= edit.offset;
+    else
+        changed = fragment->begin < edit.offset &&
+                  fragment->end + 1 >= edit.offset;
+    fragment->dirty = fragment->dirty || changed;
+    if ( changed && isDefinitionName( fragment ) )
+        flow->dropDefinitionIndex();
+
+    shiftPosition( edit, fragment->begin, fragment->beginLine,
+                   fragment->beginPos );
+    shiftPosition( edit, fragment->end, fragment->endLine,
+                   fragment->endPos );
+
+    if ( tree != NULL )
+    {
+        INT_TYPE                    offset( edit.inserted - edit.removed );
+        INT_TYPE                    line( edit.newEndLine - edit.endLine );
+        std::vector< PyObject * >   nested;
+        size_t                      part( 0 );
+
+        getNestedObjects( fragment, nested, false, false );
+        for ( size_t  k = 0; k < nested.size(); ++k )
+        {
+            if ( nested[ k ] == NULL )
+                continue;   // The suite
+
+            FragmentBase *  item( getFragment( nested[ k ] ) );
+            addShifts( item, applied );
+            if ( item->begin > edit.endLineEnd )
+            {
+                tree->partOffsets[ part ] += offset;
+                tree->partLines[ part ] += line;
+            }
+            else if ( item->end >= edit.offset - 1 )
+                applyEditTo( flow, item, edit );
+            ++part;
+        }
+
+        // The first item after the end line and the first one which could
+        // reach the edit
+        Py::List *          suite( getSuite( fragment ) );
+        int                 low( 0 );
+        int                 high( tree->order.size() );
+        while ( low < high )
+        {
+            int     middle( ( low + high ) / 2 );
+            if ( getSuiteItem( *suite, *tree, middle, applied )->begin >
+                 edit.endLineEnd )
+                high = middle;
+            else
+                low = middle + 1;
+        }
+
+        int                 after( low );
+        if ( after < int( tree->order.size() ) )
+            tree->shiftItems( after, offset, line );
+
+        low = 0;
+        high = after;
+        while ( low < high )
+        {
+            int     middle( ( low + high ) / 2 );
+            if ( getSuiteItem( *suite, *tree, tree->farthest[ middle ],
+                               applied )->end >= edit.offset - 1 )
+                high = middle;
+            else
+                low = middle + 1;
+        }
+        for ( int  rank = low; rank < after; ++rank )
+        {
+            FragmentBase *  item( getSuiteItem( *suite, *tree, rank,
+                                                applied ) );
+            if ( item->end >= edit.offset - 1 )
+                applyEditTo( flow, item, edit );
+        }
+    }
+    fragment->editCount = applied + 1;
+}
+
+
+// The edit changes the text and the fragments it reaches right away. The
+// other fragments get the shifts of the fragments they are nested in when
+// they are read. The lines are scanned from the edited one till the lexer
+// state at a line start is the same as before the edit.
+Py::Object  ControlFlow::applyEdit( const Py::Tuple &  args )
+{
+    if ( args.length() != 3 )
+        throw Py::TypeError( "applyEdit() takes exactly 3 arguments "
+                             "(offset, removed length, inserted text)" );
+    for ( int  k = 0; k < 2; ++k )
+        if ( ! PyLong_Check( args[ k ].ptr() ) || args[ k ].isBoolean() )
+            throw Py::TypeError( "applyEdit() offset and removed length "
+                                 "must be integers" );
+    if ( ! args[ 2 ].isString() )
+        throw Py::TypeError( "applyEdit() inserted text must be a string" );
+
+    FlowLock        lock( this );
+    if ( ! hasContent() )
+        throw Py::RuntimeError( "applyEdit() needs a control flow with "
+                                "the serialized content" );
+    if ( iterated )
+        throw Py::RuntimeError( "applyEdit() cannot change a control flow "
+                                "of an iterator: the fragments are not in "
+                                "its suite" );
+
+    scanContent();
+    if ( ! edited )
+    {
+        editedText.assign( content );
+        edited = true;
+        releaseContent();
+    }
+
+    INT_TYPE        offset = long( Py::Long( args[ 0 ] ) );
+    INT_TYPE        removed = long( Py::Long( args[ 1 ] ) );
+    std::string     text( Py::String( args[ 2 ] ).as_std_string( "utf-8" ) );
+    if ( offset < 0 || removed < 0 ||
+         offset + removed > editedText.getSize() )
+        throw Py::ValueError( "applyEdit() edit is out of the content" );
+
+    TextEdit        edit;
+    edit.offset = offset;
+    edit.removed = removed;
+    edit.inserted = text.size();
+    detachSharers( edit );
+    getLineAndPos( scannedLines, offset, edit.line, edit.pos );
+    getLineAndPos( scannedLines, offset + removed,
+                   edit.endLine, edit.endPos );
+    edit.endLineEnd = scannedLines.getLineStart( edit.endLine + 1 ) - 1;
+
+    editedText.replace( offset, removed, text );
+    scannedLines.rescan( editedText, offset, removed, edit.inserted );
+    getLineAndPos( scannedLines, offset + edit.inserted,
+                   edit.newEndLine, edit.newEndPos );
+
+    applyEditTo( this, this, edit );
+    ++appliedEdits;
+    return Py::None();
+}
+
+
+// The line table and the comments are scanned once; the edits rescan the
+// changed lines only
+void  ControlFlow::scanContent( void )
+{
+    if ( ! scanned )
+    {
+        if ( edited )
+            scannedLines.scan( editedText );
+        else
+            scannedLines.scan( content );
+        scanned = true;
+    }
+}
+
+
+std::string  ControlFlow::getText( INT_TYPE  begin, INT_TYPE  length ) const
+{
+    if ( edited )
+        return editedText.getText( begin, length );
+    return std::string( content + begin, length );
+}
+
+
+INT_TYPE  ControlFlow::getTextSize( void ) const
+{
+    if ( edited )
+        return editedText.getSize();
+    return strlen( content );
+}
+
+
+// The edited text replaces the parsed buffer unless the lazy suites or the
+// iterator walk it
+void  ControlFlow::releaseContent( void )
+{
+    if ( edited && ! lazySource && ! iterated && content != NULL )
+    {
+        delete [] content;
+        content = NULL;
+    }
+}
+
+
+Py::Object  ControlFlow::getComments( void )
+{
+    FlowLock        lock( this );
+    if ( ! hasContent() )
+        throw Py::RuntimeError( "getComments() needs a control flow with "
+                                "the serialized content" );
+    scanContent();
+
+    std::vector< CommentLine >  comments;
+    Py::List                    result;
+
+    scannedLines.getComments( comments );
+    for ( size_t  k = 0; k < comments.size(); ++k )
+        result.append( Py::TupleN( Py::Int( comments[ k ].begin ),
+                                   Py::Int( comments[ k ].end ),
+                                   Py::Int( comments[ k ].line ),
+                                   Py::Int( comments[ k ].pos ) ) );
+    return result;
+}
+
+
+FragmentBase *  getFragment( PyObject *  object )
+{
+    // Most of the optional parts are None
+    if ( object == Py_None )
+        return NULL;
+
+    #define CDM_CF_FRAGMENT_TYPE( type )                            \
+        if ( isInstance< type >( object ) )                         \
+            return static_cast< type * >( object )
+
+    CDM_CF_FRAGMENT_TYPE( Fragment );
+    CDM_CF_FRAGMENT_TYPE( CodeBlock );
+    CDM_CF_FRAGMENT_TYPE( Comment );
+    CDM_CF_FRAGMENT_TYPE( CMLComment );
+    CDM_CF_FRAGMENT_TYPE( Argument );
+    CDM_CF_FRAGMENT_TYPE( Annotation );
+    CDM_CF_FRAGMENT_TYPE( Function );
+    CDM_CF_FRAGMENT_TYPE( Class );
+    CDM_CF_FRAGMENT_TYPE( Docstring );
+    CDM_CF_FRAGMENT_TYPE( Decorator );
+    CDM_CF_FRAGMENT_TYPE( If );
+    CDM_CF_FRAGMENT_TYPE( ElifPart );
+    CDM_CF_FRAGMENT_TYPE( Return );
+    CDM_CF_FRAGMENT_TYPE( Import );
+    CDM_CF_FRAGMENT_TYPE( For );
+    CDM_CF_FRAGMENT_TYPE( While );
+    CDM_CF_FRAGMENT_TYPE( Try );
+    CDM_CF_FRAGMENT_TYPE( ExceptPart );
+    CDM_CF_FRAGMENT_TYPE( With );
+    CDM_CF_FRAGMENT_TYPE( Raise );
+    CDM_CF_FRAGMENT_TYPE( Assert );
+    CDM_CF_FRAGMENT_TYPE( SysExit );
+    CDM_CF_FRAGMENT_TYPE( Break );
+    CDM_CF_FRAGMENT_TYPE( Continue );
+    CDM_CF_FRAGMENT_TYPE( BangLine );
+    CDM_CF_FRAGMENT_TYPE( EncodingLine );
+    CDM_CF_FRAGMENT_TYPE( ControlFlow );
+
+    #undef CDM_CF_FRAGMENT_TYPE
+    return NULL;
+}
+
+
+static void
+appendNested( const Py::Object &  object,
+              std::vector< PyObject * > &  nested )
+{
+    if ( getFragment( object.ptr() ) != NULL )
+        nested.push_back( object.ptr() );
+}
+
+
+static void
+appendNested( const Py::List &  objects,
+              std::vector< PyObject * > &  nested )
+{
+    PyObject *      list( objects.ptr() );
+    Py_ssize_t      size( PyList_GET_SIZE( list ) );
+
+    for ( Py_ssize_t  k = 0; k < size; ++k )
+    {
+        PyObject *      item( PyList_GET_ITEM( list, k ) );
+        if ( getFragment( item ) != NULL )
+            nested.push_back( item );
+    }
+}
+
+
+static void
+appendNested( const FragmentWithComments *  statement,
+              std::vector< PyObject * > &  nested )
+{
+    appendNested( statement->leadingComment, nested );
+    appendNested( statement->sideComment, nested );
+    appendNested( statement->leadingCMLComments, nested );
+    appendNested( statement->sideCMLComments, nested );
+    appendNested( statement->body, nested );
+}
+
+
+static void
+appendSuite( FragmentBase *  owner, Py::List &  suite, bool  expandLazySuite,
+             bool  withSuite, std::vector< PyObject * > &  nested )
+{
+    if ( expandLazySuite )
+        owner->expandSuite( suite );
+    if ( withSuite )
+        appendNested( suite, nested );
+    else
+        nested.push_back( NULL );
+}
+
+
+void  getNestedObjects( FragmentBase *  fragment,
+                        std::vector< PyObject * > &  nested,
+                        bool  expandLazySuites, bool  withSuite )
+{
+    switch ( fragment->kind )
+    {
+        case COMMENT_FRAGMENT:
+            appendNested( static_cast< Comment * >( fragment )->parts,
+                          nested );
+            break;
+        case CML_COMMENT_FRAGMENT:
+            appendNested( static_cast< CMLComment * >( fragment )->parts,
+                          nested );
+            break;
+        case DOCSTRING_FRAGMENT:
+            {
+                Docstring *     f( static_cast< Docstring * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->parts, nested );
+            }
+            break;
+        case DECORATOR_FRAGMENT:
+            {
+                Decorator *     f( static_cast< Decorator * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->name, nested );
+                appendNested( f->arguments, nested );
+            }
+            break;
+        case CODEBLOCK_FRAGMENT:
+            appendNested( static_cast< CodeBlock * >( fragment ), nested );
+            break;
+        case ANNOTATION_FRAGMENT:
+            {
+                Annotation *    f( static_cast< Annotation * >( fragment ) );
+                appendNested( f->separator, nested );
+                appendNested( f->text, nested );
+            }
+            break;
+        case ARGUMENT_FRAGMENT:
+            {
+                Argument *      f( static_cast< Argument * >( fragment ) );
+                appendNested( f->name, nested );
+                appendNested( f->annotation, nested );
+                appendNested( f->separator, nested );
+                appendNested( f->defaultValue, nested );
+            }
+            break;
+        case FUNCTION_FRAGMENT:
+            {
+                Function *      f( static_cast< Function * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->decors, nested );
+                appendNested( f->asyncKeyword, nested );
+                appendNested( f->defKeyword, nested );
+                appendNested( f->name, nested );
+                appendNested( f->arguments, nested );
+                appendNested( f->argList, nested );
+                appendNested( f->annotation, nested );
+                appendNested( f->docstring, nested );
+                appendSuite( f, f->nsuite, expandLazySuites, withSuite,
+                             nested );
+            }
+            break;
+        case CLASS_FRAGMENT:
+            {
+                Class *         f( static_cast< Class * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->decors, nested );
+                appendNested( f->name, nested );
+                appendNested( f->baseClasses, nested );
+                appendNested( f->docstring, nested );
+                appendSuite( f, f->nsuite, expandLazySuites, withSuite,
+                             nested );
+            }
+            break;
+        case BREAK_FRAGMENT:
+            appendNested( static_cast< Break * >( fragment ), nested );
+            break;
+        case CONTINUE_FRAGMENT:
+            appendNested( static_cast< Continue * >( fragment ), nested );
+            break;
+        case RETURN_FRAGMENT:
+            {
+                Return *        f( static_cast< Return * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->value, nested );
+            }
+            break;
+        case RAISE_FRAGMENT:
+            {
+                Raise *         f( static_cast< Raise * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->value, nested );
+            }
+            break;
+        case ASSERT_FRAGMENT:
+            {
+                Assert *        f( static_cast< Assert * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->tst, nested );
+                appendNested( f->message, nested );
+            }
+            break;
+        case SYSEXIT_FRAGMENT:
+            {
+                SysExit *       f( static_cast< SysExit * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->arg, nested );
+                appendNested( f->actualArg, nested );
+            }
+            break;
+        case WHILE_FRAGMENT:
+            {
+                While *         f( static_cast< While * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->condition, nested );
+                appendSuite( f, f->nsuite, expandLazySuites, withSuite,
+                             nested );
+                appendNested( f->elsePart, nested );
+            }
+            break;
+        case FOR_FRAGMENT:
+            {
+                For *           f( static_cast< For * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->asyncKeyword, nested );
+                appendNested( f->forKeyword, nested );
+                appendNested( f->iteration, nested );
+                appendSuite( f, f->nsuite, expandLazySuites, withSuite,
+                             nested );
+                appendNested( f->elsePart, nested );
+            }
+            break;
+        case IMPORT_FRAGMENT:
+            {
+                Import *        f( static_cast< Import * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->fromPart, nested );
+                appendNested( f->whatPart, nested );
+            }
+            break;
+        case ELIF_PART_FRAGMENT:
+            {
+                ElifPart *      f( static_cast< ElifPart * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->condition, nested );
+                appendSuite( f, f->nsuite, expandLazySuites, withSuite,
+                             nested );
+            }
+            break;
+        case IF_FRAGMENT:
+            {
+                If *            f( static_cast< If * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->parts, nested );
+            }
+            break;
+        case WITH_FRAGMENT:
+            {
+                With *          f( static_cast< With * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->asyncKeyword, nested );
+                appendNested( f->withKeyword, nested );
+                appendNested( f->items, nested );
+                appendSuite( f, f->nsuite, expandLazySuites, withSuite,
+                             nested );
+            }
+            break;
+        case EXCEPT_PART_FRAGMENT:
+            {
+                ExceptPart *    f( static_cast< ExceptPart * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->clause, nested );
+                appendSuite( f, f->nsuite, expandLazySuites, withSuite,
+                             nested );
+            }
+            break;
+        case TRY_FRAGMENT:
+            {
+                Try *           f( static_cast< Try * >( fragment ) );
+                appendNested( f, nested );
+                appendSuite( f, f->nsuite, expandLazySuites, withSuite,
+                             nested );
+                appendNested( f->exceptParts, nested );
+                appendNested( f->elsePart, nested );
+                appendNested( f->finallyPart, nested );
+            }
+            break;
+        case CONTROL_FLOW_FRAGMENT:
+            {
+                ControlFlow *   f( static_cast< ControlFlow * >( fragment ) );
+                appendNested( f, nested );
+                appendNested( f->bangLine, nested );
+                appendNested( f->encodingLine, nested );
+                appendNested( f->docstring, nested );
+                appendSuite( f, f->nsuite, expandLazySuites, withSuite,
+                             nested );
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+
+void  getNestedFragments( FragmentBase *  fragment,
+                          std::vector< FragmentBase * > &  nested,
+                          bool  expandLazySuites )
+{
+    std::vector< PyObject * >       objects;
+
+    getNestedObjects( fragment, objects, expandLazySuites );
+    for ( size_t  k = 0; k < objects.size(); ++k )
+        nested.push_back( getFragment( objects[ k ] ) );
+}
+
+
+Py::List *  getSuite( FragmentBase *  fragment )
+{
+    switch ( fragment->kind )
+    {
+        case FUNCTION_FRAGMENT:
+            return & static_cast< Function * >( fragment )->nsuite;
+        case CLASS_FRAGMENT:
+            return & static_cast< Class * >( fragment )->nsuite;
+        case WHILE_FRAGMENT:
+            return & static_cast< While * >( fragment )->nsuite;
+        case FOR_FRAGMENT:
+            return & static_cast< For * >( fragment )->nsuite;
+        case ELIF_PART_FRAGMENT:
+            return & static_cast< ElifPart * >( fragment )->nsuite;
+        case WITH_FRAGMENT:
+            return & static_cast< With * >( fragment )->nsuite;
+        case EXCEPT_PART_FRAGMENT:
+            return & static_cast< ExceptPart * >( fragment )->nsuite;
+        case TRY_FRAGMENT:
+            return & static_cast< Try * >( fragment )->nsuite;
+        case CONTROL_FLOW_FRAGMENT:
+            return & static_cast< ControlFlow * >( fragment )->nsuite;
+        default:
+            break;
+    }
+    return NULL;
+}
+
+
+static bool
+isBeforeItem( const std::pair< INT_TYPE, int > &  first,
+              const std::pair< INT_TYPE, int > &  second )
+{
+    return first.first < second.first;
+}
+
+
+// The order stays as it is for the fragment life: an edit keeps the order of
+// the positions.
+ShiftTree *  getShiftTree( FragmentBase *  fragment )
+{
+    if ( fragment->shifts != NULL )
+        return fragment->shifts;
+
+    std::vector< PyObject * >   nested;
+    getNestedObjects( fragment, nested, true, false );
+
+    Py::List *                  suite( getSuite( fragment ) );
+    std::vector< std::pair< INT_TYPE, int > >   items;
+    if ( suite != NULL )
+    {
+        for ( Py::List::size_type  k = 0; k < suite->size(); ++k )
+        {
+            FragmentBase *  item( getFragment(
+                                    PyList_GET_ITEM( suite->ptr(), k ) ) );
+            if ( item == NULL )
+                continue;
+            item->sync();
+            items.push_back( std::make_pair( item->begin, int( k ) ) );
+        }
+    }
+    if ( items.empty() && nested.size() <= ( suite != NULL ? 1 : 0 ) )
+        return NULL;
+
+    ShiftTree *     tree( new ShiftTree );
+    for ( size_t  k = 0; k < nested.size(); ++k )
+    {
+        if ( nested[ k ] == NULL )
+            continue;
+
+        FragmentBase *  part( getFragment( nested[ k ] ) );
+        if ( part->parent == fragment )
+            part->slot = -2 - int( tree->partOffsets.size() );
+        tree->partOffsets.push_back( 0 );
+        tree->partLines.push_back( 0 );
+    }
+
+    std::stable_sort( items.begin(), items.end(), isBeforeItem );
+    for ( size_t  rank = 0; rank < items.size(); ++rank )
+    {
+        FragmentBase *  item( getFragment(
+                            PyList_GET_ITEM( suite->ptr(),
+                                             items[ rank ].second ) ) );
+        if ( item->parent == fragment )
+            item->slot = rank;
+        tree->order.push_back( items[ rank ].second );
+
+        int     farthest( rank );
+        if ( rank > 0 )
+        {
+            FragmentBase *  other( getFragment(
+                                PyList_GET_ITEM( suite->ptr(),
+                                    tree->order[ tree->farthest.back() ] ) ) );
+            if ( other->end >= item->end )
+                farthest = tree->farthest.back();
+        }
+        tree->farthest.push_back( farthest );
+    }
+    fragment->shifts = tree;
+    return tree;
+}
+
+
+LazySuite::~LazySuite()
+{
+    if ( ! previousFlow.isNone() )
+    {
+        ControlFlow *   flow( static_cast< ControlFlow * >(
+                                                    previousFlow.ptr() ) );
+        FlowLock        lock( flow );
+        flow->sharers.erase( this );
+    }
+}
+
+
+static FragmentBase *
+getRoot( FragmentBase *  fragment )
+{
+    while ( fragment->parent != NULL )
+        fragment = fragment->parent;
+    return fragment;
+}
+
+
+// The fragment which suite items the suite of the given one stands for: a
+// suite shared with a previous version is not copied till it is read
+static PyObject *
+getSuiteSource( PyObject *  object )
+{
+    for ( ;; )
+    {
+        FragmentBase *  fragment( getFragment( object ) );
+        FlowLock        lock( fragment );
+        if ( fragment->lazySuite == NULL ||
+             fragment->lazySuite->previous.isNone() )
+            return object;
+        object = fragment->lazySuite->previous.ptr();
+    }
+}
+
+
+// The previous version keeps the suite till the owner suite is read or till
+// an edit of the previous version reaches it
+static void
+shareSuite( FragmentBase *  owner, PyObject *  previous )
+{
+    LazySuite *     lazy( new LazySuite() );
+    FragmentBase *  root( getRoot( getFragment( previous ) ) );
+
+    lazy->previous = Py::Object( previous );
+    if ( root->kind == CONTROL_FLOW_FRAGMENT )
+    {
+        ControlFlow *   flow( static_cast< ControlFlow * >( root ) );
+        FlowLock        lock( flow );
+        lazy->previousFlow = Py::Object( flow->selfPtr() );
+        flow->sharers.insert( lazy );
+    }
+    delete owner->lazySuite;
+    owner->lazySuite = lazy;
+}
+
+
+// How a previous version fragment is copied: the shift of the positions and
+// whether the suites are copied as well or shared again
+struct CopyMode
+{
+    INT_TYPE    shift;
+    INT_TYPE    lineShift;
+    bool        deep;
+};
+
+
+static Py::Object
+copyFragment( PyObject *  object, FragmentBase *  parent,
+              const CopyMode &  mode );
+
+
+static Py::Object
+copyObject( const Py::Object &  object, FragmentBase *  parent,
+            const CopyMode &  mode )
+{
+    if ( getFragment( object.ptr() ) == NULL )
+        return object;
+    return copyFragment( object.ptr(), parent, mode );
+}
+
+
+static void
+copyList( Py::List &  target, const Py::List &  source,
+          FragmentBase *  parent, const CopyMode &  mode )
+{
+    for ( Py::List::size_type  k = 0; k < source.size(); ++k )
+        target.append( copyObject( source[ k ], parent, mode ) );
+}
+
+
+static void
+copyComments( FragmentWithComments *  target,
+              const FragmentWithComments *  source,
+              FragmentBase *  parent, const CopyMode &  mode )
+{
+    target->leadingComment = copyObject( source->leadingComment, parent,
+                                         mode );
+    target->sideComment = copyObject( source->sideComment, parent, mode );
+    copyList( target->leadingCMLComments, source->leadingCMLComments, parent,
+              mode );
+    copyList( target->sideCMLComments, source->sideCMLComments, parent,
+              mode );
+    target->body = copyObject( source->body, parent, mode );
+}
+
+
+// A deep copy copies the suite items right away unless the suite is shared
+// with an earlier version anyway
+static void
+copySuite( FragmentBase *  owner, Py::List &  suite, PyObject *  object,
+           Py::List &  sourceSuite, const CopyMode &  mode )
+{
+    PyObject *      previous( getSuiteSource( object ) );
+
+    if ( previous == object )
+    {
+        getFragment( object )->expandSuite( sourceSuite );
+        if ( mode.deep )
+        {
+            copyList( suite, sourceSuite, owner, mode );
+            return;
+        }
+        if ( sourceSuite.size() == 0 )
+            return;
+    }
+    shareSuite( owner, previous );
+}
+
+
+static void
+copyBase( FragmentBase *  target, const FragmentBase *  source,
+          FragmentBase *  parent, const CopyMode &  mode )
+{
+    target->parent = parent;
+    target->begin = source->begin + mode.shift;
+    target->end = source->end + mode.shift;
+    target->beginLine = source->beginLine + mode.lineShift;
+    target->beginPos = source->beginPos;
+    target->endLine = source->endLine + mode.lineShift;
+    target->endPos = source->endPos;
+    target->dirty = source->dirty;
+    target->subtreeHash = source->subtreeHash;
+}
+
+
+// The copy gets no id: the ids are dense within a version
+static Py::Object
+copyFragment( PyObject *  object, FragmentBase *  parent,
+              const CopyMode &  mode )
+{
+    FragmentBase *  source( getFragment( object ) );
+    Py::Object      copy;
+
+    source->sync();
+    switch ( source->kind )
+    {
+        case FRAGMENT:
+            {
+                Fragment *      f( new Fragment );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+            }
+            break;
+        case BANG_LINE_FRAGMENT:
+            {
+                BangLine *      f( new BangLine );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+            }
+            break;
+        case ENCODING_LINE_FRAGMENT:
+            {
+                EncodingLine *  from( static_cast< EncodingLine * >( source ) );
+                EncodingLine *  f( new EncodingLine );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                f->normalizedName = from->normalizedName;
+            }
+            break;
+        case COMMENT_FRAGMENT:
+            {
+                Comment *       from( static_cast< Comment * >( source ) );
+                Comment *       f( new Comment );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyList( f->parts, from->parts, f, mode );
+            }
+            break;
+        case CML_COMMENT_FRAGMENT:
+            {
+                CMLComment *    from( static_cast< CMLComment * >( source ) );
+                CMLComment *    f( new CMLComment );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyList( f->parts, from->parts, f, mode );
+                f->version = from->version;
+                f->recordType = from->recordType;
+                f->properties = Py::Dict( PyDict_Copy(
+                                            from->properties.ptr() ), true );
+            }
+            break;
+        case DOCSTRING_FRAGMENT:
+            {
+                Docstring *     from( static_cast< Docstring * >( source ) );
+                Docstring *     f( new Docstring );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                copyList( f->parts, from->parts, f, mode );
+            }
+            break;
+        case DECORATOR_FRAGMENT:
+            {
+                Decorator *     from( static_cast< Decorator * >( source ) );
+                Decorator *     f( new Decorator );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                f->name = copyObject( from->name, f, mode );
+                f->arguments = copyObject( from->arguments, f, mode );
+            }
+            break;
+        case CODEBLOCK_FRAGMENT:
+            {
+                CodeBlock *     from( static_cast< CodeBlock * >( source ) );
+                CodeBlock *     f( new CodeBlock );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+            }
+            break;
+        case ANNOTATION_FRAGMENT:
+            {
+                Annotation *    from( static_cast< Annotation * >( source ) );
+                Annotation *    f( new Annotation );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                f->separator = copyObject( from->separator, f, mode );
+                f->text = copyObject( from->text, f, mode );
+            }
+            break;
+        case ARGUMENT_FRAGMENT:
+            {
+                Argument *      from( static_cast< Argument * >( source ) );
+                Argument *      f( new Argument );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                f->name = copyObject( from->name, f, mode );
+                f->annotation = copyObject( from->annotation, f, mode );
+                f->separator = copyObject( from->separator, f, mode );
+                f->defaultValue = copyObject( from->defaultValue, f, mode );
+            }
+            break;
+        case FUNCTION_FRAGMENT:
+            {
+                Function *      from( static_cast< Function * >( source ) );
+                Function *      f( new Function );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                copyList( f->decors, from->decors, f, mode );
+                f->asyncKeyword = copyObject( from->asyncKeyword, f, mode );
+                f->defKeyword = copyObject( from->defKeyword, f, mode );
+                f->name = copyObject( from->name, f, mode );
+                f->arguments = copyObject( from->arguments, f, mode );
+                copyList( f->argList, from->argList, f, mode );
+                f->annotation = copyObject( from->annotation, f, mode );
+                f->docstring = copyObject( from->docstring, f, mode );
+                copySuite( f, f->nsuite, object, from->nsuite, mode );
+            }
+            break;
+        case CLASS_FRAGMENT:
+            {
+                Class *         from( static_cast< Class * >( source ) );
+                Class *         f( new Class );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                copyList( f->decors, from->decors, f, mode );
+                f->name = copyObject( from->name, f, mode );
+                f->baseClasses = copyObject( from->baseClasses, f, mode );
+                f->docstring = copyObject( from->docstring, f, mode );
+                copySuite( f, f->nsuite, object, from->nsuite, mode );
+            }
+            break;
+        case BREAK_FRAGMENT:
+            {
+                Break *         f( new Break );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, static_cast< Break * >( source ), f, mode );
+            }
+            break;
+        case CONTINUE_FRAGMENT:
+            {
+                Continue *      f( new Continue );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, static_cast< Continue * >( source ), f,
+                              mode );
+            }
+            break;
+        case RETURN_FRAGMENT:
+            {
+                Return *        from( static_cast< Return * >( source ) );
+                Return *        f( new Return );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                f->value = copyObject( from->value, f, mode );
+            }
+            break;
+        case RAISE_FRAGMENT:
+            {
+                Raise *         from( static_cast< Raise * >( source ) );
+                Raise *         f( new Raise );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                f->value = copyObject( from->value, f, mode );
+            }
+            break;
+        case ASSERT_FRAGMENT:
+            {
+                Assert *        from( static_cast< Assert * >( source ) );
+                Assert *        f( new Assert );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                f->tst = copyObject( from->tst, f, mode );
+                f->message = copyObject( from->message, f, mode );
+            }
+            break;
+        case SYSEXIT_FRAGMENT:
+            {
+                SysExit *       from( static_cast< SysExit * >( source ) );
+                SysExit *       f( new SysExit );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                f->arg = copyObject( from->arg, f, mode );
+                f->actualArg = copyObject( from->actualArg, f, mode );
+            }
+            break;
+        case WHILE_FRAGMENT:
+            {
+                While *         from( static_cast< While * >( source ) );
+                While *         f( new While );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                f->condition = copyObject( from->condition, f, mode );
+                copySuite( f, f->nsuite, object, from->nsuite, mode );
+                f->elsePart = copyObject( from->elsePart, f, mode );
+            }
+            break;
+        case FOR_FRAGMENT:
+            {
+                For *           from( static_cast< For * >( source ) );
+                For *           f( new For );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                f->asyncKeyword = copyObject( from->asyncKeyword, f, mode );
+                f->forKeyword = copyObject( from->forKeyword, f, mode );
+                f->iteration = copyObject( from->iteration, f, mode );
+                copySuite( f, f->nsuite, object, from->nsuite, mode );
+                f->elsePart = copyObject( from->elsePart, f, mode );
+            }
+            break;
+        case IMPORT_FRAGMENT:
+            {
+                Import *        from( static_cast< Import * >( source ) );
+                Import *        f( new Import );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                f->fromPart = copyObject( from->fromPart, f, mode );
+                f->whatPart = copyObject( from->whatPart, f, mode );
+            }
+            break;
+        case ELIF_PART_FRAGMENT:
+            {
+                ElifPart *      from( static_cast< ElifPart * >( source ) );
+                ElifPart *      f( new ElifPart );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                f->condition = copyObject( from->condition, f, mode );
+                copySuite( f, f->nsuite, object, from->nsuite, mode );
+            }
+            break;
+        case IF_FRAGMENT:
+            {
+                If *            from( static_cast< If * >( source ) );
+                If *            f( new If );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                copyList( f->parts, from->parts, f, mode );
+            }
+            break;
+        case WITH_FRAGMENT:
+            {
+                With *          from( static_cast< With * >( source ) );
+                With *          f( new With );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                f->asyncKeyword = copyObject( from->asyncKeyword, f, mode );
+                f->withKeyword = copyObject( from->withKeyword, f, mode );
+                f->items = copyObject( from->items, f, mode );
+                copySuite( f, f->nsuite, object, from->nsuite, mode );
+            }
+            break;
+        case EXCEPT_PART_FRAGMENT:
+            {
+                ExceptPart *    from( static_cast< ExceptPart * >( source ) );
+                ExceptPart *    f( new ExceptPart );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                f->clause = copyObject( from->clause, f, mode );
+                copySuite( f, f->nsuite, object, from->nsuite, mode );
+            }
+            break;
+        case TRY_FRAGMENT:
+            {
+                Try *           from( static_cast< Try * >( source ) );
+                Try *           f( new Try );
+                copy = Py::asObject( f );
+                copyBase( f, source, parent, mode );
+                copyComments( f, from, f, mode );
+                copySuite( f, f->nsuite, object, from->nsuite, mode );
+                copyList( f->exceptParts, from->exceptParts, f, mode );
+                f->elsePart = copyObject( from->elsePart, f, mode );
+                f->finallyPart = copyObject( from->finallyPart, f, mode );
+            }
+            break;
+        default:
+            // The control flows are not copied
+            throw Py::RuntimeError( "Cannot copy a control flow" );
+    }
+    return copy;
+}
+
+
+// The previous version is locked while the items are copied; an edit of it
+// could have detached the previous fragment in the meantime. The copies
+// keep the positions of the items relative to the suite owner.
+void  copySharedSuite( FragmentBase *  owner, Py::List &  flow )
+{
+    LazySuite *     lazy = owner->lazySuite;
+
+    for ( ;; )
+    {
+        Py::Object      previous( lazy->previous );
+        FlowLock        lock( getFragment( previous.ptr() ) );
+        if ( lazy->previous.ptr() != previous.ptr() )
+            continue;
+
+        // The suite is copied once whatever happens
+        owner->lazySuite = NULL;
+        std::unique_ptr< LazySuite >    guard( lazy );
+
+        FragmentBase *  source( getFragment( previous.ptr() ) );
+        Py::List *      suite( getSuite( source ) );
+        CopyMode        mode;
+
+        owner->sync();
+        source->sync();
+        source->expandSuite( *suite );
+        mode.shift = owner->begin - owner->shift - source->begin;
+        mode.lineShift = owner->beginLine - owner->lineShift -
+                         source->beginLine;
+        // A detached fragment goes with the last suite which stands for it
+        // so nothing may refer to its items
+        mode.deep = getRoot( source )->kind != CONTROL_FLOW_FRAGMENT;
+        copyList( flow, *suite, owner, mode );
+        return;
+    }
+}
+
+
+// The same kinds at the same relative positions all over the subtree. The
+// suites shared with the earlier versions are compared with the ones they
+// stand for. A suite which has a shift tree is not shared: the tree keeps
+// the order of the items.
+static bool
+isSameSubtree( FragmentBase *  fragment, PyObject *  previous,
+               INT_TYPE  shift, INT_TYPE  lineShift )
+{
+    FragmentBase *  old( getFragment( previous ) );
+
+    fragment->sync();
+    old->sync();
+    if ( fragment->kind != old->kind || fragment->dirty || old->dirty ||
+         fragment->begin != old->begin + shift ||
+         fragment->end != old->end + shift ||
+         fragment->beginLine != old->beginLine + lineShift ||
+         fragment->endLine != old->endLine + lineShift ||
+         fragment->beginPos != old->beginPos ||
+         fragment->endPos != old->endPos )
+        return false;
+
+    std::vector< PyObject * >   nested;
+    std::vector< PyObject * >   oldNested;
+    getNestedObjects( fragment, nested, false, false );
+    getNestedObjects( old, oldNested, false, false );
+    if ( nested.size() != oldNested.size() )
+        return false;
+    for ( size_t  k = 0; k < nested.size(); ++k )
+    {
+        if ( nested[ k ] == NULL || oldNested[ k ] == NULL )
+        {
+            if ( nested[ k ] != oldNested[ k ] )
+                return false;
+        }
+        else if ( ! isSameSubtree( getFragment( nested[ k ] ), oldNested[ k ],
+                                   shift, lineShift ) )
+            return false;
+    }
+
+    Py::List *      suite( getSuite( fragment ) );
+    if ( suite == NULL )
+        return true;
+    if ( fragment->shifts != NULL )
+        return false;
+
+    PyObject *      sourceObject( getSuiteSource( previous ) );
+    FragmentBase *  source( getFragment( sourceObject ) );
+    Py::List *      items( getSuite( source ) );
+
+    fragment->expandSuite( *suite );
+    source->sync();
+    source->expandSuite( *items );
+    if ( suite->size() != items->size() )
+        return false;
+
+    shift += old->begin - source->begin;
+    lineShift += old->beginLine - source->beginLine;
+    for ( Py::List::size_type  k = 0; k < suite->size(); ++k )
+    {
+        FragmentBase *  item( getFragment( PyList_GET_ITEM( suite->ptr(),
+                                                            k ) ) );
+        PyObject *      oldItem( PyList_GET_ITEM( items->ptr(), k ) );
+        if ( item == NULL || getFragment( oldItem ) == NULL )
+            return false;
+        if ( ! isSameSubtree( item, oldItem, shift, lineShift ) )
+            return false;
+    }
+    return true;
+}
+
+
+// The items of a suite which is shared instead lose their parent the same
+// way as the fragments of a released control flow
+static void
+dropSuite( Py::List &  suite )
+{
+    std::vector< FragmentBase * >   nested;
+
+    for ( Py::List::size_type  k = 0; k < suite.size(); ++k )
+    {
+        FragmentBase *  item( getFragment( PyList_GET_ITEM( suite.ptr(),
+                                                            k ) ) );
+        if ( item != NULL )
+            nested.push_back( item );
+    }
+    while ( ! nested.empty() )
+    {
+        FragmentBase *  fragment( nested.back() );
+
+        nested.pop_back();
+        fragment->parent = NULL;
+        getNestedFragments( fragment, nested );
+    }
+    suite = Py::List();
+}
+
+
+// Replaces the suites of a subtree which is the same as the previous version
+// one with the shared ones. The other fragments stay.
+static void
+shareSuites( FragmentBase *  fragment, PyObject *  previous )
+{
+    Py::List *      suite( getSuite( fragment ) );
+
+    if ( suite != NULL && suite->size() > 0 )
+    {
+        dropSuite( *suite );
+        shareSuite( fragment, getSuiteSource( previous ) );
+    }
+
+    std::vector< PyObject * >   nested;
+    std::vector< PyObject * >   oldNested;
+    getNestedObjects( fragment, nested, false, false );
+    getNestedObjects( getFragment( previous ), oldNested, false, false );
+    for ( size_t  k = 0; k < nested.size(); ++k )
+        if ( nested[ k ] != NULL )
+            shareSuites( getFragment( nested[ k ] ), oldNested[ k ] );
+}
+
+
+// The part of the text which differs between two versions. The text before
+// it is the same at the same positions; the text after it is the same at the
+// positions shifted by the length difference.
+struct ChangedText
+{
+    INT_TYPE    begin;      // The first changed position
+    INT_TYPE    end;        // The first position after, in the new text
+    INT_TYPE    shift;      // The new length minus the previous one
+};
+
+
+// Matches the suite items with the previous version ones at the same text:
+// the ones before the changed text and the ones after it which lines start
+// after it. The suites of the other items which start before the change are
+// matched as well. The previous owner positions are the ones of its version
+// plus the base.
+static size_t
+shareUnchangedItems( Py::List &  suite, PyObject *  previousOwner,
+                     INT_TYPE  base, const ChangedText &  changed )
+{
+    PyObject *      sourceObject( getSuiteSource( previousOwner ) );
+    FragmentBase *  owner( getFragment( previousOwner ) );
+    FragmentBase *  source( getFragment( sourceObject ) );
+    Py::List &      previous( *getSuite( source ) );
+    size_t          count( 0 );
+    Py::List::size_type     j( 0 );
+
+    owner->sync();
+    source->sync();
+    source->expandSuite( previous );
+    base += owner->begin - source->begin;
+
+    for ( Py::List::size_type  k = 0; k < suite.size(); ++k )
+    {
+        FragmentBase *  fragment( getFragment( PyList_GET_ITEM( suite.ptr(),
+                                                                k ) ) );
+        if ( fragment == NULL )
+            continue;
+
+        bool            same( true );
+        INT_TYPE        target( fragment->begin );
+        fragment->sync();
+        if ( fragment->end >= changed.begin )
+        {
+            if ( fragment->begin - fragment->beginPos + 1 >= changed.end )
+                target -= changed.shift;
+            else if ( fragment->begin < changed.begin )
+                same = false;
+            else
+                continue;
+        }
+
+        FragmentBase *  old( NULL );
+        for ( ; j < previous.size(); ++j )
+        {
+            old = getFragment( PyList_GET_ITEM( previous.ptr(), j ) );
+            if ( old == NULL )
+                continue;
+            old->sync();
+            if ( old->begin + base >= target )
+                break;
+        }
+        if ( j == previous.size() || old->begin + base != target ||
+             old->kind != fragment->kind )
+            continue;
+
+        PyObject *      oldObject( PyList_GET_ITEM( previous.ptr(), j++ ) );
+        if ( same && isSameSubtree( fragment, oldObject,
+                                    fragment->begin - old->begin,
+                                    fragment->beginLine - old->beginLine ) )
+        {
+            shareSuites( fragment, oldObject );
+            if ( fragment->subtreeHash == 0 )
+                fragment->subtreeHash = old->subtreeHash;
+            ++count;
+            continue;
+        }
+
+        Py::List *      nested( getSuite( fragment ) );
+        if ( nested != NULL && fragment->shifts == NULL )
+        {
+            fragment->expandSuite( *nested );
+            count += shareUnchangedItems( *nested, oldObject, base, changed );
+        }
+    }
+    return count;
+}
+
+
+// The text is the previous version one with the changed part replaced, so
+// the versions share the blocks of the same text
+static void
+shareText( ControlFlow *  flow, ControlFlow *  previous,
+           const ChangedText &  changed, const std::string &  text )
+{
+    if ( ! previous->edited )
+    {
+        previous->editedText.assign( previous->content );
+        previous->edited = true;
+        previous->releaseContent();
+    }
+
+    EditedText      edited( previous->editedText );
+    edited.replace( changed.begin,
+                    edited.getSize() - changed.begin -
+                    ( text.size() - changed.end ),
+                    text.substr( changed.begin,
+                                 changed.end - changed.begin ) );
+    flow->editedText = edited;
+    flow->edited = true;
+    flow->releaseContent();
+}
+
+
+// The subtrees are matched by the text: the ones before and after the
+// changed part of it. This version keeps its own fragments down to the
+// suites of the unchanged subtrees. The suites stand for the previous version
+// ones and are copied when they are read, so the versions could be edited.
+Py::Object  ControlFlow::shareUnchanged( const Py::Tuple &  args )
+{
+    if ( args.length() != 1 ||
+         ! isInstance< ControlFlow >( args[ 0 ].ptr() ) )
+        throw Py::TypeError( "shareUnchanged() takes exactly one argument "
+                             "(the previous control flow)" );
+
+    ControlFlow *   previous( static_cast< ControlFlow * >(
+                                                        args[ 0 ].ptr() ) );
+    if ( previous == this )
+        throw Py::ValueError( "shareUnchanged() needs another control flow" );
+    if ( ! hasContent() || ! previous->hasContent() )
+        throw Py::RuntimeError( "shareUnchanged() needs control flows with "
+                                "the serialized content" );
+    if ( iterated || previous->iterated )
+        throw Py::RuntimeError( "shareUnchanged() cannot share the fragments "
+                                "of an iterator control flow" );
+    if ( phase != previous->phase )
+        throw Py::ValueError( "shareUnchanged() needs control flows of "
+                              "the same phase" );
+
+    FlowLock        lock( this );
+    FlowLock        previousLock( previous );
+    if ( ! sharers.empty() )
+        throw Py::RuntimeError( "shareUnchanged() must be called before "
+                                "the later versions share this one" );
+
+    std::string     text( getText( 0, getTextSize() ) );
+    std::string     previousText( previous->getText(
+                                        0, previous->getTextSize() ) );
+    size_t          same( 0 );
+    size_t          sameAfter( 0 );
+    size_t          shorter( std::min( text.size(), previousText.size() ) );
+
+    while ( same < shorter && text[ same ] == previousText[ same ] )
+        ++same;
+    while ( sameAfter < shorter - same &&
+            text[ text.size() - 1 - sameAfter ] ==
+            previousText[ previousText.size() - 1 - sameAfter ] )
+        ++sameAfter;
+
+    ChangedText     changed;
+    changed.begin = same;
+    changed.end = text.size() - sameAfter;
+    changed.shift = INT_TYPE( text.size() ) - INT_TYPE( previousText.size() );
+
+    sync();
+    size_t      count( shareUnchangedItems( nsuite, args[ 0 ].ptr(), 0,
+                                            changed ) );
+    shareText( this, previous, changed, text );
+    if ( count > 0 )
+        dropDefinitionIndex();
+    return Py::Long( long( count ) );
+}
+
+
+// The later versions copy the suites of the fragments of this one when they
+// read them, so the fragments which an edit reaches are copied for them
+// first. The copies are detached: nothing changes them.
+void  ControlFlow::detachSharers( const TextEdit &  edit )
+{
+    std::vector< LazySuite * >      reached;
+
+    for ( std::set< LazySuite * >::iterator  k( sharers.begin() );
+          k != sharers.end(); ++k )
+    {
+        FragmentBase *  source( getFragment( ( *k )->previous.ptr() ) );
+
+        source->sync();
+        if ( edit.offset <= source->end + 1 &&
+             edit.offset + edit.removed >=
+                                    source->begin - source->beginPos + 1 )
+            reached.push_back( *k );
+    }
+
+    CopyMode        mode = { 0, 0, true };
+    for ( size_t  k = 0; k < reached.size(); ++k )
+    {
+        LazySuite *     lazy( reached[ k ] );
+
+        sharers.erase( lazy );
+        lazy->previous = copyFragment( lazy->previous.ptr(), NULL, mode );
+        lazy->previousFlow = Py::None();
+    }
+}
+
+
+// The lazy suites are walked so that no fragment appears later without an id.
+// The suites shared with a previous version are copied as well.
+void  ControlFlow::numberFragments( void )
+{
+    std::vector< FragmentBase * >   stack( 1, this );
+    while ( ! stack.empty() )
+    {
+        FragmentBase *  fragment( stack.back() );
+        stack.pop_back();
+        if ( fragment->id < 0 )
+            fragment->id = nextId++;
+
+        std::vector< FragmentBase * >   nested;
+        getNestedFragments( fragment, nested, true );
+        stack.insert( stack.end(), nested.rbegin(), nested.rend() );
+    }
+}
+
+
+// The ids are carried before they are given out so a fragment never changes
+// its id. The fragments which got no id from the previous version are
+// numbered after the previous version ids.
+Py::Object  ControlFlow::carryIds( const Py::Tuple &  args )
+{
+    if ( args.length() != 1 ||
+         ! isInstance< ControlFlow >( args[ 0 ].ptr() ) )
+        throw Py::TypeError( "carryIds() takes exactly one argument "
+                             "(the previous control flow)" );
+
+    ControlFlow *   previous( static_cast< ControlFlow * >(
+                                                        args[ 0 ].ptr() ) );
+    if ( previous == this )
+        throw Py::ValueError( "carryIds() needs another control flow" );
+
+    FlowLock        lock( this );
+    if ( id >= 0 )
+        throw Py::RuntimeError( "carryIds() must be called before the ids "
+                                "are requested" );
+
+    previous->getId();
+    carryControlFlowIds( previous, this );
+    if ( previous->nextId > nextId )
+        nextId = previous->nextId;
+    numberFragments();
+    return Py::None();
+}
+
+
+DefinitionIndex &  ControlFlow::getDefinitionIndex( void )
+{
+    if ( definitionIndex == NULL )
+        definitionIndex = new DefinitionIndex( this );
+    return *definitionIndex;
+}
+
+
+void  ControlFlow::dropDefinitionIndex( void )
+{
+    delete definitionIndex;
+    definitionIndex = NULL;
+}
+
+
+// Accepts the integer like objects as well, e.g. the numpy integers
+static INT_TYPE
+getIntegerArgument( PyObject *  value, const char *  message )
+{
+    if ( PyBool_Check( value ) )
+        throw Py::TypeError( message );
+
+    PyObject *      integer( PyNumber_Index( value ) );
+    if ( integer == NULL )
+    {
+        PyErr_Clear();
+        throw Py::TypeError( message );
+    }
+    return long( Py::Long( integer, true ) );
+}
+
+
+Py::Object  ControlFlow::fragmentsAt( const Py::Tuple &  args )
+{
+    if ( args.length() != 2 )
+        throw Py::TypeError( "fragmentsAt() takes exactly 2 arguments "
+                             "(line, column)" );
+
+    const char *    message( "fragmentsAt() line and column must be "
+                             "integers" );
+    INT_TYPE        line( getIntegerArgument( args[ 0 ].ptr(), message ) );
+    INT_TYPE        column( getIntegerArgument( args[ 1 ].ptr(), message ) );
+    FlowLock        lock( this );
+    return getChainAt( this, line, column );
+}
+
+
+Py::Object  ControlFlow::fragmentAtOffset( const Py::Tuple &  args )
+{
+    if ( args.length() != 1 )
+        throw Py::TypeError( "fragmentAtOffset() takes exactly one argument "
+                             "(absolute position)" );
+
+    INT_TYPE        offset( getIntegerArgument( args[ 0 ].ptr(),
+                                        "fragmentAtOffset() offset must be "
+                                        "an integer" ) );
+    FlowLock        lock( this );
+    return getChainAtOffset( this, offset );
+}
+
+
+Py::Object  ControlFlow::fragmentsAtOffsets( const Py::Tuple &  args )
+{
+    if ( args.length() != 1 )
+        throw Py::TypeError( "fragmentsAtOffsets() takes exactly one "
+                             "argument (iterable of absolute positions)" );
+
+    PyObject *      iterator( PyObject_GetIter( args[ 0 ].ptr() ) );
+    if ( iterator == NULL )
+    {
+        PyErr_Clear();
+        throw Py::TypeError( "fragmentsAtOffsets() needs an iterable of "
+                             "absolute positions" );
+    }
+
+    // The iterable may run any code so the offsets are taken before the
+    // fragments are searched
+    Py::Object                  guard( iterator, true );
+    std::vector< INT_TYPE >     offsets;
+    PyObject *                  item;
+    while ( ( item = PyIter_Next( iterator ) ) != NULL )
+    {
+        Py::Object      offset( item, true );
+        offsets.push_back( getIntegerArgument( item, "fragmentsAtOffsets() "
+                                                     "offsets must be "
+                                                     "integers" ) );
+    }
+    if ( PyErr_Occurred() )
+        throw Py::Exception();
+
+    FlowLock            lock( this );
+    Py::List            chains;
+    for ( size_t  k = 0; k < offsets.size(); ++k )
+        chains.append( getChainAtOffset( this, offsets[ k ] ) );
+    return chains;
+}
+
+
+Py::Object  ControlFlow::fragmentsInLineRange( const Py::Tuple &  args,
+                                               const Py::Dict &  keywords )
+{
+    if ( args.length() < 2 || args.length() > 3 )
+        throw Py::TypeError( "fragmentsInLineRange() takes 2 or 3 arguments "
+                             "(first line, last line, kinds)" );
+
+    Py::Object      kinds( args.length() == 3 ? args[ 2 ] : Py::None() );
+    Py::List        names( keywords.keys() );
+    for ( Py::List::size_type  k = 0; k < names.size(); ++k )
+    {
+        if ( names[ k ].str().as_std_string() != "kinds" ||
+             args.length() == 3 )
+            throw Py::TypeError( "fragmentsInLineRange() got an unexpected "
+                                 "keyword argument " +
+                                 names[ k ].repr().as_std_string() );
+        kinds = keywords[ names[ k ] ];
+    }
+
+    const char *    message( "fragmentsInLineRange() lines must be "
+                             "integers" );
+    INT_TYPE        first( getIntegerArgument( args[ 0 ].ptr(), message ) );
+    INT_TYPE        last( getIntegerArgument( args[ 1 ].ptr(), message ) );
+    KindFilter      filter;
+
+    if ( first > last )
+        throw Py::ValueError( "fragmentsInLineRange() the first line must "
+                              "not be after the last one" );
+    filter.set( kinds, "fragmentsInLineRange" );
+
+    FlowLock        lock( this );
+    return getInLineRange( this, first, last, filter );
+}
+
+
+Py::Object  ControlFlow::findByQualifiedName( const Py::Tuple &  args )
+{
+    if ( args.length() != 1 || ! args[ 0 ].isString() )
+        throw Py::TypeError( "findByQualifiedName() takes exactly one "
+                             "argument (dotted name string)" );
+
+    std::string     name( Py::String( args[ 0 ] ).as_std_string( "utf-8" ) );
+    FlowLock        lock( this );
+    return getDefinitionIndex().find( name );
+}
+
+
+Py::Object  ControlFlow::iterDefinitions( void )
+{
+    FlowLock        lock( this );
+    Py::List        definitions( getDefinitionIndex().getDefinitions() );
+    return Py::Object( PyObject_GetIter( definitions.ptr() ), true );
+}
+
+
+Py::Object  ControlFlow::iterFragments( const Py::Tuple &  args,
+                                        const Py::Dict &  keywords )
+{
+    if ( args.length() > 2 )
+        throw Py::TypeError( "iterFragments() takes at most 2 arguments "
+                             "(kinds, order)" );
+
+    Py::Object      kinds( args.length() > 0 ? args[ 0 ] : Py::None() );
+    Py::Object      order( args.length() > 1 ? args[ 1 ]
+                                              : Py::String( "pre" ) );
+    Py::List        names( keywords.keys() );
+    for ( Py::List::size_type  k = 0; k < names.size(); ++k )
+    {
+        std::string     name( names[ k ].str().as_std_string() );
+        if ( name == "kinds" && args.length() < 1 )
+            kinds = keywords[ names[ k ] ];
+        else if ( name == "order" && args.length() < 2 )
+            order = keywords[ names[ k ] ];
+        else
+            throw Py::TypeError( "iterFragments() got an unexpected or "
+                                 "repeated keyword argument " +
+                                 names[ k ].repr().as_std_string() );
+    }
+
+    std::string     orderName( order.isString()
+                                    ? Py::String( order ).as_std_string()
+                                    : std::string() );
+    if ( orderName != "pre" && orderName != "post" )
+        throw Py::ValueError( "iterFragments() order must be 'pre' or "
+                              "'post'" );
+
+    KindFilter      filter;
+    filter.set( kinds, "iterFragments" );
+    return Py::asObject( new FragmentIterator( this, filter,
+                                               orderName == "post" ) );
+}
@@ -23,9 +23,11 @@
 
 
 #include <Python.h>
-#include <node.h>
 
 #include <set>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 #include "CXX/Objects.hxx"
 #include "CXX/Extensions.hxx"
@@ -40,6 +42,47 @@
 
 
 struct Context;
+struct LazySuite;
+struct LazySource;
+class DefinitionIndex;
+
+
+// A text edit made by ControlFlow.applyEdit(). The positions are the ones of
+// the buffer before the edit; the columns are 1-based.
+struct TextEdit
+{
+    INT_TYPE    offset;
+    INT_TYPE    removed;        // The removed text length
+    INT_TYPE    inserted;       // The inserted text length
+    INT_TYPE    line;           // The edit start
+    INT_TYPE    pos;
+    INT_TYPE    endLine;        // The first character after the removed text
+    INT_TYPE    endPos;
+    INT_TYPE    newEndLine;     // The first character after the inserted text
+    INT_TYPE    newEndPos;
+    INT_TYPE    endLineEnd;     // The last position of the end line
+};
+
+
+// The order of the suite items by their positions and the shifts the edits
+// made to the nested fragments of a fragment. The suite items are shifted in
+// the order of their positions, so the ones after an edit are shifted by
+// adding to a single node of a Fenwick tree. The order does not change:
+// an edit moves no position over another one.
+struct ShiftTree
+{
+    std::vector< int >          order;      // The suite indices by begin
+    std::vector< int >          farthest;   // By the order: the rank of the
+                                            // highest end so far
+    std::vector< INT_TYPE >     offsets;    // By the order, 1-based;
+    std::vector< INT_TYPE >     lines;      // empty till an edit
+    std::vector< INT_TYPE >     partOffsets;    // The other nested ones
+    std::vector< INT_TYPE >     partLines;
+
+    void  shiftItems( int  rank, INT_TYPE  offset, INT_TYPE  line );
+    void  getItemShift( int  rank, INT_TYPE &  offset,
+                        INT_TYPE &  line ) const;
+};
 
 
 // Base class for all the fragments. It is visible in C++ only, python users
@@ -55,6 +98,8 @@ class FragmentBase
                                 // The most top level fragment has it as NULL
         const char *    content;// Owner of this field is the ControlFlow
                                 // object. Other derivatives must not touch it.
+        LazySuite *     lazySuite;  // The suite to walk on the first access
+                                    // or NULL. Owned by the fragment.
 
     public:
         INT_TYPE    kind;       // Fragment type
@@ -71,11 +116,37 @@ class FragmentBase
         INT_TYPE    endLine;    // 1-based line number
         INT_TYPE    endPos;     // 1-based position number in the line
 
+        // The positions are shifted by the control flow edits lazily. An
+        // edit changes the fragments it overlaps and adds the shift of the
+        // ones after it to the shift trees of the fragments they are nested
+        // in. A fragment adds up the shifts of its parents when it is read.
+        size_t      editCount;  // The control flow edits when it was read
+        INT_TYPE    shift;      // The shifts added up by then
+        INT_TYPE    lineShift;
+        ShiftTree * shifts;     // Of the nested fragments or NULL
+        int         slot;       // The rank in the parent suite order, or
+                                // -2 - index of the other nested ones, or
+                                // -1 if the parent has no shift tree
+        bool        dirty;      // An edit changed the fragment text
+
+        // Covers the kind and the text of the subtree but not the positions;
+        // 0 if it has not been computed yet
+        unsigned long long  subtreeHash;
+
+        // Dense within the control flow: the fragments are numbered in the
+        // pre-order on the first request. -1 if it has not been numbered yet.
+        INT_TYPE    id;
+
+        // The control flow of a top level fragment provided by
+        // iterControlFlow(); None otherwise. Such a fragment is not in the
+        // control flow suite so it keeps its parent alive.
+        Py::Object  owner;
+
         void  appendMembers( Py::List &  container ) const;
         bool  getAttribute( const char *        attrName,
                             Py::Object &        retval );
 
-        std::string as_string( void ) const;
+        std::string as_string( void );
         std::string alignBlock( const std::string &  content,
                                 FragmentBase *  firstFragment );
 
@@ -90,9 +161,57 @@ class FragmentBase
         void        updateBegin( const FragmentBase *  other );
         void        updateEnd( const FragmentBase *  other );
         void        updateBeginEnd( const FragmentBase *  other );
+
+        // Walks the suite if a lazy parse has not done it yet
+        void        expandSuite( Py::List &  suite );
+
+        // Adds the shifts made by the control flow edits since the last call
+        void        sync( void );
+
+        // The buffer is needed if the control flow is not serialized
+        unsigned long long  getHash( const char *  buf = NULL );
+        INT_TYPE            getId( void );
+
+        // Detaches the nested fragments if the fragment has an owner. The
+        // fragment types deallocator calls it before the destructors.
+        void        releaseSubtree( void );
 };
 
 
+// Provides the C++ part of a fragment object or NULL for None and the other
+// objects
+FragmentBase *  getFragment( PyObject *  object );
+
+// True if the object is an instance of the PyCXX class. The instances have
+// the heap types of a module object which share the deallocator with the
+// PyCXX static type, see cflowmodule.cpp.
+template < typename T >
+inline bool  isInstance( PyObject *  object )
+{
+    return Py_TYPE( object )->tp_dealloc == T::type_object()->tp_dealloc;
+}
+
+// Appends the nested fragments: the parts, the comments, the docstrings and
+// the suite items. The lazy suites are walked only if asked.
+void  getNestedFragments( FragmentBase *  fragment,
+                          std::vector< FragmentBase * > &  nested,
+                          bool  expandLazySuites = false );
+
+// The same as getNestedFragments() but provides the python objects. If the
+// suite is not asked for then NULL stands for it.
+void  getNestedObjects( FragmentBase *  fragment,
+                        std::vector< PyObject * > &  nested,
+                        bool  expandLazySuites = false,
+                        bool  withSuite = true );
+
+// The suite of a fragment or NULL if the kind has none
+Py::List *  getSuite( FragmentBase *  fragment );
+
+// Provides the shift tree of a fragment, walks the lazy suite and builds the
+// tree if there is none. NULL if the fragment has no nested fragments.
+ShiftTree *  getShiftTree( FragmentBase *  fragment );
+
+
 // General idea is as follows:
 // - the fragment in the base covers everything in the fragment, starting from
 //   the very first character of the leading comment till the very last
@@ -659,6 +778,10 @@ class Try : public FragmentBase,
 };
 
 
+// Which parse a control flow comes from
+#define PHASE_APPROXIMATE       0   // The pre-scan: top level definitions only
+#define PHASE_EXACT             1   // The parser
+
 class ControlFlow : public FragmentBase,
                     public FragmentWithComments,
                     public Py::PythonExtension< ControlFlow >
@@ -682,27 +805,209 @@ class ControlFlow : public FragmentBase,
         Py::List    errors;         // List of tuples( line, column, message )
         Py::List    warnings;       // List of tuples( line, column, message )
 
+        int         phase;          // PHASE_APPROXIMATE or PHASE_EXACT
+
+        // The content stays the parsed buffer which the lazy suites are
+        // walked from; the first edit copies it to the edited text
+        size_t                      appliedEdits;
+        EditedText                  editedText;
+        bool                        edited;
+        ScannedLines                scannedLines;   // Built by the first edit
+        bool                        scanned;        // or comments request
+
+        // The suite fragments are provided by iterControlFlow() so they
+        // are not in the suite
+        bool                        iterated;
+
+        // What the lazy suites are walked from; NULL if there are none
+        std::shared_ptr< LazySource >   lazySource;
+
+        // The suites of the later versions which are copied from the
+        // fragments of this one when they are read, see shareUnchanged()
+        std::set< LazySuite * >         sharers;
+
+        INT_TYPE                        nextId;     // The first unused id
+
+        // Built by the first name query; NULL if there was none since an
+        // edit changed a name
+        DefinitionIndex *               definitionIndex;
+
+        // Held while the fragments are changed lazily, see FlowLock
+        std::recursive_mutex            lazyMutex;
+
     public:
         void addError( int  line, int  column, const std::string &  message );
         void addWarning( int  line, int  column, const std::string &  message );
+
+        Py::Object  applyEdit( const Py::Tuple &  args );
+        Py::Object  getComments( void );
+        void        scanContent( void );
+        void        detachSharers( const TextEdit &  edit );
+
+        // The content is either the parsed buffer or the edited text
+        bool        hasContent( void ) const
+        { return edited || content != NULL; }
+        std::string getText( INT_TYPE  begin, INT_TYPE  length ) const;
+        INT_TYPE    getTextSize( void ) const;
+        void        releaseContent( void );
+        Py::Object  shareUnchanged( const Py::Tuple &  args );
+        Py::Object  carryIds( const Py::Tuple &  args );
+        Py::Object  fragmentsAt( const Py::Tuple &  args );
+        Py::Object  fragmentAtOffset( const Py::Tuple &  args );
+        Py::Object  fragmentsAtOffsets( const Py::Tuple &  args );
+        Py::Object  fragmentsInLineRange( const Py::Tuple &  args,
+                                          const Py::Dict &  keywords );
+        Py::Object  findByQualifiedName( const Py::Tuple &  args );
+        Py::Object  iterDefinitions( void );
+        Py::Object  iterFragments( const Py::Tuple &  args,
+                                   const Py::Dict &  keywords );
+
+        void        numberFragments( void );
+        DefinitionIndex &  getDefinitionIndex( void );
+        void        dropDefinitionIndex( void );
+};
+
+
+// Serializes the lazy changes of the fragments of one control flow: the
+// lazy suites walk, the edit shifts, the hashes, the ids and the indices.
+// A free-threaded python runs them from many threads at once. The lock is
+// taken recursively by the same thread; the GIL is released while waiting
+// for it. A fragment without a control flow needs no lock.
+class FlowLock
+{
+    public:
+        explicit FlowLock( FragmentBase *  fragment );
+        ~FlowLock();
+
+    private:
+        std::recursive_mutex *      mutex;
+
+        FlowLock( const FlowLock & );
+        FlowLock &  operator=( const FlowLock & );
 };
 
 
 
+struct Node;
+class ParseControl;
+
+
+// What the walker builds. The defaults give the complete control flow.
+// Each disabled feature is skipped by the walker altogether.
+struct ParseOptions
+{
+    ParseOptions() :
+        outline( false ), comments( true ), cmlProperties( true ),
+        docstrings( true ), sysExit( true ), arguments( true ),
+        serialize( true ), hashes( false ), kinds( ~0ULL ), maxDepth( 0 ),
+        lazySuites( false )
+    {}
+
+    // Comments are collected by the tokenizer and injected by the walker
+    bool  needComments( void ) const
+    { return comments && ! outline; }
+
+    // The kind is one of the suite fragment kinds
+    bool  isBuilt( int  kind ) const
+    { return ( kinds >> kind ) & 1ULL; }
+
+    // The module suite is the level 1
+    bool  isWalked( int  depth ) const
+    { return maxDepth <= 0 || depth <= maxDepth; }
+
+    // Functions and classes only: no code blocks, no comments and no other
+    // statements. The definitions nested in the other compound statements
+    // are added to the enclosing suite.
+    bool        outline;
+
+    bool        comments;       // The bang and encoding lines are still
+                                // recognized without the comments
+    bool        cmlProperties;  // CML version, record type and properties
+    bool        docstrings;     // If not then a docstring is a code block
+    bool        sysExit;        // If not then sys.exit() is a code block
+    bool        arguments;      // The function argList items
+    bool        serialize;      // The control flow keeps the content
+    bool        hashes;         // Not serialized: the subtree hashes are
+                                // computed before the content is gone
+
+    // A bit per suite fragment kind (*_FRAGMENT). A statement which kind is
+    // not built is skipped with its comments; the suites of a skipped
+    // compound statement are walked into the enclosing suite.
+    unsigned long long  kinds;
+
+    // The suites nested deeper than that are left empty; 0 means no limit.
+    // If lazySuites is set then they are walked on the first access.
+    int         maxDepth;
+    bool        lazySuites;
+};
+
+
 // The parser context
 struct Context
 {
+    Context() : walkedStatements( 0 )
+    {}
+
     ControlFlow *                   flow;
     const char *                    buffer;
     int *                           lineShifts;
     std::deque< CommentLine > *     comments;
     std::set< std::string >         sysExit;
     Docstring *                     lastDocstring;
+    ParseControl *                  control;    // NULL if not stoppable
+    long                            walkedStatements;
+    ParseOptions                    options;
+    int                             depth;      // The walked suite level
+    std::shared_ptr< LazySource >   lazySource; // NULL if not lazy
 
     // These vectors must be in sync; they are used to properly collect
     // trailing comments
     std::vector< Py::List * >       flowStack;
-    std::vector< node * >           nodeStack;
+    std::vector< Node * >           nodeStack;
+};
+
+
+// A suite deeper than the parse options allow. It keeps what the walker
+// needs to build the suite later: the node, the comments which belong to it
+// and the sys.exit() names known at its position.
+struct LazySuite
+{
+    std::weak_ptr< LazySource >     source;     // Expires with the control
+                                                // flow
+    Node *                          tree;
+    std::vector< Node * >           nodeStack;  // The upper suites
+    std::deque< CommentLine >       comments;
+    std::set< std::string >         sysExit;
+    Docstring *                     docstring;  // Of the owner or NULL
+    int                             depth;
+
+    // A suite which is the same as the suite of a previous version fragment.
+    // It is copied from there on the first access, one level at a time, so
+    // the copies share their suites again. The positions are taken relative
+    // to the fragments which own the suites.
+    Py::Object                      previous;   // None if the suite is walked
+    Py::Object                      previousFlow;   // None if the previous
+                                                    // fragment is detached
+
+    ~LazySuite();
+};
+
+// Builds the fragments of a lazy suite into the given list. Throws a python
+// exception if the control flow has already gone.
+void  walkLazySuite( FragmentBase *  owner, Py::List &  flow );
+
+// Copies the items of a suite shared with a previous version into the given
+// list. The suites of the copies are shared again.
+void  copySharedSuite( FragmentBase *  owner, Py::List &  flow );
+
+
+// The state of a suite walk kept between the suite statements
+struct WalkState
+{
+    CodeBlock *         codeBlock;      // Not added to the flow yet
+    FragmentBase *      lastAdded;
+    int                 statementCount;
+    bool                docstrProcessed;
 };
 
 #endif
@@ -0,0 +1,412 @@
+/*
+ * codimension - graphics python two-way code editor and analyzer
+ * Copyright (C) 2014 - 2016  Sergey Satskiy <sergey.satskiy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Indices and traversal of the control flow fragments
+ */
+
+#include <algorithm>
+
+#include "cflowindex.hpp"
+#include "cflowfragmenttypes.hpp"
+#include "cflowdocs.hpp"
+
+
+
+static bool
+isFragmentKind( long  kind )
+{
+    return ( kind >= FRAGMENT && kind <= ARGUMENT_FRAGMENT ) ||
+           kind == CML_COMMENT_FRAGMENT || kind == CONTROL_FLOW_FRAGMENT;
+}
+
+
+void  KindFilter::set( const Py::Object &  kinds, const char *  funcName )
+{
+    all = kinds.isNone();
+    selected.assign( CONTROL_FLOW_FRAGMENT + 1, false );
+    if ( all )
+        return;
+
+    PyObject *      iterator = PyObject_GetIter( kinds.ptr() );
+    if ( iterator == NULL )
+    {
+        PyErr_Clear();
+        throw Py::TypeError( std::string( funcName ) + "() kinds must be "
+                             "None or an iterable of the fragment kinds" );
+    }
+
+    Py::Object      guard( iterator, true );
+    PyObject *      item;
+    while ( ( item = PyIter_Next( iterator ) ) != NULL )
+    {
+        Py::Object      kind( item, true );
+        if ( ! PyLong_Check( item ) )
+            throw Py::TypeError( std::string( funcName ) + "() kinds must "
+                                 "be integers" );
+        long            value = long( Py::Long( kind ) );
+        if ( ! isFragmentKind( value ) )
+            throw Py::ValueError( std::string( funcName ) + "() kinds: " +
+                                  kind.str().as_std_string() +
+                                  " is not a fragment kind" );
+        selected[ value ] = true;
+    }
+    if ( PyErr_Occurred() )
+        throw Py::Exception();
+}
+
+
+
+// The line and the column packed so that the positions keep their order
+static long long
+getPositionKey( INT_TYPE  line, INT_TYPE  column )
+{
+    return ( (long long)line << 32 ) | ( column & 0xFFFFFFFF );
+}
+
+
+// A range of the absolute positions or of the packed line positions
+struct KeyRange
+{
+    long long   low;
+    long long   high;
+    bool        byLines;
+};
+
+
+static long long
+getBeginKey( const FragmentBase *  fragment, bool  byLines )
+{
+    if ( byLines )
+        return getPositionKey( fragment->beginLine, fragment->beginPos );
+    return fragment->begin;
+}
+
+
+static long long
+getEndKey( const FragmentBase *  fragment, bool  byLines )
+{
+    if ( byLines )
+        return getPositionKey( fragment->endLine, fragment->endPos );
+    return fragment->end;
+}
+
+
+static bool
+overlaps( const FragmentBase *  fragment, const KeyRange &  range )
+{
+    return getBeginKey( fragment, range.byLines ) <= range.high &&
+           getEndKey( fragment, range.byLines ) >= range.low;
+}
+
+
+static FragmentBase *
+getSuiteItem( const Py::List &  suite, const ShiftTree &  tree, int  rank )
+{
+    FragmentBase *      item( getFragment(
+                            PyList_GET_ITEM( suite.ptr(),
+                                             tree.order[ rank ] ) ) );
+    item->sync();
+    return item;
+}
+
+
+// Appends the nested fragments which overlap the range in the pre-order. The
+// suite items which start after the range and the ones before the first item
+// which reaches the range are skipped by the binary searches over the shift
+// tree order.
+static void
+findNested( FragmentBase *  fragment, const KeyRange &  range,
+            std::vector< PyObject * > &  found )
+{
+    ShiftTree *     tree( getShiftTree( fragment ) );
+    if ( tree == NULL )
+        return;
+
+    std::vector< PyObject * >   nested;
+    getNestedObjects( fragment, nested, false, false );
+    for ( size_t  k = 0; k < nested.size(); ++k )
+    {
+        if ( nested[ k ] != NULL )
+        {
+            FragmentBase *  item( getFragment( nested[ k ] ) );
+            item->sync();
+            if ( overlaps( item, range ) )
+                found.push_back( nested[ k ] );
+            continue;
+        }
+
+        Py::List &  suite( *getSuite( fragment ) );
+        int         low( 0 );
+        int         high( tree->order.size() );
+        while ( low < high )
+        {
+            int     middle( ( low + high ) / 2 );
+            if ( getBeginKey( getSuiteItem( suite, *tree, middle ),
+                              range.byLines ) > range.high )
+                high = middle;
+            else
+                low = middle + 1;
+        }
+
+        int         after( low );
+        low = 0;
+        high = after;
+        while ( low < high )
+        {
+            int     middle( ( low + high ) / 2 );
+            if ( getEndKey( getSuiteItem( suite, *tree,
+                                          tree->farthest[ middle ] ),
+                            range.byLines ) >= range.low )
+                high = middle;
+            else
+                low = middle + 1;
+        }
+
+        std::vector< int >  indices;
+        for ( int  rank = low; rank < after; ++rank )
+            if ( getEndKey( getSuiteItem( suite, *tree, rank ),
+                            range.byLines ) >= range.low )
+                indices.push_back( tree->order[ rank ] );
+        std::sort( indices.begin(), indices.end() );
+        for ( size_t  m = 0; m < indices.size(); ++m )
+            found.push_back( PyList_GET_ITEM( suite.ptr(), indices[ m ] ) );
+    }
+}
+
+
+// The deepest of the fragments is the innermost one; the later one in the
+// pre-order wins between the fragments of the same depth
+static void
+findInnermost( PyObject *  object, const KeyRange &  range,
+               std::vector< PyObject * > &  path,
+               std::vector< PyObject * > &  innermost )
+{
+    std::vector< PyObject * >   found;
+
+    path.push_back( object );
+    if ( path.size() >= innermost.size() )
+        innermost = path;
+
+    findNested( getFragment( object ), range, found );
+    for ( size_t  k = 0; k < found.size(); ++k )
+        findInnermost( found[ k ], range, path, innermost );
+    path.pop_back();
+}
+
+
+static Py::List
+getChain( ControlFlow *  flow, const KeyRange &  range )
+{
+    Py::List                    chain;
+    std::vector< PyObject * >   path;
+    std::vector< PyObject * >   innermost;
+
+    if ( ! overlaps( flow, range ) )
+        return chain;
+
+    findInnermost( flow->selfPtr(), range, path, innermost );
+    for ( size_t  k = innermost.size(); k > 0; --k )
+        chain.append( Py::Object( innermost[ k - 1 ] ) );
+    return chain;
+}
+
+
+Py::List  getChainAtOffset( ControlFlow *  flow, INT_TYPE  offset )
+{
+    KeyRange        range = { offset, offset, false };
+    return getChain( flow, range );
+}
+
+
+Py::List  getChainAt( ControlFlow *  flow, INT_TYPE  line, INT_TYPE  column )
+{
+    long long       key( getPositionKey( line, column ) );
+    KeyRange        range = { key, key, true };
+    return getChain( flow, range );
+}
+
+
+static void
+appendInRange( PyObject *  object, int  depth, const KeyRange &  range,
+               const KindFilter &  filter, Py::List &  result )
+{
+    FragmentBase *              fragment( getFragment( object ) );
+    std::vector< PyObject * >   found;
+
+    if ( filter.matches( fragment->kind ) )
+        result.append( Py::TupleN( Py::Object( object ),
+                                   PYTHON_INT_TYPE( depth ) ) );
+
+    findNested( fragment, range, found );
+    for ( size_t  k = 0; k < found.size(); ++k )
+        appendInRange( found[ k ], depth + 1, range, filter, result );
+}
+
+
+Py::List  getInLineRange( ControlFlow *  flow, INT_TYPE  first, INT_TYPE  last,
+                          const KindFilter &  filter )
+{
+    KeyRange        range = { getPositionKey( first, 0 ),
+                              getPositionKey( last, 0xFFFFFFFF ), true };
+    Py::List        result;
+
+    if ( overlaps( flow, range ) )
+        appendInRange( flow->selfPtr(), 0, range, filter, result );
+    return result;
+}
+
+
+
+// The lazy suites are walked so all the definitions are found. The names are
+// the same as __qualname__ at run time, i.e. the definitions in a function
+// body are under '<locals>'.
+DefinitionIndex::DefinitionIndex( ControlFlow *  flow )
+{
+    add( flow, "" );
+}
+
+
+void  DefinitionIndex::add( FragmentBase *  fragment,
+                            const std::string &  prefix )
+{
+    std::vector< PyObject * >   nested;
+
+    getNestedObjects( fragment, nested, true );
+    for ( size_t  k = 0; k < nested.size(); ++k )
+    {
+        FragmentBase *  item( getFragment( nested[ k ] ) );
+        PyObject *      name( NULL );
+
+        if ( item->kind == FUNCTION_FRAGMENT )
+            name = static_cast< Function * >( item )->name.ptr();
+        else if ( item->kind == CLASS_FRAGMENT )
+            name = static_cast< Class * >( item )->name.ptr();
+
+        FragmentBase *  nameFragment( name == NULL ? NULL
+                                                   : getFragment( name ) );
+        if ( nameFragment == NULL )
+        {
+            // Not a definition or a definition without a name yet
+            add( item, prefix );
+            continue;
+        }
+
+        std::string     qualifiedName( prefix +
+                                       nameFragment->getContent( NULL ) );
+
+        byName[ qualifiedName ] = definitions.size();
+        definitions.push_back( std::make_pair( qualifiedName,
+                                               Py::Object( nested[ k ] ) ) );
+        if ( item->kind == FUNCTION_FRAGMENT )
+            add( item, qualifiedName + ".<locals>." );
+        else
+            add( item, qualifiedName + "." );
+    }
+}
+
+
+Py::Object  DefinitionIndex::find( const std::string &  name ) const
+{
+    std::unordered_map< std::string, size_t >::const_iterator
+                                                found( byName.find( name ) );
+    if ( found == byName.end() )
+        return Py::None();
+    return definitions[ found->second ].second;
+}
+
+
+Py::List  DefinitionIndex::getDefinitions( void ) const
+{
+    Py::List        result;
+
+    for ( size_t  k = 0; k < definitions.size(); ++k )
+        result.append( Py::TupleN( Py::String( definitions[ k ].first ),
+                                   definitions[ k ].second ) );
+    return result;
+}
+
+
+
+FragmentIterator::FragmentIterator( ControlFlow *  flow,
+                                    const KindFilter &  kindFilter,
+                                    bool  post ) :
+    filter( kindFilter ), postOrder( post )
+{
+    Pending         root;
+
+    root.object = Py::Object( flow->selfPtr() );
+    root.expanded = false;
+    pending.push_back( root );
+}
+
+
+FragmentIterator::~FragmentIterator()
+{}
+
+
+void FragmentIterator::initType( void )
+{
+    behaviors().name( "FragmentIterator" );
+    behaviors().doc( FRAGMENT_ITERATOR_DOC );
+    behaviors().supportIter();
+
+    behaviors().readyType();
+}
+
+
+Py::Object  FragmentIterator::iter( void )
+{
+    return Py::Object( this );
+}
+
+
+// A fragment is provided when it is reached in the pre-order and when it is
+// reached the second time, after its nested fragments, in the post-order
+PyObject *  FragmentIterator::iternext( void )
+{
+    while ( ! pending.empty() )
+    {
+        Pending             current( pending.back() );
+        FragmentBase *      fragment( getFragment( current.object.ptr() ) );
+
+        pending.pop_back();
+        if ( ! current.expanded )
+        {
+            std::vector< PyObject * >   nested;
+
+            getNestedObjects( fragment, nested, true );
+            if ( postOrder )
+            {
+                current.expanded = true;
+                pending.push_back( current );
+            }
+            for ( size_t  k = nested.size(); k > 0; --k )
+            {
+                Pending     item;
+                item.object = Py::Object( nested[ k - 1 ] );
+                item.expanded = false;
+                pending.push_back( item );
+            }
+            if ( postOrder )
+                continue;
+        }
+
+        if ( filter.matches( fragment->kind ) )
+            return Py::new_reference_to( current.object );
+    }
+    return NULL;    // The end of the iteration
+}
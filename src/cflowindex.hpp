@@ -0,0 +1,123 @@
+/*
+ * codimension - graphics python two-way code editor and analyzer
+ * Copyright (C) 2014 - 2016  Sergey Satskiy <sergey.satskiy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Indices and traversal of the control flow fragments
+ */
+
+#ifndef CFLOWINDEX_HPP
+#define CFLOWINDEX_HPP
+
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "CXX/Objects.hxx"
+
+#include "cflowfragments.hpp"
+
+
+// The fragment kinds a query is limited to; all of them by default
+class KindFilter
+{
+    public:
+        KindFilter() : all( true )
+        {}
+
+        // None or an iterable of the *_FRAGMENT kinds
+        void  set( const Py::Object &  kinds, const char *  funcName );
+
+        bool  matches( INT_TYPE  kind ) const
+        { return all || ( kind >= 0 && size_t( kind ) < selected.size() &&
+                          selected[ kind ] ); }
+
+    private:
+        bool                    all;
+        std::vector< bool >     selected;   // By kind
+};
+
+
+// The innermost fragment which covers the position followed by the
+// fragments it is nested in; empty if there are none. The fragments are
+// found by the shift trees from the control flow down, so only the suites
+// around the position are walked.
+Py::List  getChainAtOffset( ControlFlow *  flow, INT_TYPE  offset );
+Py::List  getChainAt( ControlFlow *  flow, INT_TYPE  line, INT_TYPE  column );
+
+// The (fragment, depth) tuples in the pre-order for the fragments which
+// overlap the lines; the depth is 0 for the control flow
+Py::List  getInLineRange( ControlFlow *  flow, INT_TYPE  first, INT_TYPE  last,
+                          const KindFilter &  filter );
+
+
+// The functions and the classes by their dotted qualified names, e.g.
+// 'Outer.Inner.method' or 'f.<locals>.g' as in __qualname__. The statements
+// which are not definitions do not add to the names.
+class DefinitionIndex
+{
+    public:
+        DefinitionIndex( ControlFlow *  flow );
+
+        // None if there is no such definition; the last one if the name is
+        // defined more than once
+        Py::Object  find( const std::string &  name ) const;
+
+        // The (qualified name, fragment) tuples in the source order
+        Py::List    getDefinitions( void ) const;
+
+    private:
+        std::vector< std::pair< std::string, Py::Object > >  definitions;
+        std::unordered_map< std::string, size_t >           byName;
+
+        void  add( FragmentBase *  fragment, const std::string &  prefix );
+};
+
+
+// Walks a control flow in the pre-order or in the post-order and provides the
+// fragments of the given kinds. The nested fragments of a fragment are taken
+// when it is reached, so the lazy suites are walked only as far as the
+// iteration goes.
+class FragmentIterator : public Py::PythonExtension< FragmentIterator >
+{
+    public:
+        FragmentIterator( ControlFlow *  flow, const KindFilter &  filter,
+                          bool  postOrder );
+        virtual ~FragmentIterator();
+
+        static void initType( void );
+
+        Py::Object  iter( void );
+        PyObject *  iternext( void );
+
+    private:
+        struct Pending
+        {
+            Py::Object      object;
+            bool            expanded;   // The nested ones are pending too
+        };
+
+        std::vector< Pending >  pending;
+        KindFilter              filter;
+        bool                    postOrder;
+
+        FragmentIterator( const FragmentIterator & );
+        FragmentIterator &  operator=( const FragmentIterator & );
+};
+
+
+#endif
+
@@ -18,7 +18,15 @@
  * Python extension module
  */
 
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <map>
+#include <unordered_map>
+
 #include "cflowparser.hpp"
+#include "cflowutils.hpp"
+#include "cflowasync.hpp"
 
 #include "cflowversion.hpp"
 #include "cflowdocs.hpp"
@@ -26,95 +34,23 @@
 #include "cflowfragments.hpp"
 
 #include "cflowmodule.hpp"
+#include "cflowdiff.hpp"
+#include "cflowindex.hpp"
 
 
 
-CDMControlFlowModule::CDMControlFlowModule() :
-    Py::ExtensionModule< CDMControlFlowModule >( "cdmcfparser" )
-{
-    Fragment::initType();
-    BangLine::initType();
-    EncodingLine::initType();
-    Comment::initType();
-    CMLComment::initType();
-    Docstring::initType();
-    Decorator::initType();
-    CodeBlock::initType();
-
-    Annotation::initType();
-    Argument::initType();
-    Function::initType();
-    Class::initType();
-    Break::initType();
-    Continue::initType();
-    Return::initType();
-    Raise::initType();
-    Assert::initType();
-    SysExit::initType();
-    While::initType();
-    For::initType();
-    Import::initType();
-    ElifPart::initType();
-    If::initType();
-    With::initType();
-    ExceptPart::initType();
-    Try::initType();
-    ControlFlow::initType();
-
-    // Free functions visible from the module
-    add_varargs_method( "getControlFlowFromMemory",
-                        &CDMControlFlowModule::getControlFlowFromMemory,
-                        GET_CF_MEMORY_DOC );
-    add_varargs_method( "getControlFlowFromFile",
-                        &CDMControlFlowModule::getControlFlowFromFile,
-                        GET_CF_FILE_DOC );
-
-
-    initialize( MODULE_DOC );
-
-    // Constants visible from the module
-    Py::Dict        d( moduleDictionary() );
-    d[ "VERSION" ]                  = Py::String( CDM_CF_PARSER_VERSION );
-    d[ "CML_VERSION" ]              = Py::String( CML_VERSION_AS_STRING );
-
-    d[ "UNDEFINED_FRAGMENT" ]       = Py::Int( UNDEFINED_FRAGMENT );
-    d[ "FRAGMENT" ]                 = Py::Int( FRAGMENT );
-    d[ "BANG_LINE_FRAGMENT" ]       = Py::Int( BANG_LINE_FRAGMENT );
-    d[ "ENCODING_LINE_FRAGMENT" ]   = Py::Int( ENCODING_LINE_FRAGMENT );
-    d[ "COMMENT_FRAGMENT" ]         = Py::Int( COMMENT_FRAGMENT );
-    d[ "DOCSTRING_FRAGMENT" ]       = Py::Int( DOCSTRING_FRAGMENT );
-    d[ "DECORATOR_FRAGMENT" ]       = Py::Int( DECORATOR_FRAGMENT );
-    d[ "CODEBLOCK_FRAGMENT" ]       = Py::Int( CODEBLOCK_FRAGMENT );
-    d[ "ANNOTATION_FRAGMENT" ]      = Py::Int( ANNOTATION_FRAGMENT );
-    d[ "ARGUMENT_FRAGMENT" ]        = Py::Int( ARGUMENT_FRAGMENT );
-    d[ "FUNCTION_FRAGMENT" ]        = Py::Int( FUNCTION_FRAGMENT );
-    d[ "CLASS_FRAGMENT" ]           = Py::Int( CLASS_FRAGMENT );
-    d[ "BREAK_FRAGMENT" ]           = Py::Int( BREAK_FRAGMENT );
-    d[ "CONTINUE_FRAGMENT" ]        = Py::Int( CONTINUE_FRAGMENT );
-    d[ "RETURN_FRAGMENT" ]          = Py::Int( RETURN_FRAGMENT );
-    d[ "RAISE_FRAGMENT" ]           = Py::Int( RAISE_FRAGMENT );
-    d[ "ASSERT_FRAGMENT" ]          = Py::Int( ASSERT_FRAGMENT );
-    d[ "SYSEXIT_FRAGMENT" ]         = Py::Int( SYSEXIT_FRAGMENT );
-    d[ "WHILE_FRAGMENT" ]           = Py::Int( WHILE_FRAGMENT );
-    d[ "FOR_FRAGMENT" ]             = Py::Int( FOR_FRAGMENT );
-    d[ "IMPORT_FRAGMENT" ]          = Py::Int( IMPORT_FRAGMENT );
-    d[ "ELIF_PART_FRAGMENT" ]       = Py::Int( ELIF_PART_FRAGMENT );
-    d[ "IF_FRAGMENT" ]              = Py::Int( IF_FRAGMENT );
-    d[ "WITH_FRAGMENT" ]            = Py::Int( WITH_FRAGMENT );
-    d[ "EXCEPT_PART_FRAGMENT" ]     = Py::Int( EXCEPT_PART_FRAGMENT );
-    d[ "TRY_FRAGMENT" ]             = Py::Int( TRY_FRAGMENT );
-    d[ "CML_COMMENT_FRAGMENT" ]     = Py::Int( CML_COMMENT_FRAGMENT );
-    d[ "CONTROL_FLOW_FRAGMENT" ]    = Py::Int( CONTROL_FLOW_FRAGMENT );
-
-}
-
-
-CDMControlFlowModule::~CDMControlFlowModule()
-{}
+typedef Py::Object (*ParseFunction)( const char *  buffer,
+                                     const char *  fileName,
+                                     bool  serialize,
+                                     ParseControl *  control,
+                                     const ParseOptions *  options );
 
 
-Py::Object
-CDMControlFlowModule::getControlFlowFromMemory( const Py::Tuple &  args )
+static Py::Object
+getControlFlowFromMemoryArgs( const Py::Tuple &  args,
+                              const Py::Dict &  keywords,
+                              const char *  funcName,
+                              ParseFunction  parse )
 {
     // One or two arguments are expected:
     // - string with the python code - mandatory
@@ -132,16 +68,21 @@ CDMControlFlowModule::getControlFlowFromMemory( const Py::Tuple &  args )
         throw Py::TypeError( "Unexpected first argument type. "
                              "Expected a string: python code buffer" );
 
-    bool            makeCopy( true );
+    ParseControl    control;
+    ParseControl *  parseControl = NULL;
+    ParseOptions    options;
+    if ( getParseControl( keywords, funcName, control, options ) )
+        parseControl = & control;
+
     if ( args.length() > 1 )
     {
         Py::Object      serialize( args[ 1 ] );
         if ( ! serialize.isBoolean() )
             throw Py::TypeError( "Unexpected second argument type. "
                                  "Expected a boolean: serialize control flow or not" );
-        makeCopy = serialize.isTrue();
+        options.serialize = serialize.isTrue();
     }
-
+    bool            makeCopy( options.serialize );
 
     Py::String      code( pythonCode );
     size_t          codeSize( code.size() );
@@ -166,14 +107,158 @@ CDMControlFlowModule::getControlFlowFromMemory( const Py::Tuple &  args )
     {
         char *      contentCopy = new char[ content.size() + 1 ];
         strncpy( contentCopy, content.c_str(), content.size() + 1 );
-        return parseInput( contentCopy, "dummy.py", true );
+        return parse( contentCopy, "dummy.py", true, parseControl,
+                      & options );
+    }
+    return parse( content.c_str(), "dummy.py", false, parseControl,
+                  & options );
+}
+
+
+Py::Object
+getControlFlowFromMemory( const Py::Tuple &  args, const Py::Dict &  keywords )
+{
+    return getControlFlowFromMemoryArgs( args, keywords,
+                                         "getControlFlowFromMemory",
+                                         parseInput );
+}
+
+
+// Delivers the visitor events to a python callable. Only an explicit False
+// returned by the callable stops the walk.
+static int
+callPythonVisitor( const CFVisitEvent *  event, void *  data )
+{
+    Py::Callable    callback( static_cast< PyObject * >( data ) );
+    Py::Tuple       args( 9 );
+
+    args[ 0 ] = Py::Int( event->event );
+    args[ 1 ] = Py::Int( event->kind );
+    args[ 2 ] = event->name == NULL ? Py::None() : Py::String( event->name );
+    args[ 3 ] = Py::Long( event->begin );
+    args[ 4 ] = Py::Long( event->end );
+    args[ 5 ] = Py::Long( event->beginLine );
+    args[ 6 ] = Py::Long( event->beginPos );
+    args[ 7 ] = Py::Long( event->endLine );
+    args[ 8 ] = Py::Long( event->endPos );
+
+    return callback.apply( args ).ptr() != Py_False;
+}
+
+
+Py::Object
+visitControlFlow( const Py::Tuple &  args, const Py::Dict &  keywords )
+{
+    if ( args.length() != 2 || keywords.length() != 0 )
+        throw Py::TypeError( "visitControlFlow() takes exactly two arguments "
+                             "(python code buffer, callback)" );
+    if ( ! args[ 0 ].isString() )
+        throw Py::TypeError( "Unexpected first argument type. "
+                             "Expected a string: python code buffer" );
+
+    Py::Object      callback( args[ 1 ] );
+    bool            native( PyCapsule_IsValid( callback.ptr(),
+                                               VISIT_CALLBACK_CAPSULE ) );
+    if ( ! native && ! callback.isCallable() )
+        throw Py::TypeError( "Unexpected second argument type. Expected a "
+                             "callable or a " VISIT_CALLBACK_CAPSULE
+                             " capsule" );
+
+    Py::String      code( args[ 0 ] );
+    if ( code.size() == 0 )
+        return Py::List();
+
+    // The same trailing LFs as getControlFlowFromMemory() adds
+    std::string     content( code.as_std_string( "utf-8" ) + "\n\n" );
+
+    if ( native )
+    {
+        CFVisitCallback     function = reinterpret_cast< CFVisitCallback >(
+                PyCapsule_GetPointer( callback.ptr(), VISIT_CALLBACK_CAPSULE ) );
+        return visitInput( content.c_str(), function,
+                           PyCapsule_GetContext( callback.ptr() ), true );
     }
-    return parseInput( content.c_str(), "dummy.py", false );
+    return visitInput( content.c_str(), callPythonVisitor, callback.ptr(),
+                       false );
 }
 
 
 Py::Object
-CDMControlFlowModule::getControlFlowFromFile( const Py::Tuple &  args )
+iterControlFlow( const Py::Tuple &  args, const Py::Dict &  keywords )
+{
+    if ( args.length() != 1 || keywords.length() != 0 )
+        throw Py::TypeError( "iterControlFlow() takes exactly one argument "
+                             "(python code buffer)" );
+    if ( ! args[ 0 ].isString() )
+        throw Py::TypeError( "Unexpected first argument type. "
+                             "Expected a string: python code buffer" );
+
+    // The same trailing LFs as getControlFlowFromMemory() adds
+    Py::String      code( args[ 0 ] );
+    char *          buffer = NULL;
+    if ( code.size() > 0 )
+    {
+        std::string     content( code.as_std_string( "utf-8" ) + "\n\n" );
+
+        buffer = new char[ content.size() + 1 ];
+        memcpy( buffer, content.c_str(), content.size() + 1 );
+    }
+    return Py::asObject( new ControlFlowIterator( buffer ) );
+}
+
+
+Py::Object
+scanControlFlow( const Py::Tuple &  args, const Py::Dict &  keywords )
+{
+    if ( args.length() != 1 || keywords.length() != 0 )
+        throw Py::TypeError( "scanControlFlow() takes exactly one argument "
+                             "(python code buffer)" );
+    if ( ! args[ 0 ].isString() )
+        throw Py::TypeError( "Unexpected first argument type. "
+                             "Expected a string: python code buffer" );
+
+    // No trailing LFs are needed: the positions are the same as the
+    // getControlFlowFromMemory() ones anyway
+    Py::String      code( args[ 0 ] );
+    std::string     content( code.as_std_string( "utf-8" ) );
+    char *          buffer = new char[ content.size() + 1 ];
+
+    memcpy( buffer, content.c_str(), content.size() + 1 );
+    return scanInput( buffer );
+}
+
+
+Py::Object
+diffControlFlows( const Py::Tuple &  args, const Py::Dict &  keywords )
+{
+    if ( args.length() != 2 || keywords.length() != 0 )
+        throw Py::TypeError( "diffControlFlows() takes exactly two arguments "
+                             "(old control flow, new control flow)" );
+    for ( int  k = 0; k < 2; ++k )
+        if ( ! isInstance< ControlFlow >( args[ k ].ptr() ) )
+            throw Py::TypeError( "Unexpected argument type. "
+                                 "Expected a control flow" );
+
+    return getControlFlowDiff(
+                static_cast< ControlFlow * >( args[ 0 ].ptr() ),
+                static_cast< ControlFlow * >( args[ 1 ].ptr() ) );
+}
+
+
+#ifdef CDM_CF_PGEN_AVAILABLE
+Py::Object
+getControlFlowFromMemoryPgen( const Py::Tuple &  args,
+                              const Py::Dict &  keywords )
+{
+    return getControlFlowFromMemoryArgs( args, keywords,
+                                         "getControlFlowFromMemoryPgen",
+                                         parseInputPgen );
+}
+#endif
+
+
+Py::Object
+getControlFlowFromFile( const Py::Tuple &  args, const Py::Dict &  keywords )
 {
     // One parameter is expected: python file name
     if ( args.length() != 1 )
@@ -194,41 +279,42 @@ CDMControlFlowModule::getControlFlowFromFile( const Py::Tuple &  args )
     if ( fileName.empty() )
         throw Py::RuntimeError( "Invalid argument: file name is empty" );
 
-    // Read the whole file
-    char *  buffer = NULL;
-    FILE *  f;
-    f = fopen( fileName.c_str(), "r" );
-    if ( f == NULL )
-        throw Py::RuntimeError( "Cannot open file " + fileName );
-
-    struct stat     st;
-    stat( fileName.c_str(), &st );
+    ParseControl    control;
+    ParseControl *  parseControl = NULL;
+    ParseOptions    options;
+    if ( getParseControl( keywords, "getControlFlowFromFile", control,
+                          options ) )
+        parseControl = & control;
 
+    // Read the whole file.
     // By some reasons the python parser is very sensitive to the end of the
     // file. It needs a complete empty line at the end of the content with
     // trailing LF. It is specifically important for trailing comments for a
     // scope. Weird, but there is a simple solution: add two LF at the end of
     // the content unconditionally. It will not harm anyway.
-    if ( st.st_size > 0 )
+    char *          buffer;
+    size_t          size;
+    std::string     error;
     {
-        buffer = new char[ st.st_size + 3 ];
-
-        int             elem = fread( buffer, st.st_size, 1, f );
+        ReleasedGIL     noGIL;
+        buffer = readFileContent( fileName, size, error );
+    }
+    if ( buffer == NULL )
+        throw Py::RuntimeError( error );
 
-        fclose( f );
-        if ( elem != 1 ) {
-            delete [] buffer;
-            throw Py::RuntimeError( "Cannot read file " + fileName );
-        }
+    if ( size > 0 )
+    {
+        if ( options.serialize )
+            return parseInput( buffer, fileName.c_str(), true, parseControl,
+                               & options );
 
-        buffer[ st.st_size ] = '\n';
-        buffer[ st.st_size + 1 ] = '\n';
-        buffer[ st.st_size + 2 ] = '\0';
-        return parseInput( buffer, fileName.c_str(), true );
+        std::unique_ptr< char[] >   owner( buffer );  // Freed when parsed
+        return parseInput( buffer, fileName.c_str(), false, parseControl,
+                           & options );
     }
 
     // File size is zero
-    fclose( f );
+    delete [] buffer;
 
     ControlFlow *   controlFlow = new ControlFlow();
     return Py::asObject( controlFlow );
@@ -237,32 +323,795 @@ CDMControlFlowModule::getControlFlowFromFile( const Py::Tuple &  args )
 
 
 
-static CDMControlFlowModule *  CDMControlFlow;
+// The optional event loop argument of the asynchronous functions
+static Py::Object
+getLoopArgument( const Py::Tuple &  args, const char *  funcName,
+                 const char *  firstArgument )
+{
+    if ( args.length() < 1 || args.length() > 2 )
+    {
+        char    buf[ 32 ];
+        sprintf( buf, "%ld", args.length() );
+        throw Py::TypeError( std::string( funcName ) + "() takes 1 or 2 "
+                             "arguments (" + std::string( buf ) + " given)" );
+    }
+
+    if ( ! args[ 0 ].isString() )
+        throw Py::TypeError( "Unexpected first argument type. "
+                             "Expected a string: " +
+                             std::string( firstArgument ) );
+
+    if ( args.length() > 1 )
+        return args[ 1 ];
+    return Py::None();
+}
+
 
-#if PY_MAJOR_VERSION == 2
-extern "C" void initcdmcf()
+Py::Object
+parseMemoryAsync( WorkerPool &  pool, const Py::Tuple &  args,
+                  const Py::Dict &  keywords )
 {
-    CDMControlFlow = new CDMControlFlowModule;
+    Py::Object      loop( getLoopArgument( args, "parseMemoryAsync",
+                                           "python code buffer" ) );
+    Py::String      code( args[ 0 ] );
+
+    // The same trailing LFs as getControlFlowFromMemory() adds
+    char *          buffer = NULL;
+    if ( code.size() > 0 )
+    {
+        std::string     content( code.as_std_string( "utf-8" ) + "\n\n" );
+
+        buffer = new char[ content.size() + 1 ];
+        memcpy( buffer, content.c_str(), content.size() + 1 );
+    }
+
+    std::shared_ptr< ParseJob >     job( std::make_shared< ParseJob >( buffer ) );
+    setupParseJob( keywords, "parseMemoryAsync", *job );
+    return startParseJob( pool, job, loop );
 }
 
-// symbol required for the debug version
-extern "C" void initcdmcf_d()
+
+Py::Object
+parseFileAsync( WorkerPool &  pool, const Py::Tuple &  args,
+                const Py::Dict &  keywords )
 {
-    initcdmcf();
+    Py::Object      loop( getLoopArgument( args, "parseFileAsync",
+                                           "python file name" ) );
+    std::string     fileName( Py::String( args[ 0 ] ).as_std_string( "utf-8" ) );
+    if ( fileName.empty() )
+        throw Py::RuntimeError( "Invalid argument: file name is empty" );
+
+    std::shared_ptr< ParseJob >     job( std::make_shared< ParseJob >( fileName ) );
+    setupParseJob( keywords, "parseFileAsync", *job );
+    return startParseJob( pool, job, loop );
 }
-#else
-extern "C" PyObject *  PyInit_cdmcfparser()
+
+
+Py::Object
+createCancelToken( const Py::Tuple &  args, const Py::Dict &  keywords )
 {
-    CDMControlFlow = new CDMControlFlowModule;
-    return CDMControlFlow->module().ptr();
+    if ( args.length() != 0 || keywords.length() != 0 )
+        throw Py::TypeError( "createCancelToken() takes no arguments" );
+    return Py::asObject( new CancelToken() );
 }
 
-// symbol required for the debug version
-extern "C" PyObject *  PyInit_cdmcfparser_d()
+
+
+// Takes a non negative integer or None for the default
+static long long
+getTuningArgument( const Py::Object &  value )
 {
-    return PyInit_cdmcfparser();
+    if ( value.isNone() )
+        return -1;
+    if ( ! PyLong_Check( value.ptr() ) || value.isBoolean() ||
+         long( Py::Long( value ) ) < 0 )
+        throw Py::TypeError( "_setParseTuning() arguments must be non "
+                             "negative integers or None" );
+    return long( Py::Long( value ) );
+}
+
+
+Py::Object
+setParseTuningArgs( const Py::Tuple &  args, const Py::Dict &  keywords )
+{
+    if ( args.length() != 3 || keywords.length() != 0 )
+        throw Py::TypeError( "_setParseTuning() takes exactly 3 arguments "
+                             "(pipeline threshold, parallel threshold, "
+                             "workers)" );
+    setParseTuning( getTuningArgument( args[ 0 ] ),
+                    getTuningArgument( args[ 1 ] ),
+                    getTuningArgument( args[ 2 ] ) );
+    return Py::None();
+}
+
+
+Py::Object
+pauseParsingArgs( WorkerPool &  pool, const Py::Tuple &  args,
+                  const Py::Dict &  keywords )
+{
+    if ( args.length() != 1 || keywords.length() != 0 ||
+         ! args[ 0 ].isBoolean() )
+        throw Py::TypeError( "_pauseParsing() takes exactly 1 boolean "
+                             "argument" );
+    pool.pause( args[ 0 ].isTrue() );
+    return Py::None();
+}
+
+
+namespace Py
+{
+    // Registers the PyCXX C++ exceptions for the python ones. PyCXX calls it
+    // for its own extension modules only.
+    void initExceptions();
+}
+
+
+// The module objects create the instances of the PyCXX classes with their
+// own heap types, so the interpreters do not share any python object. The
+// PyCXX static types are set up once per process and provide the slots and
+// the layout of the heap types.
+#define EXTENSION_TYPE_COUNT    31
+
+static PyTypeObject *       staticTypes[ EXTENSION_TYPE_COUNT ];
+static std::string          heapTypeNames[ EXTENSION_TYPE_COUNT ];
+static int                  staticTypeCount = 0;
+
+static std::unordered_map< PyTypeObject *, int >    staticTypeIndices;
+
+
+// The module state: the worker pool for the asynchronous parsing and the
+// heap types. It is allocated and zeroed by python.
+struct ModuleState
+{
+    WorkerPool *    pool;
+    PyObject *      types[ EXTENSION_TYPE_COUNT ];
+    int64_t         interpreter;
+    bool            registered;
+};
+
+
+// The live module states by the interpreter id. The instances created out
+// of a module function call, e.g. the fragments of a lazy suite or of an
+// asynchronous parse result, get the types of the last module object of
+// the current interpreter.
+static std::mutex                                           statesMutex;
+static std::map< int64_t, std::vector< ModuleState * > >    liveStates;
+static std::atomic< unsigned long >                         statesGeneration( 0 );
+
+// The module object which function the thread runs
+static thread_local ModuleState *   currentState = NULL;
+
+
+static void
+registerState( ModuleState *  state )
+{
+    std::lock_guard< std::mutex >   lock( statesMutex );
+
+    state->interpreter = PyInterpreterState_GetID( PyInterpreterState_Get() );
+    state->registered = true;
+    liveStates[ state->interpreter ].push_back( state );
+    ++statesGeneration;
 }
 
+
+static void
+unregisterState( ModuleState *  state )
+{
+    std::lock_guard< std::mutex >   lock( statesMutex );
+
+    if ( ! state->registered )
+        return;
+
+    std::vector< ModuleState * > &  states( liveStates[ state->interpreter ] );
+    for ( size_t  k = 0; k < states.size(); ++k )
+    {
+        if ( states[ k ] == state )
+        {
+            states.erase( states.begin() + k );
+            break;
+        }
+    }
+    if ( states.empty() )
+        liveStates.erase( state->interpreter );
+    state->registered = false;
+    ++statesGeneration;
+}
+
+
+// Provides the last live module state of the current interpreter. The
+// thread caches it until a module object is created or freed.
+static ModuleState *
+getInterpreterState( void )
+{
+    static thread_local int64_t         cachedInterpreter = -1;
+    static thread_local unsigned long   cachedGeneration = 0;
+    static thread_local ModuleState *   cachedState = NULL;
+
+    int64_t     interpreter( PyInterpreterState_GetID(
+                                            PyInterpreterState_Get() ) );
+    if ( interpreter != cachedInterpreter ||
+         statesGeneration.load() != cachedGeneration )
+    {
+        std::lock_guard< std::mutex >   lock( statesMutex );
+
+        std::map< int64_t, std::vector< ModuleState * > >::const_iterator
+                    found( liveStates.find( interpreter ) );
+        cachedState = found == liveStates.end() ? NULL
+                                                : found->second.back();
+        cachedInterpreter = interpreter;
+        cachedGeneration = statesGeneration.load();
+    }
+    return cachedState;
+}
+
+
+// The PyCXX constructors hook: maps a static type to the heap type of the
+// current module object
+static PyTypeObject *
+getInstanceType( PyTypeObject *  staticType )
+{
+    ModuleState *   state( currentState != NULL ? currentState
+                                                : getInterpreterState() );
+    if ( state == NULL )
+        return staticType;
+
+    std::unordered_map< PyTypeObject *, int >::const_iterator
+                    found( staticTypeIndices.find( staticType ) );
+    if ( found == staticTypeIndices.end() ||
+         state->types[ found->second ] == NULL )
+        return staticType;
+    return reinterpret_cast< PyTypeObject * >(
+                                        state->types[ found->second ] );
+}
+
+
+// Marks the module object which function the thread runs
+class ModuleScope
+{
+    public:
+        explicit ModuleScope( PyObject *  module ) :
+            previous( currentState )
+        {
+            currentState = static_cast< ModuleState * >(
+                                            PyModule_GetState( module ) );
+        }
+
+        ~ModuleScope()
+        {
+            currentState = previous;
+        }
+
+    private:
+        ModuleState *   previous;
+
+        ModuleScope( const ModuleScope & );
+        ModuleScope &  operator=( const ModuleScope & );
+};
+
+
+// The instances of a heap type hold a reference to it
+static void
+releaseType( PyTypeObject *  type )
+{
+    if ( PyType_HasFeature( type, Py_TPFLAGS_HEAPTYPE ) )
+        Py_DECREF( type );
+}
+
+
+template < typename T >
+static void
+deallocExtension( PyObject *  object )
+{
+    PyTypeObject *  type( Py_TYPE( object ) );
+
+    delete static_cast< T * >( object );
+    releaseType( type );
+}
+
+
+// The nested fragments are detached while the derived fragment still has
+// them, see FragmentBase::releaseSubtree()
+template < typename T >
+static void
+deallocFragment( PyObject *  object )
+{
+    PyTypeObject *  type( Py_TYPE( object ) );
+    T *             fragment( static_cast< T * >( object ) );
+
+    fragment->releaseSubtree();
+    delete fragment;
+    releaseType( type );
+}
+
+
+static void
+addStaticType( PyTypeObject *  type )
+{
+    if ( staticTypeCount == EXTENSION_TYPE_COUNT )
+        throw Py::RuntimeError( "Too many extension types" );
+
+    std::string     name( type->tp_name );
+    if ( name.find( '.' ) == std::string::npos )
+        name = "cdmcfparser." + name;
+
+    staticTypes[ staticTypeCount ] = type;
+    heapTypeNames[ staticTypeCount ] = name;
+    staticTypeIndices[ type ] = staticTypeCount;
+    ++staticTypeCount;
+}
+
+
+template < typename T >
+static void
+initExtensionType( void )
+{
+    T::initType();
+    T::type_object()->tp_dealloc = deallocExtension< T >;
+    addStaticType( T::type_object() );
+}
+
+
+template < typename T >
+static void
+initFragmentType( void )
+{
+    T::initType();
+    T::type_object()->tp_dealloc = deallocFragment< T >;
+    addStaticType( T::type_object() );
+}
+
+
+// The static types are process wide PyCXX objects so they are initialized
+// once regardless of how many interpreters import the module
+static void
+initFragmentTypes( void )
+{
+    Py::initExceptions();
+
+    initFragmentType< Fragment >();
+    initFragmentType< BangLine >();
+    initFragmentType< EncodingLine >();
+    initFragmentType< Comment >();
+    initFragmentType< CMLComment >();
+    initFragmentType< Docstring >();
+    initFragmentType< Decorator >();
+    initFragmentType< CodeBlock >();
+
+    initFragmentType< Annotation >();
+    initFragmentType< Argument >();
+    initFragmentType< Function >();
+    initFragmentType< Class >();
+    initFragmentType< Break >();
+    initFragmentType< Continue >();
+    initFragmentType< Return >();
+    initFragmentType< Raise >();
+    initFragmentType< Assert >();
+    initFragmentType< SysExit >();
+    initFragmentType< While >();
+    initFragmentType< For >();
+    initFragmentType< Import >();
+    initFragmentType< ElifPart >();
+    initFragmentType< If >();
+    initFragmentType< With >();
+    initFragmentType< ExceptPart >();
+    initFragmentType< Try >();
+    initFragmentType< ControlFlow >();
+
+    initExtensionType< ControlFlowIterator >();
+    initExtensionType< FragmentIterator >();
+    initExtensionType< ParseRequest >();
+    initExtensionType< CancelToken >();
+
+    Py::extension_instance_type_hook = getInstanceType;
+}
+
+
+// The instances are created by the module functions only
+static PyObject *
+newInstance( PyTypeObject *  type, PyObject *  args, PyObject *  kwds )
+{
+    PyErr_Format( PyExc_TypeError, "cannot create '%s' instances",
+                  type->tp_name );
+    return NULL;
+}
+
+
+// Creates the module object heap type of a static type
+static PyObject *
+createHeapType( PyObject *  module, int  index )
+{
+    PyTypeObject *              source( staticTypes[ index ] );
+    std::vector< PyType_Slot >  slots;
+
+    #define CDM_CF_TYPE_SLOT( slot, field )                         \
+        if ( source->field != NULL )                                \
+        {                                                           \
+            PyType_Slot     item = { slot, (void *)source->field }; \
+            slots.push_back( item );                                \
+        }
+
+    CDM_CF_TYPE_SLOT( Py_tp_dealloc, tp_dealloc );
+    CDM_CF_TYPE_SLOT( Py_tp_getattr, tp_getattr );
+    CDM_CF_TYPE_SLOT( Py_tp_repr, tp_repr );
+    CDM_CF_TYPE_SLOT( Py_tp_iter, tp_iter );
+    CDM_CF_TYPE_SLOT( Py_tp_iternext, tp_iternext );
+    CDM_CF_TYPE_SLOT( Py_tp_doc, tp_doc );
+
+    #undef CDM_CF_TYPE_SLOT
+
+    PyType_Slot     newSlot = { Py_tp_new, (void *)newInstance };
+    PyType_Slot     lastSlot = { 0, NULL };
+    slots.push_back( newSlot );
+    slots.push_back( lastSlot );
+
+    // python keeps the name pointer in the type object
+    PyType_Spec     spec = { heapTypeNames[ index ].c_str(),
+                             static_cast< int >( source->tp_basicsize ),
+                             0, Py_TPFLAGS_DEFAULT, &slots[ 0 ] };
+    return PyType_FromModuleAndSpec( module, &spec, NULL );
+}
+
+
+static void
+clearTypes( ModuleState *  state )
+{
+    for ( int  k = 0; k < EXTENSION_TYPE_COUNT; ++k )
+        Py_CLEAR( state->types[ k ] );
+}
+
+
+typedef Py::Object (*ModuleFunction)( const Py::Tuple &  args,
+                                      const Py::Dict &  keywords );
+
+
+// Calls a module function and converts the C++ exceptions into a python error
+static PyObject *
+callModuleFunction( ModuleFunction  function, PyObject *  module,
+                    PyObject *  args, PyObject *  kwds )
+{
+    ModuleScope     scope( module );
+    try
+    {
+        Py::Tuple       arguments( args );
+        Py::Dict        keywords;
+        if ( kwds != NULL )
+            keywords = Py::Dict( kwds );
+        return Py::new_reference_to( function( arguments, keywords ) );
+    }
+    catch ( Py::BaseException & )
+    {
+        return NULL;
+    }
+}
+
+
+static PyObject *
+pyGetControlFlowFromMemory( PyObject *  module, PyObject *  args,
+                            PyObject *  kwds )
+{
+    return callModuleFunction( getControlFlowFromMemory, module, args, kwds );
+}
+
+
+static PyObject *
+pyGetControlFlowFromFile( PyObject *  module, PyObject *  args,
+                          PyObject *  kwds )
+{
+    return callModuleFunction( getControlFlowFromFile, module, args, kwds );
+}
+
+
+static PyObject *
+pyVisitControlFlow( PyObject *  module, PyObject *  args, PyObject *  kwds )
+{
+    return callModuleFunction( visitControlFlow, module, args, kwds );
+}
+
+
+static PyObject *
+pyIterControlFlow( PyObject *  module, PyObject *  args, PyObject *  kwds )
+{
+    return callModuleFunction( iterControlFlow, module, args, kwds );
+}
+
+
+static PyObject *
+pyScanControlFlow( PyObject *  module, PyObject *  args, PyObject *  kwds )
+{
+    return callModuleFunction( scanControlFlow, module, args, kwds );
+}
+
+
+static PyObject *
+pyDiffControlFlows( PyObject *  module, PyObject *  args, PyObject *  kwds )
+{
+    return callModuleFunction( diffControlFlows, module, args, kwds );
+}
+
+
+static PyObject *
+pyCreateCancelToken( PyObject *  module, PyObject *  args, PyObject *  kwds )
+{
+    return callModuleFunction( createCancelToken, module, args, kwds );
+}
+
+
+typedef Py::Object (*PoolFunction)( WorkerPool &  pool,
+                                    const Py::Tuple &  args,
+                                    const Py::Dict &  keywords );
+
+
+// The same as callModuleFunction() for the functions which need the pool
+static PyObject *
+callPoolFunction( PoolFunction  function, PyObject *  module, PyObject *  args,
+                  PyObject *  kwds )
+{
+    ModuleState *   state = static_cast< ModuleState * >(
+                                            PyModule_GetState( module ) );
+    ModuleScope     scope( module );
+    try
+    {
+        Py::Tuple       arguments( args );
+        Py::Dict        keywords;
+        if ( kwds != NULL )
+            keywords = Py::Dict( kwds );
+        return Py::new_reference_to( function( *state->pool, arguments,
+                                               keywords ) );
+    }
+    catch ( Py::BaseException & )
+    {
+        return NULL;
+    }
+}
+
+
+static PyObject *
+pyParseMemoryAsync( PyObject *  module, PyObject *  args, PyObject *  kwds )
+{
+    return callPoolFunction( parseMemoryAsync, module, args, kwds );
+}
+
+
+static PyObject *
+pyParseFileAsync( PyObject *  module, PyObject *  args, PyObject *  kwds )
+{
+    return callPoolFunction( parseFileAsync, module, args, kwds );
+}
+
+
+static PyObject *
+pyPauseParsing( PyObject *  module, PyObject *  args, PyObject *  kwds )
+{
+    return callPoolFunction( pauseParsingArgs, module, args, kwds );
+}
+
+
+static PyObject *
+pySetParseTuning( PyObject *  module, PyObject *  args, PyObject *  kwds )
+{
+    return callModuleFunction( setParseTuningArgs, module, args, kwds );
+}
+
+
+#ifdef CDM_CF_PGEN_AVAILABLE
+static PyObject *
+pyGetControlFlowFromMemoryPgen( PyObject *  module, PyObject *  args,
+                                PyObject *  kwds )
+{
+    return callModuleFunction( getControlFlowFromMemoryPgen, module, args, kwds );
+}
 #endif
 
 
+// Free functions visible from the module
+static PyMethodDef  moduleMethods[] =
+{
+    { "getControlFlowFromMemory", (PyCFunction)(void(*)(void))
+      pyGetControlFlowFromMemory, METH_VARARGS | METH_KEYWORDS,
+      GET_CF_MEMORY_DOC },
+    { "getControlFlowFromFile", (PyCFunction)(void(*)(void))
+      pyGetControlFlowFromFile, METH_VARARGS | METH_KEYWORDS,
+      GET_CF_FILE_DOC },
+    { "visitControlFlow", (PyCFunction)(void(*)(void))
+      pyVisitControlFlow, METH_VARARGS | METH_KEYWORDS,
+      VISIT_CF_DOC },
+    { "iterControlFlow", (PyCFunction)(void(*)(void))
+      pyIterControlFlow, METH_VARARGS | METH_KEYWORDS,
+      ITER_CF_DOC },
+    { "scanControlFlow", (PyCFunction)(void(*)(void))
+      pyScanControlFlow, METH_VARARGS | METH_KEYWORDS,
+      SCAN_CF_DOC },
+    { "diffControlFlows", (PyCFunction)(void(*)(void))
+      pyDiffControlFlows, METH_VARARGS | METH_KEYWORDS,
+      DIFF_CF_DOC },
+    { "parseMemoryAsync", (PyCFunction)(void(*)(void))
+      pyParseMemoryAsync, METH_VARARGS | METH_KEYWORDS,
+      PARSE_MEMORY_ASYNC_DOC },
+    { "parseFileAsync", (PyCFunction)(void(*)(void))
+      pyParseFileAsync, METH_VARARGS | METH_KEYWORDS,
+      PARSE_FILE_ASYNC_DOC },
+    { "createCancelToken", (PyCFunction)(void(*)(void))
+      pyCreateCancelToken, METH_VARARGS | METH_KEYWORDS,
+      CREATE_CANCEL_TOKEN_DOC },
+    { "_setParseTuning", (PyCFunction)(void(*)(void))
+      pySetParseTuning, METH_VARARGS | METH_KEYWORDS,
+      SET_PARSE_TUNING_DOC },
+    { "_pauseParsing", (PyCFunction)(void(*)(void))
+      pyPauseParsing, METH_VARARGS | METH_KEYWORDS,
+      PAUSE_PARSING_DOC },
+    #ifdef CDM_CF_PGEN_AVAILABLE
+    { "getControlFlowFromMemoryPgen", (PyCFunction)(void(*)(void))
+      pyGetControlFlowFromMemoryPgen, METH_VARARGS | METH_KEYWORDS,
+      GET_CF_MEMORY_PGEN_DOC },
+    #endif
+    { NULL, NULL, 0, NULL }
+};
+
+
+// Populates a new module object
+static int
+execModule( PyObject *  module )
+{
+    static std::once_flag   typesReady;
+
+    try
+    {
+        std::call_once( typesReady, initFragmentTypes );
+
+        ModuleState *   state = static_cast< ModuleState * >(
+                                            PyModule_GetState( module ) );
+        state->pool = new WorkerPool();
+        for ( int  k = 0; k < staticTypeCount; ++k )
+        {
+            state->types[ k ] = createHeapType( module, k );
+            if ( state->types[ k ] == NULL )
+                return -1;
+        }
+        registerState( state );
+
+        // Constants visible from the module
+        Py::Dict        d( PyModule_GetDict( module ) );
+        d[ "VERSION" ]                  = Py::String( CDM_CF_PARSER_VERSION );
+        d[ "CML_VERSION" ]              = Py::String( CML_VERSION_AS_STRING );
+        d[ "CANCELLED_ERROR" ]          = Py::String( CANCELLED_ERROR );
+        d[ "DEADLINE_ERROR" ]           = Py::String( DEADLINE_ERROR );
+        d[ "SUPERSEDED_ERROR" ]         = Py::String( SUPERSEDED_ERROR );
+
+        d[ "VISIT_ENTER" ]              = Py::Int( VISIT_ENTER );
+        d[ "VISIT_LEAVE" ]              = Py::Int( VISIT_LEAVE );
+        d[ "VISIT_CALLBACK_CAPSULE" ]   = Py::String( VISIT_CALLBACK_CAPSULE );
+
+        d[ "PHASE_APPROXIMATE" ]        = Py::Int( PHASE_APPROXIMATE );
+        d[ "PHASE_EXACT" ]              = Py::Int( PHASE_EXACT );
+
+        d[ "DIFF_INSERTED" ]            = Py::Int( DIFF_INSERTED );
+        d[ "DIFF_DELETED" ]             = Py::Int( DIFF_DELETED );
+        d[ "DIFF_MOVED" ]               = Py::Int( DIFF_MOVED );
+        d[ "DIFF_CHANGED" ]             = Py::Int( DIFF_CHANGED );
+
+        d[ "PRIORITY_BACKGROUND" ]      = Py::Int( PRIORITY_BACKGROUND );
+        d[ "PRIORITY_OPEN" ]            = Py::Int( PRIORITY_OPEN );
+        d[ "PRIORITY_VISIBLE" ]         = Py::Int( PRIORITY_VISIBLE );
+
+        d[ "UNDEFINED_FRAGMENT" ]       = Py::Int( UNDEFINED_FRAGMENT );
+        d[ "FRAGMENT" ]                 = Py::Int( FRAGMENT );
+        d[ "BANG_LINE_FRAGMENT" ]       = Py::Int( BANG_LINE_FRAGMENT );
+        d[ "ENCODING_LINE_FRAGMENT" ]   = Py::Int( ENCODING_LINE_FRAGMENT );
+        d[ "COMMENT_FRAGMENT" ]         = Py::Int( COMMENT_FRAGMENT );
+        d[ "DOCSTRING_FRAGMENT" ]       = Py::Int( DOCSTRING_FRAGMENT );
+        d[ "DECORATOR_FRAGMENT" ]       = Py::Int( DECORATOR_FRAGMENT );
+        d[ "CODEBLOCK_FRAGMENT" ]       = Py::Int( CODEBLOCK_FRAGMENT );
+        d[ "ANNOTATION_FRAGMENT" ]      = Py::Int( ANNOTATION_FRAGMENT );
+        d[ "ARGUMENT_FRAGMENT" ]        = Py::Int( ARGUMENT_FRAGMENT );
+        d[ "FUNCTION_FRAGMENT" ]        = Py::Int( FUNCTION_FRAGMENT );
+        d[ "CLASS_FRAGMENT" ]           = Py::Int( CLASS_FRAGMENT );
+        d[ "BREAK_FRAGMENT" ]           = Py::Int( BREAK_FRAGMENT );
+        d[ "CONTINUE_FRAGMENT" ]        = Py::Int( CONTINUE_FRAGMENT );
+        d[ "RETURN_FRAGMENT" ]          = Py::Int( RETURN_FRAGMENT );
+        d[ "RAISE_FRAGMENT" ]           = Py::Int( RAISE_FRAGMENT );
+        d[ "ASSERT_FRAGMENT" ]          = Py::Int( ASSERT_FRAGMENT );
+        d[ "SYSEXIT_FRAGMENT" ]         = Py::Int( SYSEXIT_FRAGMENT );
+        d[ "WHILE_FRAGMENT" ]           = Py::Int( WHILE_FRAGMENT );
+        d[ "FOR_FRAGMENT" ]             = Py::Int( FOR_FRAGMENT );
+        d[ "IMPORT_FRAGMENT" ]          = Py::Int( IMPORT_FRAGMENT );
+        d[ "ELIF_PART_FRAGMENT" ]       = Py::Int( ELIF_PART_FRAGMENT );
+        d[ "IF_FRAGMENT" ]              = Py::Int( IF_FRAGMENT );
+        d[ "WITH_FRAGMENT" ]            = Py::Int( WITH_FRAGMENT );
+        d[ "EXCEPT_PART_FRAGMENT" ]     = Py::Int( EXCEPT_PART_FRAGMENT );
+        d[ "TRY_FRAGMENT" ]             = Py::Int( TRY_FRAGMENT );
+        d[ "CML_COMMENT_FRAGMENT" ]     = Py::Int( CML_COMMENT_FRAGMENT );
+        d[ "CONTROL_FLOW_FRAGMENT" ]    = Py::Int( CONTROL_FLOW_FRAGMENT );
+    }
+    catch ( Py::BaseException & )
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+static int
+traverseModule( PyObject *  module, visitproc  visit, void *  arg )
+{
+    ModuleState *   state = static_cast< ModuleState * >(
+                                            PyModule_GetState( module ) );
+    if ( state != NULL )
+        for ( int  k = 0; k < EXTENSION_TYPE_COUNT; ++k )
+            Py_VISIT( state->types[ k ] );
+    return 0;
+}
+
+
+// The heap types refer to the module object so they are collected together
+static int
+clearModule( PyObject *  module )
+{
+    ModuleState *   state = static_cast< ModuleState * >(
+                                            PyModule_GetState( module ) );
+    if ( state != NULL )
+    {
+        unregisterState( state );
+        clearTypes( state );
+    }
+    return 0;
+}
+
+
+// Stops the module worker pool
+static void
+freeModule( void *  module )
+{
+    ModuleState *   state = static_cast< ModuleState * >(
+                        PyModule_GetState( static_cast< PyObject * >( module ) ) );
+    if ( state != NULL )
+    {
+        unregisterState( state );
+        clearTypes( state );
+        delete state->pool;
+        state->pool = NULL;
+    }
+}
+
+
+// The module could be loaded into many subinterpreters, each with its own
+// GIL: the instances have the heap types of their module object and the
+// process wide data is set up once and read only then.
+// The module runs without the GIL on a free-threaded python: the fragments
+// changed on the first access take the control flow lock, see FlowLock.
+static PyModuleDef_Slot  moduleSlots[] =
+{
+    { Py_mod_exec, (void *)execModule },
+    #if PY_VERSION_HEX >= 0x030C0000
+    { Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+    #endif
+    #if PY_VERSION_HEX >= 0x030D0000
+    { Py_mod_gil, Py_MOD_GIL_NOT_USED },
+    #endif
+    { 0, NULL }
+};
+
+
+static PyModuleDef  moduleDef =
+{
+    PyModuleDef_HEAD_INIT,
+    "cdmcfparser",              // m_name
+    MODULE_DOC,                 // m_doc
+    sizeof( ModuleState ),      // m_size
+    moduleMethods,              // m_methods
+    moduleSlots,                // m_slots
+    traverseModule,             // m_traverse
+    clearModule,                // m_clear
+    freeModule                  // m_free
+};
+
+
+extern "C" PyObject *  PyInit_cdmcfparser()
+{
+    return PyModuleDef_Init( &moduleDef );
+}
+
+// symbol required for the debug version
+extern "C" PyObject *  PyInit_cdmcfparser_d()
+{
+    return PyInit_cdmcfparser();
+}
@@ -23,19 +23,36 @@
 
 
 #include "CXX/Objects.hxx"
-#include "CXX/Extensions.hxx"
 
-
-class CDMControlFlowModule : public Py::ExtensionModule< CDMControlFlowModule >
-{
-    public:
-        CDMControlFlowModule();
-        virtual ~CDMControlFlowModule();
-
-    private:
-        Py::Object  getControlFlowFromMemory( const Py::Tuple &  args );
-        Py::Object  getControlFlowFromFile( const Py::Tuple &  args );
-};
+#include "cflowpgen.hpp"
+#include "cflowasync.hpp"
+
+
+// The module functions. The module is created with the multi-phase
+// initialization so each interpreter (and each re-import) has its own module
+// object and no C++ module instance exists.
+Py::Object  getControlFlowFromMemory( const Py::Tuple &  args,
+                                      const Py::Dict &  keywords );
+Py::Object  getControlFlowFromFile( const Py::Tuple &  args,
+                                    const Py::Dict &  keywords );
+Py::Object  visitControlFlow( const Py::Tuple &  args,
+                              const Py::Dict &  keywords );
+Py::Object  iterControlFlow( const Py::Tuple &  args,
+                             const Py::Dict &  keywords );
+Py::Object  scanControlFlow( const Py::Tuple &  args,
+                             const Py::Dict &  keywords );
+Py::Object  diffControlFlows( const Py::Tuple &  args,
+                              const Py::Dict &  keywords );
+Py::Object  parseMemoryAsync( WorkerPool &  pool, const Py::Tuple &  args,
+                              const Py::Dict &  keywords );
+Py::Object  parseFileAsync( WorkerPool &  pool, const Py::Tuple &  args,
+                            const Py::Dict &  keywords );
+Py::Object  createCancelToken( const Py::Tuple &  args,
+                               const Py::Dict &  keywords );
+#ifdef CDM_CF_PGEN_AVAILABLE
+Py::Object  getControlFlowFromMemoryPgen( const Py::Tuple &  args,
+                                          const Py::Dict &  keywords );
+#endif
 
 
 #endif
@@ -28,147 +28,61 @@
 #include "cflowcomments.hpp"
 #include "cflowutils.hpp"
 
-/*
- * The python grammar definition conflicts with the standard library
- * declarations on some platforms, particularly on MacOS: python uses
- * #define test 305
- * while the library has
- * bitset<_Size>::test(size_t __pos) const
- * Thus the python headers must be after certain PyCXX library includes which
- * use the standard library.
- */
-#include <Python.h>
-#include <node.h>
-#include <grammar.h>
-#include <parsetok.h>
-#include <graminit.h>
-#include <errcode.h>
-#include <token.h>
+#include "cflowsyntax.hpp"
+#include "cflowpgen.hpp"
+#include "cflowdocs.hpp"
 
 
-extern grammar      _PyParser_Grammar;  /* From graminit.c */
+// How often (in statements) the walker lets the other threads run and checks
+// if it should stop
+#define WALK_CHECK_INTERVAL     256
 
 
 static FragmentBase *
 walk( Context *             context,
-      node *                tree,
+      Node *                tree,
       FragmentBase *        parent,
       Py::List &            flow,
       bool                  docstrProcessed );
 
+static FragmentBase *
+walkSuite( Context *            context,
+           Node *               tree,
+           FragmentBase *       parent,
+           Py::List &           flow,
+           Docstring *          docstr );
 
 
-/* Copied and adjusted from 
- * static void err_input(perrdetail *err)
- */
-static void getErrorMessage( perrdetail *  err,
-                             int &  line, int &  column,
-                             std::string &  message )
-{
-    line = err->lineno;
-    column = err->offset;
-
-    switch ( err->error )
-    {
-        case E_ERROR:
-            message = "execution error";
-            return;
-        case E_SYNTAX:
-            if ( err->expected == INDENT )
-                message = "expected an indented block";
-            else if ( err->token == INDENT )
-                message = "unexpected indent";
-            else if (err->token == DEDENT)
-                message = "unexpected unindent";
-            else
-                message = "invalid syntax";
-            break;
-        case E_TOKEN:
-            message = "invalid token";
-            break;
-        case E_EOFS:
-            message = "EOF while scanning triple-quoted string literal";
-            break;
-        case E_EOLS:
-            message = "EOL while scanning string literal";
-            break;
-        case E_INTR:
-            message = "keyboard interrupt";
-            goto cleanup;
-        case E_NOMEM:
-            message = "no memory";
-            goto cleanup;
-        case E_EOF:
-            message = "unexpected EOF while parsing";
-            break;
-        case E_TABSPACE:
-            message = "inconsistent use of tabs and spaces in indentation";
-            break;
-        case E_OVERFLOW:
-            message = "expression too long";
-            break;
-        case E_DEDENT:
-            message = "unindent does not match any outer indentation level";
-            break;
-        case E_TOODEEP:
-            message = "too many levels of indentation";
-            break;
-        case E_DECODE:
-            message = "decode error";
-            break;
-        case E_LINECONT:
-            message = "unexpected character after line continuation character";
-            break;
-        default:
-            {
-                char    code[ 32 ];
-                sprintf( code, "%d", err->error );
-                message = "unknown parsing error (error code " +
-                           std::string( code ) + ")";
-                break;
-            }
-    }
-
-    if ( err->text != NULL )
-        message += std::string( "\n" ) + err->text;
-
-    cleanup:
-    if (err->text != NULL)
-    {
-        PyObject_FREE(err->text);
-        err->text = NULL;
-    }
-    return;
-}
 
-/* Provides the total number of lines in the code */
-static int getTotalLines( node *  tree )
+static Node *  findLastPart( Node *  tree )
 {
-    if ( tree == NULL )
-        return -1;
-
-    if ( tree->n_type != file_input )
-        tree = &(tree->n_child[ 0 ]);
-
-    assert( tree->n_type == file_input );
-    for ( int k = 0; k < tree->n_nchildren; ++k )
-    {
-        node *  child = &(tree->n_child[ k ]);
-        if ( child->n_type == ENDMARKER )
-            return child->n_lineno;
-    }
-    return -1;
+    while ( tree->n_nchildren > 0 )
+        tree = & (tree->n_child[ tree->n_nchildren - 1 ]);
+    return tree;
 }
 
-
-static node *  findLastPart( node *  tree )
+// Provides the last token of a statement skipping the NEWLINE, INDENT and
+// DEDENT tokens
+static Node *
+findLastStatementPart( Node *  tree )
 {
     while ( tree->n_nchildren > 0 )
-        tree = & (tree->n_child[ tree->n_nchildren - 1 ]);
+    {
+        int     k = tree->n_nchildren - 1;
+        while ( k > 0 )
+        {
+            int     type = tree->n_child[ k ].n_type;
+            if ( type != NEWLINE && type != INDENT && type != DEDENT )
+                break;
+            --k;
+        }
+        tree = & ( tree->n_child[ k ] );
+    }
     return tree;
 }
 
-static node *  findChildOfType( node *  from, int  type )
+
+static Node *  findChildOfType( Node *  from, int  type )
 {
     for ( int  k = 0; k < from->n_nchildren; ++k )
         if ( from->n_child[ k ].n_type == type )
@@ -176,8 +90,8 @@ static node *  findChildOfType( node *  from, int  type )
     return NULL;
 }
 
-static node *
-findChildOfTypeAndValue( node *  from, int  type, const char *  val )
+static Node *
+findChildOfTypeAndValue( Node *  from, int  type, const char *  val )
 {
     for ( int  k = 0; k < from->n_nchildren; ++k )
         if ( from->n_child[ k ].n_type == type )
@@ -187,8 +101,8 @@ findChildOfTypeAndValue( node *  from, int  type, const char *  val )
 }
 
 /* Searches for a certain  node among the first children */
-static node *
-skipToNode( node *  tree, int nodeType )
+static Node *
+skipToNode( Node *  tree, int nodeType )
 {
     if ( tree == NULL )
         return NULL;
@@ -206,7 +120,7 @@ skipToNode( node *  tree, int nodeType )
 
 /* returns 1, 2, 3 or 4,
    i.e. the number of leading quotes used in a string literal part */
-static size_t getStringLiteralPrefixLength( node *  tree )
+static size_t getStringLiteralPrefixLength( Node *  tree )
 {
     /* tree must be of STRING type */
     assert( tree->n_type == STRING );
@@ -279,55 +193,31 @@ getNewLineParts( const char *  str,
 }
 
 
+// The positions are templated so that the visitor events could get them
+// without creating the fragment objects
+template < class T >
 static void
-updateBegin( Fragment *  f, node *  n, Context *   context )
-{
-    #if PY_MAJOR_VERSION == 3 && (PY_MINOR_VERSION == 8 || PY_MINOR_VERSION == 9)
-        // Python 3.8 has the first line and column set correct
-        f->beginLine = n->n_lineno;
-        f->beginPos = n->n_col_offset + 1;
-        f->begin = context->lineShifts[ f->beginLine ] + n->n_col_offset;
-    #else
-        // Python 3.7 and below have -1 for multiline string literals
-        if ( n->n_col_offset == -1 )
-        {
-            // Bad case: it is a multiline string literal so need to guess
-            // all the values
-            node *      lastPart = skipToNode( n, STRING );
-            if ( lastPart )
-            {
-                if ( lastPart->n_col_offset == -1 )
-                {
-                    std::deque< const char * >  newLines;
-                    int                         newLineCount;
-                    int                         charCount;
-
-                    getNewLineParts( lastPart->n_str, newLines,
-                                     newLineCount, charCount );
-                    f->beginLine = n->n_lineno - newLineCount;
-                    f->begin = context->lineShifts[ n->n_lineno ] +
-                               strlen( newLines.back() + 1 ) - charCount;
-                    f->beginPos = f->begin -
-                                  context->lineShifts[ f->beginLine ] + 1;
-                    return;
-                }
-            }
-            // This should not really happened: fall through
-        }
+updateBegin( T *  f, Node *  n, const int *  lineShifts )
+{
+    f->beginLine = n->n_lineno;
+    f->beginPos = n->n_col_offset + 1;
+    f->begin = lineShifts[ f->beginLine ] + n->n_col_offset;
+}
+
 
-        // Easy case: the proper info is in the node
-        f->beginLine = n->n_lineno;
-        f->beginPos = n->n_col_offset + 1;
-        f->begin = context->lineShifts[ f->beginLine ] + n->n_col_offset;
-    #endif
+static void
+updateBegin( Fragment *  f, Node *  n, Context *   context )
+{
+    updateBegin( f, n, context->lineShifts );
 }
 
 
+template < class T >
 static void
-updateEnd( Fragment *  f, node *  n, Context *   context )
+updateEnd( T *  f, Node *  n, const int *  lineShifts )
 {
     if ( n->n_str == NULL ) {
-        f->end = context->lineShifts[ n->n_lineno ] + n->n_col_offset;
+        f->end = lineShifts[ n->n_lineno ] + n->n_col_offset;
         f->endLine = n->n_lineno;
         f->endPos = n->n_col_offset;
         return;
@@ -343,15 +233,8 @@ updateEnd( Fragment *  f, node *  n, Context *   context )
 
             getNewLineParts( n->n_str, newLines, newLineCount, charCount );
 
-            #if PY_MAJOR_VERSION == 3 && (PY_MINOR_VERSION == 8 || PY_MINOR_VERSION == 9)
-                // Python 3.8 has the first line available for multiline
-                // string literals
-                f->endLine = n->n_lineno + newLineCount;
-            #else
-                // Python 3.7 has only the end line correct for multiline
-                // string literals
-                f->endLine = n->n_lineno;
-            #endif
+            // The string literal node has the first line
+            f->endLine = n->n_lineno + newLineCount;
 
             if ( newLineCount == 0 )
             {
@@ -362,19 +245,26 @@ updateEnd( Fragment *  f, node *  n, Context *   context )
                 const char *    lastNewLine = newLines.back();
                 f->endPos = strlen( lastNewLine  + 1 );
             }
-            f->end = context->lineShifts[ f->endLine ] + f->endPos - 1;
+            f->end = lineShifts[ f->endLine ] + f->endPos - 1;
             return;
         }
     }
 
     int     lastPartLength = strlen( n->n_str );
-    f->end = context->lineShifts[ n->n_lineno ] +
+    f->end = lineShifts[ n->n_lineno ] +
              n->n_col_offset + lastPartLength - 1;
     f->endLine = n->n_lineno;
     f->endPos = n->n_col_offset + lastPartLength;
 }
 
 
+static void
+updateEnd( Fragment *  f, Node *  n, Context *   context )
+{
+    updateEnd( f, n, context->lineShifts );
+}
+
+
 // It also discards the comment from the deque if it is a bang line
 static FragmentBase *
 checkForBangLine( const char *  buffer,
@@ -413,7 +303,7 @@ checkForBangLine( const char *  buffer,
 // It also discards the comment from the deque
 static FragmentBase *
 processEncoding( const char *   buffer,
-                 node *         tree,
+                 Node *         tree,
                  ControlFlow *  controlFlow,
                  std::deque< CommentLine > &  comments )
 {
@@ -534,18 +424,21 @@ addLeadingCMLComment( Context *  context,
                       FragmentBase *  flowAsParent,
                       Py::List &  flow )
 {
-    leadingCML->extractProperties( context );
+    if ( context->options.cmlProperties )
+        leadingCML->extractProperties( context );
     if ( leadingLastLine + 1 == firstStatementLine ||
          consumeAllAsLeading )
     {
         statementAsParent->updateBeginEnd( leadingCML );
         statement->leadingCMLComments.append( Py::asObject( leadingCML ) );
     }
-    else
+    else if ( context->options.isBuilt( CML_COMMENT_FRAGMENT ) )
     {
         flowAsParent->updateBeginEnd( leadingCML );
         flow.append( Py::asObject( leadingCML ) );
     }
+    else
+        Py::asObject( leadingCML );     // Takes the only reference and drops it
     return;
 }
 
@@ -581,14 +474,14 @@ injectOneLeadingComment( Context *  context,
             }
 
             Fragment *      part( createCommentFragment( comment ) );
+
+            leadingCML = new CMLComment;
             if ( leadingLastLine + 1 == firstStatementLine ||
                  consumeAllAsLeading )
-                part->parent = statementAsParent;
+                leadingCML->parent = statementAsParent;
             else
-                part->parent = flowAsParent;
-
-            leadingCML = new CMLComment;
-            leadingCML->parent = part->parent;
+                leadingCML->parent = flowAsParent;
+            part->parent = leadingCML;
             leadingCML->updateBeginEnd( part );
             leadingCML->parts.append( Py::asObject( part ) );
         }
@@ -623,12 +516,7 @@ injectOneLeadingComment( Context *  context,
                 else
                 {
                     Fragment *      part( createCommentFragment( comment ) );
-                    if ( leadingLastLine + 1 == firstStatementLine ||
-                         consumeAllAsLeading )
-                        part->parent = statementAsParent;
-                    else
-                        part->parent = flowAsParent;
-
+                    part->parent = leadingCML;
                     leadingCML->updateEnd( part );
                     leadingCML->parts.append( Py::asObject( part ) );
                 }
@@ -647,17 +535,12 @@ injectOneLeadingComment( Context *  context,
             }
 
             Fragment *      part( createCommentFragment( comment ) );
-            if ( leadingLastLine + 1 == firstStatementLine ||
-                 consumeAllAsLeading )
-                part->parent = statementAsParent;
-            else
-                part->parent = flowAsParent;
-
             if ( leading == NULL )
             {
                 leading = new Comment;
                 leading->updateBegin( part );
             }
+            part->parent = leading;
             leading->parts.append( Py::asObject( part ) );
             leading->updateEnd( part );
         }
@@ -685,12 +568,16 @@ injectOneLeadingComment( Context *  context,
         {
             statementAsParent->updateBeginEnd( leading );
             statement->leadingComment = Py::asObject( leading );
+            leading->parent = statementAsParent;
         }
-        else
+        else if ( context->options.isBuilt( COMMENT_FRAGMENT ) )
         {
             flowAsParent->updateBeginEnd( leading );
             flow.append( Py::asObject( leading ) );
+            leading->parent = flowAsParent;
         }
+        else
+            Py::asObject( leading );    // Takes the only reference and drops it
         leading = NULL;
     }
 
@@ -766,7 +653,7 @@ addSideCMLCommentContinue( Context *  context,
 
     // All is fine, let's add the CML continue
     Fragment *      part( createCommentFragment( comment ) );
-    part->parent = statementAsParent;
+    part->parent = sideCML;
     sideCML->updateEnd( part );
     sideCML->parts.append( Py::asObject( part ) );
     return;
@@ -780,7 +667,8 @@ addSideCMLComment( Context *  context,
                    FragmentWithComments *  statement,
                    FragmentBase *  flowAsParent )
 {
-    sideCML->extractProperties( context );
+    if ( context->options.cmlProperties )
+        sideCML->extractProperties( context );
     statement->sideCMLComments.append( Py::asObject( sideCML ) );
     statementAsParent->updateEnd( sideCML );
     flowAsParent->updateEnd( sideCML );
@@ -818,10 +706,10 @@ injectSideComments( Context *  context,
             }
 
             Fragment *      part( createCommentFragment( comment ) );
-            part->parent = statementAsParent;
 
             sideCML = new CMLComment;
-            sideCML->parent = part->parent;
+            sideCML->parent = statementAsParent;
+            part->parent = sideCML;
             sideCML->updateBeginEnd( part );
             sideCML->parts.append( Py::asObject( part ) );
         }
@@ -836,13 +724,12 @@ injectSideComments( Context *  context,
         if ( comment.type == REGULAR_COMMENT )
         {
             Fragment *      part( createCommentFragment( comment ) );
-            part->parent = statementAsParent;
-
             if ( side == NULL )
             {
                 side = new Comment;
                 side->updateBegin( part );
             }
+            part->parent = side;
             side->parts.append( Py::asObject( part ) );
             side->updateEnd( part );
         }
@@ -891,10 +778,10 @@ injectSideComments( Context *  context,
             }
 
             Fragment *      part( createCommentFragment( comment ) );
-            part->parent = statementAsParent;
 
             sideCML = new CMLComment;
-            sideCML->parent = part->parent;
+            sideCML->parent = statementAsParent;
+            part->parent = sideCML;
             sideCML->updateBeginEnd( part );
             sideCML->parts.append( Py::asObject( part ) );
         }
@@ -909,13 +796,12 @@ injectSideComments( Context *  context,
         if ( comment.type == REGULAR_COMMENT )
         {
             Fragment *      part( createCommentFragment( comment ) );
-            part->parent = statementAsParent;
-
             if ( side == NULL )
             {
                 side = new Comment;
                 side->updateBegin( part );
             }
+            part->parent = side;
             side->parts.append( Py::asObject( part ) );
             side->updateEnd( part );
         }
@@ -936,6 +822,7 @@ injectSideComments( Context *  context,
         statement->sideComment = Py::asObject( side );
         statementAsParent->updateEnd( side );
         flowAsParent->updateEnd( side );
+        side->parent = statementAsParent;
         side = NULL;
     }
     return;
@@ -964,7 +851,7 @@ injectComments( Context *  context,
 
 static FragmentBase *
 processBreak( Context *  context,
-              node *  tree, FragmentBase *  parent,
+              Node *  tree, FragmentBase *  parent,
               Py::List &  flow )
 {
     assert( tree->n_type == break_stmt );
@@ -988,7 +875,7 @@ processBreak( Context *  context,
 
 static FragmentBase *
 processContinue( Context *  context,
-                 node *  tree, FragmentBase *  parent,
+                 Node *  tree, FragmentBase *  parent,
                  Py::List &  flow )
 {
     assert( tree->n_type == continue_stmt );
@@ -1012,7 +899,7 @@ processContinue( Context *  context,
 
 static FragmentBase *
 processAssert( Context *  context,
-               node *  tree, FragmentBase *  parent,
+               Node *  tree, FragmentBase *  parent,
                Py::List &  flow )
 {
     assert( tree->n_type == assert_stmt );
@@ -1029,11 +916,11 @@ processAssert( Context *  context,
     a->updateBegin( body );
 
     // One test node must be there. The second one may not be there
-    node *      firstTestNode = findChildOfType( tree, test );
+    Node *      firstTestNode = findChildOfType( tree, test );
     assert( firstTestNode != NULL );
 
     Fragment *      tst( new Fragment );
-    node *          testLastPart = findLastPart( firstTestNode );
+    Node *          testLastPart = findLastPart( firstTestNode );
 
     tst->parent = a;
     updateBegin( tst, firstTestNode, context );
@@ -1042,14 +929,14 @@ processAssert( Context *  context,
     a->tst = Py::asObject( tst );
 
     // If a comma is there => there is a message part
-    node *      commaNode = findChildOfType( tree, COMMA );
+    Node *      commaNode = findChildOfType( tree, COMMA );
     if ( commaNode != NULL )
     {
         Fragment *      message( new Fragment );
 
         // Message test node must follow the comma node
-        node *          secondTestNode = commaNode + 1;
-        node *          secondTestLastPart = findLastPart( secondTestNode );
+        Node *          secondTestNode = commaNode + 1;
+        Node *          secondTestLastPart = findLastPart( secondTestNode );
 
         message->parent = a;
         updateBegin( message, secondTestNode, context );
@@ -1071,7 +958,7 @@ processAssert( Context *  context,
 
 static FragmentBase *
 processRaise( Context *  context,
-              node *  tree, FragmentBase *  parent,
+              Node *  tree, FragmentBase *  parent,
               Py::List &  flow )
 {
     assert( tree->n_type == raise_stmt );
@@ -1087,11 +974,11 @@ processRaise( Context *  context,
 
     r->updateBegin( body );
 
-    node *      testNode = findChildOfType( tree, test );
+    Node *      testNode = findChildOfType( tree, test );
     if ( testNode != NULL )
     {
         Fragment *      val( new Fragment );
-        node *          lastPart = findLastPart( testNode );
+        Node *          lastPart = findLastPart( testNode );
 
         val->parent = r;
         updateBegin( val, testNode, context );
@@ -1111,7 +998,7 @@ processRaise( Context *  context,
 
 
 static FragmentBase *
-processReturn( Context *  context, node *  tree,
+processReturn( Context *  context, Node *  tree,
                FragmentBase *  parent, Py::List &  flow )
 {
     assert( tree->n_type == return_stmt );
@@ -1127,15 +1014,11 @@ processReturn( Context *  context, node *  tree,
 
     ret->updateBegin( body );
 
-    #if PY_MAJOR_VERSION == 3 && (PY_MINOR_VERSION == 8 || PY_MINOR_VERSION == 9)
-        node *  testlistNode = findChildOfType( tree, testlist_star_expr );
-    #else
-        node *  testlistNode = findChildOfType( tree, testlist );
-    #endif
+    Node *  testlistNode = findChildOfType( tree, testlist_star_expr );
     if ( testlistNode != NULL )
     {
         Fragment *      val( new Fragment );
-        node *          lastPart = findLastPart( testlistNode );
+        Node *          lastPart = findLastPart( testlistNode );
 
         val->parent = ret;
         updateBegin( val, testlistNode, context );
@@ -1158,7 +1041,7 @@ processReturn( Context *  context, node *  tree,
 // 'else' parts of 'while', 'for', 'try'
 static ElifPart *
 processElifPart( Context *  context, Py::List &  flow,
-                 node *  tree, FragmentBase *  parent )
+                 Node *  tree, FragmentBase *  parent )
 {
     assert( tree->n_type == NAME );
 
@@ -1171,16 +1054,12 @@ processElifPart( Context *  context, Py::List &  flow,
     ElifPart *      elifPart( new ElifPart );
     elifPart->parent = parent;
 
-    node *      current = tree + 1;
-    node *      colonNode = NULL;
-    #if PY_MAJOR_VERSION == 3 && (PY_MINOR_VERSION == 8 || PY_MINOR_VERSION == 9)
-        if ( current->n_type == namedexpr_test )
-    #else
-        if ( current->n_type == test )
-    #endif
+    Node *      current = tree + 1;
+    Node *      colonNode = NULL;
+    if ( current->n_type == namedexpr_test )
     {
         // This is an elif part, i.e. there is a condition part
-        node *      last = findLastPart( current );
+        Node *      last = findLastPart( current );
         Fragment *  condition( new Fragment );
         condition->parent = elifPart;
         updateBegin( condition, current, context );
@@ -1196,7 +1075,7 @@ processElifPart( Context *  context, Py::List &  flow,
         colonNode = current;
     }
 
-    node *          suiteNode = colonNode + 1;
+    Node *          suiteNode = colonNode + 1;
     Fragment *      body( new Fragment );
     body->parent = elifPart;
     updateBegin( body, tree, context );
@@ -1205,10 +1084,12 @@ processElifPart( Context *  context, Py::List &  flow,
     elifPart->body = Py::asObject( body );
 
     // If it is not an 'if' statement, then all the comments should be consumed
-    // as leading
-    injectComments( context, flow, parent, elifPart, elifPart, ! isIf );
-    FragmentBase *  lastAdded = walk( context, suiteNode, elifPart,
-                                      elifPart->nsuite, false );
+    // as leading. The ones left before an 'if' go to the suite the 'if'
+    // statement is in.
+    injectComments( context, flow, parent->parent, elifPart, elifPart,
+                    ! isIf );
+    FragmentBase *  lastAdded = walkSuite( context, suiteNode, elifPart,
+                                           elifPart->nsuite, NULL );
     if ( lastAdded == NULL )
         elifPart->updateEnd( body );
     else
@@ -1219,7 +1100,7 @@ processElifPart( Context *  context, Py::List &  flow,
 
 static FragmentBase *
 processIf( Context *  context,
-           node *  tree, FragmentBase *  parent,
+           Node *  tree, FragmentBase *  parent,
            Py::List &  flow )
 {
     assert( tree->n_type == if_stmt );
@@ -1229,7 +1110,7 @@ processIf( Context *  context,
 
     for ( int k = 0; k < tree->n_nchildren; ++k )
     {
-        node *  child = &(tree->n_child[ k ]);
+        Node *  child = &(tree->n_child[ k ]);
         if ( child->n_type == NAME )
         {
             ElifPart *  elifPart = processElifPart( context, flow, child,
@@ -1246,7 +1127,7 @@ processIf( Context *  context,
 
 static ExceptPart *
 processExceptPart( Context *  context, Py::List &  flow,
-                   node *  tree, FragmentBase *  parent )
+                   Node *  tree, FragmentBase *  parent )
 {
     assert( tree->n_type == except_clause ||
             tree->n_type == NAME );
@@ -1258,7 +1139,7 @@ processExceptPart( Context *  context, Py::List &  flow,
     body->parent = exceptPart;
 
     // ':' node is the very next one
-    node *          colonNode = tree + 1;
+    Node *          colonNode = tree + 1;
     updateBegin( body, tree, context );
     updateEnd( body, colonNode, context );
     exceptPart->updateBeginEnd( body );
@@ -1268,10 +1149,10 @@ processExceptPart( Context *  context, Py::List &  flow,
     // The clause could only be in the 'except' case
     if ( tree->n_type == except_clause )
     {
-        node *      testNode = findChildOfType( tree, test );
+        Node *      testNode = findChildOfType( tree, test );
         if ( testNode != NULL )
         {
-            node *      last = findLastPart( tree );
+            Node *      last = findLastPart( tree );
             Fragment *  clause( new Fragment );
 
             clause->parent = exceptPart;
@@ -1285,10 +1166,10 @@ processExceptPart( Context *  context, Py::List &  flow,
                     exceptPart, exceptPart, true );
 
     // 'suite' node follows the colon node
-    node *          suiteNode = colonNode + 1;
-    FragmentBase *  lastAdded = walk( context,
-                                      suiteNode, exceptPart,
-                                      exceptPart->nsuite, false );
+    Node *          suiteNode = colonNode + 1;
+    FragmentBase *  lastAdded = walkSuite( context,
+                                           suiteNode, exceptPart,
+                                           exceptPart->nsuite, NULL );
     if ( lastAdded == NULL )
         exceptPart->updateEnd( body );
     else
@@ -1299,7 +1180,7 @@ processExceptPart( Context *  context, Py::List &  flow,
 
 static FragmentBase *
 processTry( Context *  context,
-            node *  tree, FragmentBase *  parent,
+            Node *  tree, FragmentBase *  parent,
             Py::List &  flow )
 {
     assert( tree->n_type == try_stmt );
@@ -1308,7 +1189,7 @@ processTry( Context *  context,
     tryStatement->parent = parent;
 
     Fragment *      body( new Fragment );
-    node *          tryColonNode = findChildOfType( tree, COLON );
+    Node *          tryColonNode = findChildOfType( tree, COLON );
     body->parent = tryStatement;
     updateBegin( body, tree, context );
     updateEnd( body, tryColonNode, context );
@@ -1319,10 +1200,10 @@ processTry( Context *  context,
                     tryStatement, tryStatement );
 
     // suite
-    node *          trySuiteNode = tryColonNode + 1;
-    FragmentBase *  lastAdded = walk( context,
-                                      trySuiteNode, tryStatement,
-                                      tryStatement->nsuite, false );
+    Node *          trySuiteNode = tryColonNode + 1;
+    FragmentBase *  lastAdded = walkSuite( context,
+                                           trySuiteNode, tryStatement,
+                                           tryStatement->nsuite, NULL );
     if ( lastAdded == NULL )
         tryStatement->updateEnd( body );
     else
@@ -1332,7 +1213,7 @@ processTry( Context *  context,
     // except, finally, else parts
     for ( int k = 0; k < tree->n_nchildren; ++k )
     {
-        node *  child = &(tree->n_child[ k ]);
+        Node *  child = &(tree->n_child[ k ]);
         if ( child->n_type == except_clause )
         {
             ExceptPart *    exceptPart = processExceptPart( context, flow,
@@ -1377,7 +1258,7 @@ processTry( Context *  context,
 
 static FragmentBase *
 processWhile( Context *  context,
-              node *  tree, FragmentBase *  parent,
+              Node *  tree, FragmentBase *  parent,
               Py::List &  flow )
 {
     assert( tree->n_type == while_stmt );
@@ -1386,8 +1267,8 @@ processWhile( Context *  context,
     w->parent = parent;
 
     Fragment *      body( new Fragment );
-    node *          colonNode = findChildOfType( tree, COLON );
-    node *          whileNode = findChildOfType( tree, NAME );
+    Node *          colonNode = findChildOfType( tree, COLON );
+    Node *          whileNode = findChildOfType( tree, NAME );
 
     body->parent = w;
     updateBegin( body, whileNode, context );
@@ -1396,12 +1277,8 @@ processWhile( Context *  context,
     w->updateBeginEnd( body );
 
     // condition
-    #if PY_MAJOR_VERSION == 3 && (PY_MINOR_VERSION == 8 || PY_MINOR_VERSION == 9)
-        node *          testNode = findChildOfType( tree, namedexpr_test );
-    #else
-        node *          testNode = findChildOfType( tree, test );
-    #endif
-    node *          lastPart = findLastPart( testNode );
+    Node *          testNode = findChildOfType( tree, namedexpr_test );
+    Node *          lastPart = findLastPart( testNode );
     Fragment *      condition( new Fragment );
 
     condition->parent = w;
@@ -1412,16 +1289,16 @@ processWhile( Context *  context,
     injectComments( context, flow, parent, w, w );
 
     // suite
-    node *          suiteNode = findChildOfType( tree, suite );
-    FragmentBase *  lastAdded = walk( context, suiteNode, w, w->nsuite,
-                                      false );
+    Node *          suiteNode = findChildOfType( tree, suite );
+    FragmentBase *  lastAdded = walkSuite( context, suiteNode, w, w->nsuite,
+                                           NULL );
     if ( lastAdded == NULL )
         w->updateEnd( body );
     else
         w->updateEnd( lastAdded );
 
     // else part
-    node *          elseNode = findChildOfTypeAndValue( tree, NAME, "else" );
+    Node *          elseNode = findChildOfTypeAndValue( tree, NAME, "else" );
     if ( elseNode != NULL )
     {
         ElifPart *      elsePart = processElifPart( context, flow, elseNode, w );
@@ -1435,12 +1312,12 @@ processWhile( Context *  context,
 
 static FragmentBase *
 processWith( Context *  context,
-             node *  tree, FragmentBase *  parent,
+             Node *  tree, FragmentBase *  parent,
              Py::List &  flow )
 {
-    assert( tree->n_type == with_stmt || tree->async_stmt );
+    assert( tree->n_type == with_stmt || tree->n_type == async_stmt );
 
-    node *      asyncNode = NULL;
+    Node *      asyncNode = NULL;
     if ( tree->n_type != with_stmt )
     {
         asyncNode = & ( tree->n_child[ 0 ] );
@@ -1453,8 +1330,8 @@ processWith( Context *  context,
     w->parent = parent;
 
     Fragment *      body( new Fragment );
-    node *          colonNode = findChildOfType( tree, COLON );
-    node *          whithNode = findChildOfType( tree, NAME );
+    Node *          colonNode = findChildOfType( tree, COLON );
+    Node *          whithNode = findChildOfType( tree, NAME );
 
     body->parent = w;
 
@@ -1486,17 +1363,17 @@ processWith( Context *  context,
     w->withKeyword = Py::asObject( withKeyword );
 
     // items
-    node *      firstWithItem = findChildOfType( tree, with_item );
-    node *      lastWithItem = NULL;
+    Node *      firstWithItem = findChildOfType( tree, with_item );
+    Node *      lastWithItem = NULL;
     for ( int  k = 0; k < tree->n_nchildren; ++k )
     {
-        node *  child = &(tree->n_child[ k ]);
+        Node *  child = &(tree->n_child[ k ]);
         if ( child->n_type == with_item )
             lastWithItem = child;
     }
 
     Fragment *      items( new Fragment );
-    node *          lastPart = findLastPart(lastWithItem);
+    Node *          lastPart = findLastPart(lastWithItem);
     items->parent = w;
     updateBegin( items, firstWithItem, context );
     updateEnd( items, lastPart, context );
@@ -1505,9 +1382,9 @@ processWith( Context *  context,
     injectComments( context, flow, parent, w, w );
 
     // suite
-    node *          suiteNode = findChildOfType( tree, suite );
-    FragmentBase *  lastAdded = walk( context, suiteNode, w, w->nsuite,
-                                      false );
+    Node *          suiteNode = findChildOfType( tree, suite );
+    FragmentBase *  lastAdded = walkSuite( context, suiteNode, w, w->nsuite,
+                                           NULL );
     if ( lastAdded == NULL )
         w->updateEnd( body );
     else
@@ -1520,12 +1397,12 @@ processWith( Context *  context,
 
 static FragmentBase *
 processFor( Context *  context,
-            node *  tree, FragmentBase *  parent,
+            Node *  tree, FragmentBase *  parent,
             Py::List &  flow )
 {
-    assert( tree->n_type == for_stmt || tree->async_stmt );
+    assert( tree->n_type == for_stmt || tree->n_type == async_stmt );
 
-    node *      asyncNode = NULL;
+    Node *      asyncNode = NULL;
     if ( tree->n_type != for_stmt )
     {
         asyncNode = & ( tree->n_child[ 0 ] );
@@ -1538,8 +1415,8 @@ processFor( Context *  context,
     f->parent = parent;
 
     Fragment *      body( new Fragment );
-    node *          colonNode = findChildOfType( tree, COLON );
-    node *          forNode = findChildOfType( tree, NAME );
+    Node *          colonNode = findChildOfType( tree, COLON );
+    Node *          forNode = findChildOfType( tree, NAME );
 
     body->parent = f;
 
@@ -1571,9 +1448,9 @@ processFor( Context *  context,
     f->forKeyword = Py::asObject( forKeyword );
 
     // Iteration
-    node *          exprlistNode = findChildOfType( tree, exprlist );
-    node *          testlistNode = findChildOfType( tree, testlist );
-    node *          lastPart = findLastPart( testlistNode );
+    Node *          exprlistNode = findChildOfType( tree, exprlist );
+    Node *          testlistNode = findChildOfType( tree, testlist );
+    Node *          lastPart = findLastPart( testlistNode );
     Fragment *      iteration( new Fragment );
 
     iteration->parent = f;
@@ -1584,16 +1461,16 @@ processFor( Context *  context,
     injectComments( context, flow, parent, f, f );
 
     // suite
-    node *          suiteNode = findChildOfType( tree, suite );
-    FragmentBase *  lastAdded = walk( context, suiteNode, f, f->nsuite,
-                                      false );
+    Node *          suiteNode = findChildOfType( tree, suite );
+    FragmentBase *  lastAdded = walkSuite( context, suiteNode, f, f->nsuite,
+                                           NULL );
     if ( lastAdded == NULL )
         f->updateEnd( body );
     else
         f->updateEnd( lastAdded );
 
     // else part
-    node *          elseNode = findChildOfTypeAndValue( tree, NAME, "else" );
+    Node *          elseNode = findChildOfTypeAndValue( tree, NAME, "else" );
     if ( elseNode != NULL )
     {
         ElifPart *      elsePart = processElifPart( context, flow, elseNode, f );
@@ -1605,9 +1482,89 @@ processFor( Context *  context,
 }
 
 
+// Remembers the names sys.exit() is imported as. Receives import_from or
+// import_name.
+static void
+addSysExitNames( Context *  context, Node *  tree )
+{
+    if ( tree->n_type == import_from )
+    {
+        // Check if there is exit imported from sys; the relative imports
+        // are not of sys
+        if ( findChildOfType( tree, DOT ) != NULL ||
+             findChildOfType( tree, ELLIPSIS ) != NULL )
+            return;
+
+        Node *  fromPart = findChildOfType( tree, dotted_name );
+        if ( fromPart == NULL || fromPart->n_nchildren != 1 )
+            return;
+        if ( strcmp( fromPart->n_child[ 0 ].n_str, "sys" ) != 0 )
+            return;
+
+        Node *  importAsNames = findChildOfType( tree, import_as_names );
+        if ( importAsNames == NULL )
+        {
+            // It could be * imported
+            if ( findChildOfType( tree, STAR ) != NULL )
+                context->sysExit.insert( "exit" );
+            return;
+        }
+
+        for ( int  k = 0; k < importAsNames->n_nchildren; ++k )
+        {
+            Node *  child = &(importAsNames->n_child[ k ]);
+            if ( child->n_type != import_as_name )
+                continue;
+
+            Node *  nameNode = &(child->n_child[ 0 ]);
+            if ( strcmp( nameNode->n_str, "exit" ) != 0 )
+                continue;
+
+            if ( child->n_nchildren == 1 )
+            {
+                context->sysExit.insert( "exit" );
+            }
+            else if ( child->n_nchildren == 3 )
+            {
+                Node *  asChild = &(child->n_child[ 2 ]);
+                context->sysExit.insert( asChild->n_str );
+            }
+        }
+        return;
+    }
+
+    // Check if there are imports of sys
+    Node *  firstWhat = findChildOfType( tree, dotted_as_names );
+    if ( firstWhat == NULL )
+        return;
+
+    for ( int  k = 0; k < firstWhat->n_nchildren; ++k )
+    {
+        Node *  child = &(firstWhat->n_child[ k ]);
+        if ( child->n_type != dotted_as_name )
+            continue;
+
+        Node *  nameNode = &(child->n_child[ 0 ]);
+        nameNode = &(nameNode->n_child[ 0 ]);
+        if ( nameNode->n_type == NAME && strcmp( nameNode->n_str, "sys" ) == 0 )
+        {
+            if ( child->n_nchildren == 3 )
+            {
+                Node *  asNameNode = &(child->n_child[ 2 ]);
+                context->sysExit.insert( asNameNode->n_str + std::string( ".exit" ) );
+            }
+            else
+            {
+                context->sysExit.insert( "sys.exit" );
+            }
+        }
+    }
+}
+
+
 static FragmentBase *
 processImport( Context *  context,
-               node *  tree, FragmentBase *  parent,
+               Node *  tree, FragmentBase *  parent,
                Py::List &  flow )
 {
     assert( tree->n_type == import_stmt );
@@ -1618,7 +1575,7 @@ processImport( Context *  context,
     import->parent = parent;
 
     Fragment *      body( new Fragment );
-    node *          lastPart = findLastPart( tree );
+    Node *          lastPart = findLastPart( tree );
 
     body->parent = import;
     updateBegin( body, tree, context );
@@ -1631,7 +1588,7 @@ processImport( Context *  context,
         Fragment *  fromFragment( new Fragment );
         Fragment *  whatFragment( new Fragment );
 
-        node *      fromPartBegin = findChildOfType( tree, ELLIPSIS );
+        Node *      fromPartBegin = findChildOfType( tree, ELLIPSIS );
         if ( fromPartBegin == NULL )
         {
             fromPartBegin = findChildOfType( tree, DOT );
@@ -1645,7 +1602,7 @@ processImport( Context *  context,
 
         updateBegin( fromFragment, fromPartBegin, context );
 
-        node *      lastFromPart = NULL;
+        Node *      lastFromPart = NULL;
         if ( fromPartBegin->n_type == DOT ||
              fromPartBegin->n_type == ELLIPSIS )
         {
@@ -1673,7 +1630,7 @@ processImport( Context *  context,
 
         updateEnd( fromFragment, lastFromPart, context );
 
-        node *      whatPart = findChildOfTypeAndValue( tree, NAME, "import" );
+        Node *      whatPart = findChildOfTypeAndValue( tree, NAME, "import" );
         assert( whatPart != NULL );
 
         ++whatPart;     // the very next after import is the first of the what part
@@ -1682,49 +1639,6 @@ processImport( Context *  context,
 
         import->fromPart = Py::asObject( fromFragment );
         import->whatPart = Py::asObject( whatFragment );
-
-        // Check if there is exit imported from sys
-        if ( fromPartBegin->n_type == dotted_name )
-        {
-            if ( fromPartBegin->n_nchildren == 1 )
-            {
-                node *  fromNode = &(fromPartBegin->n_child[ 0 ]);
-                if ( strcmp( fromNode->n_str, "sys" ) == 0 )
-                {
-                    node *  importAsNames = findChildOfType( tree, import_as_names );
-                    if ( importAsNames != NULL )
-                    {
-                        for ( int  k = 0; k < importAsNames->n_nchildren; ++k )
-                        {
-                            node *  child = &(importAsNames->n_child[ k ]);
-                            if ( child->n_type == import_as_name )
-                            {
-                                node *  nameNode = &(child->n_child[ 0 ]);
-                                if ( strcmp( nameNode->n_str, "exit" ) == 0 )
-                                {
-                                    if ( child->n_nchildren == 1 )
-                                    {
-                                        context->sysExit.insert( "exit" );
-                                    }
-                                    else if ( child->n_nchildren == 3 )
-                                    {
-                                        node *  asChild = &(child->n_child[ 2 ]);
-                                        context->sysExit.insert( asChild->n_str );
-                                    }
-                                }
-                            }
-                        }
-                    }
-                    else
-                    {
-                        // It could be * imported
-                        node *  starImported = findChildOfType( tree, STAR );
-                        if ( starImported != NULL )
-                            context->sysExit.insert( "exit" );
-                    }
-                }
-            }
-        }
     }
     else
     {
@@ -1732,7 +1646,7 @@ processImport( Context *  context,
         import->fromPart = Py::None();
 
         Fragment *      whatFragment( new Fragment );
-        node *          firstWhat = findChildOfType( tree, dotted_as_names );
+        Node *          firstWhat = findChildOfType( tree, dotted_as_names );
         assert( firstWhat != NULL );
 
         whatFragment->parent = import;
@@ -1744,30 +1658,8 @@ processImport( Context *  context,
         whatFragment->endPos = body->endPos;
 
         import->whatPart = Py::asObject( whatFragment );
-
-        // Check if there are imports of sys
-        for ( int  k = 0; k < firstWhat->n_nchildren; ++k )
-        {
-            node *  child = &(firstWhat->n_child[ k ]);
-            if ( child->n_type == dotted_as_name )
-            {
-                node *  nameNode = &(child->n_child[ 0 ]);
-                nameNode = &(nameNode->n_child[ 0 ]);
-                if ( nameNode->n_type == NAME && strcmp( nameNode->n_str, "sys" ) == 0 )
-                {
-                    if ( child->n_nchildren == 3 )
-                    {
-                        node *  asNameNode = &(child->n_child[ 2 ]);
-                        context->sysExit.insert( asNameNode->n_str + std::string( ".exit" ) );
-                    }
-                    else
-                    {
-                        context->sysExit.insert( "sys.exit" );
-                    }
-                }
-            }
-        }
     }
+    addSysExitNames( context, tree );
 
     import->updateBeginEnd( body );
     import->body = Py::asObject( body );
@@ -1778,9 +1670,9 @@ processImport( Context *  context,
 
 
 static void
-findDecoratorLRPARNodes( node *  atomExprNode,
-                         node **  lparNode,
-                         node **  rparNode )
+findDecoratorLRPARNodes( Node *  atomExprNode,
+                         Node **  lparNode,
+                         Node **  rparNode )
 {
     // This function is used for python 3.9 and possibly up
     // The decorators grammar has been changed 3.8 -> 3.9. Now a decorator
@@ -1793,7 +1685,7 @@ findDecoratorLRPARNodes( node *  atomExprNode,
     if ( lastChildIndex < 0 )
         return;
 
-    node *      lastChild = & atomExprNode->n_child[ lastChildIndex ];
+    Node *      lastChild = & atomExprNode->n_child[ lastChildIndex ];
     if ( lastChild->n_type != trailer )
         return;
     if ( lastChild->n_nchildren < 2 )
@@ -1808,8 +1700,8 @@ findDecoratorLRPARNodes( node *  atomExprNode,
 }
 
 
-static node *
-findDecoratorLastPart( node *  atomExprNode, node *  lparNode )
+static Node *
+findDecoratorLastPart( Node *  atomExprNode, Node *  lparNode )
 {
     // This function is used for python 3.9 and possibly up
     // The decorators grammar has been changed 3.8 -> 3.9. Now a decorator
@@ -1820,7 +1712,7 @@ findDecoratorLastPart( node *  atomExprNode, node *  lparNode )
         --n;    // The decorator has arguments so the last child must not be
                 // participating in building the name
 
-    node *      lastChild = & atomExprNode->n_child[ n - 1 ];
+    Node *      lastChild = & atomExprNode->n_child[ n - 1 ];
     return findLastPart( lastChild );
 }
 
@@ -1828,35 +1720,30 @@ findDecoratorLastPart( node *  atomExprNode, node *  lparNode )
 static void
 processDecor( Context *  context, Py::List &  flow,
               FragmentBase *  parent,
-              node *  tree, std::list<Decorator *> &  decors )
+              Node *  tree, std::list<Decorator *> &  decors )
 {
     assert( tree->n_type == decorator );
 
-    node *      atNode = findChildOfType( tree, AT );
+    Node *      atNode = findChildOfType( tree, AT );
     assert( atNode != NULL );
 
-    #if PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION == 9
-        // The 3.9 grammar introduces a completely different structure of the
-        // tree. Now it could be an arbitrary expression.
-        node *      namedExprTestNode = findChildOfType( tree, namedexpr_test );
-        assert( namedExprTestNode != NULL );
-        node *      nameNode = skipToNode( namedExprTestNode, atom_expr );
-        assert( nameNode != NULL );
-
-        // Find LPAR
-        // Find RPAR
-        node *      lparNode = NULL;
-        node *      rparNode = NULL;
-        findDecoratorLRPARNodes( nameNode, & lparNode, & rparNode );
-
-        // Find the last name part
-        node *      lastNameNode = findDecoratorLastPart( nameNode, lparNode );
-    #else
-        node *      nameNode = findChildOfType( tree, dotted_name );
-        assert( nameNode != NULL );
-        node *      lparNode = findChildOfType( tree, LPAR );
-        node *      lastNameNode = findLastPart( nameNode );
-    #endif
+    // A decorator could be an arbitrary expression. Only the ones which
+    // start with a primary (a name possibly followed by trailers) are
+    // recognized.
+    Node *      namedExprTestNode = findChildOfType( tree, namedexpr_test );
+    assert( namedExprTestNode != NULL );
+    Node *      nameNode = skipToNode( namedExprTestNode, atom_expr );
+    if ( nameNode == NULL )
+        return;
+
+    // Find LPAR
+    // Find RPAR
+    Node *      lparNode = NULL;
+    Node *      rparNode = NULL;
+    findDecoratorLRPARNodes( nameNode, & lparNode, & rparNode );
+
+    // Find the last name part
+    Node *      lastNameNode = findDecoratorLastPart( nameNode, lparNode );
 
     Decorator *     decor( new Decorator );
     Fragment *      nameFragment( new Fragment );
@@ -1878,12 +1765,6 @@ processDecor( Context *  context, Py::List &  flow,
     else
     {
         // Decorator with arguments
-        #if PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION == 9
-            // The 3.9 decorator rpar node has been alrady been found
-        #else
-            node *          rparNode = findChildOfType( tree, RPAR );
-        #endif
-
         Fragment *      argsFragment( new Fragment );
 
         argsFragment->parent = decor;
@@ -1906,12 +1787,12 @@ processDecor( Context *  context, Py::List &  flow,
 
 static std::list<Decorator *>
 processDecorators( Context *  context, Py::List &  flow,
-                   FragmentBase *  parent, node *  tree )
+                   FragmentBase *  parent, Node *  tree )
 {
     assert( tree->n_type == decorators );
 
     int                         n = tree->n_nchildren;
-    node *                      child;
+    Node *                      child;
     std::list<Decorator *>      decors;
 
     for ( int  k = 0; k < n; ++k )
@@ -1929,7 +1810,7 @@ processDecorators( Context *  context, Py::List &  flow,
 // None or a SysExit instance
 static FragmentBase *
 checkForSysExit( Context *          context,
-                 node *             tree,
+                 Node *             tree,
                  Py::List &         flow,
                  FragmentBase *     parent )
 {
@@ -1938,16 +1819,9 @@ checkForSysExit( Context *          context,
     if ( tree->n_type != small_stmt )
         return NULL;
 
-    // Note: the python grammar has been changed between 3.4 and 3.5
-    // 3.4 and lower had the 'power' node preceeding the 'atom' node.
-    // The newer versions have a new 'atom_expr' node. So there is a
-    // define here; the variable name is kept as 'powerNode' though
-    // in python > 3.5 the name atomExprNode would fit better.
-    #if PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION >= 5
-        node *      powerNode( skipToNode( tree, atom_expr ) );
-    #else
-        node *      powerNode( skipToNode( tree, power ) );
-    #endif
+    // The variable name is kept as 'powerNode' though the atom_expr node
+    // replaced the 'power' one in python 3.5
+    Node *      powerNode( skipToNode( tree, atom_expr ) );
     if ( powerNode == NULL )
         return NULL;
 
@@ -1962,7 +1836,7 @@ checkForSysExit( Context *          context,
     if ( powerNode->n_nchildren < 2 || powerNode->n_nchildren > 3 )
         return NULL;
 
-    node *      atomNode = & ( powerNode->n_child[ 0 ] );
+    Node *      atomNode = & ( powerNode->n_child[ 0 ] );
     if ( atomNode->n_type != atom )
         return NULL;
     if ( atomNode->n_nchildren != 1 )
@@ -1970,7 +1844,7 @@ checkForSysExit( Context *          context,
     if ( atomNode->n_child[ 0 ].n_type != NAME )
         return NULL;
 
-    node *      lastTrailer = & ( powerNode->n_child[ powerNode->n_nchildren - 1 ] );
+    Node *      lastTrailer = & ( powerNode->n_child[ powerNode->n_nchildren - 1 ] );
     if ( lastTrailer->n_type != trailer )
         return NULL;
     if ( lastTrailer->n_nchildren < 2 )
@@ -1982,7 +1856,7 @@ checkForSysExit( Context *          context,
     std::string     statement( atomNode->n_child[ 0 ].n_str );
     if ( powerNode->n_nchildren == 3 )
     {
-        node *      trailerNode = & ( powerNode->n_child[ 1 ] );
+        Node *      trailerNode = & ( powerNode->n_child[ 1 ] );
         if ( trailerNode->n_type != trailer )
             return NULL;
         if ( trailerNode->n_nchildren != 2 )
@@ -1997,9 +1871,9 @@ checkForSysExit( Context *          context,
     // Check if the pattern is in the sys.exit patterns
     if ( context->sysExit.find( statement ) != context->sysExit.end() )
     {
-        node *      lparNode = findChildOfType( lastTrailer, LPAR );
-        node *      rparNode = findChildOfType( lastTrailer, RPAR );
-        node *      arglistNode = findChildOfType( lastTrailer, arglist );
+        Node *      lparNode = findChildOfType( lastTrailer, LPAR );
+        Node *      rparNode = findChildOfType( lastTrailer, RPAR );
+        Node *      arglistNode = findChildOfType( lastTrailer, arglist );
 
         SysExit *       sysExit( new SysExit );
         sysExit->parent = parent;
@@ -2012,10 +1886,10 @@ checkForSysExit( Context *          context,
 
         if ( arglistNode != NULL )
         {
-            node *      lastPartNode = findLastPart( arglistNode );
+            Node *      lastPartNode = findLastPart( arglistNode );
             Fragment *  actualArg( new Fragment );
 
-            actualArg->parent = parent;
+            actualArg->parent = sysExit;
             updateBegin( actualArg, arglistNode, context );
             updateEnd( actualArg, lastPartNode, context );
             sysExit->actualArg = Py::asObject( actualArg );
@@ -2041,16 +1915,14 @@ checkForSysExit( Context *          context,
 }
 
 
-// NULL or a Docstring instance
-static Docstring *
-checkForDocstring( Context *  context, node *  tree )
+// Provides the atom node of the suite docstring or NULL if there is none
+static Node *
+findDocstringNode( Node *  tree )
 {
-    context->lastDocstring = NULL;
-
     if ( tree == NULL )
         return NULL;
 
-    node *      child = NULL;
+    Node *      child = NULL;
     int         n = tree->n_nchildren;
     for ( int  k = 0; k < n; ++k )
     {
@@ -2070,23 +1942,36 @@ checkForDocstring( Context *  context, node *  tree )
     if ( child == NULL )
         return NULL;
 
+    /* Atom has to have children of the STRING type only */
+    for ( int  k = 0; k < child->n_nchildren; ++k )
+        if ( child->n_child[ k ].n_type != STRING )
+            return NULL;
+    return child;
+}
+
+
+// NULL or a Docstring instance
+static Docstring *
+checkForDocstring( Context *  context, Node *  tree )
+{
+    context->lastDocstring = NULL;
+
+    if ( ! context->options.docstrings )
+        return NULL;
+
+    Node *      child = findDocstringNode( tree );
+    if ( child == NULL )
+        return NULL;
+
     Docstring *     docstr( new Docstring );
     Fragment *      body( new Fragment );
     body->parent = docstr;
 
-    /* Atom has to have children of the STRING type only */
-    node *          stringChild;
-
-    n = child->n_nchildren;
+    Node *          stringChild;
+    int             n = child->n_nchildren;
     for ( int  k = 0; k < n; ++k )
     {
         stringChild = & ( child->n_child[ k ] );
-        if ( stringChild->n_type != STRING )
-        {
-            delete docstr;
-            delete body;
-            return NULL;
-        }
 
         // This is a docstring part
         Fragment *      part( new Fragment );
@@ -2110,8 +1995,8 @@ checkForDocstring( Context *  context, node *  tree )
 
 static Annotation *
 processAnnotation( Context *    context,
-                   node *       separator,
-                   node *       annotation )
+                   Node *       separator,
+                   Node *       annotation )
 {
     if ( separator == NULL || annotation == NULL )
         return NULL;
@@ -2125,7 +2010,7 @@ processAnnotation( Context *    context,
     ann->separator = Py::asObject( sep );
 
     Fragment *      text( new Fragment );
-    node *          lastPart( findLastPart( annotation ) );
+    Node *          lastPart( findLastPart( annotation ) );
 
     text->parent = ann;
     updateBegin( text, annotation, context );
@@ -2141,7 +2026,7 @@ processAnnotation( Context *    context,
 static int
 processFunctionArgument( Context *      context,
                          Function *     func,
-                         node *         arguments,
+                         Node *         arguments,
                          int            index)
 {
     // One of the cases here:
@@ -2150,15 +2035,15 @@ processFunctionArgument( Context *      context,
     // - DOUBLESTAR (* name [ + annot])
     // - STAR (*)
 
-    node *      tfpdefNode( & arguments->n_child[ index ] );
-    node *      argBegin( tfpdefNode );
-    node *      nameNode( argBegin );
+    Node *      tfpdefNode( & arguments->n_child[ index ] );
+    Node *      argBegin( tfpdefNode );
+    Node *      nameNode( argBegin );
     if ( tfpdefNode->n_type == STAR )
     {
         // Step further only if there is a following tfpdef node
         if ( index + 1 < arguments->n_nchildren )
         {
-            node *  nextNode = & arguments->n_child[ index + 1 ];
+            Node *  nextNode = & arguments->n_child[ index + 1 ];
             if ( nextNode->n_type == tfpdef )
             {
                 ++index;
@@ -2191,11 +2076,11 @@ processFunctionArgument( Context *      context,
     arg->updateBegin( name );
 
     // See if there is an annotation
-    node *      colonNode( findChildOfType( tfpdefNode, COLON ) );
+    Node *      colonNode( findChildOfType( tfpdefNode, COLON ) );
     if ( colonNode != NULL )
     {
         // That's the annotation
-        node *      testNode ( findChildOfType( tfpdefNode, test ) );
+        Node *      testNode ( findChildOfType( tfpdefNode, test ) );
         if ( testNode != NULL )
         {
             Annotation *        ann = processAnnotation( context,
@@ -2213,17 +2098,17 @@ processFunctionArgument( Context *      context,
     ++index;
     if ( index < arguments->n_nchildren )
     {
-        node *      child( & arguments->n_child[ index ] );
+        Node *      child( & arguments->n_child[ index ] );
         if ( child->n_type == EQUAL )
         {
             // The default value is here
             ++index;
-            node *      testNode( & arguments->n_child[ index ] );
+            Node *      testNode( & arguments->n_child[ index ] );
             if ( testNode->n_type == test )
             {
                 Fragment *      sep( new Fragment );
                 Fragment *      defValue( new Fragment );
-                node *          lastPart( findLastPart( testNode ) );
+                Node *          lastPart( findLastPart( testNode ) );
 
                 sep->parent = arg;
                 updateBegin( sep, child, context );
@@ -2249,7 +2134,7 @@ processFunctionArgument( Context *      context,
 
 static FragmentBase *
 processFuncDefinition( Context *                    context,
-                       node *                       tree,
+                       Node *                       tree,
                        FragmentBase *               parent,
                        Py::List &                   flow,
                        std::list<Decorator *> &     decors )
@@ -2258,7 +2143,7 @@ processFuncDefinition( Context *                    context,
             tree->n_type == async_stmt );
     assert( tree->n_nchildren > 1 );
 
-    node *      asyncNode = NULL;
+    Node *      asyncNode = NULL;
     if ( tree->n_type != funcdef )
     {
         asyncNode = & ( tree->n_child[ 0 ] );
@@ -2267,10 +2152,10 @@ processFuncDefinition( Context *                    context,
     assert( tree->n_type == funcdef );
 
 
-    node *      defNode = & ( tree->n_child[ 0 ] );
-    node *      nameNode = & ( tree->n_child[ 1 ] );
-    node *      colonNode = findChildOfType( tree, COLON );
-    node *      annotSeparator = findChildOfType( tree, RARROW );
+    Node *      defNode = & ( tree->n_child[ 0 ] );
+    Node *      nameNode = & ( tree->n_child[ 1 ] );
+    Node *      colonNode = findChildOfType( tree, COLON );
+    Node *      annotSeparator = findChildOfType( tree, RARROW );
 
     assert( colonNode != NULL );
 
@@ -2301,7 +2186,7 @@ processFuncDefinition( Context *                    context,
 
     if ( annotSeparator != NULL )
     {
-        node *      annotNode = findChildOfType( tree, test );
+        Node *      annotNode = findChildOfType( tree, test );
         if ( annotNode != NULL )
         {
             Annotation *  ann = processAnnotation( context, annotSeparator,
@@ -2326,21 +2211,21 @@ processFuncDefinition( Context *                    context,
     updateEnd( name, nameNode, context );
     func->name = Py::asObject( name );
 
-    node *      params = findChildOfType( tree, parameters );
-    node *      lparNode = findChildOfType( params, LPAR );
-    node *      rparNode = findChildOfType( params, RPAR );
+    Node *      params = findChildOfType( tree, parameters );
+    Node *      lparNode = findChildOfType( params, LPAR );
+    Node *      rparNode = findChildOfType( params, RPAR );
     Fragment *  args( new Fragment );
     args->parent = func;
     updateBegin( args, lparNode, context );
     updateEnd( args, rparNode, context );
     func->arguments = Py::asObject( args );
 
-    node *      argsNode = findChildOfType( params, typedargslist );
-    if ( argsNode != NULL )
+    Node *      argsNode = findChildOfType( params, typedargslist );
+    if ( argsNode != NULL && context->options.arguments )
     {
         /* The function has arguments */
         int         k = 0;
-        node *      child;
+        Node *      child;
         while ( k < argsNode->n_nchildren )
         {
             child = & ( argsNode->n_child[ k ] );
@@ -2378,7 +2263,7 @@ processFuncDefinition( Context *                    context,
     }
 
     // Handle docstring if so
-    node *      suiteNode = findChildOfType( tree, suite );
+    Node *      suiteNode = findChildOfType( tree, suite );
     assert( suiteNode != NULL );
 
     Docstring *  docstr = checkForDocstring( context, suiteNode );
@@ -2393,8 +2278,8 @@ processFuncDefinition( Context *                    context,
     }
 
     // Walk nested nodes
-    FragmentBase *  lastAdded = walk( context, suiteNode, func,
-                                      func->nsuite, docstr != NULL );
+    FragmentBase *  lastAdded = walkSuite( context, suiteNode, func,
+                                           func->nsuite, docstr );
     if ( lastAdded == NULL )
         func->updateEnd( body );
     else
@@ -2406,7 +2291,7 @@ processFuncDefinition( Context *                    context,
 
 static FragmentBase *
 processClassDefinition( Context *                    context,
-                        node *                       tree,
+                        Node *                       tree,
                         FragmentBase *               parent,
                         Py::List &                   flow,
                         std::list<Decorator *> &     decors )
@@ -2414,9 +2299,9 @@ processClassDefinition( Context *                    context,
     assert( tree->n_type == classdef );
     assert( tree->n_nchildren > 1 );
 
-    node *      defNode = & ( tree->n_child[ 0 ] );
-    node *      nameNode = & ( tree->n_child[ 1 ] );
-    node *      colonNode = findChildOfType( tree, COLON );
+    Node *      defNode = & ( tree->n_child[ 0 ] );
+    Node *      nameNode = & ( tree->n_child[ 1 ] );
+    Node *      colonNode = findChildOfType( tree, COLON );
 
     assert( colonNode != NULL );
 
@@ -2435,11 +2320,11 @@ processClassDefinition( Context *                    context,
     updateEnd( name, nameNode, context );
     cls->name = Py::asObject( name );
 
-    node *      lparNode = findChildOfType( tree, LPAR );
+    Node *      lparNode = findChildOfType( tree, LPAR );
     if ( lparNode != NULL )
     {
         // There is a list of base classes
-        node *      rparNode = findChildOfType( tree, RPAR );
+        Node *      rparNode = findChildOfType( tree, RPAR );
         Fragment *  baseClasses( new Fragment );
 
         baseClasses->parent = cls;
@@ -2470,7 +2355,7 @@ processClassDefinition( Context *                    context,
     }
 
     // Handle docstring if so
-    node *      suiteNode = findChildOfType( tree, suite );
+    Node *      suiteNode = findChildOfType( tree, suite );
     assert( suiteNode != NULL );
 
     Docstring *  docstr = checkForDocstring( context, suiteNode );
@@ -2485,8 +2370,8 @@ processClassDefinition( Context *                    context,
     }
 
     // Walk nested nodes
-    FragmentBase *  lastAdded = walk( context, suiteNode, cls, cls->nsuite,
-                                      docstr != NULL );
+    FragmentBase *  lastAdded = walkSuite( context, suiteNode, cls,
+                                           cls->nsuite, docstr );
 
     if ( lastAdded == NULL )
         cls->updateEnd( body );
@@ -2502,8 +2387,8 @@ processClassDefinition( Context *                    context,
 
 // Receives small_stmt
 // Provides the meaningful node to process or NULL
-static node *
-getSmallStatementNodeToProcess( node *  tree )
+static Node *
+getSmallStatementNodeToProcess( Node *  tree )
 {
     assert( tree->n_type == small_stmt );
 
@@ -2514,7 +2399,7 @@ getSmallStatementNodeToProcess( node *  tree )
     if ( tree->n_nchildren <= 0 )
         return NULL;
 
-    node *      child = & ( tree->n_child[ 0 ] );
+    Node *      child = & ( tree->n_child[ 0 ] );
     if ( child->n_type == flow_stmt )
     {
         if ( child->n_nchildren <= 0 )
@@ -2528,8 +2413,8 @@ getSmallStatementNodeToProcess( node *  tree )
 
 // Receives stmt
 // Provides the meaningful node to process or NULL
-static node *
-getStmtNodeToProcess( node *  tree )
+static Node *
+getStmtNodeToProcess( Node *  tree )
 {
     // stmt: simple_stmt | compound_stmt
     assert( tree->n_type == stmt );
@@ -2554,8 +2439,8 @@ getStmtNodeToProcess( node *  tree )
 
 // Receives stmt or small_stmt
 // Provides the meaningful node to process or NULL
-static node *
-getNodeToProcess( node *  tree )
+static Node *
+getNodeToProcess( Node *  tree )
 {
     assert( tree->n_type == stmt ||
             tree->n_type == small_stmt ||
@@ -2583,12 +2468,12 @@ addCodeBlock( Context *  context,
     Fragment *      body( new Fragment );
     body->parent = p;
 
-    node *          firstNode = (node *)(p->firstNode);
-    node *          lastItem = NULL;
+    Node *          firstNode = (Node *)(p->firstNode);
+    Node *          lastItem = NULL;
 
     updateBegin( body, firstNode, context );
 
-    node *          lastNode = findLastPart( (node *)(p->lastNode) );
+    Node *          lastNode = findLastPart( (Node *)(p->lastNode) );
 
     updateEnd( body, lastNode, context );
 
@@ -2604,7 +2489,7 @@ addCodeBlock( Context *  context,
 
 // Creates the code block and sets the beginning and the end of the block
 static CodeBlock *
-createCodeBlock( node *  tree, FragmentBase *  parent, Context *  context )
+createCodeBlock( Node *  tree, FragmentBase *  parent, Context *  context )
 {
     CodeBlock *     codeBlock( new CodeBlock );
     codeBlock->parent = parent;
@@ -2612,7 +2497,7 @@ createCodeBlock( node *  tree, FragmentBase *  parent, Context *  context )
     codeBlock->firstNode = tree;
     codeBlock->lastNode = tree;
 
-    node *      last = findLastPart( tree );
+    Node *      last = findLastPart( tree );
 
     Fragment    temp;
     updateEnd( &temp, last, context );
@@ -2624,11 +2509,11 @@ createCodeBlock( node *  tree, FragmentBase *  parent, Context *  context )
 
 // Adds a statement to the code block and updates the end of the block
 static void
-addToCodeBlock( CodeBlock *  codeBlock, node *  tree, Context *  context )
+addToCodeBlock( CodeBlock *  codeBlock, Node *  tree, Context *  context )
 {
     codeBlock->lastNode = tree;
 
-    node *      last = findLastPart( tree );
+    Node *      last = findLastPart( tree );
 
     Fragment    temp;
     updateEnd( &temp, last, context );
@@ -2637,34 +2522,52 @@ addToCodeBlock( CodeBlock *  codeBlock, node *  tree, Context *  context )
 }
 
 
-// The function is used for Python 3.7 and below
+// Provides the first line after the given one where a node of the tree
+// begins. The children lines do not decrease so a child followed by a
+// sibling which begins not after the given line cannot have such a node
+// and only the last of those children needs to be checked.
 static int
-getStringFirstLine( node *  n )
+getNextLineAfter( Node *  start, int  lineNumber )
 {
-    n = findLastPart( n );
-    if ( n->n_type != STRING || n->n_str == NULL )
-        return n->n_lineno;
-
-    std::deque< const char * >  newLines;
-    int                         newLineCount;
-    int                         charCount;
+    // The first child which begins after the line
+    int     low = 0;
+    int     high = start->n_nchildren;
+    while ( low < high )
+    {
+        int     middle = ( low + high ) / 2;
+        if ( start->n_child[ middle ].n_lineno > lineNumber )
+            high = middle;
+        else
+            low = middle + 1;
+    }
 
-    getNewLineParts( n->n_str, newLines, newLineCount, charCount );
-    return n->n_lineno - newLineCount;
+    if ( low > 0 )
+    {
+        int nestedLineNo = getNextLineAfter( & ( start->n_child[ low - 1 ] ),
+                                             lineNumber );
+        if ( nestedLineNo != INT_MAX )
+            return nestedLineNo;
+    }
+    if ( low < start->n_nchildren )
+        return start->n_child[ low ].n_lineno;
+    return INT_MAX;
 }
 
 
+// Provides the first line after the given one where a statement of the
+// suites on the node stack begins, from the given level up
 static int
-getNextLineAfter( node *  start, int  lineNumber )
+getNextStatementLine( Context *  context, int  treeLevel, int  lineNumber )
 {
-    for ( int  i = 0; i < start->n_nchildren; ++i )
+    while ( treeLevel >= 0 )
     {
-        node *      child = & ( start->n_child[ i ] );
-        if ( child->n_lineno > lineNumber )
-            return child->n_lineno;
-        int nestedLineNo = getNextLineAfter( child, lineNumber );
-        if ( nestedLineNo != INT_MAX )
-            return nestedLineNo;
+        Node *      upperTree = context->nodeStack[ treeLevel ];
+        int         nextStatementLine = getNextLineAfter( upperTree,
+                                                          lineNumber );
+        if ( nextStatementLine != INT_MAX )
+            return nextStatementLine;   // Found the limit line
+
+        --treeLevel;
     }
     return INT_MAX;
 }
@@ -2685,19 +2588,9 @@ injectTrailingComments( Context *       context,
 
     // find out a line number till which the comments should be checked.
     // Limit line is searched in trees above.
-    int     nextStatementLine( INT_MAX );
-    int     treeLevel( flowStackSize - 2 );
-
-    while ( treeLevel >= 0 )
-    {
-        node *      upperTree = context->nodeStack[ treeLevel ];
-
-        nextStatementLine = getNextLineAfter( upperTree, lastProcessedLine );
-        if ( nextStatementLine != INT_MAX )
-            break;  // Found the limit line
-
-        --treeLevel;
-    }
+    int     nextStatementLine = getNextStatementLine( context,
+                                                      flowStackSize - 2,
+                                                      lastProcessedLine );
 
     Py::List *      flowToAddTo( context->flowStack[ flowStackSize - 1 ] );
 
@@ -2721,254 +2614,397 @@ injectTrailingComments( Context *       context,
 }
 
 
+// The fragment kind of a small statement which has its own fragment or
+// UNDEFINED_FRAGMENT if the statement goes to a code block
+static int
+getSmallStatementKind( int  type )
+{
+    switch ( type )
+    {
+        case import_stmt:   return IMPORT_FRAGMENT;
+        case assert_stmt:   return ASSERT_FRAGMENT;
+        case break_stmt:    return BREAK_FRAGMENT;
+        case continue_stmt: return CONTINUE_FRAGMENT;
+        case return_stmt:   return RETURN_FRAGMENT;
+        case raise_stmt:    return RAISE_FRAGMENT;
+        default: ;
+    }
+    return UNDEFINED_FRAGMENT;
+}
+
+
+// The fragment kind of a compound statement. The decorated and async
+// statements are given the node of the statement they modify.
+static int
+getCompoundStatementKind( Node *  tree, Node **  statement )
+{
+    *statement = tree;
+    if ( tree->n_type == decorated || tree->n_type == async_stmt )
+    {
+        if ( tree->n_nchildren < 2 )
+            return UNDEFINED_FRAGMENT;
+        *statement = & ( tree->n_child[ 1 ] );
+    }
+
+    switch ( ( *statement )->n_type )
+    {
+        case if_stmt:       return IF_FRAGMENT;
+        case while_stmt:    return WHILE_FRAGMENT;
+        case for_stmt:      return FOR_FRAGMENT;
+        case try_stmt:      return TRY_FRAGMENT;
+        case with_stmt:     return WITH_FRAGMENT;
+        case funcdef:
+        case async_funcdef: return FUNCTION_FRAGMENT;
+        case classdef:      return CLASS_FRAGMENT;
+        default: ;
+    }
+    return UNDEFINED_FRAGMENT;
+}
+
+
+// A statement which is not built: its comments are dropped and the parent
+// still ends where the statement ends
+static void
+skipStatement( Context *  context, Node *  tree, FragmentBase *  parent )
+{
+    Fragment    temp;
+    updateEnd( & temp, findLastStatementPart( tree ), context );
+    parent->updateEnd( & temp );
+
+    while ( ! context->comments->empty() &&
+            context->comments->front().line <= temp.endLine )
+        context->comments->pop_front();
+}
+
+
+// A compound statement which is not built: its suites are walked into the
+// given flow. Provides the last added fragment or NULL.
 static FragmentBase *
-walk( Context *                    context,
-      node *                       tree,
-      FragmentBase *               parent,
-      Py::List &                   flow,
-      bool                         docstrProcessed )
+walkSkippedStatement( Context *      context,
+                      Node *         tree,
+                      Node *         statement,
+                      FragmentBase * parent,
+                      Py::List &     flow )
 {
-    CodeBlock *         codeBlock = NULL;
-    FragmentBase *      lastAdded = NULL;
-    int                 statementCount = 0;
+    FragmentBase *  lastAdded = NULL;
 
-    context->flowStack.push_back( &flow );
-    context->nodeStack.push_back( tree );
+    if ( statement->n_type == async_funcdef )
+        statement = & ( statement->n_child[ 1 ] );
 
-    for ( int  i = 0; i < tree->n_nchildren; ++i )
+    for ( int  k = 0; k < statement->n_nchildren; ++k )
     {
-        node *      child = & ( tree->n_child[ i ] );
-        if ( child->n_type != stmt  && child->n_type != simple_stmt )
+        Node *      suiteNode = & ( statement->n_child[ k ] );
+        if ( suiteNode->n_type != suite )
             continue;
 
-        ++statementCount;
+        // The part header comments go with the statement
+        while ( ! context->comments->empty() &&
+                context->comments->front().line <= suiteNode->n_lineno )
+            context->comments->pop_front();
 
-        node *      nodeToProcess = getNodeToProcess( child );
-        if ( nodeToProcess == NULL )
-            continue;
+        bool            docstrProcessed = false;
+        if ( statement->n_type == funcdef || statement->n_type == classdef )
+            docstrProcessed = context->options.docstrings &&
+                              findDocstringNode( suiteNode ) != NULL;
 
-        switch ( nodeToProcess->n_type )
-        {
-            case simple_stmt:
-                // need to walk over the small_stmt
-                for ( int  k = 0; k < nodeToProcess->n_nchildren; ++k )
-                {
-                    node *      simpleChild = & ( nodeToProcess->n_child[ k ] );
-                    if ( simpleChild->n_type != small_stmt )
-                        continue;
+        FragmentBase *  last = walk( context, suiteNode, parent, flow,
+                                     docstrProcessed );
+        if ( last != NULL )
+            lastAdded = last;
+    }
 
-                    if ( k != 0 )
-                        ++statementCount;
+    skipStatement( context, tree, parent );
+    return lastAdded;
+}
 
-                    node *      nodeToProcess = getNodeToProcess( simpleChild );
-                    if ( nodeToProcess == NULL )
-                        continue;
 
-                    switch ( nodeToProcess->n_type )
-                    {
-                        case import_stmt:
-                            addCodeBlock( context, & codeBlock, flow, parent );
-                            lastAdded = processImport( context, nodeToProcess,
-                                                       parent, flow );
-                            continue;
-                        case assert_stmt:
-                            addCodeBlock( context, & codeBlock, flow, parent );
-                            lastAdded = processAssert( context, nodeToProcess,
-                                                       parent, flow );
-                            continue;
-                        case break_stmt:
-                            addCodeBlock( context, & codeBlock, flow, parent );
-                            lastAdded = processBreak( context, nodeToProcess,
-                                                      parent, flow );
-                            continue;
-                        case continue_stmt:
-                            addCodeBlock( context, & codeBlock, flow, parent );
-                            lastAdded = processContinue( context, nodeToProcess,
-                                                         parent, flow );
-                            continue;
-                        case return_stmt:
-                            addCodeBlock( context, & codeBlock, flow, parent );
-                            lastAdded = processReturn( context, nodeToProcess,
-                                                       parent, flow );
-                            continue;
-                        case raise_stmt:
-                            addCodeBlock( context, & codeBlock, flow, parent );
-                            lastAdded = processRaise( context, nodeToProcess,
-                                                      parent, flow );
-                            continue;
-                        default: ;
-                    }
+// Processes the decorators and the function or class they decorate. The
+// pending code block (if any) is added before the definition. Provides NULL
+// if the node is not recognized.
+static FragmentBase *
+processDecorated( Context *                    context,
+                  Node *                       tree,
+                  CodeBlock **                 codeBlock,
+                  FragmentBase *               parent,
+                  Py::List &                   flow )
+{
+    assert( tree->n_type == decorated );
 
-                    FragmentBase *  sysExit( checkForSysExit( context,
-                                                              simpleChild,
-                                                              flow,
-                                                              parent ) );
-                    if ( sysExit != NULL )
-                    {
-                        addCodeBlock( context, & codeBlock, flow, parent );
+    // funcdef or classdef follows
+    if ( tree->n_nchildren < 2 )
+        return NULL;
 
-                        // NB: the 'checkForSysExit() does not inject comments
-                        // because they first must be injected for the current
-                        // code block. The current block comments are injected
-                        // in the addCodeBlock() function so here the comments
-                        // are injected for sys.exit() only
-                        injectComments( context, flow, parent,
-                                        static_cast<SysExit *>(sysExit),
-                                        sysExit );
-                        flow.append( Py::asObject(
-                                            static_cast<SysExit *>(sysExit) ) );
-                        lastAdded = sysExit;
-                        continue;
-                    }
+    Node *  decorsNode = & ( tree->n_child[ 0 ] );
+    Node *  classOrFuncNode = & ( tree->n_child[ 1 ] );
 
-                    // Some other statement
-                    if ( statementCount == 1 && docstrProcessed )
-                        continue;   // That's a docstring
+    if ( decorsNode->n_type != decorators )
+        return NULL;
 
-                    // Not a docstring => add it to the code block
-                    if ( codeBlock == NULL )
-                    {
-                        codeBlock = createCodeBlock( nodeToProcess, parent, context );
-                    }
-                    else
-                    {
-                        #if PY_MAJOR_VERSION == 3 && (PY_MINOR_VERSION == 8 || PY_MINOR_VERSION == 9)
-                            // Python 3.8 always has the correct first line
-                            int     realFirstLine = nodeToProcess->n_lineno;
-                        #else
-                            // Python 3.7 and below: if it a multiline string
-                            // literal then we do not have the first line.
-                            // We only have the last line
-                            int     realFirstLine;
-                            if ( nodeToProcess->n_col_offset == -1 )
-                                realFirstLine = getStringFirstLine( nodeToProcess );
-                            else
-                                realFirstLine = nodeToProcess->n_lineno;
-                        #endif
-
-                        if ( realFirstLine - codeBlock->lastLine > 1 )
-                        {
-                            lastAdded = addCodeBlock( context, & codeBlock, flow,
-                                                      parent );
-                            codeBlock = createCodeBlock( nodeToProcess, parent, context );
-                        }
-                        else
-                        {
-                            addToCodeBlock( codeBlock, nodeToProcess, context );
-                        }
-                    }
+    std::list<Decorator *>      decors =
+            processDecorators( context, flow, parent, decorsNode );
+
+    if ( classOrFuncNode->n_type == funcdef ||
+         classOrFuncNode->n_type == async_funcdef )
+    {
+        addCodeBlock( context, codeBlock, flow, parent );
+        return processFuncDefinition( context, classOrFuncNode,
+                                      parent, flow, decors );
+    }
+    if ( classOrFuncNode->n_type == classdef )
+    {
+        addCodeBlock( context, codeBlock, flow, parent );
+        return processClassDefinition( context, classOrFuncNode,
+                                       parent, flow, decors );
+    }
+    return NULL;
+}
+
+
+// Processes one stmt or simple_stmt node of a suite
+static void
+walkStatement( Context *                    context,
+               Node *                       child,
+               FragmentBase *               parent,
+               Py::List &                   flow,
+               WalkState &                  state )
+{
+    CodeBlock * &       codeBlock = state.codeBlock;
+    FragmentBase * &    lastAdded = state.lastAdded;
+    int &               statementCount = state.statementCount;
+
+    ++statementCount;
+
+    Node *      nodeToProcess = getNodeToProcess( child );
+    if ( nodeToProcess == NULL )
+        return;
+
+    switch ( nodeToProcess->n_type )
+    {
+        case simple_stmt:
+            // need to walk over the small_stmt
+            for ( int  k = 0; k < nodeToProcess->n_nchildren; ++k )
+            {
+                Node *      simpleChild = & ( nodeToProcess->n_child[ k ] );
+                if ( simpleChild->n_type != small_stmt )
+                    continue;
+
+                if ( k != 0 )
+                    ++statementCount;
+
+                Node *      nodeToProcess = getNodeToProcess( simpleChild );
+                if ( nodeToProcess == NULL )
+                    continue;
+
+                int         kind = getSmallStatementKind(
+                                                nodeToProcess->n_type );
+                if ( kind != UNDEFINED_FRAGMENT &&
+                     ! context->options.isBuilt( kind ) )
+                {
+                    addCodeBlock( context, & codeBlock, flow, parent );
+                    skipStatement( context, nodeToProcess, parent );
+                    continue;
                 }
-                continue;
-            case async_stmt:
+
+                switch ( nodeToProcess->n_type )
+                {
+                    case import_stmt:
+                        addCodeBlock( context, & codeBlock, flow, parent );
+                        lastAdded = processImport( context, nodeToProcess,
+                                                   parent, flow );
+                        continue;
+                    case assert_stmt:
+                        addCodeBlock( context, & codeBlock, flow, parent );
+                        lastAdded = processAssert( context, nodeToProcess,
+                                                   parent, flow );
+                        continue;
+                    case break_stmt:
+                        addCodeBlock( context, & codeBlock, flow, parent );
+                        lastAdded = processBreak( context, nodeToProcess,
+                                                  parent, flow );
+                        continue;
+                    case continue_stmt:
+                        addCodeBlock( context, & codeBlock, flow, parent );
+                        lastAdded = processContinue( context, nodeToProcess,
+                                                     parent, flow );
+                        continue;
+                    case return_stmt:
+                        addCodeBlock( context, & codeBlock, flow, parent );
+                        lastAdded = processReturn( context, nodeToProcess,
+                                                   parent, flow );
+                        continue;
+                    case raise_stmt:
+                        addCodeBlock( context, & codeBlock, flow, parent );
+                        lastAdded = processRaise( context, nodeToProcess,
+                                                  parent, flow );
+                        continue;
+                    default: ;
+                }
+
+                FragmentBase *  sysExit = NULL;
+                if ( context->options.sysExit )
+                    sysExit = checkForSysExit( context, simpleChild,
+                                               flow, parent );
+                if ( sysExit != NULL )
                 {
                     addCodeBlock( context, & codeBlock, flow, parent );
-                    node *      asyncStmtNode = & ( nodeToProcess->n_child[ 1 ] );
-                    if ( asyncStmtNode->n_type == funcdef )
+                    if ( ! context->options.isBuilt( SYSEXIT_FRAGMENT ) )
                     {
-                        std::list<Decorator *>      noDecors;
-                        lastAdded = processFuncDefinition( context, nodeToProcess,
-                                                           parent, flow,
-                                                           noDecors );
+                        // Takes the only reference and drops it
+                        Py::asObject( static_cast<SysExit *>(sysExit) );
+                        skipStatement( context, nodeToProcess, parent );
+                        continue;
                     }
-                    else if ( asyncStmtNode->n_type == with_stmt )
+
+                    // NB: the 'checkForSysExit() does not inject comments
+                    // because they first must be injected for the current
+                    // code block. The current block comments are injected
+                    // in the addCodeBlock() function so here the comments
+                    // are injected for sys.exit() only
+                    injectComments( context, flow, parent,
+                                    static_cast<SysExit *>(sysExit),
+                                    sysExit );
+                    flow.append( Py::asObject(
+                                        static_cast<SysExit *>(sysExit) ) );
+                    lastAdded = sysExit;
+                    continue;
+                }
+
+                // Some other statement
+                if ( statementCount == 1 && state.docstrProcessed )
+                    continue;   // That's a docstring
+
+                // Not a docstring => add it to the code block
+                if ( ! context->options.isBuilt( CODEBLOCK_FRAGMENT ) )
+                {
+                    skipStatement( context, nodeToProcess, parent );
+                    continue;
+                }
+                if ( codeBlock == NULL )
+                {
+                    codeBlock = createCodeBlock( nodeToProcess, parent, context );
+                }
+                else
+                {
+                    int     realFirstLine = nodeToProcess->n_lineno;
+
+                    if ( realFirstLine - codeBlock->lastLine > 1 )
                     {
-                        lastAdded = processWith( context, nodeToProcess,
-                                                 parent, flow );
+                        lastAdded = addCodeBlock( context, & codeBlock, flow,
+                                                  parent );
+                        codeBlock = createCodeBlock( nodeToProcess, parent, context );
                     }
-                    else if ( asyncStmtNode->n_type == for_stmt )
+                    else
                     {
-                        lastAdded = processFor( context, nodeToProcess,
-                                                parent, flow );
+                        addToCodeBlock( codeBlock, nodeToProcess, context );
                     }
                 }
-                continue;
-            case if_stmt:
-                addCodeBlock( context, & codeBlock, flow, parent );
-                lastAdded = processIf( context, nodeToProcess, parent, flow );
-                continue;
-            case while_stmt:
-                addCodeBlock( context, & codeBlock, flow, parent );
-                lastAdded = processWhile( context, nodeToProcess, parent, flow );
-                continue;
-            case for_stmt:
-                addCodeBlock( context, & codeBlock, flow, parent );
-                lastAdded = processFor( context, nodeToProcess, parent, flow );
-                continue;
-            case try_stmt:
-                addCodeBlock( context, & codeBlock, flow, parent );
-                lastAdded = processTry( context, nodeToProcess, parent, flow );
-                continue;
-            case with_stmt:
+            }
+            return;
+        default: ;
+    }
+
+    Node *      statement;
+    int         kind = getCompoundStatementKind( nodeToProcess, & statement );
+    if ( kind != UNDEFINED_FRAGMENT && ! context->options.isBuilt( kind ) )
+    {
+        addCodeBlock( context, & codeBlock, flow, parent );
+        FragmentBase *  last = walkSkippedStatement( context, nodeToProcess,
+                                                     statement, parent, flow );
+        if ( last != NULL )
+            lastAdded = last;
+        return;
+    }
+
+    switch ( nodeToProcess->n_type )
+    {
+        case async_stmt:
+            {
                 addCodeBlock( context, & codeBlock, flow, parent );
-                lastAdded = processWith( context, nodeToProcess, parent, flow );
-                continue;
-            case funcdef:
+                Node *      asyncStmtNode = & ( nodeToProcess->n_child[ 1 ] );
+                if ( asyncStmtNode->n_type == funcdef )
                 {
                     std::list<Decorator *>      noDecors;
-                    addCodeBlock( context, & codeBlock, flow, parent );
                     lastAdded = processFuncDefinition( context, nodeToProcess,
                                                        parent, flow,
                                                        noDecors );
                 }
-                continue;
-            case classdef:
+                else if ( asyncStmtNode->n_type == with_stmt )
                 {
-                    std::list<Decorator *>      noDecors;
-                    addCodeBlock( context, & codeBlock, flow, parent );
-                    lastAdded = processClassDefinition( context, nodeToProcess,
-                                                        parent, flow,
-                                                        noDecors );
+                    lastAdded = processWith( context, nodeToProcess,
+                                             parent, flow );
                 }
-                continue;
-            case decorated:
+                else if ( asyncStmtNode->n_type == for_stmt )
                 {
-                    // funcdef or classdef follows
-                    if ( nodeToProcess->n_nchildren < 2 )
-                        continue;
-
-                    node *  decorsNode = & ( nodeToProcess->n_child[ 0 ] );
-                    node *  classOrFuncNode = & ( nodeToProcess->n_child[ 1 ] );
-
-                    if ( decorsNode->n_type != decorators )
-                        continue;
-
-                    std::list<Decorator *>      decors =
-                            processDecorators( context, flow, parent,
-                                               decorsNode );
-
-                    if ( classOrFuncNode->n_type == funcdef )
-                    {
-                        addCodeBlock( context, & codeBlock, flow, parent );
-                        lastAdded = processFuncDefinition( context,
-                                                           classOrFuncNode,
-                                                           parent, flow,
-                                                           decors );
-                    }
-                    else if ( classOrFuncNode->n_type == classdef )
-                    {
-                        addCodeBlock( context, & codeBlock, flow, parent );
-                        lastAdded = processClassDefinition( context,
-                                                            classOrFuncNode,
-                                                            parent, flow,
-                                                            decors );
-                    }
-                    else if ( classOrFuncNode->n_type == async_funcdef )
-                    {
-                        addCodeBlock( context, & codeBlock, flow, parent );
-                        lastAdded = processFuncDefinition( context,
-                                                           classOrFuncNode,
-                                                           parent, flow,
-                                                           decors );
-                    }
+                    lastAdded = processFor( context, nodeToProcess,
+                                            parent, flow );
                 }
-                continue;
-        }
+            }
+            return;
+        case if_stmt:
+            addCodeBlock( context, & codeBlock, flow, parent );
+            lastAdded = processIf( context, nodeToProcess, parent, flow );
+            return;
+        case while_stmt:
+            addCodeBlock( context, & codeBlock, flow, parent );
+            lastAdded = processWhile( context, nodeToProcess, parent, flow );
+            return;
+        case for_stmt:
+            addCodeBlock( context, & codeBlock, flow, parent );
+            lastAdded = processFor( context, nodeToProcess, parent, flow );
+            return;
+        case try_stmt:
+            addCodeBlock( context, & codeBlock, flow, parent );
+            lastAdded = processTry( context, nodeToProcess, parent, flow );
+            return;
+        case with_stmt:
+            addCodeBlock( context, & codeBlock, flow, parent );
+            lastAdded = processWith( context, nodeToProcess, parent, flow );
+            return;
+        case funcdef:
+            {
+                std::list<Decorator *>      noDecors;
+                addCodeBlock( context, & codeBlock, flow, parent );
+                lastAdded = processFuncDefinition( context, nodeToProcess,
+                                                   parent, flow,
+                                                   noDecors );
+            }
+            return;
+        case classdef:
+            {
+                std::list<Decorator *>      noDecors;
+                addCodeBlock( context, & codeBlock, flow, parent );
+                lastAdded = processClassDefinition( context, nodeToProcess,
+                                                    parent, flow,
+                                                    noDecors );
+            }
+            return;
+        case decorated:
+            {
+                FragmentBase *  definition = processDecorated(
+                                                context, nodeToProcess,
+                                                & codeBlock, parent, flow );
+                if ( definition != NULL )
+                    lastAdded = definition;
+            }
+            return;
     }
+}
+
+
+// Adds the pending code block and the trailing comments of a suite. Returns
+// the last fragment added to the suite flow.
+static FragmentBase *
+finishWalk( Context *                    context,
+            FragmentBase *               parent,
+            Py::List &                   flow,
+            WalkState &                  state )
+{
+    FragmentBase *      lastAdded = state.lastAdded;
 
     // Add block if needed
-    if ( codeBlock != NULL )
+    if ( state.codeBlock != NULL )
     {
-        lastAdded = addCodeBlock( context, & codeBlock, flow, parent );
+        lastAdded = addCodeBlock( context, & state.codeBlock, flow, parent );
     }
 
     // There could be trailing comments that belong to the upper level flow
@@ -2997,85 +3033,416 @@ walk( Context *                    context,
 }
 
 
-// lastSpecialLine: max line (bang and encoding lines) or -1 if none found
-static int
-getFirstStatementLeadingCommentLine( Context *  context,
-                                     int  firstStatementLine,
-                                     int  lastSpecialLine )
+// The walker holds the GIL, so the thread which would cancel the parse could
+// not run till the walk is over. The GIL is released now and then for that.
+static bool
+isWalkStopped( Context *  context )
 {
-    if ( context->comments->empty() )
-        return INT_MAX;     // The module has no comments
+    if ( context->control == NULL ||
+         ++context->walkedStatements % WALK_CHECK_INTERVAL != 0 )
+        return false;
 
-    if ( firstStatementLine == INT_MAX )
-        return INT_MAX;     // There are no statements in the module
+    {
+        ReleasedGIL     otherThreads;
+    }
+    return context->control->shouldStop();
+}
 
-    std::deque< CommentLine >::const_iterator   current( context->comments->begin() );
-    bool                                        found = false;
-    for ( ; current != context->comments->end(); ++current )
+
+// The outline walk of a suite. Only the functions and the classes make
+// fragments; the suites of the other compound statements are walked for
+// the nested definitions which are added to the same flow. The parent end
+// is updated up to the suite last statement.
+static void
+walkOutline( Context *                    context,
+             Node *                       tree,
+             FragmentBase *               parent,
+             Py::List &                   flow )
+{
+    Node *      lastStatement = NULL;
+    CodeBlock * noCodeBlock = NULL;
+
+    for ( int  i = 0; i < tree->n_nchildren; ++i )
     {
-        if ( current->line == firstStatementLine - 1 )
+        Node *      child = & ( tree->n_child[ i ] );
+        if ( child->n_type != stmt && child->n_type != simple_stmt )
+            continue;
+
+        lastStatement = child;
+        if ( child->n_type == simple_stmt )
+            continue;
+
+        if ( isWalkStopped( context ) )
+            return;
+
+        Node *      nodeToProcess = getNodeToProcess( child );
+        if ( nodeToProcess == NULL )
+            continue;
+
+        std::list<Decorator *>      noDecors;
+        switch ( nodeToProcess->n_type )
         {
-            found = true;
-            break;
+            case funcdef:
+                processFuncDefinition( context, nodeToProcess,
+                                       parent, flow, noDecors );
+                continue;
+            case classdef:
+                processClassDefinition( context, nodeToProcess,
+                                        parent, flow, noDecors );
+                continue;
+            case decorated:
+                processDecorated( context, nodeToProcess, & noCodeBlock,
+                                  parent, flow );
+                continue;
+            case async_stmt:
+                if ( nodeToProcess->n_child[ 1 ].n_type == funcdef )
+                {
+                    processFuncDefinition( context, nodeToProcess,
+                                           parent, flow, noDecors );
+                    continue;
+                }
+                nodeToProcess = & ( nodeToProcess->n_child[ 1 ] );
+                break;
+            default: ;
         }
 
-        if ( current->line >= firstStatementLine )
-            break;
+        // if, while, for, try or with
+        for ( int  k = 0; k < nodeToProcess->n_nchildren; ++k )
+        {
+            Node *      part = & ( nodeToProcess->n_child[ k ] );
+            if ( part->n_type == suite )
+                walkOutline( context, part, parent, flow );
+        }
     }
 
-    if ( ! found )
-        return INT_MAX;
+    if ( lastStatement != NULL )
+    {
+        Fragment    temp;
+        updateEnd( & temp, findLastStatementPart( lastStatement ), context );
+        parent->updateEnd( & temp );
+    }
+}
 
-    // Here: the current iterator points to the comment line which is right
-    // before the first statement
-    if ( current->line <= lastSpecialLine )
-        return INT_MAX;     // The first statement is glued with the bang or
-                            // encoding line
 
-    // Now move back till a gap in lines or the special line
-    int     firstStatementLeadingCommentLine = current->line;
-    while ( current != context->comments->begin() )
+static FragmentBase *
+walk( Context *                    context,
+      Node *                       tree,
+      FragmentBase *               parent,
+      Py::List &                   flow,
+      bool                         docstrProcessed )
+{
+    if ( context->options.outline )
     {
-        --current;
-        if ( current->line != firstStatementLeadingCommentLine - 1 )
-            return firstStatementLeadingCommentLine;
-        if ( current->line <= lastSpecialLine )
-            return firstStatementLeadingCommentLine;
+        walkOutline( context, tree, parent, flow );
+        return NULL;
+    }
 
-        firstStatementLeadingCommentLine = current->line;
+    WalkState           state = { NULL, NULL, 0, docstrProcessed };
+
+    context->flowStack.push_back( &flow );
+    context->nodeStack.push_back( tree );
+
+    for ( int  i = 0; i < tree->n_nchildren; ++i )
+    {
+        Node *      child = & ( tree->n_child[ i ] );
+        if ( child->n_type != stmt  && child->n_type != simple_stmt )
+            continue;
+
+        if ( isWalkStopped( context ) )
+            break;
+
+        walkStatement( context, child, parent, flow, state );
     }
+    return finishWalk( context, parent, flow, state );
+}
 
-    // curremt pints to the being of the comments
-    if ( current->line == firstStatementLeadingCommentLine - 1 &&
-         current->line > lastSpecialLine )
-        firstStatementLeadingCommentLine = current->line;
 
-    return firstStatementLeadingCommentLine;
+// Adds the sys.exit() names imported in a suite which is not walked so the
+// statements after it are recognized the same way
+static void
+collectSysExitNames( Context *  context, Node *  tree )
+{
+    for ( int  k = 0; k < tree->n_nchildren; ++k )
+    {
+        Node *      child = & ( tree->n_child[ k ] );
+        switch ( child->n_type )
+        {
+            case import_stmt:
+                addSysExitNames( context, & ( child->n_child[ 0 ] ) );
+                break;
+            case stmt:          case simple_stmt:   case small_stmt:
+            case compound_stmt: case suite:         case decorated:
+            case async_stmt:    case async_funcdef: case funcdef:
+            case classdef:      case if_stmt:       case while_stmt:
+            case for_stmt:      case try_stmt:      case with_stmt:
+                collectSysExitNames( context, child );
+                break;
+            default: ;
+        }
+    }
 }
 
 
-static int
-getLastFileCommentLine( Context *  context,
-                        int  bangLine,
-                        int  encodingLine,
-                        int  firstStatementLine )
+// Provides the last token of the fragments a walk would build for the
+// last statement of the suite: the trailing ';' and the 'from' part of a
+// raise statement are not included
+static Node *
+findLastWalkedPart( Node *  tree )
 {
-    // There is one peculiar case to consider:
-    // - there is no hashbang line, but the '#' character is there
-    // - there is encoding line and it is at line 2
-    // It was decided to do the following in this case:
-    // - if the line 1 comment is not empty, then the comment is considered as
-    //   a part of comments for the file. if the comment is empty then it is
-    //   discarded
+    while ( tree->n_nchildren > 0 )
+    {
+        if ( tree->n_type == raise_stmt )
+        {
+            Node *      testNode = findChildOfType( tree, test );
+            if ( testNode == NULL )
+                return & ( tree->n_child[ 0 ] );
+            return findLastPart( testNode );
+        }
 
-    // The provided last file comment line is 1 based. -1 means the file has no
-    // comments
+        int     k = tree->n_nchildren - 1;
+        while ( k > 0 )
+        {
+            int     type = tree->n_child[ k ].n_type;
+            if ( type != NEWLINE && type != INDENT && type != DEDENT &&
+                 type != SEMI )
+                break;
+            --k;
+        }
+        tree = & ( tree->n_child[ k ] );
+    }
+    return tree;
+}
 
-    if ( context->comments->empty() )
-        return -1;      // No comment for the file
 
-    // When the first statement leading comments are analyzed, they must start
-    // after this line
+// A suite which is not walked takes the comments up to its last token. The
+// comments after it are left to the upper suites; if the walk could take
+// some of them as the suite trailing ones (the first of them is not to the
+// left of every position the suite could begin at) then the suite must be
+// walked. The parent gets the end the walk would give it. Returns false if
+// the suite must be walked.
+static bool
+deferSuite( Context *  context, Node *  tree, FragmentBase *  parent,
+            Docstring *  docstr )
+{
+    Fragment        last;
+    updateEnd( & last, findLastWalkedPart( tree ), context );
+
+    // The least position the last suite fragment could begin at
+    Node *          first = tree;
+    while ( first->n_nchildren > 0 )
+    {
+        int     k = 0;
+        while ( k < first->n_nchildren - 1 &&
+                ( first->n_child[ k ].n_type == NEWLINE ||
+                  first->n_child[ k ].n_type == INDENT ) )
+            ++k;
+        first = & ( first->n_child[ k ] );
+    }
+    INT_TYPE        blockShift = first->n_col_offset + 1;
+    if ( docstr != NULL && docstr->beginPos < blockShift )
+        blockShift = docstr->beginPos;
+
+    std::deque< CommentLine > &             comments = *context->comments;
+    std::deque< CommentLine >::iterator     after = comments.begin();
+    bool                                    sideComment = false;
+    for ( ; after != comments.end() && after->line <= last.endLine; ++after )
+    {
+        if ( after->pos < blockShift )
+            blockShift = after->pos;
+        if ( after->line == last.endLine )
+            sideComment = true;
+    }
+
+    if ( after != comments.end() && after->pos >= blockShift &&
+         after->line < getNextStatementLine( context,
+                                             context->nodeStack.size() - 1,
+                                             last.endLine ) )
+        return false;
+
+    // A side comment extends the end unless its statement is not built
+    if ( sideComment && context->options.kinds != ~0ULL )
+        return false;
+
+    if ( after != comments.begin() )
+    {
+        const CommentLine &     comment = *( after - 1 );
+        if ( comment.end > last.end )
+        {
+            last.end = comment.end;
+            last.endLine = comment.line;
+            last.endPos = comment.pos + ( comment.end - comment.begin );
+        }
+    }
+    parent->updateEnd( & last );
+
+    if ( context->lazySource )
+    {
+        LazySuite *     lazy = new LazySuite;
+        lazy->source = context->lazySource;
+        lazy->tree = tree;
+        lazy->nodeStack = context->nodeStack;
+        lazy->comments.assign( comments.begin(), after );
+        lazy->sysExit = context->sysExit;
+        lazy->docstring = docstr;
+        lazy->depth = context->depth;
+        parent->lazySuite = lazy;
+    }
+    comments.erase( comments.begin(), after );
+
+    if ( context->options.sysExit && ! context->options.outline &&
+         context->options.isBuilt( IMPORT_FRAGMENT ) )
+        collectSysExitNames( context, tree );
+    return true;
+}
+
+
+// Walks a nested suite of a statement part. The suites deeper than the
+// options allow are left empty or, if the suites are lazy, walked on the
+// first access.
+static FragmentBase *
+walkSuite( Context *            context,
+           Node *               tree,
+           FragmentBase *       parent,
+           Py::List &           flow,
+           Docstring *          docstr )
+{
+    FragmentBase *      lastAdded = NULL;
+
+    ++context->depth;
+    if ( context->options.isWalked( context->depth ) )
+        lastAdded = walk( context, tree, parent, flow, docstr != NULL );
+    else if ( ! deferSuite( context, tree, parent, docstr ) )
+    {
+        Docstring *     lastDocstring = context->lastDocstring;
+
+        lastAdded = walk( context, tree, parent, flow, docstr != NULL );
+        if ( ! context->lazySource )
+        {
+            // The walk was needed for the comments only
+            if ( lastAdded != NULL )
+                parent->updateEnd( lastAdded );
+            flow = Py::List();
+            context->lastDocstring = lastDocstring;
+            lastAdded = NULL;
+        }
+    }
+    --context->depth;
+    return lastAdded;
+}
+
+
+void  walkLazySuite( FragmentBase *  owner, Py::List &  flow )
+{
+    LazySuite *                     lazy = owner->lazySuite;
+    std::shared_ptr< LazySource >   source = lazy->source.lock();
+
+    if ( ! source )
+        throw Py::RuntimeError( "Cannot walk the suite: its control flow "
+                                "has been released" );
+
+    // The suite is walked once whatever happens
+    owner->lazySuite = NULL;
+    std::unique_ptr< LazySuite >    guard( lazy );
+
+    Context         context;
+    context.flow = source->flow;
+    context.buffer = source->buffer;
+    context.lineShifts = & source->tree.lineShifts[ 0 ];
+    context.comments = & lazy->comments;
+    context.sysExit.swap( lazy->sysExit );
+    context.lastDocstring = lazy->docstring;
+    context.control = NULL;
+    context.options = source->options;
+    context.depth = lazy->depth;
+    context.lazySource = source;
+
+    // The upper suites are needed for the trailing comments lines only
+    context.nodeStack = lazy->nodeStack;
+    context.flowStack.assign( lazy->nodeStack.size(), NULL );
+
+    walk( & context, lazy->tree, owner, flow, lazy->docstring != NULL );
+}
+
+
+// lastSpecialLine: max line (bang and encoding lines) or -1 if none found
+static int
+getFirstStatementLeadingCommentLine( Context *  context,
+                                     int  firstStatementLine,
+                                     int  lastSpecialLine )
+{
+    if ( context->comments->empty() )
+        return INT_MAX;     // The module has no comments
+
+    if ( firstStatementLine == INT_MAX )
+        return INT_MAX;     // There are no statements in the module
+
+    std::deque< CommentLine >::const_iterator   current( context->comments->begin() );
+    bool                                        found = false;
+    for ( ; current != context->comments->end(); ++current )
+    {
+        if ( current->line == firstStatementLine - 1 )
+        {
+            found = true;
+            break;
+        }
+
+        if ( current->line >= firstStatementLine )
+            break;
+    }
+
+    if ( ! found )
+        return INT_MAX;
+
+    // Here: the current iterator points to the comment line which is right
+    // before the first statement
+    if ( current->line <= lastSpecialLine )
+        return INT_MAX;     // The first statement is glued with the bang or
+                            // encoding line
+
+    // Now move back till a gap in lines or the special line
+    int     firstStatementLeadingCommentLine = current->line;
+    while ( current != context->comments->begin() )
+    {
+        --current;
+        if ( current->line != firstStatementLeadingCommentLine - 1 )
+            return firstStatementLeadingCommentLine;
+        if ( current->line <= lastSpecialLine )
+            return firstStatementLeadingCommentLine;
+
+        firstStatementLeadingCommentLine = current->line;
+    }
+
+    // curremt pints to the being of the comments
+    if ( current->line == firstStatementLeadingCommentLine - 1 &&
+         current->line > lastSpecialLine )
+        firstStatementLeadingCommentLine = current->line;
+
+    return firstStatementLeadingCommentLine;
+}
+
+
+static int
+getLastFileCommentLine( Context *  context,
+                        int  bangLine,
+                        int  encodingLine,
+                        int  firstStatementLine )
+{
+    // There is one peculiar case to consider:
+    // - there is no hashbang line, but the '#' character is there
+    // - there is encoding line and it is at line 2
+    // It was decided to do the following in this case:
+    // - if the line 1 comment is not empty, then the comment is considered as
+    //   a part of comments for the file. if the comment is empty then it is
+    //   discarded
+
+    // The provided last file comment line is 1 based. -1 means the file has no
+    // comments
+
+    if ( context->comments->empty() )
+        return -1;      // No comment for the file
+
+    // When the first statement leading comments are analyzed, they must start
+    // after this line
     int     beginLimit = std::max( bangLine, encodingLine );
     int     firstStatementLeadingCommentLine =
                     getFirstStatementLeadingCommentLine( context,
@@ -3144,12 +3511,12 @@ getLastFileCommentLine( Context *  context,
 
 
 static int
-findFirstStatementLine( node *  tree )
+findFirstStatementLine( Node *  tree )
 {
     assert( tree->n_type == file_input );
     for ( int k = 0; k < tree->n_nchildren; ++k )
     {
-        node *  child = &(tree->n_child[ k ]);
+        Node *  child = &(tree->n_child[ k ]);
         if ( child->n_type == stmt )
             return child->n_lineno;
     }
@@ -3157,128 +3524,932 @@ findFirstStatementLine( node *  tree )
 }
 
 
-Py::Object  parseInput( const char *  buffer, const char *  fileName,
-                        bool  serialize )
+// Checks that the buffer could be decoded with the declared encoding.
+// UTF-8 is the default one and it is not checked.
+static bool
+isDecodable( const char *  buffer, const std::string &  encoding )
 {
-    ControlFlow *           controlFlow = new ControlFlow();
+    if ( encoding.empty() || encoding == "utf-8" )
+        return true;
 
-    if ( serialize )
-        controlFlow->content = buffer;
+    PyObject *      decoded = PyUnicode_Decode( buffer, strlen( buffer ),
+                                                encoding.c_str(), "strict" );
+    if ( decoded == NULL )
+    {
+        PyErr_Clear();
+        return false;
+    }
+    Py_DECREF( decoded );
+    return true;
+}
 
-    perrdetail          error;
-    PyCompilerFlags     flags = { 0 };
-    node *              tree = PyParser_ParseStringFlagsFilename(
-                                    buffer, fileName, &_PyParser_Grammar,
-                                    file_input, &error, flags.cf_flags );
 
-    if ( tree == NULL )
+// Replaces a partially built control flow with an empty one which reports
+// why the parse was stopped. The partial fragments are released.
+static Py::Object
+stoppedControlFlow( ControlFlow *  partial, const ParseControl &  control )
+{
+    ControlFlow *   controlFlow = new ControlFlow();
+
+    controlFlow->content = partial->content;
+    partial->content = NULL;
+    Py::asObject( partial );        // Takes the only reference and drops it
+
+    switch ( control.getStatus() )
     {
-        int             line;
-        int             column;
-        std::string     message;
+        case ParseControl::CANCELLED:
+            controlFlow->addError( -1, -1, CANCELLED_ERROR );
+            break;
+        case ParseControl::SUPERSEDED:
+            controlFlow->addError( -1, -1, SUPERSEDED_ERROR );
+            break;
+        default:
+            controlFlow->addError( -1, -1, DEADLINE_ERROR );
+    }
+    return Py::asObject( controlFlow );
+}
 
-        getErrorMessage( & error, line, column, message );
-        controlFlow->addError( line, column, message );
-        PyErr_Clear();
+
+// Processes the module header: the bang and encoding lines, the file leading
+// comments and the docstring. The context is set up for the module suite
+// walk. Provides the file_input node to walk.
+static Node *
+walkModuleHeader( Context *  context, const char *  buffer, ParseTree &  tree,
+                  ControlFlow *  controlFlow, Py::List &  flow,
+                  bool &  docstrProcessed )
+{
+    Node *                          root = tree.root;
+    int                             bangLine = -1;
+    int                             encodingLine = -1;
+    std::deque< CommentLine > &     comments = tree.comments;
+
+    FragmentBase *      bang = checkForBangLine( buffer, controlFlow,
+                                                 comments );
+    if ( bang != NULL )
+        bangLine = bang->beginLine;
+
+    if ( root->n_type == encoding_decl )
+    {
+        FragmentBase *  encoding = processEncoding( buffer, root,
+                                                    controlFlow, comments );
+        root = & (root->n_child[ 0 ]);
+        if ( encoding != NULL )
+            encodingLine = encoding->beginLine;
     }
-    else
+
+
+    assert( root->n_type == file_input );
+
+    // The bang and the encoding lines are reported even if the comments
+    // are not needed
+    if ( ! context->options.needComments() )
+        comments.clear();
+
+    context->flow = controlFlow;
+    context->buffer = buffer;
+    context->lineShifts = & tree.lineShifts[ 0 ];
+    context->comments = & comments;
+    context->depth = 1;
+
+    // A file may also have leading comments
+    int     lastFileCommentLine = getLastFileCommentLine(
+                                        context,
+                                        bangLine, encodingLine,
+                                        findFirstStatementLine( root ) );
+    if ( lastFileCommentLine != -1 )
     {
-        /* Walk the tree and populate the python structures */
-        node *      root = tree;
-        int         totalLines = getTotalLines( tree );
-        int         bangLine = -1;
-        int         encodingLine = -1;
-
-        assert( totalLines >= 0 );
-        int                         lineShifts[ totalLines + 1 ];
-        std::deque< CommentLine >   comments;
-
-        getLineShiftsAndComments( buffer, lineShifts, comments );
-        FragmentBase *      bang = checkForBangLine( buffer, controlFlow,
-                                                     comments );
-        if ( bang != NULL )
-            bangLine = bang->beginLine;
-
-        if ( root->n_type == encoding_decl )
+        // A leading comment for a file has been detected. Inject it to the
+        // context object.
+        // true: consume all as leading. This is because of the case like:
+        //       # meaningful comment
+        //       # encoding: utf-8
+        //       # meaningful comment
+        // It is wierd but need to be handled.
+        // In the example above the lastFileCommentLine == 3 and there is
+        // a gap in the comments due to stripped encoding line
+        injectLeadingComments( context, flow,
+                               controlFlow, controlFlow, controlFlow,
+                               lastFileCommentLine + 1, true );
+    }
+
+    // Check for the docstring
+    Docstring *  docstr = checkForDocstring( context, root );
+    if ( docstr != NULL )
+    {
+        docstr->parent = controlFlow;
+        injectComments( context, flow, controlFlow, docstr, docstr );
+        controlFlow->docstring = Py::asObject( docstr );
+        controlFlow->updateBeginEnd( docstr );
+    }
+
+    docstrProcessed = docstr != NULL;
+    return root;
+}
+
+
+// Injects the module trailing comments and creates the module body. The
+// first suite fragment is None if it is still in the flow.
+static void
+walkModuleTail( Context *  context, ControlFlow *  controlFlow,
+                Py::List &  flow, Py::Object  first )
+{
+    // Inject trailing comments if so
+    injectLeadingComments( context, flow,
+                           controlFlow, NULL, NULL, INT_MAX, false );
+
+    if ( first.isNone() && flow.size() > 0 )
+        first = flow.front();
+
+    if ( ! first.isNone() )
+    {
+        // If there is nothing in the file => body is None
+        // Here: there is something, so create the real body fragment, i.e.
+        // everything except the 2 special purpose comment lines and
+        // possible a comment for the file
+        Fragment *      body( new Fragment );
+        body->parent = controlFlow;
+
+        body->begin = Py::Long( first.getAttr( "begin" ) );
+        body->beginLine = Py::Long( first.getAttr( "beginLine" ) );
+        body->beginPos = Py::Long( first.getAttr( "beginPos" ) );
+
+        // The control flow end had been already properly updated
+        body->updateEnd( controlFlow );
+
+        controlFlow->body = Py::asObject( body );
+    }
+}
+
+
+// The outline flow has the definitions only so the module body position is
+// taken from the first statement whatever it is. None if there is none.
+static Py::Object
+getFirstStatementPosition( Context *  context, Node *  tree,
+                           bool  docstrProcessed )
+{
+    for ( int  k = 0; k < tree->n_nchildren; ++k )
+    {
+        Node *      child = & ( tree->n_child[ k ] );
+        if ( child->n_type != stmt )
+            continue;
+        if ( docstrProcessed )
         {
-            FragmentBase *  encoding = processEncoding( buffer, tree,
-                                                        controlFlow, comments );
-            root = & (root->n_child[ 0 ]);
-            if ( encoding != NULL )
-                encodingLine = encoding->beginLine;
+            docstrProcessed = false;
+            continue;
         }
 
+        while ( child->n_nchildren > 0 )
+            child = & ( child->n_child[ 0 ] );
+
+        Fragment *      position( new Fragment );
+        updateBegin( position, child, context );
+        return Py::asObject( position );
+    }
+    return Py::None();
+}
+
+
+// Populates the control flow python structures from a syntax tree
+Py::Object
+buildControlFlow( const char *  buffer, bool  serialize,
+                  bool  parsed, ParseTree &  tree, ParseControl *  control,
+                  const ParseOptions *  options )
+{
+    ControlFlow *           controlFlow = new ControlFlow();
+
+    if ( serialize )
+        controlFlow->content = buffer;
 
-        assert( root->n_type == file_input );
+    if ( control != NULL && control->isStopped() )
+        return stoppedControlFlow( controlFlow, *control );
 
-        // Walk the syntax tree
+    // The buffer is decoded before it is tokenized so the decode errors
+    // come first
+    if ( ! isDecodable( buffer, tree.encoding ) )
+        controlFlow->addError( 0, 0, "decode error" );
+    else if ( ! parsed )
+        controlFlow->addError( tree.errorLine, tree.errorColumn,
+                               tree.errorMessage );
+    else
+    {
+        /* Walk the tree and populate the python structures */
         Context         context;
-        context.flow = controlFlow;
-        context.buffer = buffer;
-        context.lineShifts = lineShifts;
-        context.comments = & comments;
-
-        // A file may also have leading comments
-        int     lastFileCommentLine = getLastFileCommentLine(
-                                            & context,
-                                            bangLine, encodingLine,
-                                            findFirstStatementLine( root ) );
-        if ( lastFileCommentLine != -1 )
+        bool            docstrProcessed;
+
+        ParseTree *     walked = & tree;
+
+        context.control = control;
+        if ( control != NULL )
+            control->markStarted();
+        if ( options != NULL )
+            context.options = *options;
+        if ( serialize && context.options.lazySuites &&
+             context.options.maxDepth > 0 )
         {
-            // A leading comment for a file has been detected. Inject it to the
-            // context object.
-            // true: consume all as leading. This is because of the case like:
-            //       # meaningful comment
-            //       # encoding: utf-8
-            //       # meaningful comment
-            // It is wierd but need to be handled.
-            // In the example above the lastFileCommentLine == 3 and there is
-            // a gap in the comments due to stripped encoding line
-            injectLeadingComments( & context, controlFlow->nsuite,
-                                   controlFlow, controlFlow, controlFlow,
-                                   lastFileCommentLine + 1, true );
+            // The lazy suites are walked from the same tree later
+            std::shared_ptr< LazySource >   source( new LazySource );
+
+            source->tree.adopt( tree );
+            source->tree.root = tree.root;
+            source->tree.lineShifts.swap( tree.lineShifts );
+            source->tree.comments.swap( tree.comments );
+            source->buffer = buffer;
+            source->flow = controlFlow;
+            source->options = context.options;
+
+            controlFlow->lazySource = source;
+            context.lazySource = source;
+            walked = & source->tree;
         }
 
-        // Check for the docstring
-        Docstring *  docstr = checkForDocstring( & context, root );
-        if ( docstr != NULL )
+        Node *          root = walkModuleHeader( & context, buffer, *walked,
+                                                 controlFlow,
+                                                 controlFlow->nsuite,
+                                                 docstrProcessed );
+
+        walk( & context, root, controlFlow,
+              controlFlow->nsuite, docstrProcessed );
+        if ( control != NULL && control->isStopped() )
+            return stoppedControlFlow( controlFlow, *control );
+
+        Py::Object      first( Py::None() );
+        if ( context.options.outline )
+            first = getFirstStatementPosition( & context, root,
+                                               docstrProcessed );
+        walkModuleTail( & context, controlFlow, controlFlow->nsuite, first );
+
+        // The subtree hashes need the text which is not kept
+        if ( ! serialize && context.options.hashes )
+            controlFlow->getHash( buffer );
+    }
+
+    return Py::asObject( controlFlow );
+}
+
+
+
+Py::Object  parseInput( const char *  buffer, const char *  fileName,
+                        bool  serialize, ParseControl *  control,
+                        const ParseOptions *  options )
+{
+    ParseTree       tree;
+    bool            parsed;
+
+    if ( options != NULL )
+        tree.headerCommentsOnly = ! options->needComments();
+
+    // The native parser does not use python at all so the other threads
+    // could parse their buffers at the same time
+    {
+        ReleasedGIL     noGIL;
+        parsed = buildParseTree( buffer, tree, control );
+    }
+
+    return buildControlFlow( buffer, serialize, parsed, tree, control,
+                             options );
+}
+
+
+// The scanned fragments are on the definition line
+static Py::Object
+createScannedFragment( FragmentBase *  parent, int  begin, int  end,
+                       int  line, int  pos )
+{
+    Fragment *      fragment( new Fragment );
+
+    fragment->parent = parent;
+    fragment->begin = begin;
+    fragment->end = end;
+    fragment->beginLine = line;
+    fragment->beginPos = pos;
+    fragment->endLine = line;
+    fragment->endPos = pos + end - begin;
+    return Py::asObject( fragment );
+}
+
+
+static void
+setScannedParts( FragmentBase *  item, Py::Object &  name,
+                 ControlFlow *  controlFlow,
+                 const ScannedDefinition &  definition )
+{
+    item->parent = controlFlow;
+    item->begin = definition.begin;
+    item->beginLine = definition.beginLine;
+    item->beginPos = 1;
+    item->end = definition.end;
+    item->endLine = definition.endLine;
+    item->endPos = definition.endPos;
+    controlFlow->updateBeginEnd( item );
+
+    if ( definition.nameBegin != -1 )
+        name = createScannedFragment( item, definition.nameBegin,
+                                      definition.nameEnd, definition.line,
+                                      definition.pos + definition.nameBegin -
+                                      definition.keywordBegin );
+}
+
+
+Py::Object  scanInput( char *  buffer )
+{
+    ControlFlow *                       controlFlow = new ControlFlow();
+    std::vector< ScannedDefinition >    definitions;
+
+    controlFlow->content = buffer;
+    controlFlow->phase = PHASE_APPROXIMATE;
+    scanDefinitions( buffer, definitions );
+
+    for ( std::vector< ScannedDefinition >::const_iterator
+            k = definitions.begin(); k != definitions.end(); ++k )
+    {
+        if ( k->isClass )
         {
-            docstr->parent = controlFlow;
-            injectComments( & context, controlFlow->nsuite,
-                            controlFlow, docstr, docstr );
-            controlFlow->docstring = Py::asObject( docstr );
-            controlFlow->updateBeginEnd( docstr );
+            Class *     cls( new Class );
+
+            setScannedParts( cls, cls->name, controlFlow, *k );
+            controlFlow->nsuite.append( Py::asObject( cls ) );
+            continue;
         }
 
-        walk( & context, root, controlFlow,
-              controlFlow->nsuite, docstr != NULL );
-        PyNode_Free( tree );
+        Function *  func( new Function );
+
+        setScannedParts( func, func->name, controlFlow, *k );
+        func->defKeyword = createScannedFragment( func, k->keywordBegin,
+                                                  k->keywordBegin + 2,
+                                                  k->line, k->pos );
+        if ( k->asyncBegin != -1 )
+            func->asyncKeyword = createScannedFragment( func, k->asyncBegin,
+                                                        k->asyncBegin + 4,
+                                                        k->line, 1 );
+        controlFlow->nsuite.append( Py::asObject( func ) );
+    }
+    return Py::asObject( controlFlow );
+}
+
+
+ControlFlowIterator::ControlFlowIterator( char *  buffer ) :
+    partTree( NULL ), walkedTree( NULL ), nextPart( 0 ),
+    controlFlow( new ControlFlow() ),
+    root( NULL ), nextChild( 0 ), readyIndex( 0 )
+{
+    controlFlowObject = Py::asObject( controlFlow );
+    controlFlow->iterated = true;
+    if ( buffer == NULL )
+        return;
+
+    controlFlow->content = buffer;
+    getParseParts( buffer, parts );
+
+    // The header needs the first statement line so a first part without
+    // statements is parsed with the rest of the buffer
+    bool        parsed = parsePart( 0 );
+    if ( parsed && parts.size() > 1 &&
+         findFirstStatementLine( root ) == INT_MAX )
+        parsed = false;
+    if ( ! parsed && parts.size() > 1 )
+        parsed = parseRest( 0 );
+
+    if ( ! isDecodable( buffer, tree.encoding ) )
+    {
+        controlFlow->addError( 0, 0, "decode error" );
+        root = NULL;
+        return;
+    }
+    if ( ! parsed )
+    {
+        controlFlow->addError( tree.errorLine, tree.errorColumn,
+                               tree.errorMessage );
+        root = NULL;
+        return;
+    }
+
+    context.control = NULL;
+    state.codeBlock = NULL;
+    state.lastAdded = NULL;
+    state.statementCount = 0;
+
+    Py::List    flow;
+    tree.root = partTree->root;
+    walkModuleHeader( & context, buffer, tree, controlFlow, flow,
+                      state.docstrProcessed );
+    tree.root = NULL;   // The nodes belong to the part tree
+    if ( flow.size() > 0 )
+        first = flow.front();
+
+    // The header pieces go before the comments collected with them
+    if ( ! controlFlow->bangLine.isNone() )
+        ready.append( controlFlow->bangLine );
+    if ( ! controlFlow->encodingLine.isNone() )
+        ready.append( controlFlow->encodingLine );
+    if ( ! controlFlow->docstring.isNone() )
+        ready.append( controlFlow->docstring );
+    for ( Py::List::size_type  k = 0; k < flow.size(); ++k )
+        ready.append( flow[ k ] );
+
+    context.flowStack.push_back( & ready );
+    context.nodeStack.push_back( root );
+}
+
+
+ControlFlowIterator::~ControlFlowIterator()
+{
+    delete walkedTree;
+    delete partTree;
+}
+
+
+// Parses the given buffer part. The walked part nodes are replaced only if
+// the part is fine.
+bool ControlFlowIterator::parsePart( size_t  index )
+{
+    ParseTree *     parsedTree( new ParseTree() );
+    bool            parsed;
+    {
+        ReleasedGIL     noGIL;
+        parsed = buildPartParseTree( controlFlow->content, parts, index,
+                                     *parsedTree );
+    }
+
+    nextPart = index + 1;
+    return addPart( parsedTree, parsed, parts[ index ].firstLine,
+                    index == 0 );
+}
+
+
+// The parts are parsed alone as they come so a part with a syntax error is
+// reparsed with the whole buffer for the proper error message. The walk goes
+// on from the part beginning in the unlikely case the buffer is fine.
+bool ControlFlowIterator::parseRest( size_t  index )
+{
+    ParseTree *     parsedTree( new ParseTree() );
+    bool            parsed;
+    {
+        ReleasedGIL     noGIL;
+        parsed = buildParseTree( controlFlow->content, *parsedTree );
+    }
+
+    nextPart = parts.size();
+    if ( parsed && index == 0 )
+        tree.comments.clear();
+    if ( ! addPart( parsedTree, parsed, parts[ index ].firstLine, true ) )
+        return false;
+
+    while ( nextChild < root->n_nchildren &&
+            root->n_child[ nextChild ].n_lineno < parts[ index ].firstLine )
+        ++nextChild;
+    return true;
+}
+
+
+// Takes the nodes, the line shifts and the comments of the parsed tree from
+// the given line on. The complete trees cover the buffer from the first line.
+// The error of a failed parse is kept in the tree error fields.
+bool ControlFlowIterator::addPart( ParseTree *  parsedTree, bool  parsed,
+                                   int  firstLine, bool  complete )
+{
+    if ( complete )
+        tree.encoding = parsedTree->encoding;
+    if ( ! parsed )
+    {
+        tree.errorLine = parsedTree->errorLine;
+        tree.errorColumn = parsedTree->errorColumn;
+        tree.errorMessage = parsedTree->errorMessage;
+        delete parsedTree;
+        return false;
+    }
+
+    if ( complete )
+        tree.lineShifts.swap( parsedTree->lineShifts );
+    else
+        tree.lineShifts.insert( tree.lineShifts.end(),
+                                parsedTree->lineShifts.begin(),
+                                parsedTree->lineShifts.end() );
+
+    // The comments of the walked parts which are not injected yet stay
+    if ( context.flowStack.empty() || context.options.needComments() )
+    {
+        std::deque< CommentLine > &     comments( parsedTree->comments );
+        std::deque< CommentLine >::iterator     k( comments.begin() );
+        while ( k != comments.end() && k->line < firstLine )
+            ++k;
+        tree.comments.insert( tree.comments.end(), k, comments.end() );
+    }
+
+    root = parsedTree->root;
+    if ( root->n_type == encoding_decl )
+        root = & root->n_child[ 0 ];
+    nextChild = 0;
+
+    if ( ! context.flowStack.empty() )
+    {
+        // The header is walked; the vectors could be reallocated
+        context.lineShifts = & tree.lineShifts[ 0 ];
+        context.nodeStack[ 0 ] = root;
+    }
+
+    // A pending code block refers to the walked part nodes. The part starts
+    // with a definition which adds the block so the nodes are not needed
+    // after that.
+    delete walkedTree;
+    walkedTree = partTree;
+    partTree = parsedTree;
+    return true;
+}
+
+
+void ControlFlowIterator::initType( void )
+{
+    behaviors().name( "ControlFlowIterator" );
+    behaviors().doc( CONTROL_FLOW_ITERATOR_DOC );
+    behaviors().supportGetattr();
+    behaviors().supportIter();
+
+    behaviors().readyType();
+}
+
+
+Py::Object  ControlFlowIterator::getattr( const char *  attrName )
+{
+    if ( strcmp( attrName, "controlFlow" ) == 0 )
+        return controlFlowObject;
+    return getattr_methods( attrName );
+}
+
+
+Py::Object  ControlFlowIterator::iter( void )
+{
+    return Py::Object( this );
+}
+
+
+// Walks the next top level statements until some fragments are complete
+void ControlFlowIterator::walkNext( void )
+{
+    previous = ready;
+    ready = Py::List();
+    readyIndex = 0;
+
+    for ( ; ; )
+    {
+        if ( nextChild >= root->n_nchildren )
+        {
+            if ( nextPart >= parts.size() )
+                break;
+
+            size_t      index = nextPart;
+            if ( ! parsePart( index ) && ! parseRest( index ) )
+            {
+                // The fragments walked so far are still provided
+                finishWalk( & context, controlFlow, ready, state );
+                controlFlow->addError( tree.errorLine, tree.errorColumn,
+                                       tree.errorMessage );
+                root = NULL;
+                previous = Py::List();
+                return;
+            }
+            continue;
+        }
 
-        // Inject trailing comments if so
-        injectLeadingComments( & context, controlFlow->nsuite,
-                               controlFlow, NULL, NULL, INT_MAX, false );
+        Node *      child = & ( root->n_child[ nextChild++ ] );
+        if ( child->n_type != stmt  && child->n_type != simple_stmt )
+            continue;
 
-        if ( controlFlow->nsuite.size() > 0 )
+        walkStatement( & context, child, controlFlow, ready, state );
+        if ( ready.size() > 0 )
         {
-            // If there is nothing in the file => body is None
-            // Here: there is something, so create the real body fragment, i.e.
-            // everything except the 2 special purpose comment lines and
-            // possible a comment for the file
-            Fragment *      body( new Fragment );
-            body->parent = controlFlow;
-
-            Py::Object      fo = controlFlow->nsuite.front();
-            body->begin = Py::Long( fo.getAttr( "begin" ) );
-            body->beginLine = Py::Long( fo.getAttr( "beginLine" ) );
-            body->beginPos = Py::Long( fo.getAttr( "beginPos" ) );
-
-            // The control flow end had been already properly updated
-            body->updateEnd( controlFlow );
-
-            controlFlow->body = Py::asObject( body );
+            if ( first.isNone() )
+            {
+                // Only the position is needed for the module body
+                Py::Object      fo( ready.front() );
+                Fragment *      position( new Fragment );
+                position->begin = Py::Long( fo.getAttr( "begin" ) );
+                position->beginLine = Py::Long( fo.getAttr( "beginLine" ) );
+                position->beginPos = Py::Long( fo.getAttr( "beginPos" ) );
+                first = Py::asObject( position );
+            }
+            return;
         }
     }
 
-    return Py::asObject( controlFlow );
+    finishWalk( & context, controlFlow, ready, state );
+    walkModuleTail( & context, controlFlow, ready, first );
+    root = NULL;
+    previous = Py::List();
+}
+
+
+// The header fragments are held by the control flow itself
+static bool
+isHeaderFragment( ControlFlow *  controlFlow, const Py::Object &  fragment )
+{
+    return fragment.ptr() == controlFlow->bangLine.ptr() ||
+           fragment.ptr() == controlFlow->encodingLine.ptr() ||
+           fragment.ptr() == controlFlow->docstring.ptr();
+}
+
+
+PyObject *  ControlFlowIterator::iternext( void )
+{
+    while ( readyIndex >= ready.size() )
+    {
+        if ( root == NULL )
+            return NULL;    // The end of the iteration
+        walkNext();
+    }
+
+    Py::Object      fragment( ready[ readyIndex++ ] );
+    if ( ! isHeaderFragment( controlFlow, fragment ) )
+        getFragment( fragment.ptr() )->owner = controlFlowObject;
+    return Py::new_reference_to( fragment );
 }
 
+
+// The visitor walk state
+struct VisitContext
+{
+    const int *         lineShifts;
+    CFVisitCallback     callback;
+    void *              data;
+};
+
+
+static bool
+visitSuite( VisitContext *  context, Node *  tree );
+
+
+static Node *
+findSuiteAfter( Node *  tree, Node *  from )
+{
+    Node *      last = & ( tree->n_child[ tree->n_nchildren - 1 ] );
+    for ( ; from <= last; ++from )
+        if ( from->n_type == suite )
+            return from;
+    return NULL;
+}
+
+
+static void
+initEvent( VisitContext *  context, CFVisitEvent &  event, int  kind,
+           const char *  name, Node *  first, Node *  last )
+{
+    event.kind = kind;
+    event.name = name;
+    updateBegin( & event, first, context->lineShifts );
+    updateEnd( & event, last, context->lineShifts );
+}
+
+
+// Returns false if the callback stopped the walk
+static bool
+sendEvent( VisitContext *  context, CFVisitEvent &  event, int  type )
+{
+    event.event = type;
+    return context->callback( & event, context->data ) != 0;
+}
+
+
+// Reports a statement which has no nested suites
+static bool
+visitSimple( VisitContext *  context, int  kind, Node *  tree )
+{
+    CFVisitEvent    event;
+    initEvent( context, event, kind, NULL, tree, findLastPart( tree ) );
+    return sendEvent( context, event, VISIT_ENTER ) &&
+           sendEvent( context, event, VISIT_LEAVE );
+}
+
+
+// Reports an elif, else, except or finally part which begins at the given
+// node and lasts till the end of the suite
+static bool
+visitPart( VisitContext *  context, int  kind, Node *  first, Node *  suiteNode )
+{
+    if ( suiteNode == NULL )
+        return true;
+
+    CFVisitEvent    event;
+    initEvent( context, event, kind, NULL, first,
+               findLastStatementPart( suiteNode ) );
+    return sendEvent( context, event, VISIT_ENTER ) &&
+           visitSuite( context, suiteNode ) &&
+           sendEvent( context, event, VISIT_LEAVE );
+}
+
+
+// first is the decorators or the async node if there is one
+static bool
+visitStatement( VisitContext *  context, Node *  tree, Node *  first )
+{
+    CFVisitEvent    event;
+
+    switch ( tree->n_type )
+    {
+        case simple_stmt:
+            for ( int  k = 0; k < tree->n_nchildren; ++k )
+            {
+                Node *      simpleChild = & ( tree->n_child[ k ] );
+                if ( simpleChild->n_type != small_stmt )
+                    continue;
+
+                Node *      nodeToProcess = getNodeToProcess( simpleChild );
+                if ( nodeToProcess == NULL )
+                    continue;
+
+                bool        proceed = true;
+                switch ( nodeToProcess->n_type )
+                {
+                    case import_stmt:
+                        proceed = visitSimple( context, IMPORT_FRAGMENT,
+                                               nodeToProcess );
+                        break;
+                    case assert_stmt:
+                        proceed = visitSimple( context, ASSERT_FRAGMENT,
+                                               nodeToProcess );
+                        break;
+                    case break_stmt:
+                        proceed = visitSimple( context, BREAK_FRAGMENT,
+                                               nodeToProcess );
+                        break;
+                    case continue_stmt:
+                        proceed = visitSimple( context, CONTINUE_FRAGMENT,
+                                               nodeToProcess );
+                        break;
+                    case return_stmt:
+                        proceed = visitSimple( context, RETURN_FRAGMENT,
+                                               nodeToProcess );
+                        break;
+                    case raise_stmt:
+                        proceed = visitSimple( context, RAISE_FRAGMENT,
+                                               nodeToProcess );
+                        break;
+                    default: ;
+                }
+                if ( ! proceed )
+                    return false;
+            }
+            return true;
+        case async_stmt:
+        case async_funcdef:
+        case decorated:
+            if ( tree->n_nchildren < 2 )
+                return true;
+            return visitStatement( context, & ( tree->n_child[ 1 ] ), first );
+        case if_stmt:
+            initEvent( context, event, IF_FRAGMENT, NULL, first,
+                       findLastStatementPart( tree ) );
+            if ( ! sendEvent( context, event, VISIT_ENTER ) )
+                return false;
+            for ( int  k = 0; k < tree->n_nchildren; ++k )
+            {
+                Node *  child = & ( tree->n_child[ k ] );
+                if ( child->n_type == NAME )
+                    if ( ! visitPart( context, ELIF_PART_FRAGMENT, child,
+                                      findSuiteAfter( tree, child ) ) )
+                        return false;
+            }
+            return sendEvent( context, event, VISIT_LEAVE );
+        case while_stmt:
+        case for_stmt:
+            initEvent( context, event,
+                       tree->n_type == while_stmt ? WHILE_FRAGMENT
+                                                  : FOR_FRAGMENT,
+                       NULL, first, findLastStatementPart( tree ) );
+            if ( ! sendEvent( context, event, VISIT_ENTER ) )
+                return false;
+            if ( ! visitSuite( context, findChildOfType( tree, suite ) ) )
+                return false;
+            {
+                Node *  elseNode = findChildOfTypeAndValue( tree, NAME,
+                                                            "else" );
+                if ( elseNode != NULL )
+                    if ( ! visitPart( context, ELIF_PART_FRAGMENT, elseNode,
+                                      findSuiteAfter( tree, elseNode ) ) )
+                        return false;
+            }
+            return sendEvent( context, event, VISIT_LEAVE );
+        case try_stmt:
+            initEvent( context, event, TRY_FRAGMENT, NULL, first,
+                       findLastStatementPart( tree ) );
+            if ( ! sendEvent( context, event, VISIT_ENTER ) )
+                return false;
+            if ( ! visitSuite( context, findChildOfType( tree, suite ) ) )
+                return false;
+            for ( int  k = 0; k < tree->n_nchildren; ++k )
+            {
+                Node *  child = & ( tree->n_child[ k ] );
+                int     kind = EXCEPT_PART_FRAGMENT;
+
+                if ( child->n_type == NAME )
+                {
+                    if ( strcmp( child->n_str, "else" ) == 0 )
+                        kind = ELIF_PART_FRAGMENT;
+                    else if ( strcmp( child->n_str, "finally" ) != 0 )
+                        continue;
+                }
+                else if ( child->n_type != except_clause )
+                    continue;
+
+                if ( ! visitPart( context, kind, child,
+                                  findSuiteAfter( tree, child ) ) )
+                    return false;
+            }
+            return sendEvent( context, event, VISIT_LEAVE );
+        case with_stmt:
+            initEvent( context, event, WITH_FRAGMENT, NULL, first,
+                       findLastStatementPart( tree ) );
+            return sendEvent( context, event, VISIT_ENTER ) &&
+                   visitSuite( context, findChildOfType( tree, suite ) ) &&
+                   sendEvent( context, event, VISIT_LEAVE );
+        case funcdef:
+        case classdef:
+            initEvent( context, event,
+                       tree->n_type == funcdef ? FUNCTION_FRAGMENT
+                                               : CLASS_FRAGMENT,
+                       tree->n_child[ 1 ].n_str, first,
+                       findLastStatementPart( tree ) );
+            return sendEvent( context, event, VISIT_ENTER ) &&
+                   visitSuite( context, findChildOfType( tree, suite ) ) &&
+                   sendEvent( context, event, VISIT_LEAVE );
+    }
+    return true;
+}
+
+
+static bool
+visitSuite( VisitContext *  context, Node *  tree )
+{
+    if ( tree == NULL )
+        return true;
+
+    for ( int  i = 0; i < tree->n_nchildren; ++i )
+    {
+        Node *      child = & ( tree->n_child[ i ] );
+        if ( child->n_type != stmt  && child->n_type != simple_stmt )
+            continue;
+
+        Node *      nodeToProcess = getNodeToProcess( child );
+        if ( nodeToProcess == NULL )
+            continue;
+        if ( ! visitStatement( context, nodeToProcess, nodeToProcess ) )
+            return false;
+    }
+    return true;
+}
+
+
+bool  visitParseTree( ParseTree &  tree, CFVisitCallback  callback,
+                      void *  data )
+{
+    Node *          root = tree.root;
+    if ( root->n_type == encoding_decl )
+        root = & ( root->n_child[ 0 ] );
+
+    VisitContext    context;
+    context.lineShifts = & tree.lineShifts[ 0 ];
+    context.callback = callback;
+    context.data = data;
+    return visitSuite( & context, root );
+}
+
+
+Py::Object  visitInput( const char *  buffer, CFVisitCallback  callback,
+                        void *  data, bool  withoutGIL )
+{
+    ParseTree       tree;
+    bool            parsed;
+    {
+        ReleasedGIL     noGIL;
+        parsed = buildParseTree( buffer, tree );
+    }
+
+    Py::List        errors;
+    if ( ! isDecodable( buffer, tree.encoding ) )
+        errors.append( Py::TupleN( Py::Int( 0 ), Py::Int( 0 ),
+                                   Py::String( "decode error" ) ) );
+    else if ( ! parsed )
+        errors.append( Py::TupleN( Py::Int( tree.errorLine ),
+                                   Py::Int( tree.errorColumn ),
+                                   Py::String( tree.errorMessage ) ) );
+    else if ( withoutGIL )
+    {
+        ReleasedGIL     noGIL;
+        visitParseTree( tree, callback, data );
+    }
+    else
+        visitParseTree( tree, callback, data );
+    return errors;
+}
+
+
+#ifdef CDM_CF_PGEN_AVAILABLE
+Py::Object  parseInputPgen( const char *  buffer, const char *  fileName,
+                            bool  serialize, ParseControl *  control,
+                            const ParseOptions *  options )
+{
+    ParseTree       tree;
+    bool            parsed = buildPgenParseTree( buffer, fileName, tree );
+
+    return buildControlFlow( buffer, serialize, parsed, tree, control,
+                             options );
+}
+#endif
@@ -22,9 +22,140 @@
 #define CFLOWPARSER_HPP
 
 #include "CXX/Objects.hxx"
+#include "CXX/Extensions.hxx"
+#include "cflowpgen.hpp"
+#include "cflowsyntax.hpp"
+#include "cflowfragments.hpp"
+#include "cflowvisitor.hpp"
 
+
+// Lets the other python threads run while the code which does not touch the
+// python objects is working, e.g. while the syntax tree is built. The GIL
+// is taken back when the object goes out of scope, exceptions included.
+class ReleasedGIL
+{
+    public:
+        ReleasedGIL() : state( PyEval_SaveThread() )
+        {}
+        ~ReleasedGIL()
+        { PyEval_RestoreThread( state ); }
+
+    private:
+        PyThreadState *     state;
+
+        ReleasedGIL( const ReleasedGIL & );
+        ReleasedGIL &  operator=( const ReleasedGIL & );
+};
+
+// The errors of a stopped parse
+#define CANCELLED_ERROR     "cancelled"
+#define DEADLINE_ERROR      "deadline exceeded"
+#define SUPERSEDED_ERROR    "superseded"
+
+// The control (if given) can stop the parse. A stopped parse gives an empty
+// control flow with the CANCELLED_ERROR, DEADLINE_ERROR or SUPERSEDED_ERROR
+// message at line -1. NULL options stand for the defaults.
 Py::Object  parseInput( const char *  buffer, const char *  fileName,
-                        bool  serialize );
+                        bool  serialize, ParseControl *  control = NULL,
+                        const ParseOptions *  options = NULL );
+
+// The pre-scan of a freshly opened file: provides a PHASE_APPROXIMATE control
+// flow with the top level functions and classes only. They have the ranges,
+// the names and the keywords while the rest is left empty. It takes the
+// ownership of the buffer.
+Py::Object  scanInput( char *  buffer );
+
+// The second half of parseInput(): builds the control flow objects from the
+// syntax tree built by buildParseTree(). It needs the GIL while the tree
+// could be built on any thread. If serialize is true then the control flow
+// takes the ownership of the buffer. The lazy suites (if any) take the
+// syntax tree over.
+Py::Object  buildControlFlow( const char *  buffer, bool  serialize,
+                              bool  parsed, ParseTree &  tree,
+                              ParseControl *  control = NULL,
+                              const ParseOptions *  options = NULL );
+
+// What the lazy suites of a control flow are walked from. The control flow
+// owns it so the syntax tree lives while the control flow does.
+struct LazySource
+{
+    ParseTree       tree;       // The comments are given to the suites
+    const char *    buffer;     // Owned by the control flow
+    ControlFlow *   flow;
+    ParseOptions    options;
+};
+
+// Walks the module suite lazily. The top level fragments are provided one by
+// one as soon as they are complete, comments included, so a consumer could
+// process and drop them before the rest of the module is walked. The header
+// fragments (the bang line, the encoding line and the docstring) come first.
+// The control flow gets its end and its body when the iteration is over.
+// The buffer is parsed part by part, see getParseParts(), so only the syntax
+// trees of the walked part and of the previous one are in memory.
+class ControlFlowIterator : public Py::PythonExtension< ControlFlowIterator >
+{
+    public:
+        // Takes the ownership of the buffer; NULL stands for an empty code
+        ControlFlowIterator( char *  buffer );
+        virtual ~ControlFlowIterator();
+
+        static void initType( void );
+        Py::Object getattr( const char *  attrName );
+
+        Py::Object  iter( void );
+        PyObject *  iternext( void );
+
+    private:
+        ParseTree       tree;           // The header nodes, the line shifts
+                                        // and the comments of the parts
+                                        // parsed so far
+        ParseTree *     partTree;       // The nodes of the part being walked
+        ParseTree *     walkedTree;     // The nodes of the previous part
+        std::vector< BufferPart >   parts;
+        size_t          nextPart;
+        Context         context;
+        WalkState       state;
+        Py::Object      controlFlowObject;  // The fragments parent
+        ControlFlow *   controlFlow;
+        Node *          root;           // NULL when the walk is over
+        int             nextChild;
+
+        Py::List        ready;          // Complete fragments to provide
+        Py::List::size_type readyIndex;
+        Py::List        previous;       // The last walked statement fragments
+                                        // are referred to by the walk state
+        Py::Object      first;          // The module body begin or None
+
+        bool  parsePart( size_t  index );
+        bool  parseRest( size_t  index );
+        bool  addPart( ParseTree *  parsedTree, bool  parsed,
+                       int  firstLine, bool  complete );
+        void  walkNext( void );
+
+        ControlFlowIterator( const ControlFlowIterator & );
+        ControlFlowIterator &  operator=( const ControlFlowIterator & );
+};
+
+// Walks the syntax tree built by buildParseTree() and reports the control
+// flow statements to the callback instead of creating the fragments. It
+// does not touch the python objects. Returns false if the callback stopped
+// the walk.
+bool  visitParseTree( ParseTree &  tree, CFVisitCallback  callback,
+                      void *  data );
+
+// Builds the syntax tree and visits it. Provides the list of errors in the
+// same format as the control flow errors. The callback is called without the
+// GIL if withoutGIL is true.
+Py::Object  visitInput( const char *  buffer, CFVisitCallback  callback,
+                        void *  data, bool  withoutGIL );
+
+#ifdef CDM_CF_PGEN_AVAILABLE
+// The same as parseInput() but the syntax tree is built by the python pgen
+// parser. It is available for python 3.9 only and used to cross check the results.
+Py::Object  parseInputPgen( const char *  buffer, const char *  fileName,
+                            bool  serialize, ParseControl *  control = NULL,
+                            const ParseOptions *  options = NULL );
+#endif
 
 
 #endif
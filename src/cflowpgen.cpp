@@ -0,0 +1,210 @@
+/*
+ * codimension - graphics python two-way code editor and analyzer
+ * Copyright (C) 2014 - 2016  Sergey Satskiy <sergey.satskiy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Syntax tree built by the python pgen parser
+ */
+
+#include <string.h>
+
+#include "cflowsyntax.hpp"
+#include "cflowpgen.hpp"
+
+
+#ifdef CDM_CF_PGEN_AVAILABLE
+
+/*
+ * The python grammar and token headers define the same names as the native
+ * parser enumerations (with the same values) so they must be the last ones.
+ */
+#include <node.h>
+#include <grammar.h>
+#include <parsetok.h>
+#include <graminit.h>
+#include <errcode.h>
+#include <token.h>
+
+
+extern grammar      _PyParser_Grammar;  /* From graminit.c */
+
+
+/* Copied and adjusted from
+ * static void err_input(perrdetail *err)
+ */
+static void getErrorMessage( perrdetail *  err,
+                             int &  line, int &  column,
+                             std::string &  message )
+{
+    line = err->lineno;
+    column = err->offset;
+
+    switch ( err->error )
+    {
+        case E_ERROR:
+            message = "execution error";
+            return;
+        case E_SYNTAX:
+            if ( err->expected == INDENT )
+                message = "expected an indented block";
+            else if ( err->token == INDENT )
+                message = "unexpected indent";
+            else if (err->token == DEDENT)
+                message = "unexpected unindent";
+            else
+                message = "invalid syntax";
+            break;
+        case E_TOKEN:
+            message = "invalid token";
+            break;
+        case E_EOFS:
+            message = "EOF while scanning triple-quoted string literal";
+            break;
+        case E_EOLS:
+            message = "EOL while scanning string literal";
+            break;
+        case E_INTR:
+            message = "keyboard interrupt";
+            goto cleanup;
+        case E_NOMEM:
+            message = "no memory";
+            goto cleanup;
+        case E_EOF:
+            message = "unexpected EOF while parsing";
+            break;
+        case E_TABSPACE:
+            message = "inconsistent use of tabs and spaces in indentation";
+            break;
+        case E_OVERFLOW:
+            message = "expression too long";
+            break;
+        case E_DEDENT:
+            message = "unindent does not match any outer indentation level";
+            break;
+        case E_TOODEEP:
+            message = "too many levels of indentation";
+            break;
+        case E_DECODE:
+            message = "decode error";
+            break;
+        case E_LINECONT:
+            message = "unexpected character after line continuation character";
+            break;
+        default:
+            {
+                char    code[ 32 ];
+                sprintf( code, "%d", err->error );
+                message = "unknown parsing error (error code " +
+                           std::string( code ) + ")";
+                break;
+            }
+    }
+
+    if ( err->text != NULL )
+        message += std::string( "\n" ) + err->text;
+
+    cleanup:
+    if (err->text != NULL)
+    {
+        PyObject_FREE(err->text);
+        err->text = NULL;
+    }
+    return;
+}
+
+
+static int
+countLineBreaks( const char *  buffer )
+{
+    int     count = 0;
+    for ( ; *buffer != '\0'; ++buffer )
+    {
+        if ( *buffer == '\n' )
+            ++count;
+        else if ( *buffer == '\r' && *(buffer + 1) != '\n' )
+            ++count;
+    }
+    return count;
+}
+
+
+/* Copies the pgen node children into the tree arena */
+static void
+copyChildren( const node *  from, Node *  to, ParseTree &  tree )
+{
+    to->n_nchildren = from->n_nchildren;
+    to->n_child = NULL;
+    if ( from->n_nchildren == 0 )
+        return;
+
+    to->n_child = tree.allocateNodes( from->n_nchildren );
+    for ( int  k = 0; k < from->n_nchildren; ++k )
+    {
+        const node *    src = & from->n_child[ k ];
+        Node *          dest = & to->n_child[ k ];
+
+        dest->n_type = src->n_type;
+        dest->n_str = NULL;
+        if ( src->n_str != NULL )
+            dest->n_str = tree.copyString( src->n_str, strlen( src->n_str ) );
+        dest->n_lineno = src->n_lineno;
+        dest->n_col_offset = src->n_col_offset;
+        copyChildren( src, dest, tree );
+    }
+}
+
+
+bool
+buildPgenParseTree( const char *  buffer, const char *  fileName,
+                    ParseTree &  tree )
+{
+    perrdetail          error;
+    PyCompilerFlags     flags = { 0 };
+    node *              pgenTree = PyParser_ParseStringFlagsFilename(
+                                    buffer, fileName, &_PyParser_Grammar,
+                                    file_input, &error, flags.cf_flags );
+
+    if ( pgenTree == NULL )
+    {
+        getErrorMessage( & error, tree.errorLine, tree.errorColumn,
+                         tree.errorMessage );
+        PyErr_Clear();
+        return false;
+    }
+
+    Node *      root = tree.allocateNodes( 1 );
+    root->n_type = pgenTree->n_type;
+    root->n_str = NULL;
+    if ( pgenTree->n_str != NULL )
+        root->n_str = tree.copyString( pgenTree->n_str,
+                                       strlen( pgenTree->n_str ) );
+    root->n_lineno = pgenTree->n_lineno;
+    root->n_col_offset = pgenTree->n_col_offset;
+    copyChildren( pgenTree, root, tree );
+
+    if ( root->n_type == encoding_decl )
+        tree.encoding = root->n_str;
+
+    // pgen does not keep the comments so the buffer is scanned separately
+    tree.lineShifts.resize( countLineBreaks( buffer ) + 2 );
+    getLineShiftsAndComments( buffer, & tree.lineShifts[ 0 ], tree.comments );
+
+    tree.root = root;
+    PyNode_Free( pgenTree );
+    return true;
+}
+
+#endif
+
@@ -0,0 +1,48 @@
+/*
+ * codimension - graphics python two-way code editor and analyzer
+ * Copyright (C) 2014 - 2016  Sergey Satskiy <sergey.satskiy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Syntax tree built by the python pgen parser
+ */
+
+#ifndef CFLOWPGEN_HPP
+#define CFLOWPGEN_HPP
+
+
+#include <Python.h>
+
+
+// The pgen parser is exposed by python up to 3.9. It is kept as a reference
+// implementation for the native parser.
+#if PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION == 9
+    #define CDM_CF_PGEN_AVAILABLE
+#endif
+
+
+#ifdef CDM_CF_PGEN_AVAILABLE
+
+class ParseTree;
+
+// Parses the buffer with pgen and converts the result into the native
+// parser syntax tree. Returns false in case of a syntax error.
+bool buildPgenParseTree( const char *  buffer, const char *  fileName,
+                         ParseTree &  tree );
+
+#endif
+
+
+#endif
+
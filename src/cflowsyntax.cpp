@@ -0,0 +1,2295 @@
+/*
+ * codimension - graphics python two-way code editor and analyzer
+ * Copyright (C) 2014 - 2016  Sergey Satskiy <sergey.satskiy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Python statement level syntax tree
+ */
+
+#include <string.h>
+#include <algorithm>
+
+#include "cflowsyntax.hpp"
+
+
+#define ARENA_BLOCK_SIZE    65536
+
+
+ParseTree::ParseTree() :
+    root( NULL ), headerCommentsOnly( false ),
+    errorLine( 0 ), errorColumn( 0 ),
+    blockCur( NULL ), blockLeft( 0 )
+{}
+
+
+ParseTree::~ParseTree()
+{
+    for ( std::vector< char * >::iterator  k = blocks.begin();
+          k != blocks.end(); ++k )
+        delete [] *k;
+}
+
+
+void *
+ParseTree::allocate( size_t  size )
+{
+    // Keep everything aligned for the Node structures
+    size = ( size + 7 ) & ~size_t( 7 );
+    if ( size > blockLeft )
+    {
+        size_t      blockSize = size > ARENA_BLOCK_SIZE ? size
+                                                        : ARENA_BLOCK_SIZE;
+        blockCur = new char[ blockSize ];
+        blockLeft = blockSize;
+        blocks.push_back( blockCur );
+    }
+
+    void *      ptr = blockCur;
+    blockCur += size;
+    blockLeft -= size;
+    return ptr;
+}
+
+
+void
+ParseTree::adopt( ParseTree &  other )
+{
+    blocks.insert( blocks.end(), other.blocks.begin(), other.blocks.end() );
+    other.blocks.clear();
+    other.blockCur = NULL;
+    other.blockLeft = 0;
+}
+
+
+Node *
+ParseTree::allocateNodes( size_t  count )
+{
+    return static_cast< Node * >( allocate( count * sizeof( Node ) ) );
+}
+
+
+const char *
+ParseTree::copyString( const char *  str, size_t  length )
+{
+    char *      dest = static_cast< char * >( allocate( length + 1 ) );
+    memcpy( dest, str, length );
+    dest[ length ] = '\0';
+    return dest;
+}
+
+
+
+// Expression parsing flags
+#define EXPR_TUPLE      0x01    // Top level commas make a tuple
+#define EXPR_STAR       0x02    // Starred elements are allowed
+#define EXPR_PLAIN      0x04    // The elements are arithmetic or bitwise
+                                // expressions only (exprlist, with targets)
+#define EXPR_WALRUS     0x08    // Top level ':=' is allowed
+
+// Buffers of that size and bigger are split into parts parsed on many
+// threads; a part is not smaller than the minimum
+#define PARALLEL_THRESHOLD  ( 1024 * 1024 )
+#define PARALLEL_MIN_PART   ( 256 * 1024 )
+
+// Buffers of that size and bigger are tokenized on a helper thread while
+// the tree is built if there is more than one CPU. For the smaller ones
+// starting a thread costs more than the overlap saves.
+#define PIPELINE_THRESHOLD  ( 256 * 1024 )
+
+// How often (in tokens) the parser checks if it should stop
+#define PARSE_CHECK_INTERVAL    1024
+
+// The operand positions of the expression grammar
+#define OPERAND_TEST    0       // Any operand including a lambda
+#define OPERAND_NOT     1       // Any operand except a lambda
+#define OPERAND_EXPR    2       // An arithmetic or a bitwise operand only
+
+// The parameter list parts in the order they must appear
+#define PARAMS_NONE         0
+#define PARAMS_POSITIONAL   1
+#define PARAMS_SLASH        2
+#define PARAMS_STAR         3
+#define PARAMS_DOUBLESTAR   4
+
+
+namespace
+{
+
+// Thrown when a syntax error is detected. The error details are already
+// stored in the tree by then.
+struct SyntaxFailure
+{};
+
+
+// Recursive descent parser. The statements follow the python 3.9 grammar
+// and build exactly the pgen node structure. The expressions are only
+// checked for the operands/operators sequence and the brackets balance; see
+// the ParseTree description for the nodes they produce.
+class Parser
+{
+    public:
+        Parser( const char *  buffer, ParseTree &  parseTree,
+                const BufferPart *  part = NULL,
+                ParseControl *  parseControl = NULL );
+        ~Parser();
+
+        bool  parse( void );
+
+    private:
+        Tokenizer               tokenizer;
+        TokenPipe *             pipe;       // NULL for small buffers
+        ParseTree &             tree;
+        ParseControl *          control;    // NULL if not stoppable
+        unsigned int            tokenCount;
+        Token                   tok;        // Lookahead token
+        std::vector< Node >     stack;      // Children of the open nodes
+
+    private:
+        void  advance( void );
+        void  stopTokenizer( void );
+        void  shift( void );
+        void  reduce( int  type, size_t  mark );
+        void  fail( bool  expectedIndent = false );
+        void  setError( int  line, int  column, const std::string &  message );
+
+        size_t  mark( void ) const
+        { return stack.size(); }
+        bool  isKeyword( int  keyword ) const
+        { return tok.type == NAME && tok.keyword == keyword; }
+
+        void  expect( int  type );
+        void  expectKeyword( int  keyword );
+        void  expectName( void );
+
+        bool  canStartOperand( void ) const;
+        bool  isArithmeticOperator( void ) const;
+        bool  isBinaryOperator( void ) const;
+        bool  isAugAssign( void ) const;
+        bool  isCompoundStatementStart( void ) const;
+
+        int  shiftBinaryOperator( void );
+        void  expressionNode( int  type, unsigned int  flags );
+        void  expression( unsigned int  flags );
+        void  bracketContent( int  type, int  closing );
+        int  checkDictItem( int  type, int  dictItems, bool  isDictItem );
+        void  operand( int  level );
+        void  lambdaHeader( void );
+        int  checkParameter( int  part );
+        void  primary( void );
+        void  atomPart( void );
+        void  trailerPart( void );
+        void  group( int  type, int  closing );
+        void  yieldExpression( void );
+
+        void  statement( void );
+        void  simpleStatement( void );
+        void  smallStatement( void );
+        void  exprStatement( void );
+        void  flowStatement( void );
+        void  importStatement( void );
+        void  importAsNames( void );
+        void  importAsName( void );
+        void  dottedAsNames( void );
+        void  dottedAsName( void );
+        void  dottedName( void );
+        void  namesStatement( int  type );
+        void  assertStatement( void );
+        void  compoundStatement( void );
+        void  asyncStatement( void );
+        void  ifStatement( void );
+        void  whileStatement( void );
+        void  forStatement( void );
+        void  tryStatement( void );
+        void  exceptClause( void );
+        void  withStatement( void );
+        void  withItem( void );
+        void  elsePart( void );
+        void  funcDefinition( void );
+        void  parameterList( void );
+        void  typedArgsList( void );
+        void  tfpdefinition( void );
+        void  classDefinition( void );
+        void  decoratedDefinition( void );
+        void  decoratorLine( void );
+        void  suiteBody( void );
+};
+
+
+// The overrides of the thresholds and of the number of CPUs; negative if
+// not set. They are set by the tests only.
+static std::atomic< long long >     pipelineThreshold( -1 );
+static std::atomic< long long >     parallelThreshold( -1 );
+static std::atomic< long long >     workers( -1 );
+
+
+static size_t
+getTuning( const std::atomic< long long > &  value, size_t  defaultValue )
+{
+    long long       overridden( value );
+    return overridden < 0 ? defaultValue : size_t( overridden );
+}
+
+
+static size_t
+getWorkers( void )
+{
+    return getTuning( workers, std::thread::hardware_concurrency() );
+}
+
+
+Parser::Parser( const char *  buffer, ParseTree &  parseTree,
+                const BufferPart *  part, ParseControl *  parseControl ) :
+    tokenizer( buffer, & parseTree.lineShifts, & parseTree.comments, part ),
+    pipe( NULL ), tree( parseTree ), control( parseControl ), tokenCount( 0 )
+{
+    if ( parseTree.headerCommentsOnly )
+        tokenizer.setCommentLineLimit( 2 );
+
+    // The buffer parts are already parsed in parallel
+    stack.reserve( 256 );
+    if ( part == NULL &&
+         size_t( tokenizer.getBufferEnd() - buffer ) >=
+                getTuning( pipelineThreshold, PIPELINE_THRESHOLD ) &&
+         getWorkers() > 1 )
+        pipe = new TokenPipe( tokenizer );
+}
+
+
+Parser::~Parser()
+{
+    delete pipe;
+}
+
+
+// The tokenizer members may be used only when its thread is finished
+void
+Parser::stopTokenizer( void )
+{
+    if ( pipe != NULL )
+        pipe->stop();
+}
+
+
+void
+Parser::setError( int  line, int  column, const std::string &  message )
+{
+    tree.errorLine = line;
+    tree.errorColumn = column;
+    tree.errorMessage = message;
+}
+
+
+void
+Parser::advance( void )
+{
+    int     type = pipe != NULL ? pipe->next( tok ) : tokenizer.next( tok );
+    if ( type == ERRORTOKEN )
+    {
+        stopTokenizer();
+        setError( tokenizer.errorLine, tokenizer.errorColumn,
+                  tokenizer.errorMessage );
+        throw SyntaxFailure();
+    }
+
+    if ( control != NULL && ++tokenCount % PARSE_CHECK_INTERVAL == 0 &&
+         control->shouldStop() )
+    {
+        stopTokenizer();
+        throw SyntaxFailure();
+    }
+}
+
+
+void
+Parser::shift( void )
+{
+    Node        leaf;
+
+    leaf.n_type = tok.type;
+    if ( tok.end > tok.begin )
+        leaf.n_str = tree.copyString( tok.begin, tok.end - tok.begin );
+    else
+        leaf.n_str = "";
+    leaf.n_lineno = tok.line;
+    leaf.n_col_offset = tok.col;
+    leaf.n_nchildren = 0;
+    leaf.n_child = NULL;
+    stack.push_back( leaf );
+
+    advance();
+}
+
+
+// Makes a non-terminal of everything collected since the mark
+void
+Parser::reduce( int  type, size_t  mark )
+{
+    size_t      count = stack.size() - mark;
+    Node *      children = tree.allocateNodes( count );
+
+    memcpy( children, & stack[ mark ], count * sizeof( Node ) );
+    stack.resize( mark );
+
+    Node        node;
+    node.n_type = type;
+    node.n_str = NULL;
+    node.n_lineno = children[ 0 ].n_lineno;
+    node.n_col_offset = children[ 0 ].n_col_offset;
+    node.n_nchildren = count;
+    node.n_child = children;
+    stack.push_back( node );
+}
+
+
+/* The messages and positions follow the pgen parser ones, see
+ * Parser/parsetok.c and Python/pythonrun.c err_input()
+ */
+void
+Parser::fail( bool  expectedIndent )
+{
+    stopTokenizer();
+    if ( tok.atEOF )
+    {
+        const char *    lastLine = tokenizer.getLastLineBegin();
+        const char *    end = tokenizer.getBufferEnd();
+        setError( tokenizer.getEOFLine(), end - lastLine,
+                  "unexpected EOF while parsing\n" +
+                  std::string( lastLine, end - lastLine ) );
+        throw SyntaxFailure();
+    }
+
+    // pgen could not classify the unknown operators so it never reported
+    // a missing indentation for them
+    std::string     message( "invalid syntax" );
+    if ( tok.type == OP || ( tok.type == NOTEQUAL && *tok.begin == '<' ) )
+        ;
+    else if ( expectedIndent )
+        message = "expected an indented block";
+    else if ( tok.type == INDENT )
+        message = "unexpected indent";
+    else if ( tok.type == DEDENT )
+        message = "unexpected unindent";
+
+    // The offending text: from the beginning of the joined lines the token
+    // belongs to till the end of the line where the token ends
+    const char *    textEnd = tok.end;
+    while ( *textEnd != '\0' && *textEnd != '\n' && *textEnd != '\r' )
+        ++textEnd;
+
+    std::string     text;
+    for ( const char *  p = tok.textBegin; p < textEnd; ++p )
+        if ( *p != '\r' )
+            text += *p;
+        else if ( *(p + 1) != '\n' )
+            text += '\n';
+
+    int     column = tok.col >= 0 ? tok.col + 1 : tok.begin - tok.textBegin;
+    setError( tok.endLine, column, message + "\n" + text + "\n" );
+    throw SyntaxFailure();
+}
+
+
+void
+Parser::expect( int  type )
+{
+    if ( tok.type != type )
+        fail();
+    shift();
+}
+
+
+void
+Parser::expectKeyword( int  keyword )
+{
+    if ( ! isKeyword( keyword ) )
+        fail();
+    shift();
+}
+
+
+void
+Parser::expectName( void )
+{
+    if ( tok.type != NAME || tok.keyword != KW_NONE )
+        fail();
+    shift();
+}
+
+
+bool
+Parser::canStartOperand( void ) const
+{
+    switch ( tok.type )
+    {
+        case NAME:
+            return tok.keyword == KW_NONE ||
+                   tok.keyword == KW_NONE_VALUE ||
+                   tok.keyword == KW_TRUE ||
+                   tok.keyword == KW_FALSE ||
+                   tok.keyword == KW_NOT ||
+                   tok.keyword == KW_LAMBDA;
+        case NUMBER:
+        case STRING:
+        case ELLIPSIS:
+        case LPAR:
+        case LSQB:
+        case LBRACE:
+        case MINUS:
+        case PLUS:
+        case TILDE:
+        case STAR:
+        case AWAIT:
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+
+// The arithmetic and bitwise binary operators
+bool
+Parser::isArithmeticOperator( void ) const
+{
+    switch ( tok.type )
+    {
+        case PLUS:
+        case MINUS:
+        case STAR:
+        case SLASH:
+        case DOUBLESLASH:
+        case PERCENT:
+        case AT:
+        case DOUBLESTAR:
+        case LEFTSHIFT:
+        case RIGHTSHIFT:
+        case AMPER:
+        case VBAR:
+        case CIRCUMFLEX:
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+
+// Any binary operator including the comparisons and the boolean ones
+bool
+Parser::isBinaryOperator( void ) const
+{
+    switch ( tok.type )
+    {
+        case LESS:
+        case GREATER:
+        case EQEQUAL:
+        case LESSEQUAL:
+        case GREATEREQUAL:
+            return true;
+        case NOTEQUAL:
+            // '<>' is accepted only with the barry_as_FLUFL future import
+            return *tok.begin == '!';
+        case NAME:
+            return tok.keyword == KW_AND || tok.keyword == KW_OR ||
+                   tok.keyword == KW_IN || tok.keyword == KW_IS ||
+                   tok.keyword == KW_NOT;
+        default:
+            break;
+    }
+    return isArithmeticOperator();
+}
+
+
+bool
+Parser::isAugAssign( void ) const
+{
+    switch ( tok.type )
+    {
+        case PLUSEQUAL:
+        case MINEQUAL:
+        case STAREQUAL:
+        case SLASHEQUAL:
+        case PERCENTEQUAL:
+        case AMPEREQUAL:
+        case VBAREQUAL:
+        case CIRCUMFLEXEQUAL:
+        case LEFTSHIFTEQUAL:
+        case RIGHTSHIFTEQUAL:
+        case DOUBLESTAREQUAL:
+        case DOUBLESLASHEQUAL:
+        case ATEQUAL:
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+
+bool
+Parser::isCompoundStatementStart( void ) const
+{
+    if ( tok.type == AT || tok.type == ASYNC )
+        return true;
+    if ( tok.type != NAME )
+        return false;
+    switch ( tok.keyword )
+    {
+        case KW_IF:
+        case KW_WHILE:
+        case KW_FOR:
+        case KW_TRY:
+        case KW_WITH:
+        case KW_DEF:
+        case KW_CLASS:
+            return true;
+        default:
+            break;
+    }
+    return false;
+}
+
+
+// 'not in' and 'is not' are two token operators.
+// Returns the position of the right operand.
+int
+Parser::shiftBinaryOperator( void )
+{
+    if ( isKeyword( KW_AND ) || isKeyword( KW_OR ) )
+    {
+        shift();
+        return OPERAND_NOT;
+    }
+    if ( isKeyword( KW_NOT ) )
+    {
+        shift();
+        expectKeyword( KW_IN );
+        return OPERAND_EXPR;
+    }
+    if ( isKeyword( KW_IS ) )
+    {
+        shift();
+        if ( isKeyword( KW_NOT ) )
+            shift();
+        return OPERAND_EXPR;
+    }
+    shift();
+    return OPERAND_EXPR;
+}
+
+
+void
+Parser::expressionNode( int  type, unsigned int  flags )
+{
+    size_t      start = mark();
+    expression( flags );
+    reduce( type, start );
+}
+
+
+// An expression outside of brackets
+void
+Parser::expression( unsigned int  flags )
+{
+    for ( ; ; )
+    {
+        // An element: a starred expression is limited to the arithmetic
+        // and bitwise operators
+        bool    plain = ( flags & EXPR_PLAIN ) != 0;
+        bool    pendingElse = false;
+
+        if ( tok.type == STAR && ( flags & EXPR_STAR ) )
+        {
+            shift();
+            plain = true;
+        }
+        operand( plain ? OPERAND_EXPR : OPERAND_TEST );
+
+        for ( ; ; )
+        {
+            int     level;
+
+            if ( isArithmeticOperator() )
+            {
+                shift();
+                level = OPERAND_EXPR;
+            }
+            else if ( plain )
+                break;
+            else if ( isBinaryOperator() )
+                level = shiftBinaryOperator();
+            else if ( isKeyword( KW_IF ) && ! pendingElse )
+            {
+                shift();
+                pendingElse = true;
+                level = OPERAND_NOT;
+            }
+            else if ( isKeyword( KW_ELSE ) && pendingElse )
+            {
+                shift();
+                pendingElse = false;
+                level = OPERAND_TEST;
+            }
+            else if ( tok.type == COLONEQUAL && ( flags & EXPR_WALRUS ) )
+            {
+                shift();
+                level = OPERAND_TEST;
+            }
+            else
+                break;
+            operand( level );
+        }
+
+        if ( pendingElse )
+            fail();
+        if ( tok.type != COMMA || ( flags & EXPR_TUPLE ) == 0 )
+            return;
+        shift();
+        if ( ! canStartOperand() )
+            return;     // Trailing comma
+    }
+}
+
+
+// Everything between the brackets: the elements separated by commas, the
+// slices and the dictionary items separated by colons, the keyword
+// arguments and the comprehensions. Only the tokens sequence is checked.
+void
+Parser::bracketContent( int  type, int  closing )
+{
+    bool    expectOperand = true;
+    int     level = OPERAND_TEST;   // The expected operand position
+    int     separator = -1;     // What the expected operand follows: -1 for
+                                // the element beginning, COMMA or COLON for
+                                // the separators, 0 for an operator
+    bool    plain = false;      // Starred element or a comprehension target
+    bool    pendingElse = false;
+    bool    sawComma = false;
+    int     colons = 0;         // Colons in the current element
+    int     comprehension = 0;  // 1: in a 'for' target, 2: after its 'in'
+    int     unpacked = 0;       // STAR or DOUBLESTAR if the element starts
+                                // with it
+    bool    assigned = false;   // The element has '=' or ':='
+    int     dictItems = -1;     // -1: unknown, 1: dictionary, 0: set
+
+    for ( ; ; )
+    {
+        if ( expectOperand )
+        {
+            if ( tok.type == closing )
+            {
+                if ( separator == COMMA && comprehension != 1 )
+                    return;     // Trailing comma; the element is checked
+                if ( separator == COLON && type == subscriptlist )
+                    return;     // Slice without the upper bound
+                fail();
+            }
+
+            if ( ( separator == -1 || separator == COMMA ) &&
+                 comprehension != 2 && type != subscriptlist &&
+                 ( tok.type == STAR ||
+                   ( tok.type == DOUBLESTAR &&
+                     ( type == arglist || type == dictorsetmaker ) ) ) )
+            {
+                // The arguments unpacking allows any expressions
+                plain = ( type != arglist );
+                unpacked = ( comprehension == 0 ) ? tok.type : 0;
+                level = plain ? OPERAND_EXPR : OPERAND_TEST;
+                separator = 0;
+                shift();
+                continue;
+            }
+
+            if ( canStartOperand() )
+            {
+                operand( level );
+                expectOperand = false;
+                continue;
+            }
+
+            if ( type == subscriptlist && separator != 0 &&
+                 ( ( tok.type == COLON && colons < 2 ) ||
+                   ( tok.type == COMMA && separator == COLON ) ) )
+            {
+                // The slice parts may be omitted
+                if ( tok.type == COLON )
+                    ++colons;
+                else
+                    colons = 0;
+                separator = tok.type;
+                level = OPERAND_TEST;
+                shift();
+                continue;
+            }
+
+            if ( isKeyword( KW_IN ) && comprehension == 1 &&
+                 separator == COMMA )
+            {
+                // Comprehension target with a trailing comma
+                shift();
+                comprehension = 2;
+                plain = false;
+                separator = 0;
+                level = OPERAND_NOT;
+                continue;
+            }
+            fail();
+        }
+
+        // Operator position
+        if ( isArithmeticOperator() )
+        {
+            shift();
+            level = OPERAND_EXPR;
+            separator = 0;
+            expectOperand = true;
+            continue;
+        }
+
+        if ( comprehension == 1 )
+        {
+            // The target list of a comprehension
+            if ( isKeyword( KW_IN ) )
+            {
+                shift();
+                comprehension = 2;
+                plain = false;
+                separator = 0;
+                level = OPERAND_NOT;
+            }
+            else if ( tok.type == COMMA )
+            {
+                shift();
+                separator = COMMA;
+                level = OPERAND_EXPR;
+            }
+            else
+                fail();
+            expectOperand = true;
+            continue;
+        }
+
+        separator = 0;
+        if ( ! plain && isBinaryOperator() )
+            level = shiftBinaryOperator();
+        else if ( ! plain && ! pendingElse && isKeyword( KW_IF ) )
+        {
+            // comprehension 'if' or a conditional expression
+            shift();
+            pendingElse = ( comprehension == 0 );
+            level = OPERAND_NOT;
+        }
+        else if ( pendingElse && isKeyword( KW_ELSE ) )
+        {
+            shift();
+            pendingElse = false;
+            level = OPERAND_TEST;
+        }
+        else if ( ! pendingElse && type != subscriptlist &&
+                  ( isKeyword( KW_FOR ) || tok.type == ASYNC ) &&
+                  ( comprehension == 2 || type == arglist || ! sawComma ) &&
+                  ! ( ( assigned || unpacked != 0 ) && type == arglist ) )
+        {
+            if ( tok.type == ASYNC )
+                shift();
+            expectKeyword( KW_FOR );
+            comprehension = 1;
+            plain = true;
+            separator = -1;
+            level = OPERAND_EXPR;
+        }
+        else if ( ! plain && ! pendingElse && ! assigned && unpacked == 0 &&
+                  comprehension == 0 &&
+                  ( ( tok.type == COLONEQUAL &&
+                      ( type == arglist || type == testlist_comp ) ) ||
+                    ( tok.type == EQUAL && type == arglist ) ) )
+        {
+            shift();
+            assigned = true;
+            level = OPERAND_TEST;
+        }
+        else if ( pendingElse )
+            fail();
+        else if ( tok.type == COMMA ||
+                  ( tok.type == COLON && comprehension == 0 && ! plain &&
+                    unpacked == 0 &&
+                    ( ( type == subscriptlist && colons < 2 ) ||
+                      ( type == dictorsetmaker && colons < 1 ) ) ) )
+        {
+            // Only the arguments may follow a comprehension
+            if ( comprehension == 2 )
+            {
+                if ( tok.type != COMMA || type != arglist )
+                    fail();
+                comprehension = 0;
+            }
+            if ( tok.type == COMMA )
+            {
+                if ( comprehension == 0 )
+                    dictItems = checkDictItem( type, dictItems,
+                                               colons > 0 || unpacked == DOUBLESTAR );
+                sawComma = true;
+                colons = 0;
+                unpacked = 0;
+                assigned = false;
+            }
+            else
+                ++colons;
+            separator = tok.type;
+            plain = false;
+            level = OPERAND_TEST;
+            shift();
+        }
+        else if ( tok.type == closing )
+        {
+            if ( comprehension == 0 )
+                checkDictItem( type, dictItems, colons > 0 || unpacked == DOUBLESTAR );
+            return;
+        }
+        else
+            fail();
+
+        expectOperand = true;
+    }
+}
+
+
+// The dictionary and the set displays must not mix their items.
+// Returns the display kind after the current element.
+int
+Parser::checkDictItem( int  type, int  dictItems, bool  isDictItem )
+{
+    if ( type != dictorsetmaker )
+        return dictItems;
+    if ( dictItems != -1 && dictItems != int( isDictItem ) )
+        fail();
+    return int( isDictItem );
+}
+
+
+// Unary prefixes, lambda headers and then a primary
+void
+Parser::operand( int  level )
+{
+    for ( ; ; )
+    {
+        if ( tok.type == MINUS || tok.type == PLUS || tok.type == TILDE )
+        {
+            shift();
+            level = OPERAND_EXPR;
+            continue;
+        }
+        if ( isKeyword( KW_NOT ) && level != OPERAND_EXPR )
+        {
+            shift();
+            level = OPERAND_NOT;
+            continue;
+        }
+        if ( isKeyword( KW_LAMBDA ) && level == OPERAND_TEST )
+        {
+            lambdaHeader();
+            continue;
+        }
+        break;
+    }
+    primary();
+}
+
+
+// Checks that the current parameter may follow the already seen ones.
+// Returns the parameter list part after it.
+int
+Parser::checkParameter( int  part )
+{
+    switch ( tok.type )
+    {
+        case SLASH:
+            if ( part != PARAMS_POSITIONAL )
+                fail();
+            return PARAMS_SLASH;
+        case STAR:
+            if ( part >= PARAMS_STAR )
+                fail();
+            return PARAMS_STAR;
+        case DOUBLESTAR:
+            if ( part == PARAMS_DOUBLESTAR )
+                fail();
+            return PARAMS_DOUBLESTAR;
+        default:
+            if ( part == PARAMS_DOUBLESTAR )
+                fail();
+            return part == PARAMS_NONE ? PARAMS_POSITIONAL : part;
+    }
+}
+
+
+// 'lambda' [varargslist] ':'
+void
+Parser::lambdaHeader( void )
+{
+    int     part = PARAMS_NONE;
+
+    shift();
+    while ( tok.type != COLON )
+    {
+        part = checkParameter( part );
+        if ( tok.type == STAR || tok.type == DOUBLESTAR )
+        {
+            shift();
+            if ( tok.type == NAME )
+                expectName();
+        }
+        else if ( tok.type == SLASH )
+            shift();
+        else
+        {
+            expectName();
+            if ( tok.type == EQUAL )
+            {
+                shift();
+                expression( 0 );
+            }
+        }
+
+        if ( tok.type != COMMA )
+            break;
+        shift();
+    }
+    expect( COLON );
+}
+
+
+// atom_expr: [AWAIT] atom trailer*
+void
+Parser::primary( void )
+{
+    size_t      start = mark();
+
+    if ( tok.type == AWAIT )
+        shift();
+    atomPart();
+    while ( tok.type == LPAR || tok.type == LSQB || tok.type == DOT )
+        trailerPart();
+    reduce( atom_expr, start );
+}
+
+
+void
+Parser::atomPart( void )
+{
+    size_t      start = mark();
+
+    switch ( tok.type )
+    {
+        case NAME:
+            if ( tok.keyword != KW_NONE && tok.keyword != KW_NONE_VALUE &&
+                 tok.keyword != KW_TRUE && tok.keyword != KW_FALSE )
+                fail();
+            shift();
+            break;
+        case NUMBER:
+        case ELLIPSIS:
+            shift();
+            break;
+        case STRING:
+            while ( tok.type == STRING )
+                shift();
+            break;
+        case LPAR:
+            shift();
+            if ( isKeyword( KW_YIELD ) )
+                yieldExpression();
+            else if ( tok.type != RPAR )
+                group( testlist_comp, RPAR );
+            expect( RPAR );
+            break;
+        case LSQB:
+            shift();
+            if ( tok.type != RSQB )
+                group( testlist_comp, RSQB );
+            expect( RSQB );
+            break;
+        case LBRACE:
+            shift();
+            if ( tok.type != RBRACE )
+                group( dictorsetmaker, RBRACE );
+            expect( RBRACE );
+            break;
+        default:
+            fail();
+    }
+    reduce( atom, start );
+}
+
+
+// trailer: '(' [arglist] ')' | '[' subscriptlist ']' | '.' NAME
+void
+Parser::trailerPart( void )
+{
+    size_t      start = mark();
+
+    if ( tok.type == LPAR )
+    {
+        shift();
+        if ( tok.type != RPAR )
+            group( arglist, RPAR );
+        expect( RPAR );
+    }
+    else if ( tok.type == LSQB )
+    {
+        shift();
+        group( subscriptlist, RSQB );
+        expect( RSQB );
+    }
+    else
+    {
+        expect( DOT );
+        expectName();
+    }
+    reduce( trailer, start );
+}
+
+
+void
+Parser::group( int  type, int  closing )
+{
+    size_t      start = mark();
+    bracketContent( type, closing );
+    reduce( type, start );
+}
+
+
+// yield_expr: 'yield' [yield_arg]
+// yield_arg: 'from' test | testlist_star_expr
+void
+Parser::yieldExpression( void )
+{
+    size_t      start = mark();
+
+    expectKeyword( KW_YIELD );
+    if ( isKeyword( KW_FROM ) )
+    {
+        size_t      argStart = mark();
+        shift();
+        expressionNode( test, 0 );
+        reduce( yield_arg, argStart );
+    }
+    else if ( canStartOperand() )
+    {
+        size_t      argStart = mark();
+        expressionNode( testlist_star_expr, EXPR_TUPLE | EXPR_STAR );
+        reduce( yield_arg, argStart );
+    }
+    reduce( yield_expr, start );
+}
+
+
+// stmt: simple_stmt | compound_stmt
+void
+Parser::statement( void )
+{
+    size_t      start = mark();
+
+    if ( isCompoundStatementStart() )
+        compoundStatement();
+    else
+        simpleStatement();
+    reduce( stmt, start );
+}
+
+
+// simple_stmt: small_stmt (';' small_stmt)* [';'] NEWLINE
+void
+Parser::simpleStatement( void )
+{
+    size_t      start = mark();
+
+    smallStatement();
+    while ( tok.type == SEMI )
+    {
+        shift();
+        if ( tok.type == NEWLINE )
+            break;
+        smallStatement();
+    }
+    expect( NEWLINE );
+    reduce( simple_stmt, start );
+}
+
+
+void
+Parser::smallStatement( void )
+{
+    size_t      start = mark();
+
+    if ( tok.type != NAME )
+        exprStatement();
+    else
+    {
+        switch ( tok.keyword )
+        {
+            case KW_DEL:
+                {
+                    size_t      stmtStart = mark();
+                    shift();
+                    expressionNode( exprlist,
+                                    EXPR_TUPLE | EXPR_STAR | EXPR_PLAIN );
+                    reduce( del_stmt, stmtStart );
+                }
+                break;
+            case KW_PASS:
+                {
+                    size_t      stmtStart = mark();
+                    shift();
+                    reduce( pass_stmt, stmtStart );
+                }
+                break;
+            case KW_BREAK:
+            case KW_CONTINUE:
+            case KW_RETURN:
+            case KW_RAISE:
+            case KW_YIELD:
+                flowStatement();
+                break;
+            case KW_IMPORT:
+            case KW_FROM:
+                importStatement();
+                break;
+            case KW_GLOBAL:
+                namesStatement( global_stmt );
+                break;
+            case KW_NONLOCAL:
+                namesStatement( nonlocal_stmt );
+                break;
+            case KW_ASSERT:
+                assertStatement();
+                break;
+            default:
+                exprStatement();
+                break;
+        }
+    }
+    reduce( small_stmt, start );
+}
+
+
+// expr_stmt: testlist_star_expr (annassign | augassign (yield_expr|testlist) |
+//                                ('=' (yield_expr|testlist_star_expr))*)
+// annassign: ':' test ['=' (yield_expr|testlist_star_expr)]
+void
+Parser::exprStatement( void )
+{
+    size_t      start = mark();
+
+    expressionNode( testlist_star_expr, EXPR_TUPLE | EXPR_STAR );
+    if ( tok.type == COLON )
+    {
+        size_t      annStart = mark();
+        shift();
+        expressionNode( test, 0 );
+        if ( tok.type == EQUAL )
+        {
+            shift();
+            if ( isKeyword( KW_YIELD ) )
+                yieldExpression();
+            else
+                expressionNode( testlist_star_expr, EXPR_TUPLE | EXPR_STAR );
+        }
+        reduce( annassign, annStart );
+    }
+    else if ( isAugAssign() )
+    {
+        size_t      augStart = mark();
+        shift();
+        reduce( augassign, augStart );
+        if ( isKeyword( KW_YIELD ) )
+            yieldExpression();
+        else
+            expressionNode( testlist, EXPR_TUPLE );
+    }
+    else
+    {
+        while ( tok.type == EQUAL )
+        {
+            shift();
+            if ( isKeyword( KW_YIELD ) )
+                yieldExpression();
+            else
+                expressionNode( testlist_star_expr, EXPR_TUPLE | EXPR_STAR );
+        }
+    }
+    reduce( expr_stmt, start );
+}
+
+
+// flow_stmt: break_stmt | continue_stmt | return_stmt | raise_stmt |
+//            yield_stmt
+void
+Parser::flowStatement( void )
+{
+    size_t      start = mark();
+    size_t      stmtStart = mark();
+
+    switch ( tok.keyword )
+    {
+        case KW_BREAK:
+            shift();
+            reduce( break_stmt, stmtStart );
+            break;
+        case KW_CONTINUE:
+            shift();
+            reduce( continue_stmt, stmtStart );
+            break;
+        case KW_RETURN:
+            shift();
+            if ( canStartOperand() )
+                expressionNode( testlist_star_expr, EXPR_TUPLE | EXPR_STAR );
+            reduce( return_stmt, stmtStart );
+            break;
+        case KW_RAISE:
+            shift();
+            if ( canStartOperand() )
+            {
+                expressionNode( test, 0 );
+                if ( isKeyword( KW_FROM ) )
+                {
+                    shift();
+                    expressionNode( test, 0 );
+                }
+            }
+            reduce( raise_stmt, stmtStart );
+            break;
+        default:
+            yieldExpression();
+            reduce( yield_stmt, stmtStart );
+            break;
+    }
+    reduce( flow_stmt, start );
+}
+
+
+// import_stmt: import_name | import_from
+// import_name: 'import' dotted_as_names
+// import_from: ('from' (('.' | '...')* dotted_name | ('.' | '...')+)
+//               'import' ('*' | '(' import_as_names ')' | import_as_names))
+void
+Parser::importStatement( void )
+{
+    size_t      start = mark();
+    size_t      stmtStart = mark();
+
+    if ( isKeyword( KW_IMPORT ) )
+    {
+        shift();
+        dottedAsNames();
+        reduce( import_name, stmtStart );
+    }
+    else
+    {
+        bool    hasDots = false;
+
+        expectKeyword( KW_FROM );
+        while ( tok.type == DOT || tok.type == ELLIPSIS )
+        {
+            shift();
+            hasDots = true;
+        }
+        if ( ! hasDots || ! isKeyword( KW_IMPORT ) )
+            dottedName();
+        expectKeyword( KW_IMPORT );
+
+        if ( tok.type == STAR )
+            shift();
+        else if ( tok.type == LPAR )
+        {
+            shift();
+            importAsNames();
+            expect( RPAR );
+        }
+        else
+            importAsNames();
+        reduce( import_from, stmtStart );
+    }
+    reduce( import_stmt, start );
+}
+
+
+// import_as_names: import_as_name (',' import_as_name)* [',']
+void
+Parser::importAsNames( void )
+{
+    size_t      start = mark();
+
+    importAsName();
+    while ( tok.type == COMMA )
+    {
+        shift();
+        if ( tok.type != NAME || tok.keyword != KW_NONE )
+            break;
+        importAsName();
+    }
+    reduce( import_as_names, start );
+}
+
+
+// import_as_name: NAME ['as' NAME]
+void
+Parser::importAsName( void )
+{
+    size_t      start = mark();
+
+    expectName();
+    if ( isKeyword( KW_AS ) )
+    {
+        shift();
+        expectName();
+    }
+    reduce( import_as_name, start );
+}
+
+
+// dotted_as_names: dotted_as_name (',' dotted_as_name)*
+void
+Parser::dottedAsNames( void )
+{
+    size_t      start = mark();
+
+    dottedAsName();
+    while ( tok.type == COMMA )
+    {
+        shift();
+        dottedAsName();
+    }
+    reduce( dotted_as_names, start );
+}
+
+
+// dotted_as_name: dotted_name ['as' NAME]
+void
+Parser::dottedAsName( void )
+{
+    size_t      start = mark();
+
+    dottedName();
+    if ( isKeyword( KW_AS ) )
+    {
+        shift();
+        expectName();
+    }
+    reduce( dotted_as_name, start );
+}
+
+
+// dotted_name: NAME ('.' NAME)*
+void
+Parser::dottedName( void )
+{
+    size_t      start = mark();
+
+    expectName();
+    while ( tok.type == DOT )
+    {
+        shift();
+        expectName();
+    }
+    reduce( dotted_name, start );
+}
+
+
+// global_stmt: 'global' NAME (',' NAME)*
+// nonlocal_stmt: 'nonlocal' NAME (',' NAME)*
+void
+Parser::namesStatement( int  type )
+{
+    size_t      start = mark();
+
+    shift();
+    expectName();
+    while ( tok.type == COMMA )
+    {
+        shift();
+        expectName();
+    }
+    reduce( type, start );
+}
+
+
+// assert_stmt: 'assert' test [',' test]
+void
+Parser::assertStatement( void )
+{
+    size_t      start = mark();
+
+    shift();
+    expressionNode( test, 0 );
+    if ( tok.type == COMMA )
+    {
+        shift();
+        expressionNode( test, 0 );
+    }
+    reduce( assert_stmt, start );
+}
+
+
+// compound_stmt: if_stmt | while_stmt | for_stmt | try_stmt | with_stmt |
+//                funcdef | classdef | decorated | async_stmt
+void
+Parser::compoundStatement( void )
+{
+    size_t      start = mark();
+
+    if ( tok.type == AT )
+        decoratedDefinition();
+    else if ( tok.type == ASYNC )
+        asyncStatement();
+    else
+    {
+        switch ( tok.keyword )
+        {
+            case KW_IF:
+                ifStatement();
+                break;
+            case KW_WHILE:
+                whileStatement();
+                break;
+            case KW_FOR:
+                forStatement();
+                break;
+            case KW_TRY:
+                tryStatement();
+                break;
+            case KW_WITH:
+                withStatement();
+                break;
+            case KW_DEF:
+                funcDefinition();
+                break;
+            default:
+                classDefinition();
+                break;
+        }
+    }
+    reduce( compound_stmt, start );
+}
+
+
+// async_stmt: ASYNC (funcdef | with_stmt | for_stmt)
+void
+Parser::asyncStatement( void )
+{
+    size_t      start = mark();
+
+    shift();
+    if ( isKeyword( KW_DEF ) )
+        funcDefinition();
+    else if ( isKeyword( KW_WITH ) )
+        withStatement();
+    else if ( isKeyword( KW_FOR ) )
+        forStatement();
+    else
+        fail();
+    reduce( async_stmt, start );
+}
+
+
+// ['else' ':' suite]
+void
+Parser::elsePart( void )
+{
+    if ( isKeyword( KW_ELSE ) )
+    {
+        shift();
+        expect( COLON );
+        suiteBody();
+    }
+}
+
+
+// if_stmt: 'if' namedexpr_test ':' suite
+//          ('elif' namedexpr_test ':' suite)* ['else' ':' suite]
+void
+Parser::ifStatement( void )
+{
+    size_t      start = mark();
+
+    do
+    {
+        shift();
+        expressionNode( namedexpr_test, EXPR_WALRUS );
+        expect( COLON );
+        suiteBody();
+    } while ( isKeyword( KW_ELIF ) );
+    elsePart();
+    reduce( if_stmt, start );
+}
+
+
+// while_stmt: 'while' namedexpr_test ':' suite ['else' ':' suite]
+void
+Parser::whileStatement( void )
+{
+    size_t      start = mark();
+
+    shift();
+    expressionNode( namedexpr_test, EXPR_WALRUS );
+    expect( COLON );
+    suiteBody();
+    elsePart();
+    reduce( while_stmt, start );
+}
+
+
+// for_stmt: 'for' exprlist 'in' testlist ':' suite ['else' ':' suite]
+void
+Parser::forStatement( void )
+{
+    size_t      start = mark();
+
+    shift();
+    expressionNode( exprlist, EXPR_TUPLE | EXPR_STAR | EXPR_PLAIN );
+    expectKeyword( KW_IN );
+    expressionNode( testlist, EXPR_TUPLE );
+    expect( COLON );
+    suiteBody();
+    elsePart();
+    reduce( for_stmt, start );
+}
+
+
+// try_stmt: ('try' ':' suite
+//            ((except_clause ':' suite)+
+//             ['else' ':' suite]
+//             ['finally' ':' suite] |
+//            'finally' ':' suite))
+void
+Parser::tryStatement( void )
+{
+    size_t      start = mark();
+
+    shift();
+    expect( COLON );
+    suiteBody();
+
+    if ( ! isKeyword( KW_FINALLY ) )
+    {
+        if ( ! isKeyword( KW_EXCEPT ) )
+            fail();
+        while ( isKeyword( KW_EXCEPT ) )
+        {
+            exceptClause();
+            expect( COLON );
+            suiteBody();
+        }
+        elsePart();
+    }
+    if ( isKeyword( KW_FINALLY ) )
+    {
+        shift();
+        expect( COLON );
+        suiteBody();
+    }
+    reduce( try_stmt, start );
+}
+
+
+// except_clause: 'except' [test ['as' NAME]]
+void
+Parser::exceptClause( void )
+{
+    size_t      start = mark();
+
+    shift();
+    if ( canStartOperand() )
+    {
+        expressionNode( test, 0 );
+        if ( isKeyword( KW_AS ) )
+        {
+            shift();
+            expectName();
+        }
+    }
+    reduce( except_clause, start );
+}
+
+
+// with_stmt: 'with' with_item (',' with_item)*  ':' suite
+void
+Parser::withStatement( void )
+{
+    size_t      start = mark();
+
+    shift();
+    withItem();
+    while ( tok.type == COMMA )
+    {
+        shift();
+        withItem();
+    }
+    expect( COLON );
+    suiteBody();
+    reduce( with_stmt, start );
+}
+
+
+// with_item: test ['as' expr]
+void
+Parser::withItem( void )
+{
+    size_t      start = mark();
+
+    expressionNode( test, 0 );
+    if ( isKeyword( KW_AS ) )
+    {
+        shift();
+        expressionNode( expr, EXPR_PLAIN );
+    }
+    reduce( with_item, start );
+}
+
+
+// funcdef: 'def' NAME parameters ['->' test] ':' suite
+void
+Parser::funcDefinition( void )
+{
+    size_t      start = mark();
+
+    expectKeyword( KW_DEF );
+    expectName();
+    parameterList();
+    if ( tok.type == RARROW )
+    {
+        shift();
+        expressionNode( test, 0 );
+    }
+    expect( COLON );
+    suiteBody();
+    reduce( funcdef, start );
+}
+
+
+// parameters: '(' [typedargslist] ')'
+void
+Parser::parameterList( void )
+{
+    size_t      start = mark();
+
+    expect( LPAR );
+    if ( tok.type != RPAR )
+        typedArgsList();
+    expect( RPAR );
+    reduce( parameters, start );
+}
+
+
+// typedargslist: the arguments with defaults, '/', '*' [tfpdef] and
+//                '**' tfpdef separated by commas
+void
+Parser::typedArgsList( void )
+{
+    size_t      start = mark();
+    int         part = PARAMS_NONE;
+
+    for ( ; ; )
+    {
+        part = checkParameter( part );
+        if ( tok.type == STAR )
+        {
+            shift();
+            if ( tok.type == NAME )
+                tfpdefinition();
+        }
+        else if ( tok.type == DOUBLESTAR )
+        {
+            shift();
+            tfpdefinition();
+        }
+        else if ( tok.type == SLASH )
+            shift();
+        else
+        {
+            tfpdefinition();
+            if ( tok.type == EQUAL )
+            {
+                shift();
+                expressionNode( test, 0 );
+            }
+        }
+
+        if ( tok.type != COMMA )
+            break;
+        shift();
+        if ( tok.type == RPAR )
+            break;
+    }
+    reduce( typedargslist, start );
+}
+
+
+// tfpdef: NAME [':' test]
+void
+Parser::tfpdefinition( void )
+{
+    size_t      start = mark();
+
+    expectName();
+    if ( tok.type == COLON )
+    {
+        shift();
+        expressionNode( test, 0 );
+    }
+    reduce( tfpdef, start );
+}
+
+
+// classdef: 'class' NAME ['(' [arglist] ')'] ':' suite
+void
+Parser::classDefinition( void )
+{
+    size_t      start = mark();
+
+    expectKeyword( KW_CLASS );
+    expectName();
+    if ( tok.type == LPAR )
+    {
+        shift();
+        if ( tok.type != RPAR )
+            group( arglist, RPAR );
+        expect( RPAR );
+    }
+    expect( COLON );
+    suiteBody();
+    reduce( classdef, start );
+}
+
+
+// decorated: decorators (classdef | funcdef | async_funcdef)
+// decorators: decorator+
+// async_funcdef: ASYNC funcdef
+void
+Parser::decoratedDefinition( void )
+{
+    size_t      start = mark();
+    size_t      decorsStart = mark();
+
+    while ( tok.type == AT )
+        decoratorLine();
+    reduce( decorators, decorsStart );
+
+    if ( isKeyword( KW_DEF ) )
+        funcDefinition();
+    else if ( isKeyword( KW_CLASS ) )
+        classDefinition();
+    else if ( tok.type == ASYNC )
+    {
+        size_t      asyncStart = mark();
+        shift();
+        funcDefinition();
+        reduce( async_funcdef, asyncStart );
+    }
+    else
+        fail();
+    reduce( decorated, start );
+}
+
+
+// decorator: '@' namedexpr_test NEWLINE
+void
+Parser::decoratorLine( void )
+{
+    size_t      start = mark();
+
+    shift();
+    expressionNode( namedexpr_test, EXPR_WALRUS );
+    expect( NEWLINE );
+    reduce( decorator, start );
+}
+
+
+// suite: simple_stmt | NEWLINE INDENT stmt+ DEDENT
+void
+Parser::suiteBody( void )
+{
+    size_t      start = mark();
+
+    if ( tok.type == NEWLINE )
+    {
+        shift();
+        if ( tok.type != INDENT )
+            fail( true );
+        shift();
+        do
+        {
+            statement();
+        } while ( tok.type != DEDENT );
+        shift();
+    }
+    else
+        simpleStatement();
+    reduce( suite, start );
+}
+
+
+// file_input: (NEWLINE | stmt)* ENDMARKER
+bool
+Parser::parse( void )
+{
+    try
+    {
+        size_t      start = mark();
+
+        advance();
+        while ( tok.type != ENDMARKER )
+        {
+            if ( tok.type == NEWLINE )
+                shift();
+            else
+                statement();
+        }
+        stack.push_back( Node() );
+        stack.back().n_type = ENDMARKER;
+        stack.back().n_str = "";
+        stack.back().n_lineno = tok.line;
+        stack.back().n_col_offset = tok.col;
+        stack.back().n_nchildren = 0;
+        stack.back().n_child = NULL;
+        reduce( file_input, start );
+    }
+    catch ( SyntaxFailure & )
+    {
+        tree.encoding = tokenizer.getEncoding();
+        return false;
+    }
+
+    stopTokenizer();
+    Node *      root = tree.allocateNodes( 1 );
+    *root = stack.back();
+
+    tree.encoding = tokenizer.getEncoding();
+    if ( ! tree.encoding.empty() )
+    {
+        // pgen makes the encoding declaration the root
+        Node *      encodingNode = tree.allocateNodes( 1 );
+        encodingNode->n_type = encoding_decl;
+        encodingNode->n_str = tree.copyString( tree.encoding.c_str(),
+                                               tree.encoding.size() );
+        encodingNode->n_lineno = 0;
+        encodingNode->n_col_offset = 0;
+        encodingNode->n_nchildren = 1;
+        encodingNode->n_child = root;
+        root = encodingNode;
+    }
+
+    tree.root = root;
+    return true;
+}
+
+
+
+static bool
+isKeywordAt( const char *  pos, const char *  keyword, size_t  length )
+{
+    if ( strncmp( pos, keyword, length ) != 0 )
+        return false;
+
+    char    next = pos[ length ];
+    return ! ( ( next >= 'a' && next <= 'z' ) || ( next >= 'A' && next <= 'Z' ) ||
+               ( next >= '0' && next <= '9' ) || next == '_' ||
+               (unsigned char)next >= 128 );
+}
+
+
+// Line kinds for splitting
+#define LINE_CONTINUES      -1  // Blank, comment or indented line
+#define LINE_STATEMENT      0
+#define LINE_DEFINITION     1   // 'def', 'class' or 'async def'
+#define LINE_DECORATOR      2
+
+static int
+getLineKind( const char *  line )
+{
+    switch ( *line )
+    {
+        case '@':
+            return LINE_DECORATOR;
+        case ' ': case '\t': case '\014': case '#': case '\\':
+        case '\r': case '\n': case '\0':
+            return LINE_CONTINUES;
+        default:
+            break;
+    }
+
+    if ( isKeywordAt( line, "def", 3 ) || isKeywordAt( line, "class", 5 ) )
+        return LINE_DEFINITION;
+    if ( isKeywordAt( line, "async", 5 ) )
+    {
+        line += 5;
+        while ( *line == ' ' || *line == '\t' || *line == '\014' )
+            ++line;
+        if ( isKeywordAt( line, "def", 3 ) )
+            return LINE_DEFINITION;
+    }
+    return LINE_STATEMENT;
+}
+
+
+// Splits the buffer into up to the given number of parts of about the same
+// size. A part starts at a column 0 definition or decorator line which is
+// outside of the string literals, the brackets and the line continuations.
+// The decorators are not separated from their definitions.
+static void
+getBufferParts( const char *  buffer, size_t  size, size_t  count,
+                std::vector< BufferPart > &  parts )
+{
+    const char *    end = buffer + size;
+    const char *    p = buffer;
+    int             line = 1;
+    int             depth = 0;
+    bool            lineStart = true;
+    bool            continuation = false;
+    bool            decorated = false;
+
+    parts.push_back( BufferPart( 1, 0, true ) );
+    while ( p < end && parts.size() < count )
+    {
+        if ( lineStart )
+        {
+            lineStart = false;
+            if ( depth == 0 && ! continuation )
+            {
+                int     kind = getLineKind( p );
+                if ( kind != LINE_CONTINUES )
+                {
+                    size_t  target = parts.size() * size / count;
+                    if ( kind != LINE_STATEMENT && ! decorated &&
+                         size_t( p - buffer ) >= target )
+                    {
+                        parts.back().last = false;
+                        parts.push_back( BufferPart( line, p - buffer,
+                                                     true ) );
+                    }
+                    decorated = ( kind == LINE_DECORATOR );
+                }
+            }
+            continuation = false;
+        }
+
+        char    c = *p;
+        if ( c == '\r' || c == '\n' )
+        {
+            if ( c == '\r' && *(p + 1) == '\n' )
+                ++p;
+            ++p;
+            ++line;
+            lineStart = true;
+            continue;
+        }
+
+        ++p;
+        switch ( c )
+        {
+            case '#':
+                while ( p < end && *p != '\r' && *p != '\n' )
+                    ++p;
+                break;
+            case '\\':
+                if ( *p == '\r' || *p == '\n' )
+                    continuation = true;
+                break;
+            case '(': case '[': case '{':
+                ++depth;
+                break;
+            case ')': case ']': case '}':
+                if ( depth > 0 )
+                    --depth;
+                break;
+            case '"': case '\'':
+                {
+                    bool    triple = ( p[ 0 ] == c && p[ 1 ] == c );
+                    if ( triple )
+                        p += 2;
+                    while ( p < end )
+                    {
+                        char    s = *p++;
+                        if ( s == '\\' && p < end )
+                        {
+                            // The escaped character could be a line break
+                            s = *p++;
+                            if ( s == '\r' && *p == '\n' )
+                                ++p;
+                            if ( s == '\r' || s == '\n' )
+                                ++line;
+                            continue;
+                        }
+                        if ( s == c &&
+                             ( ! triple || ( p[ 0 ] == c && p[ 1 ] == c ) ) )
+                        {
+                            if ( triple )
+                                p += 2;
+                            break;
+                        }
+                        if ( s == '\r' || s == '\n' )
+                        {
+                            if ( s == '\r' && *p == '\n' )
+                                ++p;
+                            ++line;
+                            if ( ! triple )
+                            {
+                                // Unterminated string; the tokenizer will
+                                // report it
+                                lineStart = true;
+                                break;
+                            }
+                        }
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+
+// Parses the buffer parts on many threads and stitches the trees. Returns
+// false if any part has an error; the error is reported by the whole buffer
+// parse then.
+static bool
+parseParts( const char *  buffer, size_t  size,
+            const std::vector< BufferPart > &  parts, ParseTree &  tree,
+            ParseControl *  control )
+{
+    size_t                          count = parts.size();
+    std::vector< std::string >      texts( count );
+    std::vector< ParseTree * >      trees( count );
+    std::vector< char >             parsed( count, 0 );
+    std::vector< std::thread >      workers;
+
+    for ( size_t  k = 0; k < count; ++k )
+    {
+        size_t      partEnd = k + 1 < count ? parts[ k + 1 ].offset : size;
+        texts[ k ].assign( buffer + parts[ k ].offset,
+                           partEnd - parts[ k ].offset );
+        trees[ k ] = new ParseTree();
+        trees[ k ]->headerCommentsOnly = tree.headerCommentsOnly;
+    }
+
+    struct PartParser
+    {
+        static void  run( const std::string *  text, ParseTree *  partTree,
+                          const BufferPart *  part, ParseControl *  control,
+                          char *  result )
+        {
+            Parser      parser( text->c_str(), *partTree, part, control );
+            *result = parser.parse();
+        }
+    };
+
+    for ( size_t  k = 1; k < count; ++k )
+        workers.push_back( std::thread( & PartParser::run, & texts[ k ],
+                                        trees[ k ], & parts[ k ], control,
+                                        & parsed[ k ] ) );
+    PartParser::run( & texts[ 0 ], trees[ 0 ], & parts[ 0 ], control,
+                     & parsed[ 0 ] );
+    for ( size_t  k = 0; k < workers.size(); ++k )
+        workers[ k ].join();
+
+    bool        success = std::find( parsed.begin(), parsed.end(), 0 ) ==
+                          parsed.end();
+    if ( success )
+    {
+        // The statements of all the parts go to one file_input. Only the
+        // last part ENDMARKER is kept.
+        std::vector< Node * >   inputs( count );
+        size_t                  total = 0;
+        for ( size_t  k = 0; k < count; ++k )
+        {
+            Node *  root = trees[ k ]->root;
+            if ( root->n_type == encoding_decl )
+                root = & root->n_child[ 0 ];
+            inputs[ k ] = root;
+            total += root->n_nchildren - ( k + 1 < count ? 1 : 0 );
+        }
+
+        Node *      children = tree.allocateNodes( total );
+        Node *      dest = children;
+        for ( size_t  k = 0; k < count; ++k )
+        {
+            size_t  n = inputs[ k ]->n_nchildren - ( k + 1 < count ? 1 : 0 );
+            memcpy( dest, inputs[ k ]->n_child, n * sizeof( Node ) );
+            dest += n;
+        }
+
+        Node *      root = tree.allocateNodes( 1 );
+        *root = *inputs[ 0 ];
+        root->n_nchildren = total;
+        root->n_child = children;
+        if ( trees[ 0 ]->root->n_type == encoding_decl )
+        {
+            Node *  encodingNode = tree.allocateNodes( 1 );
+            *encodingNode = *trees[ 0 ]->root;
+            encodingNode->n_child = root;
+            root = encodingNode;
+        }
+        tree.root = root;
+        tree.encoding = trees[ 0 ]->encoding;
+
+        for ( size_t  k = 0; k < count; ++k )
+        {
+            tree.lineShifts.insert( tree.lineShifts.end(),
+                                    trees[ k ]->lineShifts.begin(),
+                                    trees[ k ]->lineShifts.end() );
+            tree.comments.insert( tree.comments.end(),
+                                  trees[ k ]->comments.begin(),
+                                  trees[ k ]->comments.end() );
+            tree.adopt( *trees[ k ] );
+        }
+    }
+
+    for ( size_t  k = 0; k < count; ++k )
+        delete trees[ k ];
+    return success;
+}
+
+}   // end of the anonymous namespace
+
+
+
+ParseControl::ParseControl() :
+    cancelled( false ), hasDeadline( false ), status( RUNNING )
+{}
+
+
+void
+ParseControl::setTimeout( double  seconds )
+{
+    hasDeadline = true;
+    deadline = std::chrono::steady_clock::now() +
+               std::chrono::duration_cast< std::chrono::steady_clock::duration >(
+                    std::chrono::duration< double >( seconds ) );
+}
+
+
+void
+ParseControl::supersede( void )
+{
+    int     expected = RUNNING;
+    status.compare_exchange_strong( expected, SUPERSEDED );
+}
+
+
+bool
+ParseControl::shouldStop( void )
+{
+    if ( status != RUNNING )
+        return true;
+
+    int     reason = RUNNING;
+    if ( cancelled || ( cancelFlag && *cancelFlag ) )
+        reason = CANCELLED;
+    else if ( hasDeadline && std::chrono::steady_clock::now() >= deadline )
+        reason = DEADLINE_EXCEEDED;
+    else
+        return false;
+
+    int     expected = RUNNING;
+    status.compare_exchange_strong( expected, reason );
+    return true;
+}
+
+
+
+void setParseTuning( long long  pipeline, long long  parallel,
+                     long long  cpus )
+{
+    pipelineThreshold = pipeline;
+    parallelThreshold = parallel;
+    workers = cpus;
+}
+
+
+// The smallest part of a buffer parsed in parts
+static size_t
+getPartMinimum( void )
+{
+    size_t      threshold = getTuning( parallelThreshold, PARALLEL_THRESHOLD );
+    return std::max( size_t( 1 ),
+                     std::min( size_t( PARALLEL_MIN_PART ), threshold / 4 ) );
+}
+
+
+bool
+buildParseTree( const char *  buffer, ParseTree &  tree,
+                ParseControl *  control )
+{
+    if ( control != NULL && control->shouldStop() )
+        return false;
+
+    size_t          size = strlen( buffer );
+    size_t          cpus = getWorkers();
+    size_t          threshold = getTuning( parallelThreshold,
+                                           PARALLEL_THRESHOLD );
+
+    if ( size >= threshold && cpus > 1 )
+    {
+        std::vector< BufferPart >   parts;
+        getBufferParts( buffer, size,
+                        std::min( cpus, size / getPartMinimum() ), parts );
+
+        // The syntax errors are reported by the whole buffer parse so that
+        // the messages are the same in both cases
+        if ( parts.size() > 1 &&
+             parseParts( buffer, size, parts, tree, control ) )
+            return true;
+        if ( control != NULL && control->isStopped() )
+            return false;
+    }
+
+    Parser      parser( buffer, tree, NULL, control );
+    return parser.parse();
+}
+
+
+void
+getParseParts( const char *  buffer, std::vector< BufferPart > &  parts )
+{
+    size_t      size = strlen( buffer );
+
+    parts.clear();
+    getBufferParts( buffer, size,
+                    std::max( size_t( 1 ), size / getPartMinimum() ), parts );
+}
+
+
+bool
+buildPartParseTree( const char *  buffer,
+                    const std::vector< BufferPart > &  parts, size_t  index,
+                    ParseTree &  tree, ParseControl *  control )
+{
+    if ( parts.size() == 1 )
+        return buildParseTree( buffer, tree, control );
+
+    if ( control != NULL && control->shouldStop() )
+        return false;
+
+    const char *    begin = buffer + parts[ index ].offset;
+    std::string     text;
+    if ( index + 1 < parts.size() )
+        text.assign( begin, parts[ index + 1 ].offset - parts[ index ].offset );
+    else
+        text.assign( begin );
+    Parser          parser( text.c_str(), tree, & parts[ index ], control );
+    return parser.parse();
+}
+
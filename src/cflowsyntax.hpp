@@ -0,0 +1,273 @@
+/*
+ * codimension - graphics python two-way code editor and analyzer
+ * Copyright (C) 2014 - 2016  Sergey Satskiy <sergey.satskiy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Python statement level syntax tree
+ */
+
+#ifndef CFLOWSYNTAX_HPP
+#define CFLOWSYNTAX_HPP
+
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+
+#include "cflowtokenizer.hpp"
+
+
+// The non-terminal numbers match the python 3.9 graminit.h ones
+enum SymbolType
+{
+    single_input = 256,
+    file_input = 257,
+    eval_input = 258,
+    decorator = 259,
+    decorators = 260,
+    decorated = 261,
+    async_funcdef = 262,
+    funcdef = 263,
+    parameters = 264,
+    typedargslist = 265,
+    tfpdef = 266,
+    varargslist = 267,
+    vfpdef = 268,
+    stmt = 269,
+    simple_stmt = 270,
+    small_stmt = 271,
+    expr_stmt = 272,
+    annassign = 273,
+    testlist_star_expr = 274,
+    augassign = 275,
+    del_stmt = 276,
+    pass_stmt = 277,
+    flow_stmt = 278,
+    break_stmt = 279,
+    continue_stmt = 280,
+    return_stmt = 281,
+    yield_stmt = 282,
+    raise_stmt = 283,
+    import_stmt = 284,
+    import_name = 285,
+    import_from = 286,
+    import_as_name = 287,
+    dotted_as_name = 288,
+    import_as_names = 289,
+    dotted_as_names = 290,
+    dotted_name = 291,
+    global_stmt = 292,
+    nonlocal_stmt = 293,
+    assert_stmt = 294,
+    compound_stmt = 295,
+    async_stmt = 296,
+    if_stmt = 297,
+    while_stmt = 298,
+    for_stmt = 299,
+    try_stmt = 300,
+    with_stmt = 301,
+    with_item = 302,
+    except_clause = 303,
+    suite = 304,
+    namedexpr_test = 305,
+    test = 306,
+    test_nocond = 307,
+    lambdef = 308,
+    lambdef_nocond = 309,
+    or_test = 310,
+    and_test = 311,
+    not_test = 312,
+    comparison = 313,
+    comp_op = 314,
+    star_expr = 315,
+    expr = 316,
+    xor_expr = 317,
+    and_expr = 318,
+    shift_expr = 319,
+    arith_expr = 320,
+    term = 321,
+    factor = 322,
+    power = 323,
+    atom_expr = 324,
+    atom = 325,
+    testlist_comp = 326,
+    trailer = 327,
+    subscriptlist = 328,
+    subscript = 329,
+    sliceop = 330,
+    exprlist = 331,
+    testlist = 332,
+    dictorsetmaker = 333,
+    classdef = 334,
+    arglist = 335,
+    argument = 336,
+    comp_iter = 337,
+    sync_comp_for = 338,
+    comp_for = 339,
+    comp_if = 340,
+    encoding_decl = 341,
+    yield_expr = 342,
+    yield_arg = 343
+};
+
+
+// The node layout follows the CPython node.h one: children are stored in a
+// contiguous array so the siblings could be reached by pointer arithmetics.
+struct Node
+{
+    int             n_type;
+    const char *    n_str;          // Token text; NULL for non-terminals
+    int             n_lineno;       // 1-based
+    int             n_col_offset;   // 0-based; -1 if not available
+    int             n_nchildren;
+    Node *          n_child;
+};
+
+
+// Owns the nodes and the token strings of a parsed buffer.
+//
+// The statements are modelled exactly as the pgen concrete syntax tree had
+// them. The expressions are not: an expression node has the token leaves
+// and the atom_expr nodes (primaries with their trailers) as direct
+// children. The walker relies only on the first child chains, the last
+// leaves and the node types listed in the statement rules so both trees give
+// the same control flow.
+class ParseTree
+{
+    public:
+        ParseTree();
+        ~ParseTree();
+
+        Node *  allocateNodes( size_t  count );
+        const char *  copyString( const char *  str, size_t  length );
+
+        // Takes the ownership of the other tree nodes and strings
+        void  adopt( ParseTree &  other );
+
+    public:
+        Node *          root;       // NULL if there was an error
+        std::string     encoding;   // Normalized; empty if not specified
+
+        // Collected while tokenizing; complete only if there was no error.
+        // If headerCommentsOnly is set before the parse then the comments
+        // of the first two lines (the bang and the encoding lines) only are
+        // collected.
+        std::vector< int >          lineShifts;
+        std::deque< CommentLine >   comments;
+        bool                        headerCommentsOnly;
+
+        int             errorLine;
+        int             errorColumn;
+        std::string     errorMessage;
+
+    private:
+        std::vector< char * >   blocks;
+        char *                  blockCur;
+        size_t                  blockLeft;
+
+        void *  allocate( size_t  size );
+
+        ParseTree( const ParseTree & );
+        ParseTree &  operator=( const ParseTree & );
+};
+
+
+// Lets a parse be stopped from another thread or when a deadline passes.
+// The parser checks it every PARSE_CHECK_INTERVAL tokens and the walker
+// checks it before each statement. The first reason to stop sticks.
+class ParseControl
+{
+    public:
+        enum Status
+        {
+            RUNNING = 0,
+            CANCELLED,
+            DEADLINE_EXCEEDED,
+            SUPERSEDED          // A newer parse of the same document came
+        };
+
+        ParseControl();
+
+        // The flags are shared with a python CancelToken
+        void  setCancelFlag( const std::shared_ptr< std::atomic< bool > > &  flag )
+        { cancelFlag = flag; }
+        void  setStartedFlag( const std::shared_ptr< std::atomic< bool > > &  flag )
+        { startedFlag = flag; }
+        // Called when the control flow is built from the syntax tree
+        void  markStarted( void )
+        { if ( startedFlag ) *startedFlag = true; }
+        // The deadline is counted from now
+        void  setTimeout( double  seconds );
+
+        // Stops the parse regardless of the cancel flag
+        void  cancel( void )
+        { cancelled = true; }
+        // Stops the parse at once; used by the scheduler for the queued
+        // parses which were replaced by a newer one
+        void  supersede( void );
+
+        // Thread safe; may be called by many parser threads
+        bool  shouldStop( void );
+
+        int  getStatus( void ) const
+        { return status; }
+        bool  isStopped( void ) const
+        { return status != RUNNING; }
+
+    private:
+        std::shared_ptr< std::atomic< bool > >      cancelFlag;
+        std::shared_ptr< std::atomic< bool > >      startedFlag;
+        std::atomic< bool >                         cancelled;
+        bool                                        hasDeadline;
+        std::chrono::steady_clock::time_point       deadline;
+        std::atomic< int >                          status;
+
+        ParseControl( const ParseControl & );
+        ParseControl &  operator=( const ParseControl & );
+};
+
+
+// Parses the buffer with the native tokenizer and parser. Big buffers are
+// split at the top level definitions and the parts are parsed on many
+// threads. Returns false in case of a syntax error or if the control (if
+// given) stopped the parse.
+bool buildParseTree( const char *  buffer, ParseTree &  tree,
+                     ParseControl *  control = NULL );
+
+// Splits the buffer at the column 0 definitions into the parts of about the
+// parallel parse part size; a small buffer is a single part.
+void getParseParts( const char *  buffer, std::vector< BufferPart > &  parts );
+
+// Parses one of the buffer parts so that the big buffers could be processed
+// part by part. The line shifts and the comments are reported as for the
+// whole buffer; the ones of the consecutive parts could be concatenated. The
+// syntax error messages may differ from the whole buffer parse ones.
+bool buildPartParseTree( const char *  buffer,
+                         const std::vector< BufferPart > &  parts,
+                         size_t  index, ParseTree &  tree,
+                         ParseControl *  control = NULL );
+
+// Overrides the thresholds of the helper tokenizer thread and of the parallel
+// parts and the number of CPUs so the tests could take the threaded paths on
+// the small buffers and on a single CPU. A negative value restores the
+// default. The part minimum is limited to a quarter of the parallel threshold.
+void setParseTuning( long long  pipelineThreshold,
+                     long long  parallelThreshold, long long  workers );
+
+
+#endif
+
@@ -0,0 +1,1114 @@
+/*
+ * codimension - graphics python two-way code editor and analyzer
+ * Copyright (C) 2014 - 2016  Sergey Satskiy <sergey.satskiy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Python tokenizer
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "cflowtokenizer.hpp"
+
+
+#define TAB_SIZE    8
+
+
+static inline bool
+isLineBreak( char  c )
+{
+    return c == '\n' || c == '\r';
+}
+
+
+static inline bool
+isIdentifierStart( unsigned char  c )
+{
+    return ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) ||
+           c == '_' || c >= 128;
+}
+
+
+static inline bool
+isIdentifierChar( unsigned char  c )
+{
+    return isIdentifierStart( c ) || ( c >= '0' && c <= '9' );
+}
+
+
+static inline bool
+isDigit( char  c )
+{
+    return c >= '0' && c <= '9';
+}
+
+
+// Provides the position after the line break which ends the line the given
+// position belongs to (or the end of the buffer)
+static const char *
+getLineEnd( const char *  pos )
+{
+    while ( *pos != '\0' && ! isLineBreak( *pos ) )
+        ++pos;
+    if ( *pos == '\r' && *(pos + 1) == '\n' )
+        return pos + 2;
+    if ( *pos != '\0' )
+        return pos + 1;
+    return pos;
+}
+
+
+// The pgen parser worked on a buffer with the line ends translated to '\n'.
+// The error messages keep it this way.
+static std::string
+getErrorText( const char *  begin, const char *  end )
+{
+    std::string     text;
+    text.reserve( end - begin );
+    for ( ; begin < end; ++begin )
+    {
+        if ( *begin == '\r' )
+        {
+            text += '\n';
+            if ( begin + 1 < end && *(begin + 1) == '\n' )
+                ++begin;
+            continue;
+        }
+        text += *begin;
+    }
+    return text;
+}
+
+
+static int
+getKeyword( const char *  begin, size_t  length )
+{
+    #define CHECK_KEYWORD( word, kw ) \
+        if ( memcmp( begin, word, length ) == 0 ) return kw
+
+    switch ( length )
+    {
+        case 2:
+            CHECK_KEYWORD( "if", KW_IF );
+            CHECK_KEYWORD( "in", KW_IN );
+            CHECK_KEYWORD( "is", KW_IS );
+            CHECK_KEYWORD( "as", KW_AS );
+            CHECK_KEYWORD( "or", KW_OR );
+            break;
+        case 3:
+            CHECK_KEYWORD( "def", KW_DEF );
+            CHECK_KEYWORD( "for", KW_FOR );
+            CHECK_KEYWORD( "not", KW_NOT );
+            CHECK_KEYWORD( "and", KW_AND );
+            CHECK_KEYWORD( "del", KW_DEL );
+            CHECK_KEYWORD( "try", KW_TRY );
+            break;
+        case 4:
+            CHECK_KEYWORD( "else", KW_ELSE );
+            CHECK_KEYWORD( "elif", KW_ELIF );
+            CHECK_KEYWORD( "None", KW_NONE_VALUE );
+            CHECK_KEYWORD( "True", KW_TRUE );
+            CHECK_KEYWORD( "from", KW_FROM );
+            CHECK_KEYWORD( "pass", KW_PASS );
+            CHECK_KEYWORD( "with", KW_WITH );
+            break;
+        case 5:
+            CHECK_KEYWORD( "class", KW_CLASS );
+            CHECK_KEYWORD( "while", KW_WHILE );
+            CHECK_KEYWORD( "raise", KW_RAISE );
+            CHECK_KEYWORD( "False", KW_FALSE );
+            CHECK_KEYWORD( "break", KW_BREAK );
+            CHECK_KEYWORD( "yield", KW_YIELD );
+            break;
+        case 6:
+            CHECK_KEYWORD( "return", KW_RETURN );
+            CHECK_KEYWORD( "import", KW_IMPORT );
+            CHECK_KEYWORD( "except", KW_EXCEPT );
+            CHECK_KEYWORD( "lambda", KW_LAMBDA );
+            CHECK_KEYWORD( "assert", KW_ASSERT );
+            CHECK_KEYWORD( "global", KW_GLOBAL );
+            break;
+        case 7:
+            CHECK_KEYWORD( "finally", KW_FINALLY );
+            break;
+        case 8:
+            CHECK_KEYWORD( "continue", KW_CONTINUE );
+            CHECK_KEYWORD( "nonlocal", KW_NONLOCAL );
+            break;
+        default:
+            break;
+    }
+    return KW_NONE;
+
+    #undef CHECK_KEYWORD
+}
+
+
+/* Copied and adjusted from Parser/tokenizer.c get_normal_name() */
+static std::string
+getNormalEncodingName( const std::string &  name )
+{
+    char    buf[ 13 ];
+    size_t  i;
+
+    for ( i = 0; i < 12 && i < name.size(); ++i )
+    {
+        char    c = name[ i ];
+        if ( c == '_' )
+            buf[ i ] = '-';
+        else
+            buf[ i ] = tolower( c );
+    }
+    buf[ i ] = '\0';
+
+    if ( strcmp( buf, "utf-8" ) == 0 || strncmp( buf, "utf-8-", 6 ) == 0 )
+        return "utf-8";
+    if ( strcmp( buf, "latin-1" ) == 0 ||
+         strcmp( buf, "iso-8859-1" ) == 0 ||
+         strcmp( buf, "iso-latin-1" ) == 0 ||
+         strncmp( buf, "latin-1-", 8 ) == 0 ||
+         strncmp( buf, "iso-8859-1-", 11 ) == 0 ||
+         strncmp( buf, "iso-latin-1-", 12 ) == 0 )
+        return "iso-8859-1";
+    return name;
+}
+
+
+/* Copied and adjusted from Parser/tokenizer.c get_coding_spec()
+ * 0 - the line is a comment without the coding spec or an empty line
+ * 1 - the coding spec is found
+ * -1 - the line has something else so the coding spec must not be searched
+ *      further
+ */
+static int
+getCodingSpec( const char *  line, const char *  lineEnd,
+               std::string &  spec )
+{
+    const char *    p = line;
+    for ( ; p < lineEnd; ++p )
+    {
+        if ( *p == '#' || isLineBreak( *p ) )
+            break;
+        if ( *p != ' ' && *p != '\t' && *p != '\014' )
+            return -1;
+    }
+    if ( p >= lineEnd || *p != '#' )
+        return 0;
+
+    for ( ; p + 6 < lineEnd; ++p )
+    {
+        if ( memcmp( p, "coding", 6 ) != 0 )
+            continue;
+
+        const char *    t = p + 6;
+        if ( *t != ':' && *t != '=' )
+            continue;
+        do
+        {
+            ++t;
+        } while ( *t == ' ' || *t == '\t' );
+
+        const char *    begin = t;
+        while ( isalnum( (unsigned char)(*t) ) ||
+                *t == '-' || *t == '_' || *t == '.' )
+            ++t;
+        if ( begin < t )
+        {
+            spec = getNormalEncodingName( std::string( begin, t - begin ) );
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+Tokenizer::Tokenizer( const char *  buf,
+                      std::vector< int > *  shifts,
+                      std::deque< CommentLine > *  commentLines,
+                      const BufferPart *  part ) :
+    errorLine( 0 ), errorColumn( 0 ),
+    buffer( buf ), bufferEnd( buf + strlen( buf ) ),
+    cur( buf ), lineBegin( buf ), textBegin( buf ), lastLineBegin( buf ),
+    line( 1 ), lineShifts( shifts ), comments( commentLines ),
+    commentLineLimit( INT_MAX ), offset( 0 ), continued( false ),
+    atBOL( true ), reachedEOF( false ), started( false ),
+    eofNewLine( false ), pending( 0 ), indent( 0 ), level( 0 )
+{
+    indStack[ 0 ] = 0;
+    altIndStack[ 0 ] = 0;
+
+    if ( part != NULL )
+    {
+        line = part->firstLine;
+        offset = part->offset;
+        continued = ! part->last;
+    }
+
+    if ( lineShifts != NULL )
+    {
+        lineShifts->clear();
+        if ( line == 1 )
+        {
+            // index 0 is not used; the first line starts with shift 0 even
+            // if there is a BOM
+            lineShifts->push_back( 0 );
+            lineShifts->push_back( 0 );
+        }
+    }
+
+    // The encoding could be specified only at the buffer beginning
+    if ( line == 1 )
+        detectEncoding();
+}
+
+
+void
+Tokenizer::detectEncoding( void )
+{
+    if ( strncmp( cur, "\xEF\xBB\xBF", 3 ) == 0 )
+    {
+        // The pgen tokenizer skipped the BOM so the first line columns are
+        // counted from the character after it
+        encoding = "utf-8";
+        cur += 3;
+        lineBegin = cur;
+        textBegin = cur;
+    }
+
+    // The coding spec could be in the first or in the second line
+    const char *    firstLineEnd = getLineEnd( cur );
+    std::string     spec;
+    int             status = getCodingSpec( cur, firstLineEnd, spec );
+
+    if ( status == 0 && *firstLineEnd != '\0' )
+        status = getCodingSpec( firstLineEnd, getLineEnd( firstLineEnd ),
+                                spec );
+    if ( status == 1 )
+    {
+        if ( encoding.empty() )
+            encoding = spec;
+        else if ( encoding != spec )
+            encoding = "bom-mismatch-" + spec;
+    }
+}
+
+
+// joined is true if the line continues a multi line string or a backslash
+// terminated line
+void
+Tokenizer::newLine( const char *  lineStart, bool  joined )
+{
+    ++line;
+    lineBegin = lineStart;
+    if ( ! joined )
+        textBegin = lineStart;
+    if ( lineStart < bufferEnd )
+        lastLineBegin = lineStart;
+    if ( lineShifts != NULL )
+        lineShifts->push_back( offset + ( lineStart - buffer ) );
+}
+
+
+// begin points to '#', cur to the line break or the end of the buffer
+void
+Tokenizer::addComment( const char *  begin )
+{
+    if ( comments == NULL || line > commentLineLimit )
+        return;
+
+    // The columns are counted from the buffer line beginning, i.e. the BOM
+    // is included
+    int             beginPos = begin - buffer;
+    CommentLine     comment( beginPos, cur - buffer - 1, line,
+                             beginPos - ( line == 1 ? 0 : lineBegin - buffer )
+                             + 1, UNKNOWN_COMMENT );
+    comment.detectType( buffer );
+    comment.begin += offset;
+    comment.end += offset;
+    comments->push_back( comment );
+}
+
+
+// cur points to a line break. The function moves to the next line.
+// Returns true if it was the last line break in the buffer.
+bool
+Tokenizer::skipLineEnd( bool  joined )
+{
+    if ( *cur == '\r' && *(cur + 1) == '\n' )
+        ++cur;
+    ++cur;
+    newLine( cur, joined );
+    return cur >= bufferEnd;
+}
+
+
+int
+Tokenizer::fail( const char *  message, int  errLine, int  column,
+                 const char *  textBegin, const char *  textEnd )
+{
+    errorLine = errLine;
+    errorColumn = column;
+    errorMessage = std::string( message ) + "\n" +
+                   getErrorText( textBegin, textEnd );
+    return ERRORTOKEN;
+}
+
+
+// The errors detected by the tokenizer were reported as SyntaxError with
+// the position right after the problematic character
+int
+Tokenizer::failAtCurrentLine( const std::string &  message )
+{
+    return fail( message.c_str(), line, cur - lineBegin,
+                 lineBegin, getLineEnd( lineBegin ) );
+}
+
+
+int
+Tokenizer::finish( Token &  token, int  type, const char *  start )
+{
+    token.type = type;
+    token.keyword = KW_NONE;
+    token.begin = start;
+    token.end = cur;
+    token.line = line;
+    token.col = start - lineBegin;
+    token.endLine = line;
+    token.lineBegin = lineBegin;
+    token.textBegin = textBegin;
+    token.atEOF = false;
+    started = true;
+    return type;
+}
+
+
+// Analyses the indentation of a new line. Updates the number of pending
+// INDENT/DEDENT tokens. Returns ERRORTOKEN in case of errors, otherwise the
+// indicator if the line is blank.
+int
+Tokenizer::processIndentation( void )
+{
+    int             col = 0;
+    int             altCol = 0;
+    const char *    lineEnd;
+
+    for ( ; ; ++cur )
+    {
+        if ( *cur == ' ' )
+        {
+            ++col;
+            ++altCol;
+        }
+        else if ( *cur == '\t' )
+        {
+            col = ( col / TAB_SIZE + 1 ) * TAB_SIZE;
+            ++altCol;
+        }
+        else if ( *cur == '\014' )  // Control-L (formfeed)
+            col = altCol = 0;
+        else
+            break;
+    }
+
+    // Blank lines, comment lines and lines starting with a line continuation
+    // do not affect the indentation
+    if ( *cur == '#' || *cur == '\\' || isLineBreak( *cur ) )
+        return 1;
+    if ( level != 0 )
+        return 0;   // Implicit line joining
+
+    lineEnd = getLineEnd( cur );
+    if ( col == indStack[ indent ] )
+    {
+        if ( altCol != altIndStack[ indent ] )
+            return fail( "inconsistent use of tabs and spaces in indentation",
+                         line, lineEnd - lineBegin, lineBegin, lineEnd );
+    }
+    else if ( col > indStack[ indent ] )
+    {
+        if ( indent + 1 >= MAX_INDENT_LEVEL )
+            return fail( "too many levels of indentation",
+                         line, lineEnd - lineBegin, lineBegin, lineEnd );
+        if ( altCol <= altIndStack[ indent ] )
+            return fail( "inconsistent use of tabs and spaces in indentation",
+                         line, lineEnd - lineBegin, lineBegin, lineEnd );
+        ++pending;
+        ++indent;
+        indStack[ indent ] = col;
+        altIndStack[ indent ] = altCol;
+    }
+    else
+    {
+        while ( indent > 0 && col < indStack[ indent ] )
+        {
+            --pending;
+            --indent;
+        }
+        if ( col != indStack[ indent ] )
+            return fail( "unindent does not match any outer indentation level",
+                         line, lineEnd - lineBegin, lineBegin, lineEnd );
+        if ( altCol != altIndStack[ indent ] )
+            return fail( "inconsistent use of tabs and spaces in indentation",
+                         line, lineEnd - lineBegin, lineBegin, lineEnd );
+    }
+    return 0;
+}
+
+
+/* Follows Parser/tokenizer.c tok_decimal_tail() */
+static const char *
+skipDecimalTail( const char *  p, bool &  failed )
+{
+    for ( ; ; )
+    {
+        while ( isDigit( *p ) )
+            ++p;
+        if ( *p != '_' )
+            break;
+        ++p;
+        if ( ! isDigit( *p ) )
+        {
+            failed = true;
+            break;
+        }
+    }
+    return p;
+}
+
+
+// start points to the first number character: a digit or '.'
+int
+Tokenizer::readNumber( Token &  token, const char *  start )
+{
+    const char *    p = start;
+    bool            failed = false;
+
+    if ( *p == '0' && ( p[ 1 ] == 'x' || p[ 1 ] == 'X' ||
+                        p[ 1 ] == 'o' || p[ 1 ] == 'O' ||
+                        p[ 1 ] == 'b' || p[ 1 ] == 'B' ) )
+    {
+        char            kind = tolower( p[ 1 ] );
+        const char *    name = kind == 'x' ? "hexadecimal" :
+                               kind == 'o' ? "octal" : "binary";
+
+        p += 2;
+        do
+        {
+            if ( *p == '_' )
+                ++p;
+
+            bool    valid = kind == 'x' ? isxdigit( (unsigned char)(*p) ) :
+                            kind == 'o' ? ( *p >= '0' && *p <= '7' ) :
+                                          ( *p == '0' || *p == '1' );
+            if ( ! valid )
+            {
+                cur = p;
+                if ( kind != 'x' && isDigit( *p ) )
+                {
+                    ++cur;
+                    return failAtCurrentLine( std::string( "invalid digit '" ) +
+                                              *p + "' in " + name + " literal" );
+                }
+                return failAtCurrentLine( std::string( "invalid " ) +
+                                          name + " literal" );
+            }
+            while ( kind == 'x' ? isxdigit( (unsigned char)(*p) ) :
+                    kind == 'o' ? ( *p >= '0' && *p <= '7' ) :
+                                  ( *p == '0' || *p == '1' ) )
+                ++p;
+        } while ( *p == '_' );
+
+        if ( kind != 'x' && isDigit( *p ) )
+        {
+            cur = p + 1;
+            return failAtCurrentLine( std::string( "invalid digit '" ) +
+                                      *p + "' in " + name + " literal" );
+        }
+
+        cur = p;
+        return finish( token, NUMBER, start );
+    }
+
+    bool    fraction = ( *p == '.' );
+    if ( *p == '0' )
+    {
+        // Maybe an old style octal; '0' itself is a valid literal
+        bool    nonZero = false;
+        for ( ; ; )
+        {
+            if ( *p == '_' )
+            {
+                ++p;
+                if ( ! isDigit( *p ) )
+                {
+                    cur = p;
+                    return failAtCurrentLine( "invalid decimal literal" );
+                }
+            }
+            if ( *p != '0' )
+                break;
+            ++p;
+        }
+        if ( isDigit( *p ) )
+        {
+            nonZero = true;
+            p = skipDecimalTail( p, failed );
+        }
+        if ( ! failed && nonZero && *p != '.' && *p != 'e' && *p != 'E' &&
+             *p != 'j' && *p != 'J' )
+        {
+            cur = p;
+            return failAtCurrentLine( "leading zeros in decimal integer "
+                                      "literals are not permitted; use an 0o "
+                                      "prefix for octal integers" );
+        }
+    }
+    else if ( ! fraction )
+        p = skipDecimalTail( p, failed );
+
+    if ( ! failed && *p == '.' )
+    {
+        ++p;
+        if ( isDigit( *p ) )
+            p = skipDecimalTail( p, failed );
+    }
+    if ( ! failed && ( *p == 'e' || *p == 'E' ) )
+    {
+        const char *    exponent = p;
+        ++p;
+        if ( *p == '+' || *p == '-' )
+        {
+            ++p;
+            if ( ! isDigit( *p ) )
+            {
+                cur = p;
+                return failAtCurrentLine( "invalid decimal literal" );
+            }
+        }
+        if ( isDigit( *p ) )
+            p = skipDecimalTail( p, failed );
+        else
+            p = exponent;   // 'e' is not a part of the number
+    }
+    if ( ! failed && ( *p == 'j' || *p == 'J' ) )
+        ++p;
+
+    cur = p;
+    if ( failed )
+        return failAtCurrentLine( "invalid decimal literal" );
+    return finish( token, NUMBER, start );
+}
+
+
+// start points to the first prefix character (if any), quote points to the
+// opening quote
+int
+Tokenizer::readString( Token &  token, const char *  start,
+                       const char *  quote )
+{
+    char            q = *quote;
+    int             quoteSize = 1;
+    int             endQuoteSize = 0;
+    int             firstLine = line;
+    const char *    firstLineBegin = lineBegin;
+    const char *    firstTextBegin = textBegin;
+
+    cur = quote + 1;
+    if ( *cur == q )
+    {
+        ++cur;
+        if ( *cur == q )
+        {
+            ++cur;
+            quoteSize = 3;
+        }
+        else
+            endQuoteSize = 1;   // Empty string
+    }
+
+    while ( endQuoteSize != quoteSize )
+    {
+        if ( cur >= bufferEnd )
+        {
+            if ( quoteSize == 3 )
+                return fail( "EOF while scanning triple-quoted string literal",
+                             getEOFLine(), bufferEnd - firstTextBegin,
+                             firstTextBegin, bufferEnd );
+            return fail( "EOL while scanning string literal",
+                         line, bufferEnd - firstTextBegin,
+                         firstTextBegin, bufferEnd );
+        }
+
+        char    c = *cur;
+        if ( isLineBreak( c ) )
+        {
+            if ( quoteSize == 1 )
+            {
+                const char *    lineEnd = getLineEnd( cur );
+                return fail( "EOL while scanning string literal",
+                             line, lineEnd - firstTextBegin,
+                             firstTextBegin, lineEnd );
+            }
+            skipLineEnd( true );
+            endQuoteSize = 0;
+            continue;
+        }
+
+        ++cur;
+        if ( c == q )
+        {
+            ++endQuoteSize;
+            continue;
+        }
+
+        endQuoteSize = 0;
+        if ( c == '\\' && cur < bufferEnd )
+        {
+            // Skip the escaped character which could be a line break
+            if ( isLineBreak( *cur ) )
+                skipLineEnd( true );
+            else
+                ++cur;
+        }
+    }
+
+    token.type = STRING;
+    token.keyword = KW_NONE;
+    token.begin = start;
+    token.end = cur;
+    token.line = firstLine;
+    token.col = start - firstLineBegin;
+    token.endLine = line;
+    token.lineBegin = firstLineBegin;
+    token.textBegin = firstTextBegin;
+    token.atEOF = false;
+    started = true;
+    return STRING;
+}
+
+
+int
+Tokenizer::next( Token &  token )
+{
+    // The blank line status survives the line continuations within a call
+    // as it was in pgen
+    bool    blankLine = false;
+
+    for ( ; ; )
+    {
+        if ( atBOL )
+        {
+            atBOL = false;
+
+            int     status = processIndentation();
+            if ( status == ERRORTOKEN )
+                return ERRORTOKEN;
+            blankLine = ( status == 1 );
+            if ( cur >= bufferEnd )
+                reachedEOF = true;
+        }
+
+        if ( pending != 0 )
+        {
+            int     type = pending < 0 ? DEDENT : INDENT;
+            pending += pending < 0 ? 1 : -1;
+            finish( token, type, cur );
+            token.col = -1;
+            token.atEOF = reachedEOF;
+            if ( reachedEOF )
+                token.line = token.endLine = getEOFLine();
+            return type;
+        }
+
+        // Skip spaces and a comment. A comment at the end of a line
+        // becomes a part of the NEWLINE token like it was in pgen.
+        while ( *cur == ' ' || *cur == '\t' || *cur == '\014' )
+            ++cur;
+
+        const char *    start = cur;
+        if ( *cur == '#' )
+        {
+            while ( *cur != '\0' && ! isLineBreak( *cur ) )
+                ++cur;
+            addComment( start );
+        }
+        unsigned char   c = *cur;
+
+        if ( cur >= bufferEnd )
+        {
+            reachedEOF = true;
+            if ( continued && ! eofNewLine )
+            {
+                // The input continues in the next part. The next statement
+                // beginning there closes all the blocks.
+                eofNewLine = true;
+                pending = -indent;
+                indent = 0;
+                continue;
+            }
+            if ( started && ! eofNewLine )
+            {
+                // pgen added an extra NEWLINE before the ENDMARKER and the
+                // DEDENTs which were not produced because of the open
+                // brackets
+                eofNewLine = true;
+                pending = -indent;
+                indent = 0;
+                finish( token, NEWLINE, cur );
+                token.line = token.endLine = getEOFLine();
+                token.col = -1;
+                token.atEOF = true;
+                return NEWLINE;
+            }
+            finish( token, ENDMARKER, cur );
+            token.line = token.endLine = getEOFLine();
+            token.col = -1;
+            token.atEOF = true;
+            return ENDMARKER;
+        }
+
+        if ( isLineBreak( c ) )
+        {
+            if ( blankLine || level > 0 )
+            {
+                skipLineEnd( false );
+                atBOL = true;
+                continue;
+            }
+
+            finish( token, NEWLINE, start );
+            skipLineEnd( false );
+            atBOL = true;
+            return NEWLINE;
+        }
+
+        if ( isIdentifierStart( c ) )
+        {
+            // It could be a string literal prefix
+            bool    sawB = false, sawR = false, sawU = false, sawF = false;
+            for ( ; ; )
+            {
+                char    p = *cur;
+                if ( ! ( sawB || sawU || sawF ) && ( p == 'b' || p == 'B' ) )
+                    sawB = true;
+                else if ( ! ( sawB || sawU || sawR || sawF ) &&
+                          ( p == 'u' || p == 'U' ) )
+                    sawU = true;
+                else if ( ! ( sawR || sawU ) && ( p == 'r' || p == 'R' ) )
+                    sawR = true;
+                else if ( ! ( sawF || sawB || sawU ) &&
+                          ( p == 'f' || p == 'F' ) )
+                    sawF = true;
+                else
+                    break;
+                ++cur;
+                if ( *cur == '"' || *cur == '\'' )
+                    return readString( token, start, cur );
+            }
+
+            while ( isIdentifierChar( *cur ) )
+                ++cur;
+
+            size_t  length = cur - start;
+            if ( length == 5 && memcmp( start, "async", 5 ) == 0 )
+                return finish( token, ASYNC, start );
+            if ( length == 5 && memcmp( start, "await", 5 ) == 0 )
+                return finish( token, AWAIT, start );
+
+            finish( token, NAME, start );
+            token.keyword = getKeyword( start, length );
+            return NAME;
+        }
+
+        if ( isDigit( c ) || ( c == '.' && isDigit( cur[ 1 ] ) ) )
+            return readNumber( token, start );
+
+        if ( c == '"' || c == '\'' )
+            return readString( token, start, cur );
+
+        if ( c == '\\' )
+        {
+            // Line continuation
+            ++cur;
+            if ( ! isLineBreak( *cur ) )
+            {
+                ++cur;
+                return fail( "unexpected character after line continuation "
+                             "character", line, cur - textBegin,
+                             textBegin, getLineEnd( lineBegin ) );
+            }
+            if ( skipLineEnd( true ) )
+            {
+                reachedEOF = true;
+                return fail( "unexpected EOF while parsing", getEOFLine(),
+                             bufferEnd - lastLineBegin,
+                             lastLineBegin, bufferEnd );
+            }
+            continue;
+        }
+
+        // Operators and delimiters
+        int     type = OP;
+        char    c1 = cur[ 1 ];
+        char    c2 = c1 == '\0' ? '\0' : cur[ 2 ];
+
+        ++cur;
+        switch ( c )
+        {
+            case '(':
+            case '[':
+            case '{':
+                if ( level >= MAX_BRACKET_LEVEL )
+                    return failAtCurrentLine( "too many nested parentheses" );
+                bracketStack[ level ] = c;
+                bracketLine[ level ] = line;
+                ++level;
+                type = c == '(' ? LPAR : ( c == '[' ? LSQB : LBRACE );
+                break;
+            case ')':
+            case ']':
+            case '}':
+                {
+                    if ( level == 0 )
+                        return failAtCurrentLine( std::string( "unmatched '" ) +
+                                                  char( c ) + "'" );
+                    --level;
+                    char    opening = bracketStack[ level ];
+                    if ( ( opening == '(' && c != ')' ) ||
+                         ( opening == '[' && c != ']' ) ||
+                         ( opening == '{' && c != '}' ) )
+                    {
+                        std::string     message( "closing parenthesis '" );
+                        message += char( c );
+                        message += "' does not match opening parenthesis '";
+                        message += opening;
+                        message += "'";
+                        if ( bracketLine[ level ] != line )
+                        {
+                            char    buf[ 32 ];
+                            sprintf( buf, "%d", bracketLine[ level ] );
+                            message += " on line " + std::string( buf );
+                        }
+                        return failAtCurrentLine( message );
+                    }
+                    type = c == ')' ? RPAR : ( c == ']' ? RSQB : RBRACE );
+                }
+                break;
+            case ':':
+                if ( c1 == '=' ) { ++cur; type = COLONEQUAL; }
+                else type = COLON;
+                break;
+            case ',':
+                type = COMMA;
+                break;
+            case ';':
+                type = SEMI;
+                break;
+            case '+':
+                if ( c1 == '=' ) { ++cur; type = PLUSEQUAL; }
+                else type = PLUS;
+                break;
+            case '-':
+                if ( c1 == '=' ) { ++cur; type = MINEQUAL; }
+                else if ( c1 == '>' ) { ++cur; type = RARROW; }
+                else type = MINUS;
+                break;
+            case '*':
+                if ( c1 == '*' )
+                {
+                    ++cur;
+                    if ( c2 == '=' ) { ++cur; type = DOUBLESTAREQUAL; }
+                    else type = DOUBLESTAR;
+                }
+                else if ( c1 == '=' ) { ++cur; type = STAREQUAL; }
+                else type = STAR;
+                break;
+            case '/':
+                if ( c1 == '/' )
+                {
+                    ++cur;
+                    if ( c2 == '=' ) { ++cur; type = DOUBLESLASHEQUAL; }
+                    else type = DOUBLESLASH;
+                }
+                else if ( c1 == '=' ) { ++cur; type = SLASHEQUAL; }
+                else type = SLASH;
+                break;
+            case '|':
+                if ( c1 == '=' ) { ++cur; type = VBAREQUAL; }
+                else type = VBAR;
+                break;
+            case '&':
+                if ( c1 == '=' ) { ++cur; type = AMPEREQUAL; }
+                else type = AMPER;
+                break;
+            case '<':
+                if ( c1 == '<' )
+                {
+                    ++cur;
+                    if ( c2 == '=' ) { ++cur; type = LEFTSHIFTEQUAL; }
+                    else type = LEFTSHIFT;
+                }
+                else if ( c1 == '=' ) { ++cur; type = LESSEQUAL; }
+                else if ( c1 == '>' ) { ++cur; type = NOTEQUAL; }
+                else type = LESS;
+                break;
+            case '>':
+                if ( c1 == '>' )
+                {
+                    ++cur;
+                    if ( c2 == '=' ) { ++cur; type = RIGHTSHIFTEQUAL; }
+                    else type = RIGHTSHIFT;
+                }
+                else if ( c1 == '=' ) { ++cur; type = GREATEREQUAL; }
+                else type = GREATER;
+                break;
+            case '=':
+                if ( c1 == '=' ) { ++cur; type = EQEQUAL; }
+                else type = EQUAL;
+                break;
+            case '!':
+                if ( c1 == '=' ) { ++cur; type = NOTEQUAL; }
+                break;
+            case '.':
+                if ( c1 == '.' && c2 == '.' ) { cur += 2; type = ELLIPSIS; }
+                else type = DOT;
+                break;
+            case '%':
+                if ( c1 == '=' ) { ++cur; type = PERCENTEQUAL; }
+                else type = PERCENT;
+                break;
+            case '~':
+                type = TILDE;
+                break;
+            case '^':
+                if ( c1 == '=' ) { ++cur; type = CIRCUMFLEXEQUAL; }
+                else type = CIRCUMFLEX;
+                break;
+            case '@':
+                if ( c1 == '=' ) { ++cur; type = ATEQUAL; }
+                else type = AT;
+                break;
+            default:
+                break;
+        }
+        return finish( token, type, start );
+    }
+}
+
+
+
+TokenPipe::TokenPipe( Tokenizer &  tok ) :
+    tokenizer( tok ), cancelled( false ), currentPos( 0 )
+{
+    worker = std::thread( & TokenPipe::produce, this );
+}
+
+
+TokenPipe::~TokenPipe()
+{
+    stop();
+}
+
+
+void
+TokenPipe::stop( void )
+{
+    if ( ! worker.joinable() )
+        return;
+
+    {
+        std::lock_guard< std::mutex >   guard( lock );
+        cancelled = true;
+    }
+    consumed.notify_one();
+    worker.join();
+}
+
+
+// The helper thread body. It stops after the last token or an error or when
+// the parser does not need the tokens anymore.
+void
+TokenPipe::produce( void )
+{
+    for ( ; ; )
+    {
+        std::vector< Token >    block;
+        size_t                  count = 0;
+        bool                    last = false;
+
+        {
+            // The consumed blocks are reused: the fresh ones are big enough
+            // to be mapped and unmapped by malloc every time
+            std::lock_guard< std::mutex >   guard( lock );
+            if ( ! spare.empty() )
+            {
+                block.swap( spare.back() );
+                spare.pop_back();
+            }
+        }
+        block.resize( TOKEN_BLOCK_SIZE );
+
+        while ( count < TOKEN_BLOCK_SIZE && ! last )
+        {
+            // The error token is not filled by the tokenizer
+            int     type = tokenizer.next( block[ count ] );
+            block[ count ].type = type;
+            ++count;
+            last = ( type == ENDMARKER || type == ERRORTOKEN );
+        }
+        block.resize( count );
+
+        std::unique_lock< std::mutex >  guard( lock );
+        while ( blocks.size() >= TOKEN_BLOCKS_AHEAD && ! cancelled )
+            consumed.wait( guard );
+        if ( cancelled )
+            return;
+        blocks.push_back( std::vector< Token >() );
+        blocks.back().swap( block );
+        guard.unlock();
+        produced.notify_one();
+
+        if ( last )
+            return;
+    }
+}
+
+
+int
+TokenPipe::next( Token &  token )
+{
+    if ( currentPos >= current.size() )
+    {
+        std::unique_lock< std::mutex >  guard( lock );
+        while ( blocks.empty() )
+            produced.wait( guard );
+        if ( current.capacity() != 0 )
+        {
+            spare.push_back( std::vector< Token >() );
+            spare.back().swap( current );
+        }
+        current.swap( blocks.front() );
+        blocks.pop_front();
+        currentPos = 0;
+        guard.unlock();
+        consumed.notify_one();
+    }
+
+    token = current[ currentPos++ ];
+    return token.type;
+}
@@ -0,0 +1,331 @@
+/*
+ * codimension - graphics python two-way code editor and analyzer
+ * Copyright (C) 2014 - 2016  Sergey Satskiy <sergey.satskiy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Python tokenizer
+ */
+
+#ifndef CFLOWTOKENIZER_HPP
+#define CFLOWTOKENIZER_HPP
+
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "cflowcomments.hpp"
+
+
+// The token numbers match the python 3.9 Include/token.h ones so that the
+// nodes built by the native parser and the ones converted from the pgen
+// tree share the same type values.
+enum TokenType
+{
+    ENDMARKER = 0,
+    NAME = 1,
+    NUMBER = 2,
+    STRING = 3,
+    NEWLINE = 4,
+    INDENT = 5,
+    DEDENT = 6,
+    LPAR = 7,
+    RPAR = 8,
+    LSQB = 9,
+    RSQB = 10,
+    COLON = 11,
+    COMMA = 12,
+    SEMI = 13,
+    PLUS = 14,
+    MINUS = 15,
+    STAR = 16,
+    SLASH = 17,
+    VBAR = 18,
+    AMPER = 19,
+    LESS = 20,
+    GREATER = 21,
+    EQUAL = 22,
+    DOT = 23,
+    PERCENT = 24,
+    LBRACE = 25,
+    RBRACE = 26,
+    EQEQUAL = 27,
+    NOTEQUAL = 28,
+    LESSEQUAL = 29,
+    GREATEREQUAL = 30,
+    TILDE = 31,
+    CIRCUMFLEX = 32,
+    LEFTSHIFT = 33,
+    RIGHTSHIFT = 34,
+    DOUBLESTAR = 35,
+    PLUSEQUAL = 36,
+    MINEQUAL = 37,
+    STAREQUAL = 38,
+    SLASHEQUAL = 39,
+    PERCENTEQUAL = 40,
+    AMPEREQUAL = 41,
+    VBAREQUAL = 42,
+    CIRCUMFLEXEQUAL = 43,
+    LEFTSHIFTEQUAL = 44,
+    RIGHTSHIFTEQUAL = 45,
+    DOUBLESTAREQUAL = 46,
+    DOUBLESLASH = 47,
+    DOUBLESLASHEQUAL = 48,
+    AT = 49,
+    ATEQUAL = 50,
+    RARROW = 51,
+    ELLIPSIS = 52,
+    COLONEQUAL = 53,
+    OP = 54,
+    AWAIT = 55,
+    ASYNC = 56,
+    ERRORTOKEN = 59
+};
+
+
+// Keywords are NAME tokens; the tokenizer marks them to save the parser
+// from comparing strings
+enum KeywordType
+{
+    KW_NONE = 0,        // Not a keyword
+
+    KW_FALSE,
+    KW_NONE_VALUE,
+    KW_TRUE,
+    KW_AND,
+    KW_AS,
+    KW_ASSERT,
+    KW_BREAK,
+    KW_CLASS,
+    KW_CONTINUE,
+    KW_DEF,
+    KW_DEL,
+    KW_ELIF,
+    KW_ELSE,
+    KW_EXCEPT,
+    KW_FINALLY,
+    KW_FOR,
+    KW_FROM,
+    KW_GLOBAL,
+    KW_IF,
+    KW_IMPORT,
+    KW_IN,
+    KW_IS,
+    KW_LAMBDA,
+    KW_NONLOCAL,
+    KW_NOT,
+    KW_OR,
+    KW_PASS,
+    KW_RAISE,
+    KW_RETURN,
+    KW_TRY,
+    KW_WHILE,
+    KW_WITH,
+    KW_YIELD
+};
+
+
+struct Token
+{
+    int             type;
+    int             keyword;    // KeywordType for NAME tokens
+
+    const char *    begin;      // First character of the token
+    const char *    end;        // Character after the last one
+    int             line;       // 1-based line of the first character
+    int             col;        // 0-based column of the first character
+                                // or -1 (INDENT, DEDENT and the tokens
+                                // generated at the end of the input)
+    int             endLine;    // 1-based line of the last character
+    const char *    lineBegin;  // Beginning of the token first line
+    const char *    textBegin;  // Beginning of the first physical line joined
+                                // with the token line by multi line strings
+                                // or backslashes. Error texts start there.
+    bool            atEOF;      // Generated at the end of the input
+
+    Token() :
+        type( ENDMARKER ), keyword( KW_NONE ), begin( NULL ), end( NULL ),
+        line( 0 ), col( -1 ), endLine( 0 ), lineBegin( NULL ),
+        textBegin( NULL ), atEOF( false )
+    {}
+};
+
+
+// A part of a bigger buffer which is tokenized separately. The part must
+// start at the beginning of a line outside of any statement. The lines, the
+// line shifts and the comments are reported as for the whole buffer.
+struct BufferPart
+{
+    int     firstLine;      // 1-based line of the part beginning
+    int     offset;         // Absolute position of the part beginning
+    bool    last;           // The part ends the whole buffer
+
+    BufferPart( int  line, int  pos, bool  isLast ) :
+        firstLine( line ), offset( pos ), last( isLast )
+    {}
+};
+
+
+// Maximum indentation levels and maximum nesting of brackets
+#define MAX_INDENT_LEVEL    100
+#define MAX_BRACKET_LEVEL   200
+
+
+// Produces the python tokens in the same way the CPython 3.9 tokenizer did
+// it for the pgen parser: line and column conventions, implicit line joining,
+// INDENT/DEDENT generation and the error positions.
+//
+// The same single pass over the buffer optionally collects the absolute
+// positions of the line beginnings (index 0 is not used, the first line
+// starts at 0) and the comments, i.e. what getLineShiftsAndComments()
+// provides. For a buffer part the line shifts start from the part second
+// line so that the parts vectors could be simply concatenated.
+class Tokenizer
+{
+    public:
+        Tokenizer( const char *  buffer,
+                   std::vector< int > *  lineShifts = NULL,
+                   std::deque< CommentLine > *  comments = NULL,
+                   const BufferPart *  part = NULL );
+
+        // Provides the next token. ERRORTOKEN means an error; the details
+        // are in the error members.
+        int  next( Token &  token );
+
+        // The comments after the given line are not collected
+        void  setCommentLineLimit( int  lineNumber )
+        { commentLineLimit = lineNumber; }
+
+        // Normalized encoding from the BOM or the coding comment; empty if
+        // none
+        const std::string &  getEncoding( void ) const
+        { return encoding; }
+
+        // Number of line breaks in the buffer, i.e. the line number the
+        // tokens generated at the end of the input have. Valid only when the
+        // end of the input is reached.
+        int  getEOFLine( void ) const
+        { return continued ? line : line - 1; }
+
+        // The trailing part of the buffer: from the beginning of its last
+        // line till the end. It is used for the unexpected EOF errors.
+        // Valid only when the end of the input is reached.
+        const char *  getLastLineBegin( void ) const
+        { return lastLineBegin; }
+        const char *  getBufferEnd( void ) const
+        { return bufferEnd; }
+
+    public:
+        // Error details if ERRORTOKEN has been returned
+        int             errorLine;
+        int             errorColumn;
+        std::string     errorMessage;   // Message with the offending line
+
+    private:
+        const char *    buffer;
+        const char *    bufferEnd;
+        const char *    cur;            // Current position
+        const char *    lineBegin;      // Beginning of the current line
+        const char *    textBegin;      // Beginning of the joined lines
+        const char *    lastLineBegin;  // The last non empty line so far
+        int             line;           // Current line
+
+        std::vector< int > *            lineShifts;
+        std::deque< CommentLine > *     comments;
+        int                             commentLineLimit;
+        int                             offset;     // Of the buffer part
+        bool                            continued;  // Not the last part
+
+        bool            atBOL;          // At the beginning of a line
+        bool            reachedEOF;
+        bool            started;        // At least one token produced
+        bool            eofNewLine;     // The end of input NEWLINE produced
+        int             pending;        // Pending INDENT (> 0) or DEDENT (< 0)
+
+        int             indent;
+        int             indStack[ MAX_INDENT_LEVEL ];
+        int             altIndStack[ MAX_INDENT_LEVEL ];
+
+        int             level;          // Brackets nesting
+        char            bracketStack[ MAX_BRACKET_LEVEL ];
+        int             bracketLine[ MAX_BRACKET_LEVEL ];
+
+        std::string     encoding;
+
+    private:
+        void  detectEncoding( void );
+        void  newLine( const char *  lineStart, bool  joined );
+        void  addComment( const char *  begin );
+        bool  skipLineEnd( bool  joined );
+        int  fail( const char *  message, int  errLine, int  column,
+                   const char *  textBegin, const char *  textEnd );
+        int  failAtCurrentLine( const std::string &  message );
+        int  processIndentation( void );
+        int  readNumber( Token &  token, const char *  start );
+        int  readString( Token &  token, const char *  start,
+                         const char *  quote );
+        int  finish( Token &  token, int  type, const char *  start );
+};
+
+
+// Tokens are handed over between the threads in blocks of that size
+#define TOKEN_BLOCK_SIZE        1024
+// The tokenizer thread may run ahead of the parser by that many blocks
+#define TOKEN_BLOCKS_AHEAD      16
+
+
+// Runs a tokenizer on a helper thread so that the tokens, the line shifts
+// and the comments are produced while the parser builds the tree. The
+// tokenizer must not be touched till stop() returns; the line shifts and
+// the comments are complete only after that.
+class TokenPipe
+{
+    public:
+        TokenPipe( Tokenizer &  tokenizer );
+        ~TokenPipe();
+
+        // Provides the next token in the same way Tokenizer::next() does
+        int  next( Token &  token );
+
+        // Waits for the helper thread. It is safe to call it many times.
+        void  stop( void );
+
+    private:
+        Tokenizer &                         tokenizer;
+        std::thread                         worker;
+
+        std::mutex                          lock;
+        std::condition_variable             produced;
+        std::condition_variable             consumed;
+        std::deque< std::vector< Token > >  blocks;
+        std::vector< std::vector< Token > > spare;      // Consumed blocks
+        bool                                cancelled;
+
+        std::vector< Token >                current;    // Being consumed
+        size_t                              currentPos;
+
+    private:
+        void  produce( void );
+
+        TokenPipe( const TokenPipe & );
+        TokenPipe &  operator=( const TokenPipe & );
+};
+
+
+#endif
+
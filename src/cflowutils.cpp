@@ -18,7 +18,9 @@
  * Python extension module - utility functions
  */
 
+#include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "cflowutils.hpp"
 
 
@@ -141,3 +143,34 @@ bool  isBlankLine( const std::string &  s )
     return true;
 }
 
+
+char *  readFileContent( const std::string &  fileName, size_t &  size,
+                         std::string &  error )
+{
+    FILE *  f = fopen( fileName.c_str(), "r" );
+    if ( f == NULL )
+    {
+        error = "Cannot open file " + fileName;
+        return NULL;
+    }
+
+    struct stat     st;
+    if ( fstat( fileno( f ), &st ) != 0 )
+        st.st_size = 0;
+    size = st.st_size;
+
+    char *  buffer = new char[ size + 3 ];
+    if ( size > 0 && fread( buffer, size, 1, f ) != 1 )
+    {
+        fclose( f );
+        delete [] buffer;
+        error = "Cannot read file " + fileName;
+        return NULL;
+    }
+    fclose( f );
+
+    buffer[ size ] = '\n';
+    buffer[ size + 1 ] = '\n';
+    buffer[ size + 2 ] = '\0';
+    return buffer;
+}
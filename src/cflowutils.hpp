@@ -35,6 +35,12 @@ std::vector< std::string >
               splitLines( const std::string &  str );
 bool          isBlankLine( const std::string &  str );
 
+// Reads the whole file and appends two line feeds as the parser needs them.
+// Returns NULL and the error message if the file cannot be read. The caller
+// owns the buffer; size is the file size.
+char *        readFileContent( const std::string &  fileName, size_t &  size,
+                               std::string &  error );
+
 
 #endif
 
@@ -0,0 +1,59 @@
+/*
+ * codimension - graphics python two-way code editor and analyzer
+ * Copyright (C) 2014 - 2016  Sergey Satskiy <sergey.satskiy@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Visitor mode events. The definitions are C compatible so the other
+ * extension modules could provide a native callback.
+ */
+
+#ifndef CFLOWVISITOR_HPP
+#define CFLOWVISITOR_HPP
+
+
+#define VISIT_ENTER     1
+#define VISIT_LEAVE     2
+
+// The name of a PyCapsule which holds a native callback. The capsule context
+// (if any) is passed to the callback as the data argument.
+#define VISIT_CALLBACK_CAPSULE  "cdmcfparser.VisitCallback"
+
+
+// A statement the control flow would have a fragment for. The range covers
+// the statement from its first token (decorators and async included) till
+// the last token of its last suite; the comments are not included.
+struct CFVisitEvent
+{
+    int             event;      // VISIT_ENTER or VISIT_LEAVE
+    int             kind;       // *_FRAGMENT
+    const char *    name;       // Functions and classes only; NULL otherwise
+
+    long            begin;      // 0-based absolute positions
+    long            end;
+    long            beginLine;  // 1-based
+    long            beginPos;
+    long            endLine;
+    long            endPos;
+};
+
+
+// Returns non-zero to continue the walk and zero to stop it. A callback
+// given in a capsule is called without the GIL.
+typedef int (*CFVisitCallback)( const struct CFVisitEvent *  event,
+                                void *  data );
+
+
+#endif
+
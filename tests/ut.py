@@ -25,11 +25,48 @@ from __future__ import print_function
 import unittest
 import os.path
 import sys
+import gc
+import time
+import threading
+import asyncio
+import ctypes
+import importlib.util
 import cdmcfparser
+try:
+    import _interpreters as subinterpreters
+except ImportError:
+    try:
+        import _xxsubinterpreters as subinterpreters
+    except ImportError:
+        subinterpreters = None
 from cdmcfparser import (getControlFlowFromMemory,
                          getControlFlowFromFile, VERSION)
 
 
+def runInSubinterpreter(script, isolated):
+    """Runs the script in a new subinterpreter; returns the error or None"""
+    if subinterpreters.__name__ == "_interpreters":
+        interp = subinterpreters.create("isolated" if isolated else "legacy")
+    else:
+        interp = subinterpreters.create(isolated=isolated)
+    try:
+        error = subinterpreters.run_string(interp, script)
+        return None if error is None else error.formatted
+    except subinterpreters.RunFailedError as exc:
+        return str(exc)
+    finally:
+        subinterpreters.destroy(interp)
+
+
+def parseThreaded(content, pipeline=None, parallel=None, workers=None):
+    """Parses with the given thresholds and number of CPUs"""
+    cdmcfparser._setParseTuning(pipeline, parallel, workers)
+    try:
+        return getControlFlowFromMemory(content)
+    finally:
+        cdmcfparser._setParseTuning(None, None, None)
+
+
 def formatFlow(s):
     """Reformats the control flow output"""
     result = ""
@@ -429,6 +466,1212 @@ class CDMControlFlowParserTest(unittest.TestCase):
         self.meat(self.dir + "returnmultiline.py",
                   "return with multiline string literal and replacement")
 
+    def test_escaped_quote_comments(self):
+        """Test the comments after the strings ending with a backslash"""
+        content = 'import os\nx = "\\\\"  # c\ny = \'\\\\\'  # d\n'
+        controlFlow = getControlFlowFromMemory(content)
+        comment = controlFlow.suite[1].sideComment
+        self.assertEqual([(part.beginLine, part.beginPos, part.getContent())
+                          for part in comment.parts],
+                         [(2, 11, "# c"), (3, 11, "# d")])
+
+    @unittest.skipUnless(hasattr(cdmcfparser, 'getControlFlowFromMemoryPgen'),
+                         "pgen parser is not available")
+    def test_pgen_differential(self):
+        """Test the native parser against the pgen one"""
+        for name in sorted(os.listdir(self.dir)):
+            if not name.endswith(".py"):
+                continue
+            f = open(self.dir + name)
+            content = f.read()
+            f.close()
+
+            native = getControlFlowFromMemory(content)
+            pgen = cdmcfparser.getControlFlowFromMemoryPgen(content)
+            if native.errors != pgen.errors:
+                self.fail("Native and pgen errors differ for " + name)
+            if str(native) != str(pgen):
+                self.fail("Native and pgen control flows differ for " + name)
+
+    def threadedContents(self):
+        """Provides the test files and the contents split into many parts"""
+        contents = []
+        for name in sorted(os.listdir(self.dir)):
+            if name.endswith(".py"):
+                f = open(self.dir + name)
+                contents.append((name, f.read()))
+                f.close()
+
+        definitions = "".join('@decor\ndef f%d(a, b=1):\n    """doc"""\n'
+                              '    return a + b  # side\n\n' % k
+                              for k in range(40))
+        contents.append(("crlf", definitions.replace("\n", "\r\n")))
+        contents.append(("coding", "# -*- coding: latin-1 -*-\n" +
+                         definitions))
+        contents.append(("error in a later part",
+                         definitions + "def g(:\n    pass\n" + definitions))
+        contents.append(("string across parts",
+                         definitions + 's = """\ndef h():\n"""\n' +
+                         definitions))
+        return contents
+
+    def test_pipelined_parsing(self):
+        """Test the tokenizer thread against the sequential parse"""
+        for name, content in self.threadedContents():
+            sequential = parseThreaded(content, workers=1)
+            pipelined = parseThreaded(content, pipeline=0, workers=2)
+            self.assertEqual(pipelined.errors, sequential.errors, name)
+            self.assertEqual(str(pipelined), str(sequential), name)
+
+    def test_parallel_parsing(self):
+        """Test the parts parsed on many threads against the sequential one"""
+        for name, content in self.threadedContents():
+            sequential = parseThreaded(content, workers=1)
+            for workers in (2, 3, 8):
+                parallel = parseThreaded(content, parallel=1, workers=workers)
+                self.assertEqual(parallel.errors, sequential.errors, name)
+                self.assertEqual(str(parallel), str(sequential), name)
+
+    def test_concurrent_parsing(self):
+        """Test parsing the same files from many threads at once"""
+        names = [name for name in sorted(os.listdir(self.dir))
+                 if name.endswith(".py")]
+        contents = {}
+        expected = {}
+        for name in names:
+            f = open(self.dir + name)
+            contents[name] = f.read()
+            f.close()
+            controlFlow = getControlFlowFromMemory(contents[name])
+            expected[name] = (controlFlow.errors, str(controlFlow))
+
+        failures = []
+
+        def worker(index):
+            for rnd in range(5):
+                for k in range(len(names)):
+                    name = names[(k + index) % len(names)]
+                    if (k + rnd) % 2 == 0:
+                        controlFlow = getControlFlowFromMemory(contents[name])
+                    else:
+                        controlFlow = getControlFlowFromFile(self.dir + name)
+                    if (controlFlow.errors,
+                            str(controlFlow)) != expected[name]:
+                        failures.append(name)
+
+        threads = [threading.Thread(target=worker, args=(index,))
+                   for index in range(8)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+        if failures:
+            self.fail("Concurrent parsing results differ for " +
+                      ", ".join(sorted(set(failures))))
+
+    def test_async_parsing(self):
+        """Test parsing on the worker pool from an asyncio loop"""
+        names = [self.dir + name for name in sorted(os.listdir(self.dir))
+                 if name.endswith(".py")]
+        contents = []
+        for name in names:
+            f = open(name)
+            contents.append(f.read())
+            f.close()
+
+        async def parseAll():
+            fromFiles = await asyncio.gather(
+                *[cdmcfparser.parseFileAsync(name) for name in names])
+            fromMemory = await asyncio.gather(
+                *[cdmcfparser.parseMemoryAsync(content)
+                  for content in contents])
+            empty = await cdmcfparser.parseMemoryAsync("")
+            with self.assertRaises(RuntimeError):
+                await cdmcfparser.parseFileAsync(self.dir + "missing.py")
+            return fromFiles, fromMemory, empty
+
+        fromFiles, fromMemory, empty = asyncio.run(parseAll())
+        for k in range(len(names)):
+            controlFlow = getControlFlowFromMemory(contents[k])
+            self.assertEqual(str(fromFiles[k]), str(controlFlow))
+            self.assertEqual(str(fromMemory[k]), str(controlFlow))
+            self.assertEqual(fromMemory[k].errors, controlFlow.errors)
+        self.assertTrue(empty.isOK)
+        self.assertEqual(len(empty.suite), 0)
+
+    def test_iter_control_flow(self):
+        """Test iterating over the top level fragments"""
+        for name in sorted(os.listdir(self.dir)):
+            if not name.endswith(".py"):
+                continue
+            f = open(self.dir + name)
+            content = f.read()
+            f.close()
+
+            controlFlow = getControlFlowFromMemory(content)
+            expected = [str(item) for item in [controlFlow.bangLine,
+                                               controlFlow.encodingLine,
+                                               controlFlow.docstring]
+                        if item is not None]
+            expected += [str(item) for item in controlFlow.suite]
+
+            iterator = cdmcfparser.iterControlFlow(content)
+            self.assertEqual([str(item) for item in iterator], expected,
+                             "Iterated fragments differ for " + name)
+            self.assertEqual(iterator.controlFlow.errors, controlFlow.errors)
+            self.assertEqual(str(iterator.controlFlow.body),
+                             str(controlFlow.body))
+            self.assertEqual(iterator.controlFlow.end, controlFlow.end)
+
+        self.assertEqual(list(cdmcfparser.iterControlFlow("")), [])
+        iterator = cdmcfparser.iterControlFlow("def f(:\n")
+        self.assertEqual(list(iterator), [])
+        self.assertFalse(iterator.controlFlow.isOK)
+
+    def test_iter_control_flow_parts(self):
+        """Test iterating over a content parsed part by part"""
+        content = ("x = 1\n# comment\n\n"
+                   "@decor\ndef f(a):\n    # inner\n    return a\n"
+                   "class C:\n    pass\n# trailing\n") * 50
+        controlFlow = getControlFlowFromMemory(content)
+        cdmcfparser._setParseTuning(None, 400, None)
+        try:
+            iterator = cdmcfparser.iterControlFlow(content)
+            self.assertEqual([str(item) for item in iterator],
+                             [str(item) for item in controlFlow.suite])
+            self.assertEqual(str(iterator.controlFlow.body),
+                             str(controlFlow.body))
+            self.assertEqual(iterator.controlFlow.end, controlFlow.end)
+
+            # The fragments before a syntax error in a later part are
+            # provided. The last one is completed without the statements
+            # which follow it so its comments may differ.
+            broken = content + "def g(:\n    pass\n"
+            iterator = cdmcfparser.iterControlFlow(broken)
+            items = [str(item) for item in iterator]
+            self.assertTrue(len(items) > 1)
+            self.assertEqual(items[:-1], [str(item) for item in
+                                          controlFlow.suite][:len(items) - 1])
+            self.assertEqual(iterator.controlFlow.errors,
+                             getControlFlowFromMemory(broken).errors)
+        finally:
+            cdmcfparser._setParseTuning(None, None, None)
+
+    def test_iter_control_flow_lifetime(self):
+        """Test the iterated fragments outliving the iterator"""
+        content = ("import os\n# comment\n"
+                   "def f(a):\n    # inner\n    return a\n") * 20
+        iterator = cdmcfparser.iterControlFlow(content)
+        items = list(iterator)
+        function = [item for item in items
+                    if item.kind == cdmcfparser.FUNCTION_FRAGMENT][0]
+        body = function.body
+        returnBody = function.suite[-1].body
+        del function
+        expected = [item.getContent() for item in items]
+        del iterator
+        gc.collect()
+        for _ in range(20):
+            getControlFlowFromMemory(content)
+        self.assertEqual([item.getContent() for item in items], expected)
+        self.assertEqual(body.getContent(), "def f(a):")
+
+        # The nested fragments lose their parent with the top level ones
+        del items
+        gc.collect()
+        for _ in range(20):
+            getControlFlowFromMemory(content)
+        with self.assertRaises(RuntimeError):
+            body.getContent()
+        self.assertEqual(returnBody.getContent(content), "return")
+
+    def test_visit_control_flow(self):
+        """Test the visitor events against the control flow fragments"""
+        kinds = {cdmcfparser.FUNCTION_FRAGMENT, cdmcfparser.CLASS_FRAGMENT,
+                 cdmcfparser.IF_FRAGMENT, cdmcfparser.ELIF_PART_FRAGMENT,
+                 cdmcfparser.FOR_FRAGMENT, cdmcfparser.WHILE_FRAGMENT,
+                 cdmcfparser.WITH_FRAGMENT, cdmcfparser.TRY_FRAGMENT,
+                 cdmcfparser.EXCEPT_PART_FRAGMENT,
+                 cdmcfparser.IMPORT_FRAGMENT, cdmcfparser.RETURN_FRAGMENT,
+                 cdmcfparser.RAISE_FRAGMENT, cdmcfparser.ASSERT_FRAGMENT,
+                 cdmcfparser.BREAK_FRAGMENT, cdmcfparser.CONTINUE_FRAGMENT}
+
+        comments = (cdmcfparser.COMMENT_FRAGMENT,
+                    cdmcfparser.CML_COMMENT_FRAGMENT)
+
+        def statementRange(item):
+            """The first and the last fragments of a statement without the
+               comments; the visitor does not include them"""
+            first = last = None
+            for attr in ("body", "decorators", "docstring", "value", "parts",
+                         "suite", "exceptParts", "elsePart", "finallyPart"):
+                value = getattr(item, attr, None)
+                for part in value if isinstance(value, list) else [value]:
+                    if part is None or part.kind in comments:
+                        continue
+                    if part.kind in kinds or attr == "elsePart" or \
+                            attr == "finallyPart":
+                        partFirst, partLast = statementRange(part)
+                    elif part.kind == cdmcfparser.FRAGMENT:
+                        partFirst = partLast = part
+                    else:
+                        partFirst = partLast = part.body
+                    if first is None or partFirst.begin < first.begin:
+                        first = partFirst
+                    if last is None or partLast.end > last.end:
+                        last = partLast
+            return first, last
+
+        def collect(fragments, events):
+            for item in fragments:
+                if item.kind not in kinds:
+                    continue
+                name = None
+                if item.kind in (cdmcfparser.FUNCTION_FRAGMENT,
+                                 cdmcfparser.CLASS_FRAGMENT):
+                    name = item.name.getContent()
+                first, last = statementRange(item)
+                events.append((cdmcfparser.VISIT_ENTER, item.kind, name,
+                               first.begin, last.end, first.beginLine,
+                               first.beginPos, last.endLine, last.endPos))
+                if item.kind == cdmcfparser.IF_FRAGMENT:
+                    collect(item.parts, events)
+                elif hasattr(item, "suite"):
+                    collect(item.suite, events)
+                if item.kind == cdmcfparser.TRY_FRAGMENT:
+                    collect(list(item.exceptParts) +
+                            [part for part in (item.elsePart,
+                                               item.finallyPart) if part],
+                            events)
+                elif item.kind in (cdmcfparser.FOR_FRAGMENT,
+                                   cdmcfparser.WHILE_FRAGMENT):
+                    if item.elsePart:
+                        collect([item.elsePart], events)
+                events.append((cdmcfparser.VISIT_LEAVE, item.kind, name,
+                               first.begin, last.end, first.beginLine,
+                               first.beginPos, last.endLine, last.endPos))
+
+        for name in sorted(os.listdir(self.dir)):
+            if not name.endswith(".py"):
+                continue
+            f = open(self.dir + name)
+            content = f.read()
+            f.close()
+
+            controlFlow = getControlFlowFromMemory(content)
+            expected = []
+            collect(controlFlow.suite, expected)
+            events = []
+            errors = cdmcfparser.visitControlFlow(content, lambda *args:
+                                                  events.append(args))
+            self.assertEqual(errors, controlFlow.errors)
+            if controlFlow.isOK:
+                self.assertEqual(events, expected,
+                                 "Visitor events differ for " + name)
+
+        content = "@decor\ndef f(a):\n    if a:\n        return a\n"
+        events = []
+        cdmcfparser.visitControlFlow(content,
+                                     lambda *args: events.append(args))
+        self.assertEqual(events[0], (cdmcfparser.VISIT_ENTER,
+                                     cdmcfparser.FUNCTION_FRAGMENT, "f",
+                                     0, len(content) - 2, 1, 1, 4, 16))
+        self.assertEqual(len(events), 8)
+
+        # The fragments cover the leading and the side comments, the visitor
+        # ranges do not
+        commented = "# leading\ndef f():  # side\n    return 1  # side\n"
+        function = getControlFlowFromMemory(commented).suite[0]
+        events = []
+        cdmcfparser.visitControlFlow(commented,
+                                     lambda *args: events.append(args))
+        self.assertEqual((function.begin, function.end),
+                         (0, len(commented) - 2))
+        self.assertEqual(events[0][3:], (commented.index("def"),
+                                         commented.index("1  #"),
+                                         2, 1, 3, 12))
+
+        # False stops the walk
+        events = []
+        cdmcfparser.visitControlFlow(content, lambda *args:
+                                     events.append(args) or False)
+        self.assertEqual(len(events), 1)
+
+        # A native callback in a capsule
+        event = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p,
+                                 ctypes.c_void_p)
+        counts = []
+        callback = event(lambda event, data: counts.append(data) or 1)
+        newCapsule = ctypes.pythonapi.PyCapsule_New
+        newCapsule.restype = ctypes.py_object
+        newCapsule.argtypes = [ctypes.c_void_p, ctypes.c_char_p,
+                               ctypes.c_void_p]
+        capsuleName = cdmcfparser.VISIT_CALLBACK_CAPSULE.encode()
+        capsule = newCapsule(ctypes.cast(callback, ctypes.c_void_p),
+                             capsuleName, None)
+        self.assertEqual(cdmcfparser.visitControlFlow(content, capsule), [])
+        self.assertEqual(len(counts), 8)
+
+        with self.assertRaises(TypeError):
+            cdmcfparser.visitControlFlow(content, None)
+
+    def test_cancelled_parsing(self):
+        """Test stopping a parse by a token and by a timeout"""
+        content = "".join("def f%d(a):\n    if a:\n        return a\n" % k
+                          for k in range(30000))
+        cancelled = [(-1, -1, cdmcfparser.CANCELLED_ERROR)]
+        exceeded = [(-1, -1, cdmcfparser.DEADLINE_ERROR)]
+
+        token = cdmcfparser.createCancelToken()
+        controlFlow = getControlFlowFromMemory(content, token=token)
+        self.assertTrue(controlFlow.isOK)
+        self.assertEqual(len(controlFlow.suite), 30000)
+
+        token.cancel()
+        self.assertTrue(token.isCancelled())
+        controlFlow = getControlFlowFromMemory(content, token=token)
+        self.assertEqual(controlFlow.errors, cancelled)
+        self.assertEqual(len(controlFlow.suite), 0)
+        controlFlow = getControlFlowFromFile(self.dir + "empty_brackets.py",
+                                             token=token)
+        self.assertEqual(controlFlow.errors, cancelled)
+
+        controlFlow = getControlFlowFromMemory(content, timeout=0)
+        self.assertEqual(controlFlow.errors, exceeded)
+        self.assertTrue(getControlFlowFromMemory(content, timeout=None).isOK)
+        with self.assertRaises(TypeError):
+            getControlFlowFromMemory(content, token=1)
+        with self.assertRaises(TypeError):
+            getControlFlowFromMemory(content, deadline=1)
+
+        # A token cancelled from another thread stops a running parse
+        token = cdmcfparser.createCancelToken()
+        results = []
+        thread = threading.Thread(target=lambda: results.append(
+            getControlFlowFromMemory(content, token=token)))
+        thread.start()
+        token.cancel()
+        thread.join()
+        self.assertEqual(results[0].errors, cancelled)
+
+        # The cancel takes effect soon while the fragments are built; the
+        # walker holds the GIL but lets the other threads run now and then
+        token = cdmcfparser.createCancelToken()
+        results = []
+        thread = threading.Thread(target=lambda: results.append(
+            getControlFlowFromMemory(content * 4, token=token)))
+        self.assertFalse(token.isStarted())
+        thread.start()
+        while not token.isStarted():
+            time.sleep(0.001)
+        cancelTime = time.monotonic()
+        token.cancel()
+        thread.join()
+        self.assertLess(time.monotonic() - cancelTime, 0.5)
+        self.assertEqual(results[0].errors, cancelled)
+
+        # The None values keep the defaults but the names are checked
+        self.assertTrue(getControlFlowFromMemory(content, token=None,
+                                                 maxDepth=None).isOK)
+        with self.assertRaises(TypeError):
+            getControlFlowFromMemory(content, unknown=None)
+        with self.assertRaises(TypeError):
+            cdmcfparser.parseMemoryAsync(content, unknown=None)
+
+        async def parseCancelled():
+            token = cdmcfparser.createCancelToken()
+            token.cancel()
+            byToken = await cdmcfparser.parseMemoryAsync(content, token=token)
+            byTimeout = await cdmcfparser.parseMemoryAsync(content, timeout=0)
+            future = cdmcfparser.parseMemoryAsync(content)
+            future.cancel()
+            with self.assertRaises(asyncio.CancelledError):
+                await future
+            return byToken, byTimeout
+
+        byToken, byTimeout = asyncio.run(parseCancelled())
+        self.assertEqual(byToken.errors, cancelled)
+        self.assertEqual(byTimeout.errors, exceeded)
+
+    def test_scheduled_parsing(self):
+        """Test the parse priorities and superseding the queued parses"""
+        async def parseScheduled():
+            # No worker starts a job so all of them stay queued whatever
+            # the number of workers is
+            cdmcfparser._pauseParsing(True)
+            try:
+                versions = [cdmcfparser.parseMemoryAsync(
+                    "x = %d\n" % k, document="doc",
+                    priority=cdmcfparser.PRIORITY_VISIBLE) for k in range(5)]
+                other = cdmcfparser.parseMemoryAsync(
+                    "y = 1\n", document="other",
+                    priority=cdmcfparser.PRIORITY_BACKGROUND)
+                with self.assertRaises(TypeError):
+                    cdmcfparser.parseMemoryAsync("z = 1\n", priority="high")
+                with self.assertRaises(TypeError):
+                    cdmcfparser.parseMemoryAsync("z = 1\n", document=1)
+                with self.assertRaises(TypeError):
+                    cdmcfparser._pauseParsing(1)
+
+                # The superseded versions are delivered without a worker
+                superseded = await asyncio.gather(*versions[:-1])
+                self.assertFalse(versions[-1].done())
+                self.assertFalse(other.done())
+            finally:
+                cdmcfparser._pauseParsing(False)
+            return superseded + [await versions[-1]], (await other)
+
+        versions, other = asyncio.run(parseScheduled())
+        superseded = [(-1, -1, cdmcfparser.SUPERSEDED_ERROR)]
+        for controlFlow in versions[:-1]:
+            self.assertEqual(controlFlow.errors, superseded)
+            self.assertEqual(len(controlFlow.suite), 0)
+        self.assertTrue(versions[-1].isOK)
+        self.assertEqual(versions[-1].suite[0].body.getContent(), "x = 4")
+        self.assertTrue(other.isOK)
+
+        # The event loop is the running one, not a new default one
+        with self.assertRaises(RuntimeError):
+            cdmcfparser.parseMemoryAsync("x = 1\n")
+
+    def test_outline(self):
+        """Test the functions and classes only parsing"""
+        definitionKinds = (cdmcfparser.FUNCTION_FRAGMENT,
+                           cdmcfparser.CLASS_FRAGMENT)
+
+        def definitions(items):
+            """The definitions as the outline has them"""
+            result = []
+            for item in items:
+                if item.kind in definitionKinds:
+                    docstring = item.docstring
+                    if item.kind == cdmcfparser.CLASS_FRAGMENT:
+                        arguments = item.baseClasses
+                    else:
+                        arguments = item.arguments
+                    result.append((str(item.name), str(arguments),
+                                   [(str(dec.name), str(dec.arguments))
+                                    for dec in item.decorators],
+                                   docstring.getDisplayValue()
+                                   if docstring else None,
+                                   definitions(item.suite)))
+                    continue
+
+                parts = [item]
+                if item.kind == cdmcfparser.IF_FRAGMENT:
+                    parts = item.parts
+                elif item.kind == cdmcfparser.TRY_FRAGMENT:
+                    parts += item.exceptParts + [item.finallyPart]
+                if item.kind in (cdmcfparser.FOR_FRAGMENT,
+                                 cdmcfparser.WHILE_FRAGMENT,
+                                 cdmcfparser.TRY_FRAGMENT):
+                    parts.append(item.elsePart)
+                for part in parts:
+                    if part is not None and hasattr(part, "suite"):
+                        result += definitions(part.suite)
+            return result
+
+        for name in sorted(os.listdir(self.dir)):
+            if not name.endswith(".py"):
+                continue
+            controlFlow = getControlFlowFromFile(self.dir + name)
+            outline = getControlFlowFromFile(self.dir + name, outline=True)
+            self.assertEqual(outline.errors, controlFlow.errors)
+            if not controlFlow.isOK:
+                continue
+            self.assertEqual(definitions(outline.suite),
+                             definitions(controlFlow.suite),
+                             "Outline differs for " + name)
+            if controlFlow.docstring is not None:
+                self.assertEqual(outline.docstring.getDisplayValue(),
+                                 controlFlow.docstring.getDisplayValue())
+
+        content = "# comment\nimport sys\nif sys:\n    @d\n    def f(a):\n" \
+                  "        '''Doc'''\n        sys.exit(a)\n"
+        outline = getControlFlowFromMemory(content, outline=True)
+        self.assertEqual(len(outline.suite), 1)
+        self.assertEqual(outline.suite[0].kind, cdmcfparser.FUNCTION_FRAGMENT)
+        self.assertEqual(outline.suite[0].leadingComment, None)
+        self.assertEqual(outline.suite[0].suite, [])
+        self.assertEqual(outline.body.getContent(), content[10:-1])
+        with self.assertRaises(TypeError):
+            getControlFlowFromMemory(content, outline=1)
+
+    def test_parse_options(self):
+        """Test switching off the individual analyses and fragment kinds"""
+        content = "#!/usr/bin/env python\n# -*- coding: utf-8 -*-\n" \
+                  "import os\nx = 1  # side\n" \
+                  "def f(a, b=2):\n    '''Doc'''\n    if a:\n" \
+                  "        import sys\n        sys.exit(1)\n" \
+                  "    # cml 1 rt text=\"R\"\n    return a\n" \
+                  "class C(B):\n    def g(self):\n        for i in x:\n" \
+                  "            break\n"
+        full = getControlFlowFromMemory(content)
+
+        controlFlow = getControlFlowFromMemory(content, comments=False)
+        self.assertNotEqual(controlFlow.bangLine, None)
+        self.assertNotEqual(controlFlow.encodingLine, None)
+        self.assertEqual(controlFlow.suite[1].sideComment, None)
+        self.assertNotEqual(full.suite[1].sideComment, None)
+        self.assertEqual(controlFlow.suite[2].suite[1].leadingCMLComments, [])
+
+        controlFlow = getControlFlowFromMemory(content, cmlProperties=False)
+        cml = controlFlow.suite[2].suite[1].leadingCMLComments[0]
+        self.assertEqual(cml.version, 0)
+        self.assertEqual(full.suite[2].suite[1].leadingCMLComments[0].version,
+                         1)
+
+        controlFlow = getControlFlowFromMemory(content, docstrings=False)
+        self.assertEqual(controlFlow.suite[2].docstring, None)
+        self.assertEqual(controlFlow.suite[2].suite[0].kind,
+                         cdmcfparser.CODEBLOCK_FRAGMENT)
+
+        controlFlow = getControlFlowFromMemory(content, sysExit=False)
+        self.assertEqual(controlFlow.suite[2].suite[0].parts[0].suite[1].kind,
+                         cdmcfparser.CODEBLOCK_FRAGMENT)
+        self.assertEqual(full.suite[2].suite[0].parts[0].suite[1].kind,
+                         cdmcfparser.SYSEXIT_FRAGMENT)
+
+        controlFlow = getControlFlowFromMemory(content, arguments=False)
+        self.assertEqual(controlFlow.suite[2].argList, [])
+        self.assertEqual(len(full.suite[2].argList), 2)
+
+        controlFlow = getControlFlowFromMemory(content, serialize=False)
+        with self.assertRaises(RuntimeError):
+            controlFlow.suite[0].getContent()
+        self.assertEqual(controlFlow.suite[0].getContent(content),
+                         full.suite[0].getContent())
+
+        # The items of the skipped statements are hoisted
+        controlFlow = getControlFlowFromMemory(
+            content, kinds=[cdmcfparser.FUNCTION_FRAGMENT,
+                            cdmcfparser.CLASS_FRAGMENT,
+                            cdmcfparser.IMPORT_FRAGMENT,
+                            cdmcfparser.BREAK_FRAGMENT])
+        self.assertEqual([item.kind for item in controlFlow.suite],
+                         [cdmcfparser.IMPORT_FRAGMENT,
+                          cdmcfparser.FUNCTION_FRAGMENT,
+                          cdmcfparser.CLASS_FRAGMENT])
+        self.assertEqual([item.kind for item in controlFlow.suite[1].suite],
+                         [cdmcfparser.IMPORT_FRAGMENT])
+        self.assertEqual(controlFlow.suite[2].suite[0].suite[0].kind,
+                         cdmcfparser.BREAK_FRAGMENT)
+        self.assertEqual(controlFlow.suite[1].end, full.suite[2].end)
+        self.assertEqual(controlFlow.end, full.end)
+
+        with self.assertRaises(ValueError):
+            getControlFlowFromMemory(content,
+                                     kinds=[cdmcfparser.DOCSTRING_FRAGMENT])
+        with self.assertRaises(TypeError):
+            getControlFlowFromMemory(content, kinds=1)
+        with self.assertRaises(TypeError):
+            getControlFlowFromMemory(content, comments=0)
+
+    def test_lazy_suites(self):
+        """Test the depth limited and the lazily walked suites"""
+        content = "import sys\ndef f(a):\n    '''Doc'''\n    # lead\n" \
+                  "    if a:  # side\n        x = 1\n        # trailing\n" \
+                  "    else:\n        from sys import exit as stop\n" \
+                  "    return a  # side\n# module\nclass C:\n" \
+                  "    def g(self):\n        for i in x:\n" \
+                  "            break\nstop(1)\n"
+        full = getControlFlowFromMemory(content)
+
+        controlFlow = getControlFlowFromMemory(content, maxDepth=1)
+        self.assertEqual([item.kind for item in controlFlow.suite],
+                         [item.kind for item in full.suite])
+        self.assertEqual(controlFlow.suite[3].kind,
+                         cdmcfparser.SYSEXIT_FRAGMENT)
+        for item, fullItem in zip(controlFlow.suite, full.suite):
+            self.assertEqual(item.end, fullItem.end)
+            if hasattr(item, 'suite'):
+                self.assertEqual(item.suite, [])
+        self.assertEqual(controlFlow.suite[1].docstring.getContent(),
+                         full.suite[1].docstring.getContent())
+
+        controlFlow = getControlFlowFromMemory(content, maxDepth=2)
+        self.assertEqual(len(controlFlow.suite[1].suite), 2)
+        self.assertEqual(controlFlow.suite[1].suite[0].parts[0].suite, [])
+
+        for depth in (1, 2):
+            controlFlow = getControlFlowFromMemory(content, maxDepth=depth,
+                                                   lazySuites=True)
+            self.assertEqual(str(controlFlow), str(full))
+
+        controlFlow = getControlFlowFromMemory(content, maxDepth=1,
+                                               lazySuites=True)
+        function = controlFlow.suite[1]
+        del controlFlow
+        with self.assertRaises(RuntimeError):
+            function.suite
+
+        with self.assertRaises(ValueError):
+            getControlFlowFromMemory(content, maxDepth=-1)
+        with self.assertRaises(TypeError):
+            getControlFlowFromMemory(content, maxDepth="1")
+
+    def test_scan_control_flow(self):
+        """Test the approximate pre-scan of the top level definitions"""
+        content = "import os\n# lead\n@decor(1,\n       2)\n" \
+                  "def f(a, b='''\ndef g():\n'''):\n    x = [\n1]\n" \
+                  "    # trailing\n\nasync def h():\n    s = 'class D:'\n" \
+                  "class C(B):  # side\n    def m(self):\n        pass\n"
+        exact = getControlFlowFromMemory(content)
+        scanned = cdmcfparser.scanControlFlow(content)
+
+        self.assertEqual(exact.phase, cdmcfparser.PHASE_EXACT)
+        self.assertEqual(scanned.phase, cdmcfparser.PHASE_APPROXIMATE)
+        self.assertEqual(scanned.errors, [])
+
+        exactItems = [item for item in exact.suite
+                      if item.kind in (cdmcfparser.FUNCTION_FRAGMENT,
+                                       cdmcfparser.CLASS_FRAGMENT)]
+        self.assertEqual(len(scanned.suite), 3)
+        for item, exactItem in zip(scanned.suite, exactItems):
+            self.assertEqual(item.kind, exactItem.kind)
+            self.assertEqual(item.name.getContent(),
+                             exactItem.name.getContent())
+            self.assertEqual(item.getAbsPosRange(),
+                             exactItem.getAbsPosRange())
+            self.assertEqual(item.getLineRange(), exactItem.getLineRange())
+            self.assertEqual(item.suite, [])
+        self.assertEqual(scanned.suite[1].asyncKeyword.getContent(), "async")
+        self.assertEqual(scanned.suite[1].defKeyword.getContent(), "def")
+
+        # The code being typed does not hide the next definitions
+        scanned = cdmcfparser.scanControlFlow(
+            "def f(a,\n    x = 'abc\nclass C:\n    pass\ndef \n")
+        self.assertEqual([item.kind for item in scanned.suite],
+                         [cdmcfparser.FUNCTION_FRAGMENT,
+                          cdmcfparser.CLASS_FRAGMENT,
+                          cdmcfparser.FUNCTION_FRAGMENT])
+        self.assertEqual(scanned.suite[0].getLineRange(), (1, 2))
+        self.assertEqual(scanned.suite[1].name.getContent(), "C")
+        self.assertIsNone(scanned.suite[2].name)
+
+        self.assertEqual(cdmcfparser.scanControlFlow("").suite, [])
+        with self.assertRaises(TypeError):
+            cdmcfparser.scanControlFlow(content, serialize=False)
+
+    def test_apply_edit(self):
+        """Test the edits shifting the fragments lazily"""
+        content = "import os\n\ndef f(a):\n    return a\n\nx = 1  # side\n"
+        controlFlow = getControlFlowFromMemory(content)
+        imp, func, code = controlFlow.suite
+        controlFlow.applyEdit(0, 0, "# first\n")
+        controlFlow.applyEdit(content.find("a)") + 8, 1, "arg")
+
+        self.assertEqual(controlFlow.getContent(),
+                         "import os\n\ndef f(arg):\n"
+                         "    return a\n\nx = 1  # side")
+        self.assertFalse(imp.dirty)
+        self.assertEqual(imp.getLineRange(), (2, 2))
+        self.assertEqual(imp.getAbsPosRange(), (8, 16))
+        self.assertEqual(imp.getContent(), "import os")
+        self.assertTrue(func.dirty)
+        self.assertTrue(func.arguments.dirty)
+        self.assertFalse(func.name.dirty)
+        self.assertEqual(func.name.getContent(), "f")
+        self.assertFalse(code.dirty)
+        self.assertEqual(code.beginLine, 7)
+        self.assertEqual(code.getContent(), "x = 1  # side")
+        self.assertEqual(code.sideComment.getContent(), "# side")
+        self.assertEqual(code.sideComment.getLineRange(), (7, 7))
+
+        with self.assertRaises(ValueError):
+            controlFlow.applyEdit(len(content) + 100, 1, "")
+        with self.assertRaises(TypeError):
+            controlFlow.applyEdit(0, 0, 1)
+        with self.assertRaises(RuntimeError):
+            getControlFlowFromMemory(content,
+                                     serialize=False).applyEdit(0, 0, "")
+
+        # The fragments which outlive the control flow have no content
+        del controlFlow
+        with self.assertRaises(RuntimeError):
+            code.getContent()
+
+    def test_apply_edit_lines(self):
+        """Test the line table kept by the edits which open strings"""
+        content = "a = 1\nb = 2\n\n\nc = 3  # side\n"
+        controlFlow = getControlFlowFromMemory(content)
+        last = controlFlow.suite[-1]
+        edited = content
+        for offset, removed, text in ((4, 1, "'''x\n"), (0, 0, "\r\n"),
+                                      (10, 0, "'''"), (3, 2, "")):
+            controlFlow.applyEdit(offset, removed, text)
+            edited = edited[:offset] + text + edited[offset + removed:]
+            begin = edited.index("c = 3")
+            lines = edited[:begin].replace("\r\n", "\n").count("\n")
+            self.assertEqual(last.begin, begin)
+            self.assertEqual(last.beginLine, lines + 1)
+            self.assertEqual(last.endPos, len("c = 3  # side"))
+
+    def test_apply_edit_strings(self):
+        """Test the lines scanned after the edits of the escaped strings"""
+        content = "s = '\\\\'  # it's\n" + "v = 1\n" * 20000 + \
+                  "def f():\n    pass\n"
+        controlFlow = getControlFlowFromMemory(content)
+        last = controlFlow.suite[-1]
+        offset = content.index("v")
+
+        def typeAndErase(text):
+            start = time.perf_counter()
+            for _ in range(40):
+                controlFlow.applyEdit(offset, 0, text)
+                controlFlow.applyEdit(offset, len(text), "")
+            return time.perf_counter() - start
+
+        # The quote closes no string and an unclosed one ends at its line,
+        # so the rest of the lines is not scanned
+        plain = min(typeAndErase("x"), typeAndErase("x"))
+        quote = typeAndErase("'")
+        self.assertLess(quote, 5 * plain + 0.005)
+
+        inserted = "'\\\n'''\n"
+        controlFlow.applyEdit(offset, 0, inserted)
+        self.assertEqual(last.begin, content.index("def") + len(inserted))
+        self.assertEqual((last.beginLine, last.beginPos), (20004, 1))
+
+    def test_apply_edit_comments(self):
+        """Test the comments rescanned after the edits"""
+        content = "x = 1  # a\ny = 2\n\n# b\nz = '#'  # c\n"
+        controlFlow = getControlFlowFromMemory(content)
+
+        def comments():
+            """The expected comments of the edited content"""
+            return getControlFlowFromMemory(content).getComments()
+
+        self.assertEqual(controlFlow.getComments(),
+                         [(7, 9, 1, 8), (18, 20, 4, 1), (31, 33, 5, 10)])
+
+        # The edits are at the first occurrence of the text or at the end
+        edits = [("a\n", 1, "aa\n# new"),    # Inside a comment
+                 ("# aa", 0, "'"),          # An open quote before it
+                 ("'# aa", 1, ""),
+                 ("x", 0, "s = '''\n"),     # A string over the rest
+                 ("s = ", 8, ""),
+                 ("# b", 1, ""),            # Uncomments a line
+                 (None, 0, "# end\n")]
+        for anchor, removed, text in edits:
+            offset = len(content) if anchor is None else content.index(anchor)
+            controlFlow.applyEdit(offset, removed, text)
+            content = content[:offset] + text + content[offset + removed:]
+            self.assertEqual(controlFlow.getComments(), comments())
+
+        self.assertEqual(controlFlow.getComments()[-1][2:], (7, 1))
+        with self.assertRaises(RuntimeError):
+            getControlFlowFromMemory(content, False).getComments()
+
+    def test_apply_many_edits(self):
+        """Test the cost of reading the fragments after many edits"""
+        content = "".join("import m%d\n" % k for k in range(1000))
+        controlFlow = getControlFlowFromMemory(content)
+        imports = list(controlFlow.suite)
+
+        def readStale(fragments):
+            start = time.perf_counter()
+            for item in fragments:
+                item.begin
+            return time.perf_counter() - start
+
+        # Typing and erasing
+        for k, symbol in enumerate("# typed\n"):
+            controlFlow.applyEdit(k, 0, symbol)
+        controlFlow.applyEdit(6, 2, "")
+        controlFlow.applyEdit(6, 0, "\n")
+        self.assertEqual(imports[0].begin, len("# type\n"))
+        self.assertEqual(imports[0].beginLine, 2)
+
+        # The fragments read after a few edits and after many ones add up
+        # the shifts of the same number of fragments they are nested in
+        for _ in range(100):
+            controlFlow.applyEdit(0, 0, " ")
+        fewEdits = min(readStale(imports[:250]), readStale(imports[:250]))
+        for _ in range(20000):
+            controlFlow.applyEdit(0, 0, " ")
+        manyEdits = readStale(imports[250:500])
+        self.assertLess(manyEdits, 5 * fewEdits + 0.005)
+
+        shift = len("# type\n") + 20100
+        self.assertEqual([item.begin - shift for item in imports],
+                         [content.index("import m%d\n" % k)
+                          for k in range(1000)])
+        self.assertEqual(imports[-1].getContent(), "import m999")
+        self.assertEqual((imports[0].beginLine, imports[0].beginPos), (2, 1))
+
+        # An edit costs about the same in a small and in a large content
+        def editTime(lineCount):
+            text = "".join("import m%d\n" % k for k in range(lineCount))
+            flow = getControlFlowFromMemory(text)
+            middle = len(text) // 2
+            flow.applyEdit(0, 0, "")    # The first edit copies the content
+            start = time.perf_counter()
+            for _ in range(500):
+                flow.applyEdit(middle, 0, "x")
+                flow.applyEdit(middle, 1, "")
+            return time.perf_counter() - start
+
+        smallContent = min(editTime(1000), editTime(1000))
+        largeContent = editTime(100000)
+        self.assertLess(largeContent, 5 * smallContent + 0.005)
+
+    def test_share_unchanged(self):
+        """Test the versions sharing the unchanged subtrees"""
+        content = "import os\n# note\n\nclass C:\n    def a(self):\n" \
+                  "        return 1\n\n    def b(self):\n        return 2\n" \
+                  "\ndef f():\n    pass\n"
+        previous = getControlFlowFromMemory(content)
+        current = getControlFlowFromMemory(content.replace("2", "22"))
+
+        changed = content.replace("2", "22")
+        current = getControlFlowFromMemory(changed)
+
+        def describe(flow):
+            return [(item.kind, item.begin, item.end, item.beginLine,
+                     item.beginPos, item.endLine, item.endPos,
+                     item.getContent()) for item in flow.iterFragments()]
+
+        # The class crosses the change: its first method and the shifted
+        # function are shared with the import and the comment
+        self.assertEqual(current.shareUnchanged(previous), 4)
+        self.assertEqual(describe(current),
+                         describe(getControlFlowFromMemory(changed)))
+        self.assertIsNot(current.suite[3].suite[0],
+                         previous.suite[3].suite[0])
+        with self.assertRaises(TypeError):
+            current.shareUnchanged(content)
+
+        # The ids are dense within each version
+        fragments = list(current.iterFragments())
+        self.assertEqual(sorted(item.id for item in fragments),
+                         list(range(len(fragments))))
+
+        # Both versions stay editable: an edit of the previous version
+        # leaves the later one as it was
+        current = getControlFlowFromMemory(changed)
+        current.shareUnchanged(previous)
+        previous.applyEdit(content.index("pass"), 4, "return 3")
+        self.assertTrue(previous.suite[3].suite[0].dirty)
+        self.assertEqual(describe(current),
+                         describe(getControlFlowFromMemory(changed)))
+        current.applyEdit(0, 0, "#\n")
+        self.assertEqual(current.suite[3].suite[0].getContent(), "pass")
+        self.assertEqual(current.suite[3].suite[0].beginLine, 13)
+
+        # The shared suites keep the previous version
+        current = getControlFlowFromMemory(changed)
+        current.shareUnchanged(getControlFlowFromMemory(content))
+        self.assertEqual(describe(current),
+                         describe(getControlFlowFromMemory(changed)))
+
+    def test_subtree_hash(self):
+        """Test the position independent subtree hashes"""
+        function = "def f(a):\n    # note\n    if a:\n        return 1\n"
+        module = getControlFlowFromMemory(function)
+        nested = getControlFlowFromMemory(
+            "x = 1\n\nclass C:\n" +
+            "".join("    " + line + "\n" for line in function.splitlines()))
+        changed = getControlFlowFromMemory(function.replace("1", "2"))
+        lazy = getControlFlowFromMemory(function, maxDepth=1, lazySuites=True)
+
+        self.assertEqual(module.suite[0].hash, nested.suite[1].suite[0].hash)
+        self.assertNotEqual(module.suite[0].hash, changed.suite[0].hash)
+        self.assertEqual(module.suite[0].suite[0].parts[0].condition.hash,
+                         changed.suite[0].suite[0].parts[0].condition.hash)
+        self.assertEqual(module.suite[0].hash, lazy.suite[0].hash)
+        self.assertTrue(0 < module.hash < 2 ** 64)
+        self.assertIn("hash", module.suite[0].__members__)
+        self.assertEqual(getControlFlowFromMemory(function, False,
+                                                  hashes=True).hash,
+                         module.hash)
+        with self.assertRaises(RuntimeError):
+            getControlFlowFromMemory(function, False).suite[0].hash
+        with self.assertRaises(TypeError):
+            getControlFlowFromMemory(function, hashes=1)
+
+        # The blanks in the string literals and the comments count
+        literals = ["x = 'a  b'\n", "x = 'a b'\n", "x = 'a\\\\ b'\n",
+                    'x = """a\n  b"""\n', 'x = """a\n b"""\n',
+                    "x = 1  # a  b\n", "x = 1  # a b\n"]
+        hashes = {getControlFlowFromMemory(item).hash for item in literals}
+        self.assertEqual(len(hashes), len(literals))
+        self.assertEqual(getControlFlowFromMemory("x = ('a  b',\n  1)\n").hash,
+                         getControlFlowFromMemory("x = ('a  b', 1)\n").hash)
+
+        # The edited fragments are hashed again
+        edited = getControlFlowFromMemory(function)
+        condition = edited.suite[0].suite[0].parts[0].condition
+        before = edited.hash, condition.hash
+        edited.applyEdit(function.index("return 1") + 7, 1, "2")
+        self.assertEqual(condition.hash, before[1])
+        self.assertEqual(edited.suite[0].hash, changed.suite[0].hash)
+        self.assertNotEqual(edited.hash, before[0])
+
+    def test_diff_control_flows(self):
+        """Test the structural difference between two control flows"""
+        old = getControlFlowFromMemory(
+            "import os\n\ndef f(a):\n    return a\n\n"
+            "def g():\n    x = 1\n    y = 2\n\nclass C:\n    pass\n")
+        new = getControlFlowFromMemory(
+            "import os\n\nclass C:\n    pass\n\n"
+            "def g():\n    x = 1\n    y = 3\n    # new\n\n"
+            "def h(a):\n    return a\n")
+        script = cdmcfparser.diffControlFlows(old, new)
+
+        f, g, oldCode = old.suite[1], old.suite[2], old.suite[2].suite[0]
+        newG, newCode = new.suite[2], new.suite[2].suite[0]
+        self.assertEqual(script,
+                         [(cdmcfparser.DIFF_DELETED, f, None),
+                          (cdmcfparser.DIFF_CHANGED, g, newG),
+                          (cdmcfparser.DIFF_CHANGED, oldCode, newCode),
+                          (cdmcfparser.DIFF_INSERTED, None,
+                           new.suite[2].suite[1]),
+                          (cdmcfparser.DIFF_INSERTED, None, new.suite[3])])
+
+        swapped = getControlFlowFromMemory("x = 1\n\ndef f():\n    pass\n\n"
+                                           "def g():\n    pass\n")
+        moved = getControlFlowFromMemory("def g():\n    pass\n\nx = 1\n\n"
+                                         "def f():\n    pass\n")
+        self.assertEqual(cdmcfparser.diffControlFlows(swapped, moved),
+                         [(cdmcfparser.DIFF_MOVED, swapped.suite[2],
+                           moved.suite[0])])
+        self.assertEqual(cdmcfparser.diffControlFlows(old, old), [])
+        with self.assertRaises(TypeError):
+            cdmcfparser.diffControlFlows(old, "x = 1")
+
+        # The subtrees moved to another level are matched as well
+        functions = "def f(a):\n    return a\n\ndef g():\n    pass\n"
+        flat = getControlFlowFromMemory("import os\n\n" + functions)
+        wrapped = getControlFlowFromMemory(
+            "import os\n\nclass C:\n" +
+            "".join("    " + line + "\n" if line else "\n"
+                    for line in functions.splitlines()))
+        members = wrapped.suite[1].suite
+        self.assertEqual(cdmcfparser.diffControlFlows(flat, wrapped),
+                         [(cdmcfparser.DIFF_INSERTED, None, wrapped.suite[1]),
+                          (cdmcfparser.DIFF_MOVED, flat.suite[1], members[0]),
+                          (cdmcfparser.DIFF_MOVED, flat.suite[2],
+                           members[1])])
+        self.assertEqual(cdmcfparser.diffControlFlows(wrapped, flat),
+                         [(cdmcfparser.DIFF_DELETED, wrapped.suite[1], None),
+                          (cdmcfparser.DIFF_MOVED, members[0], flat.suite[1]),
+                          (cdmcfparser.DIFF_MOVED, members[1],
+                           flat.suite[2])])
+        wrapped.carryIds(flat)
+        self.assertEqual([item.id for item in members],
+                         [flat.suite[1].id, flat.suite[2].id])
+
+    def test_fragment_ids(self):
+        """Test the fragment ids and carrying them over to a new version"""
+        old = getControlFlowFromMemory(
+            "import os\n\ndef f(a):\n    return a\n\ndef g():\n    x = 1\n")
+        self.assertEqual(old.id, 0)
+        ids = [old.id, old.suite[0].id, old.suite[1].id, old.suite[1].name.id,
+               old.suite[1].suite[0].id, old.suite[2].id]
+        self.assertEqual(len(set(ids)), len(ids))
+        self.assertEqual(ids, sorted(ids))
+
+        new = getControlFlowFromMemory(
+            "import os\n\ndef g():\n    x = 2\n\n"
+            "def f(a):\n    return a\n\ny = 3\n")
+        new.carryIds(old)
+        self.assertEqual([item.id for item in new.suite[:3]],
+                         [old.suite[0].id, old.suite[2].id, old.suite[1].id])
+        self.assertEqual(new.suite[2].suite[0].id, old.suite[1].suite[0].id)
+        self.assertEqual(new.suite[1].suite[0].id, old.suite[2].suite[0].id)
+        self.assertGreaterEqual(new.suite[3].id, old.suite[2].suite[0].id)
+        self.assertNotIn(new.suite[3].id, ids)
+        with self.assertRaises(RuntimeError):
+            new.carryIds(old)
+
+    def test_concurrent_lazy_access(self):
+        """Test the lazily completed fragments read from many threads"""
+        content = "".join("def f%d(a):\n    if a:\n        return a\n"
+                          "    for i in a:\n        print(i)\n" % k
+                          for k in range(40))
+
+        def describe(controlFlow):
+            result = []
+            stack = [controlFlow]
+            while stack:
+                item = stack.pop()
+                result.append((item.id, item.hash, item.kind,
+                               item.getLineRange()))
+                stack.extend(getattr(item, "suite", []))
+            return sorted(result)
+
+        expected = describe(getControlFlowFromMemory(content))
+        for rnd in range(5):
+            controlFlow = getControlFlowFromMemory(content, maxDepth=1,
+                                                   lazySuites=True)
+            controlFlow.applyEdit(0, 0, "#\n")
+            controlFlow.applyEdit(0, 2, "")
+            barrier = threading.Barrier(4)
+            results = []
+
+            def worker():
+                barrier.wait()
+                results.append(describe(controlFlow))
+
+            threads = [threading.Thread(target=worker) for _ in range(4)]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+            self.assertEqual(results, [expected] * 4)
+
+    def test_position_lookups(self):
+        """Test the innermost fragment lookups by position"""
+        code = "import os\n\ndef f(a):\n    # c\n    return a\n"
+        controlFlow = getControlFlowFromMemory(code)
+        function = controlFlow.suite[1]
+        statement = function.suite[0]
+
+        chain = controlFlow.fragmentsAt(5, 12)
+        self.assertEqual(chain[1:], [statement, function, controlFlow])
+        self.assertEqual(chain[0].getContent(), "a")
+        self.assertEqual(controlFlow.fragmentAtOffset(code.rindex("a")),
+                         chain)
+        self.assertEqual(controlFlow.fragmentsAt(9, 1), [])
+
+        offsets = [0, code.index("# c"), len(code) + 10]
+        chains = controlFlow.fragmentsAtOffsets(offsets)
+        self.assertEqual(chains[0][1:], [controlFlow.suite[0], controlFlow])
+        self.assertIs(chains[1][-2], function)
+        self.assertEqual(chains[2], [])
+        with self.assertRaises(TypeError):
+            controlFlow.fragmentAtOffset("0")
+
+        controlFlow.applyEdit(code.index("def"), 0, "\n\n")
+        self.assertEqual(controlFlow.fragmentsAt(7, 12)[1], statement)
+
+    def test_line_range_query(self):
+        """Test the fragments which overlap a line range"""
+        code = "import os\n\ndef f(a):\n    # c\n    return a\n\nx = 1\n"
+        controlFlow = getControlFlowFromMemory(code)
+        function = controlFlow.suite[1]
+        statement = function.suite[0]
+
+        visible = controlFlow.fragmentsInLineRange(4, 5)
+        self.assertEqual(visible[0], (controlFlow, 0))
+        self.assertIn((function, 1), visible)
+        self.assertIn((statement, 2), visible)
+        self.assertNotIn(controlFlow.suite[0],
+                         [item for item, depth in visible])
+        self.assertEqual(
+            controlFlow.fragmentsInLineRange(
+                1, 7, kinds=[cdmcfparser.FUNCTION_FRAGMENT,
+                             cdmcfparser.CODEBLOCK_FRAGMENT]),
+            [(function, 1), (controlFlow.suite[2], 1)])
+        self.assertEqual(controlFlow.fragmentsInLineRange(8, 9, []), [])
+        self.assertIn((function, 1), controlFlow.fragmentsInLineRange(5, 5))
+        with self.assertRaises(ValueError):
+            controlFlow.fragmentsInLineRange(5, 4)
+        with self.assertRaises(ValueError):
+            controlFlow.fragmentsInLineRange(120, 100)
+        with self.assertRaises(ValueError):
+            controlFlow.fragmentsInLineRange(1, 2, kinds=[99])
+
+    def test_qualified_names(self):
+        """Test the definitions lookup by the qualified names"""
+        code = ("class Outer:\n    class Inner:\n        def method(self):\n"
+                "            pass\n    if True:\n        def other(self):\n"
+                "            pass\n\ndef f():\n    pass\n\ndef f():\n"
+                "    class C:\n        def g(self):\n            def h():\n"
+                "                pass\n    return 1\n")
+        for lazySuites in (False, True):
+            controlFlow = getControlFlowFromMemory(code,
+                                                   lazySuites=lazySuites)
+            names = [name for name, item in controlFlow.iterDefinitions()]
+            self.assertEqual(names, ["Outer", "Outer.Inner",
+                                     "Outer.Inner.method", "Outer.other",
+                                     "f", "f", "f.<locals>.C",
+                                     "f.<locals>.C.g",
+                                     "f.<locals>.C.g.<locals>.h"])
+
+            method = controlFlow.findByQualifiedName("Outer.Inner.method")
+            self.assertEqual(method.name.getContent(), "method")
+            self.assertEqual(method.beginLine, 3)
+            self.assertIs(controlFlow.findByQualifiedName("f"),
+                          controlFlow.suite[2])
+            self.assertIsNone(controlFlow.findByQualifiedName("Inner"))
+
+    def test_iter_fragments(self):
+        """Test the native fragment iterator"""
+        code = ('"""doc"""\n@dec\ndef f(a):\n    if a:  # side\n'
+                '        pass\n    else:\n        x = 1\n    try:\n'
+                '        z()\n    except E:\n        w()\n')
+        kinds = [cdmcfparser.DOCSTRING_FRAGMENT,
+                 cdmcfparser.DECORATOR_FRAGMENT, cdmcfparser.IF_FRAGMENT,
+                 cdmcfparser.ELIF_PART_FRAGMENT,
+                 cdmcfparser.EXCEPT_PART_FRAGMENT,
+                 cdmcfparser.COMMENT_FRAGMENT]
+        for lazySuites in (False, True):
+            controlFlow = getControlFlowFromMemory(code,
+                                                   lazySuites=lazySuites)
+            self.assertEqual(
+                [type(item).__name__
+                 for item in controlFlow.iterFragments(kinds)],
+                ["Docstring", "Decorator", "If", "ElifPart", "Comment",
+                 "ElifPart", "ExceptPart"])
+
+        function = controlFlow.suite[0]
+        self.assertEqual(
+            list(controlFlow.iterFragments(
+                kinds=[cdmcfparser.FUNCTION_FRAGMENT,
+                       cdmcfparser.IF_FRAGMENT,
+                       cdmcfparser.CONTROL_FLOW_FRAGMENT], order="post")),
+            [function.suite[0], function, controlFlow])
+        everything = list(controlFlow.iterFragments())
+        self.assertIs(everything[0], controlFlow)
+        self.assertIn(function.name, everything)
+        with self.assertRaises(ValueError):
+            controlFlow.iterFragments(order="in")
+
+    def test_module_instances(self):
+        """Test a separate module object created from the same library"""
+        spec = importlib.util.spec_from_file_location('cdmcfparser',
+                                                      cdmcfparser.__file__)
+        other = importlib.util.module_from_spec(spec)
+        spec.loader.exec_module(other)
+        self.assertIsNot(other, cdmcfparser)
+        self.assertEqual(other.VERSION, VERSION)
+
+        content = "def f(a):\n    # comment\n    return a\n"
+        self.assertEqual(str(other.getControlFlowFromMemory(content)),
+                         str(getControlFlowFromMemory(content)))
+
+    @unittest.skipIf(subinterpreters is None,
+                     "subinterpreters are not available")
+    def test_subinterpreter(self):
+        """Test the module in the subinterpreters"""
+        script = """if True:
+            import sys
+            sys.path.insert(0, %r)
+            import cdmcfparser
+            cf = cdmcfparser.getControlFlowFromMemory(
+                "import os\\ndef f():\\n    return 1\\n")
+            assert cf.isOK and len(cf.suite) == 2
+            assert type(cf.suite[1].suite[0]).__name__ == "Return"
+            assert repr(cf.suite[0]).startswith("<Import")
+            """ % os.path.dirname(cdmcfparser.__file__)
+
+        # The interpreters which share the GIL can load the module
+        self.assertIsNone(runInSubinterpreter(script, False))
+
+        # The fragment types are the heap types of the module object so the
+        # interpreters with their own GIL (python 3.12+) can load it too
+        if sys.version_info < (3, 12):
+            return
+        self.assertIsNone(runInSubinterpreter(script, True))
+        self.assertIsNone(runInSubinterpreter(script, True))
+
+        # The types of the main interpreter are not affected
+        cf = cdmcfparser.getControlFlowFromMemory("import os\n")
+        self.assertTrue(cf.isOK)
+        self.assertEqual(type(cf).__module__, "cdmcfparser")
 
 # Run the unit tests
 if __name__ == '__main__':
@@ -83,7 +83,9 @@ namespace Py
         explicit PythonExtension()
         : PythonExtensionBase()
         {
-            PyObject_Init( this, type_object() );
+            PyObject_Init( this, extension_instance_type_hook != NULL
+                                    ? extension_instance_type_hook( type_object() )
+                                    : type_object() );
 
             // every object must support getattr
             behaviors().supportGetattr();
@@ -40,6 +40,12 @@
 
 namespace Py
 {
+    // Local change: the hook, when set, maps the static type object of a
+    // PythonExtension class to the type an instance is created with, e.g.
+    // a heap type of the current module object. It must return a type
+    // with the same layout and deallocator.
+    extern PyTypeObject *( *extension_instance_type_hook )( PyTypeObject * );
+
     // Class PythonExtension is what you inherit from to create
     // a new Python extension type. You give your class itself
     // as the template paramter.
@@ -1965,7 +1965,7 @@ namespace Py
 
 #if !defined( Py_LIMITED_API )
         Char( const unicodestring &v )
-        : Object( PyUnicode_FromUnicode( const_cast<Py_UNICODE*>( v.data() ),1 ), true )
+        : Object( PyUnicode_FromWideChar( const_cast<Py_UNICODE*>( v.data() ),1 ), true )
         {
             validate();
         }
@@ -1987,7 +1987,7 @@ namespace Py
 #if !defined( Py_LIMITED_API )
         Char &operator=( const unicodestring &v )
         {
-            set( PyUnicode_FromUnicode( const_cast<Py_UNICODE*>( v.data() ), 1 ), true );
+            set( PyUnicode_FromWideChar( const_cast<Py_UNICODE*>( v.data() ), 1 ), true );
             return *this;
         }
 #endif
@@ -1996,7 +1996,7 @@ namespace Py
         Char &operator=( int v_ )
         {
             Py_UNICODE v( static_cast<Py_UNICODE>( v_ ) );
-            set( PyUnicode_FromUnicode( &v, 1 ), true );
+            set( PyUnicode_FromWideChar( &v, 1 ), true );
             return *this;
         }
 #endif
@@ -2004,7 +2004,7 @@ namespace Py
 #if !defined( Py_LIMITED_API )
         Char &operator=( Py_UNICODE v )
         {
-            set( PyUnicode_FromUnicode( &v, 1 ), true );
+            set( PyUnicode_FromWideChar( &v, 1 ), true );
             return *this;
         }
 #endif
@@ -2142,7 +2142,7 @@ namespace Py
 
 #if !defined( Py_LIMITED_API )
         String( const Py_UNICODE *s, int length )
-        : SeqBase<Char>( PyUnicode_FromUnicode( s, length ), true )
+        : SeqBase<Char>( PyUnicode_FromWideChar( s, length ), true )
         {
             validate();
         }
@@ -2164,7 +2164,7 @@ namespace Py
 #if !defined( Py_LIMITED_API )
         String &operator=( const unicodestring &v )
         {
-            set( PyUnicode_FromUnicode( const_cast<Py_UNICODE *>( v.data() ), v.length() ), true );
+            set( PyUnicode_FromWideChar( const_cast<Py_UNICODE *>( v.data() ), v.length() ), true );
             return *this;
         }
 #endif
@@ -2190,7 +2190,8 @@ namespace Py
         }
 #endif
 
-#if !defined( Py_LIMITED_API )
+// Python 3.12 removed the Py_UNICODE representation of the strings
+#if !defined( Py_LIMITED_API ) && PY_VERSION_HEX < 0x030c0000
         const Py_UNICODE *unicode_data() const
         {
             return PyUnicode_AS_UNICODE( ptr() );
@@ -2200,7 +2201,15 @@ namespace Py
 #if !defined( Py_LIMITED_API )
         unicodestring as_unicodestring() const
         {
-            return unicodestring( unicode_data(), PyUnicode_GetLength( ptr() ) );
+            Py_ssize_t size( 0 );
+            wchar_t *data( PyUnicode_AsWideCharString( ptr(), &size ) );
+            if( data == NULL )
+            {
+                ifPyErrorThrowCxxException();
+            }
+            unicodestring result( data, size );
+            PyMem_Free( data );
+            return result;
         }
 #endif
         ucs4string as_ucs4string() const
@@ -3242,7 +3251,7 @@ namespace Py
         // Call with keywords
         Object apply( const Tuple &args, const Dict &kw ) const
         {
-            PyObject *result = PyEval_CallObjectWithKeywords( ptr(), args.ptr(), kw.ptr() );
+            PyObject *result = PyObject_Call( ptr(), args.ptr(), kw.ptr() );
             if( result == NULL )
             {
                 ifPyErrorThrowCxxException();
@@ -518,7 +518,11 @@ int &_Py_InteractiveFlag()              { return Py_InteractiveFlag; }
 int &_Py_OptimizeFlag()                 { return Py_OptimizeFlag; }
 int &_Py_NoSiteFlag()                   { return Py_NoSiteFlag; }
 int &_Py_VerboseFlag()                  { return Py_VerboseFlag; }
-#  if PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION >= 7
+#  if PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION >= 12
+// The package context is a part of the runtime state since Python 3.12;
+// the callers fall back to the module name
+const char *__Py_PackageContext()       { return NULL; }
+#  elif PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION >= 7
 const char *__Py_PackageContext()       { return _Py_PackageContext; }
 #  else
 char *__Py_PackageContext()             { return _Py_PackageContext; }
@@ -56,6 +56,7 @@ void printRefCount( PyObject *obj )
 
 namespace Py
 {
+PyTypeObject *( *extension_instance_type_hook )( PyTypeObject * ) = NULL;
 
 void Object::validate()
 {
@@ -23,7 +23,7 @@
 import os, os.path, sys
 import datetime
 import cdmcfparser
-from cdmcfparser import getControlFlowFromFile, VERSION
+from cdmcfparser import getControlFlowFromFile, scanControlFlow, VERSION
 
 
 def collectFiles(path, files):
@@ -48,14 +48,40 @@ def getTotalSize(files):
     return total
 
 
-def cdmcfparserTest(files):
+# The fragment kinds which could be a suite item except the code blocks
+NO_CODEBLOCK_KINDS = [getattr(cdmcfparser, name + "_FRAGMENT") for name in
+                      ["COMMENT", "CML_COMMENT", "FUNCTION", "CLASS", "BREAK",
+                       "CONTINUE", "RETURN", "RAISE", "ASSERT", "SYSEXIT",
+                       "WHILE", "FOR", "IMPORT", "IF", "WITH", "TRY"]]
+
+# The parse options which switch off one feature each
+FEATURES = [("comments", {"comments": False}),
+            ("CML properties", {"cmlProperties": False}),
+            ("docstrings", {"docstrings": False}),
+            ("sys.exit() detection", {"sysExit": False}),
+            ("argument lists", {"arguments": False}),
+            ("content serialization", {"serialize": False}),
+            ("code blocks", {"kinds": NO_CODEBLOCK_KINDS}),
+            ("all but definitions", {"outline": True})]
+
+
+def cdmcfparserTest(files, options=None):
     """Loop for the codimension parser"""
+    if options is None:
+        options = {}
     count = 0
     for item in files:
         # print("Processing " + item + " ...")
-        tempObj = getControlFlowFromFile(item)
+        tempObj = getControlFlowFromFile(item, **options)
         count += 1
-    print("cdmcf: processed " + str(count) + " file(s)")
+    return count
+
+
+def timeParse(files, options=None):
+    """Provides the time to parse all the files"""
+    start = datetime.datetime.now()
+    cdmcfparserTest(files, options)
+    return datetime.datetime.now() - start
 
 
 print("Speed test measures the time required for "
@@ -88,10 +114,34 @@ else:
 
 # timing for cdmcfparser
 start = datetime.datetime.now()
-cdmcfparserTest(pythonFiles)
+count = cdmcfparserTest(pythonFiles)
 end = datetime.datetime.now()
+print("cdmcf: processed " + str(count) + " file(s)")
 
 print("cdmcf timing:")
 print("Start: " + str(start))
 print("End:   " + str(end))
 print("Delta: " + str(end - start))
+
+# The cost of a feature is the difference between the complete parse time
+# and the time of the parse with the feature switched off
+total = end - start
+print("cdmcf feature costs:")
+for name, options in FEATURES:
+    cost = total - timeParse(pythonFiles, options)
+    print("  {0:24} {1:>10.3f}s {2:6.1f}%".format(
+        name + ":", cost.total_seconds(),
+        100.0 * cost.total_seconds() / max(total.total_seconds(), 1e-9)))
+
+# The approximate pre-scan of the already read content
+contents = []
+for item in pythonFiles:
+    with open(item, encoding="utf-8", errors="replace") as f:
+        contents.append(f.read())
+start = datetime.datetime.now()
+for content in contents:
+    scanControlFlow(content)
+delta = datetime.datetime.now() - start
+size = max(sum(len(content) for content in contents), 1)
+print("cdmcf pre-scan: {0:.3f}s ({1:.1f} us/KB)".format(
+    delta.total_seconds(), delta.total_seconds() * 1e6 * 1024 / size))